@@ -0,0 +1,461 @@
+/**
+ * @file Bundle.cpp
+ * @author Cristian Madrazo
+ * @brief Implementations for Bundle
+ * @version 1.0
+ *
+ */
+
+#include "Bundle.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+#include "logging.h"
+
+// bodies start on a page boundary so they can be mapped and sent without touching neighbours
+#define BUNDLE_ALIGN 4096
+
+// give up on a table size after this many seeds for one bucket and try a bigger one
+#define MAX_SEED_TRIES (1 << 20)
+
+// seeded FNV-1a with a final avalanche so different seeds give unrelated slots
+static uint64_t path_hash (const char* str, size_t len, uint32_t seed) {
+    uint64_t hash = 0xcbf29ce484222325ULL ^ (seed * 0x9e3779b97f4a7c15ULL);
+    for (size_t i = 0; i < len; i++) {
+        hash ^= (unsigned char)str[i];
+        hash *= 0x100000001b3ULL;
+    }
+
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdULL;
+    hash ^= hash >> 33;
+    return hash;
+}
+
+static uint64_t align_up (uint64_t value, uint64_t alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+}
+
+// Returns the Content-Type to serve a file with based on its extension
+std::string mime_type (const std::string& path) {
+    std::string extension = std::filesystem::path (path).extension ().string ();
+    std::transform (extension.begin (), extension.end (), extension.begin (), ::tolower);
+
+    if (extension == ".html" || extension == ".htm") {
+        return "text/html; charset=UTF-8";
+    } else if (extension == ".jpg" || extension == ".jpeg") {
+        return "image/jpeg";
+    } else if (extension == ".png") {
+        return "image/png";
+    } else if (extension == ".gif") {
+        return "image/gif";
+    } else if (extension == ".svg") {
+        return "image/svg+xml";
+    } else if (extension == ".ico") {
+        return "image/x-icon";
+    } else if (extension == ".css") {
+        return "text/css; charset=UTF-8";
+    } else if (extension == ".js") {
+        return "text/javascript; charset=UTF-8";
+    } else if (extension == ".json") {
+        return "application/json";
+    } else if (extension == ".txt") {
+        return "text/plain; charset=UTF-8";
+    }
+
+    return "application/octet-stream";
+}
+
+// Returns true if a Content-Type is text-like and worth compressing
+bool is_compressible (const std::string& type) {
+    return type.compare (0, 5, "text/") == 0 || type == "application/json" || type == "image/svg+xml";
+}
+
+// Constructor, use open()
+Bundle::Bundle () {
+    fd      = -1;
+    data    = nullptr;
+    size    = 0;
+    header  = nullptr;
+    seeds   = nullptr;
+    entries = nullptr;
+}
+
+// Destructor, unmaps and closes the bundle
+Bundle::~Bundle () {
+    if (data != nullptr) {
+        munmap ((void*)data, size);
+    }
+    if (fd >= 0) {
+        close (fd);
+    }
+}
+
+// Maps the bundle at path and checks its header and index
+std::shared_ptr<const Bundle> Bundle::open (const std::string& path) {
+    int fd = ::open (path.c_str (), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        ERROR << "Bundle " << path << " could not be opened" << ENDL;
+        return nullptr;
+    }
+
+    struct stat st;
+    if (fstat (fd, &st) < 0 || (size_t)st.st_size < sizeof (Bundleheader)) {
+        ERROR << "Bundle " << path << " is too small to be a bundle" << ENDL;
+        close (fd);
+        return nullptr;
+    }
+
+    void* addr = mmap (nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (addr == MAP_FAILED) {
+        ERROR << "Bundle " << path << " could not be mapped" << ENDL;
+        close (fd);
+        return nullptr;
+    }
+
+    std::shared_ptr<Bundle> bundle (new Bundle ());
+    bundle->fd     = fd;
+    bundle->path   = path;
+    bundle->data   = (const char*)addr;
+    bundle->size   = st.st_size;
+    bundle->header = (const Bundleheader*)addr;
+
+    const Bundleheader& header = *bundle->header;
+    if (memcmp (header.magic, BUNDLE_MAGIC, sizeof (header.magic)) != 0 ||
+    header.version != BUNDLE_VERSION || header.total_size != bundle->size ||
+    header.num_buckets == 0 || header.num_slots == 0 ||
+    header.seeds_offset + header.num_buckets * sizeof (uint32_t) > bundle->size ||
+    header.entries_offset + header.num_slots * sizeof (Bundleentry) > bundle->size) {
+        ERROR << "Bundle " << path << " has a bad header" << ENDL;
+        return nullptr;
+    }
+
+    bundle->seeds   = (const uint32_t*)(bundle->data + header.seeds_offset);
+    bundle->entries = (const Bundleentry*)(bundle->data + header.entries_offset);
+
+    // check every entry once here so find() can trust the offsets
+    for (uint32_t i = 0; i < header.num_slots; i++) {
+        const Bundleentry& entry = bundle->entries[i];
+        if (entry.path_len == 0) {
+            continue;
+        }
+        if (entry.path_offset + entry.path_len > bundle->size ||
+        entry.headers_offset + entry.headers_len > bundle->size ||
+        entry.body_offset + entry.body_len > bundle->size) {
+            ERROR << "Bundle " << path << " has an entry pointing outside the file" << ENDL;
+            return nullptr;
+        }
+    }
+
+    // the index is touched on every request, bodies are faulted in as they are sent
+    madvise ((void*)bundle->data, header.entries_offset + header.num_slots * sizeof (Bundleentry),
+    MADV_WILLNEED);
+
+    INFO << "Mapped bundle " << path << " with " << header.count << " files" << ENDL;
+    return bundle;
+}
+
+// Looks up a path, returns false if it isn't in the bundle
+bool Bundle::find (const std::string& path, Bundlefile& file) const {
+    uint32_t bucket = path_hash (path.data (), path.size (), 0) % header->num_buckets;
+    uint32_t seed   = seeds[bucket];
+
+    // nothing hashed to this bucket when the bundle was packed
+    if (seed == 0) {
+        return false;
+    }
+
+    const Bundleentry& entry =
+    entries[path_hash (path.data (), path.size (), seed) % header->num_slots];
+
+    // the hash is only perfect for packed paths, anything else still needs a compare
+    if (entry.path_len != path.size () || memcmp (data + entry.path_offset, path.data (), path.size ()) != 0) {
+        return false;
+    }
+
+    file.headers     = data + entry.headers_offset;
+    file.headers_len = entry.headers_len;
+    file.body        = data + entry.body_offset;
+    file.body_len    = entry.body_len;
+    file.mtime       = entry.mtime;
+    file.body_offset = entry.body_offset;
+    return true;
+}
+
+// Calls visit with every packed file, in slot order
+void Bundle::for_each (const std::function<void (const std::string& path, const Bundlefile& file)>& visit) const {
+    for (uint32_t slot = 0; slot < header->num_slots; slot++) {
+        const Bundleentry& entry = entries[slot];
+        if (entry.path_len == 0) {
+            continue;
+        }
+
+        Bundlefile file;
+        file.headers     = data + entry.headers_offset;
+        file.headers_len = entry.headers_len;
+        file.body        = data + entry.body_offset;
+        file.body_len    = entry.body_len;
+        file.mtime       = entry.mtime;
+        file.body_offset = entry.body_offset;
+        visit (std::string (data + entry.path_offset, entry.path_len), file);
+    }
+}
+
+// Returns the open bundle file
+int Bundle::descriptor () const {
+    return fd;
+}
+
+// Returns the path the bundle was opened from
+const std::string& Bundle::source () const {
+    return path;
+}
+
+// Returns the number of packed files
+uint32_t Bundle::count () const {
+    return header->count;
+}
+
+// finds a seed for every bucket so each path lands in its own slot, returns false if the
+// table is too small to manage it
+static bool build_index (const std::vector<std::string>& paths,
+uint32_t num_buckets,
+uint32_t num_slots,
+std::vector<uint32_t>& seeds,
+std::vector<int>& slots) {
+
+    std::vector<std::vector<int>> buckets (num_buckets);
+    for (size_t i = 0; i < paths.size (); i++) {
+        buckets[path_hash (paths[i].data (), paths[i].size (), 0) % num_buckets].push_back (i);
+    }
+
+    // place the fullest buckets first while there is still plenty of room
+    std::vector<uint32_t> order (num_buckets);
+    for (uint32_t i = 0; i < num_buckets; i++) {
+        order[i] = i;
+    }
+    std::stable_sort (order.begin (), order.end (),
+    [&] (uint32_t a, uint32_t b) { return buckets[a].size () > buckets[b].size (); });
+
+    seeds.assign (num_buckets, 0);
+    slots.assign (num_slots, -1);
+
+    for (uint32_t bucket : order) {
+        if (buckets[bucket].empty ()) {
+            break;
+        }
+
+        bool placed = false;
+        for (uint32_t seed = 1; seed < MAX_SEED_TRIES && !placed; seed++) {
+            std::vector<uint32_t> tried;
+            placed = true;
+
+            for (int index : buckets[bucket]) {
+                uint32_t slot = path_hash (paths[index].data (), paths[index].size (), seed) % num_slots;
+                if (slots[slot] != -1 || std::find (tried.begin (), tried.end (), slot) != tried.end ()) {
+                    placed = false;
+                    break;
+                }
+                tried.push_back (slot);
+            }
+
+            if (placed) {
+                for (size_t i = 0; i < tried.size (); i++) {
+                    slots[tried[i]] = buckets[bucket][i];
+                }
+                seeds[bucket] = seed;
+            }
+        }
+
+        if (!placed) {
+            return false;
+        }
+    }
+
+    return true;
+}
+
+// writes count zero bytes
+static void write_padding (std::ofstream& out, uint64_t count) {
+    static const char zeros[BUNDLE_ALIGN] = { 0 };
+    while (count > 0) {
+        uint64_t len = std::min (count, (uint64_t)BUNDLE_ALIGN);
+        out.write (zeros, len);
+        count -= len;
+    }
+}
+
+// Packs every regular file under a directory into a bundle
+int pack_bundle (const std::string& dir, const std::string& out) {
+    namespace fs = std::filesystem;
+
+    std::string tmp = out + ".tmp";
+    std::error_code ec;
+    fs::path out_path = fs::weakly_canonical (out, ec);
+    fs::path tmp_path = fs::weakly_canonical (tmp, ec);
+
+    // collect paths relative to dir, skipping hidden files and the bundle being written
+    std::vector<std::string> paths;
+    std::vector<uint64_t> sizes;
+    std::vector<uint64_t> mtimes;
+    for (fs::recursive_directory_iterator it (dir, ec), end; it != end; it.increment (ec)) {
+        if (ec) {
+            break;
+        }
+
+        std::string name = it->path ().filename ().string ();
+        if (!name.empty () && name[0] == '.') {
+            if (it->is_directory ()) {
+                it.disable_recursion_pending ();
+            }
+            continue;
+        }
+
+        fs::path canonical = fs::weakly_canonical (it->path (), ec);
+        if (!it->is_regular_file () || canonical == out_path || canonical == tmp_path) {
+            continue;
+        }
+
+        struct stat st;
+        if (stat (it->path ().c_str (), &st) < 0) {
+            continue;
+        }
+
+        paths.push_back (fs::relative (it->path (), dir).generic_string ());
+        sizes.push_back (st.st_size);
+        mtimes.push_back (st.st_mtime);
+    }
+
+    if (ec) {
+        ERROR << "Could not read directory " << dir << ": " << ec.message () << ENDL;
+        return -1;
+    }
+
+    // a slot table a bit larger than the file count keeps seed searches short
+    uint32_t num_buckets = std::max<size_t> (1, (paths.size () + 3) / 4);
+    uint32_t num_slots   = std::max<size_t> (1, paths.size () + paths.size () / 4);
+    std::vector<uint32_t> seeds;
+    std::vector<int> slots;
+    while (!build_index (paths, num_buckets, num_slots, seeds, slots)) {
+        num_slots *= 2;
+    }
+
+    // lay out the file before writing anything
+    Bundleheader header;
+    memset (&header, 0, sizeof (header));
+    memcpy (header.magic, BUNDLE_MAGIC, sizeof (header.magic));
+    header.version        = BUNDLE_VERSION;
+    header.count          = paths.size ();
+    header.num_buckets    = num_buckets;
+    header.num_slots      = num_slots;
+    header.seeds_offset   = align_up (sizeof (Bundleheader), 8);
+    header.entries_offset = align_up (header.seeds_offset + num_buckets * sizeof (uint32_t), 8);
+
+    std::vector<std::string> headers (paths.size ());
+    std::vector<Bundleentry> entries (num_slots);
+    memset (entries.data (), 0, entries.size () * sizeof (Bundleentry));
+
+    uint64_t offset = header.entries_offset + num_slots * sizeof (Bundleentry);
+    for (uint32_t slot = 0; slot < num_slots; slot++) {
+        if (slots[slot] == -1) {
+            continue;
+        }
+
+        int index = slots[slot];
+
+        // a .gz next to a packed file is its precompressed variant and keeps its type
+        std::string name = paths[index];
+        std::string encoding;
+        if (name.size () > 3 && name.compare (name.size () - 3, 3, ".gz") == 0 &&
+        std::find (paths.begin (), paths.end (), name.substr (0, name.size () - 3)) != paths.end ()) {
+            name     = name.substr (0, name.size () - 3);
+            encoding = "Content-Encoding: gzip\r\n";
+        }
+
+        headers[index] = "Content-Type: " + mime_type (name) + "\r\n" + encoding +
+        "Content-Length: " + std::to_string (sizes[index]) + "\r\n";
+
+        Bundleentry& entry   = entries[slot];
+        entry.path_offset    = offset;
+        entry.path_len       = paths[index].size ();
+        entry.headers_offset = offset + entry.path_len;
+        entry.headers_len    = headers[index].size ();
+        offset               = entry.headers_offset + entry.headers_len;
+    }
+
+    for (uint32_t slot = 0; slot < num_slots; slot++) {
+        if (slots[slot] == -1) {
+            continue;
+        }
+
+        entries[slot].body_offset = align_up (offset, BUNDLE_ALIGN);
+        entries[slot].body_len    = sizes[slots[slot]];
+        entries[slot].mtime       = mtimes[slots[slot]];
+        offset                    = entries[slot].body_offset + entries[slot].body_len;
+    }
+    header.total_size = offset;
+
+    // write everything in file order
+    std::ofstream file (tmp, std::ios::binary | std::ios::trunc);
+    if (!file) {
+        ERROR << "Could not create " << tmp << ENDL;
+        return -1;
+    }
+
+    file.write ((const char*)&header, sizeof (header));
+    write_padding (file, header.seeds_offset - sizeof (header));
+    file.write ((const char*)seeds.data (), num_buckets * sizeof (uint32_t));
+    write_padding (file, header.entries_offset - header.seeds_offset - num_buckets * sizeof (uint32_t));
+    file.write ((const char*)entries.data (), num_slots * sizeof (Bundleentry));
+
+    for (uint32_t slot = 0; slot < num_slots; slot++) {
+        if (slots[slot] != -1) {
+            file.write (paths[slots[slot]].data (), paths[slots[slot]].size ());
+            file.write (headers[slots[slot]].data (), headers[slots[slot]].size ());
+        }
+    }
+
+    for (uint32_t slot = 0; slot < num_slots; slot++) {
+        if (slots[slot] == -1) {
+            continue;
+        }
+
+        write_padding (file, entries[slot].body_offset - (uint64_t)file.tellp ());
+
+        std::ifstream body ((fs::path (dir) / paths[slots[slot]]).string (), std::ios::binary);
+        std::vector<char> buffer (entries[slot].body_len);
+        if (!body.read (buffer.data (), buffer.size ())) {
+            ERROR << "Could not read " << paths[slots[slot]] << ENDL;
+            file.close ();
+            fs::remove (tmp, ec);
+            return -1;
+        }
+        file.write (buffer.data (), buffer.size ());
+
+        DEBUG << "Packed " << paths[slots[slot]] << " (" << buffer.size () << " bytes)" << ENDL;
+    }
+
+    file.close ();
+    if (!file) {
+        ERROR << "Could not write " << tmp << ENDL;
+        fs::remove (tmp, ec);
+        return -1;
+    }
+
+    // swap the finished bundle in with a single rename
+    if (rename (tmp.c_str (), out.c_str ()) < 0) {
+        ERROR << "Could not rename " << tmp << " to " << out << ENDL;
+        fs::remove (tmp, ec);
+        return -1;
+    }
+
+    return paths.size ();
+}
@@ -0,0 +1,145 @@
+/**
+ * @file Bundle.h
+ * @author Cristian Madrazo
+ * @brief Packs a document root into a single file and serves it back from a mapping
+ * @version 1.0
+ *
+ * Layout of a bundle file, every offset is from the start of the file:
+ *   Bundleheader
+ *   uint32_t seeds[num_buckets]       displacement seed for each bucket of the path hash
+ *   Bundleentry entries[num_slots]    indexed by the perfect hash of the path
+ *   string area                       paths and precomputed headers
+ *   bodies                            each starting on a page boundary
+ *
+ */
+
+#ifndef BUNDLE_H
+#define BUNDLE_H
+
+#include <cstdint>
+#include <ctime>
+#include <functional>
+#include <memory>
+#include <string>
+
+// identifies a bundle file and its format version
+#define BUNDLE_MAGIC "WSBUNDL"
+#define BUNDLE_VERSION 2
+
+struct Bundleheader {
+    char magic[8];
+    uint32_t version;
+
+    // number of files packed
+    uint32_t count;
+
+    // size of the seed table and the slot table
+    uint32_t num_buckets;
+    uint32_t num_slots;
+
+    uint64_t seeds_offset;
+    uint64_t entries_offset;
+
+    // size of the whole bundle, used to catch truncated files
+    uint64_t total_size;
+};
+
+struct Bundleentry {
+    // path relative to the packed directory, empty slots have path_len 0
+    uint64_t path_offset;
+    uint32_t path_len;
+
+    // "Content-Type: ...\r\nContent-Length: ...\r\n" for this file, gzip sidecars of another
+    // packed file also get "Content-Encoding: gzip" and the other file's type
+    uint32_t headers_len;
+    uint64_t headers_offset;
+
+    uint64_t body_offset;
+    uint64_t body_len;
+
+    // modification time of the packed file, in seconds since the epoch
+    uint64_t mtime;
+};
+
+// a file found in a bundle, points straight into the mapping
+struct Bundlefile {
+    const char* headers;
+    size_t headers_len;
+    const char* body;
+    size_t body_len;
+    time_t mtime;
+
+    // where the body starts in the bundle file, for sendfile() on descriptor()
+    uint64_t body_offset;
+};
+
+class Bundle {
+    private:
+    // path the bundle was opened from
+    std::string path;
+
+    // bundle file, kept open so bodies can also be sent with sendfile()
+    int fd;
+
+    // whole bundle mapped read only
+    const char* data;
+    size_t size;
+
+    const Bundleheader* header;
+    const uint32_t* seeds;
+    const Bundleentry* entries;
+
+    // Constructor, use open()
+    Bundle ();
+
+    public:
+    // Destructor, unmaps and closes the bundle
+    ~Bundle ();
+
+    // Maps the bundle at path and checks its header and index.
+    // Returns nullptr if it can't be opened or isn't a valid bundle
+    static std::shared_ptr<const Bundle> open (const std::string& path);
+
+    // Looks up a path, returns false if it isn't in the bundle
+    bool find (const std::string& path, Bundlefile& file) const;
+
+    // Calls visit with every packed file, in slot order
+    void for_each (const std::function<void (const std::string& path, const Bundlefile& file)>& visit) const;
+
+    // Returns the open bundle file, bodies start at their Bundlefile::body_offset
+    int descriptor () const;
+
+    // Returns the path the bundle was opened from
+    const std::string& source () const;
+
+    // Returns the number of packed files
+    uint32_t count () const;
+};
+
+/**
+ * @brief Packs every regular file under a directory into a bundle, written next to the output
+ * path first and renamed over it once complete so a running server never sees half a bundle
+ *
+ * @param dir directory to pack, paths in the bundle are relative to it
+ * @param out path of the bundle file to write
+ * @return number of packed files, or -1 on error
+ */
+int pack_bundle (const std::string& dir, const std::string& out);
+
+/**
+ * @brief Returns the Content-Type to serve a file with based on its extension
+ *
+ * @param path file path
+ * @return MIME type, application/octet-stream if the extension is unknown
+ */
+std::string mime_type (const std::string& path);
+
+/**
+ * @brief Returns true if a Content-Type is text-like and worth compressing
+ *
+ * @param type MIME type as returned by mime_type()
+ * @return true for text, JSON, JavaScript and SVG
+ */
+bool is_compressible (const std::string& type);
+
+#endif
@@ -0,0 +1,289 @@
+/**
+ * @file Filecache.cpp
+ * @author Cristian Madrazo
+ * @brief Implementations for Filecache
+ * @version 1.0
+ *
+ */
+
+#include "Filecache.h"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "logging.h"
+
+// bodies smaller than this gain next to nothing from compression
+#define GZIP_MIN_BYTES 256
+
+// Constructor
+Filecache::Filecache (size_t max_bytes, Statcache& stats) : stats (stats) {
+    this->max_bytes  = max_bytes;
+    this->used_bytes = 0;
+    this->pool       = nullptr;
+}
+
+// Sets the pool compressed variants are built on
+void Filecache::set_pool (Threadpool* pool) {
+    std::lock_guard<std::mutex> guard (lock);
+    this->pool = pool;
+}
+
+// reads a file from disk, returns nullptr if it can't be opened or read
+std::shared_ptr<const Cachedfile> Filecache::load (const std::string& path) {
+    int fd = open (path.c_str (), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return nullptr;
+    }
+
+    // identity is taken from the opened file so it always matches the bytes we read
+    struct stat st;
+    if (fstat (fd, &st) < 0) {
+        close (fd);
+        return nullptr;
+    }
+
+    auto file   = std::make_shared<Cachedfile> ();
+    file->path  = path;
+    file->ino   = st.st_ino;
+    file->size  = st.st_size;
+    file->mtime = st.st_mtim;
+    file->body.resize (st.st_size);
+
+    size_t done = 0;
+    while (done < file->body.size ()) {
+        ssize_t n = read (fd, file->body.data () + done, file->body.size () - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        done += n;
+    }
+    close (fd);
+
+    // file shrank or errored while reading
+    if (done != file->body.size ()) {
+        return nullptr;
+    }
+
+    DEBUG << "Loaded " << path << " (" << done << " bytes) into file cache" << ENDL;
+    return file;
+}
+
+// adds a loaded file and evicts older entries until it fits, caller holds lock
+void Filecache::insert (const std::shared_ptr<const Cachedfile>& file) {
+
+    // files bigger than the whole cache are served but never kept
+    if (file->body.size () > max_bytes) {
+        return;
+    }
+
+    erase (file->path);
+
+    while (used_bytes + file->body.size () > max_bytes && !lru.empty ()) {
+        DEBUG << "Evicting " << lru.back () << " from file cache" << ENDL;
+        erase (lru.back ());
+    }
+
+    lru.push_front (file->path);
+    entries[file->path] = Entry{ file, lru.begin (), nullptr, false };
+    used_bytes += file->body.size ();
+}
+
+// removes an entry, caller holds lock
+void Filecache::erase (const std::string& path) {
+    auto it = entries.find (path);
+    if (it == entries.end ()) {
+        return;
+    }
+
+    used_bytes -= it->second.file->body.size ();
+    if (it->second.gzip) {
+        used_bytes -= it->second.gzip->body.size ();
+    }
+    lru.erase (it->second.lru_pos);
+    entries.erase (it);
+}
+
+// Returns the file at path, loading it if it isn't cached or changed on disk
+std::shared_ptr<const Cachedfile> Filecache::get (const std::string& path) {
+    Fileinfo info;
+    if (!stats.get (path, info)) {
+        invalidate (path);
+        return nullptr;
+    }
+
+    std::unique_lock<std::mutex> guard (lock);
+
+    // hit, as long as the file on disk is still the one we loaded
+    auto it = entries.find (path);
+    if (it != entries.end ()) {
+        const Cachedfile& cached = *it->second.file;
+        if (same_version (info, cached.ino, cached.size, cached.mtime)) {
+            lru.splice (lru.begin (), lru, it->second.lru_pos);
+            return it->second.file;
+        }
+
+        DEBUG << path << " changed on disk, reloading" << ENDL;
+        erase (path);
+    }
+
+    // someone else is already loading this file, wait for their result
+    auto flight = flights.find (path);
+    if (flight != flights.end ()) {
+        std::shared_future<std::shared_ptr<const Cachedfile>> pending = flight->second;
+        guard.unlock ();
+
+        DEBUG << "Waiting on in-flight load of " << path << ENDL;
+        return pending.get ();
+    }
+
+    // we are the first miss, load it without holding the lock
+    std::promise<std::shared_ptr<const Cachedfile>> promise;
+    flights[path] = promise.get_future ().share ();
+    guard.unlock ();
+
+    std::shared_ptr<const Cachedfile> file = load (path);
+    promise.set_value (file);
+
+    // the stat cache is behind the file we just read, let it catch up
+    if (file && !same_version (info, file->ino, file->size, file->mtime)) {
+        stats.invalidate (path);
+    }
+
+    guard.lock ();
+    flights.erase (path);
+    if (file) {
+        insert (file);
+    }
+
+    return file;
+}
+
+// Returns the file at path if it is already cached and still current, never loads it
+std::shared_ptr<const Cachedfile> Filecache::peek (const std::string& path) {
+    Fileinfo info;
+    if (!stats.get (path, info)) {
+        return nullptr;
+    }
+
+    std::lock_guard<std::mutex> guard (lock);
+    auto it = entries.find (path);
+    if (it == entries.end () || !same_version (info, it->second.file->ino, it->second.file->size, it->second.file->mtime)) {
+        return nullptr;
+    }
+
+    return it->second.file;
+}
+
+// Reports how many files are cached and how many bytes they take
+void Filecache::usage (size_t& count, size_t& bytes) {
+    std::lock_guard<std::mutex> guard (lock);
+    count = entries.size ();
+    bytes = used_bytes;
+}
+
+// Drops the cached copy of a file so the next get() reloads it
+void Filecache::invalidate (const std::string& path) {
+    std::lock_guard<std::mutex> guard (lock);
+    erase (path);
+}
+
+// Returns the gzip encoded variant of a file returned by get(), or nullptr if there isn't one yet
+std::shared_ptr<const Cachedfile> Filecache::get_gzip (const std::shared_ptr<const Cachedfile>& file) {
+    if (file->body.size () < GZIP_MIN_BYTES) {
+        return nullptr;
+    }
+
+    std::lock_guard<std::mutex> guard (lock);
+
+    // only the exact load that's cached gets a variant, a stale copy never does
+    auto it = entries.find (file->path);
+    if (it == entries.end () || it->second.file != file) {
+        return nullptr;
+    }
+
+    if (!it->second.gzip_queued && pool != nullptr) {
+        it->second.gzip_queued = true;
+        pool->submit ([this, file] { compress (file); });
+    }
+
+    return it->second.gzip;
+}
+
+// compresses file on a pool thread and attaches the result to its entry if it is still cached
+void Filecache::compress (std::shared_ptr<const Cachedfile> file) {
+    z_stream stream;
+    memset (&stream, 0, sizeof (stream));
+
+    // window bits 15 + 16 asks zlib for a gzip wrapper instead of a zlib one
+    if (deflateInit2 (&stream, Z_BEST_COMPRESSION, Z_DEFLATED, 15 + 16, 9, Z_DEFAULT_STRATEGY) != Z_OK) {
+        ERROR << "deflateInit2() failed for " << file->path << ENDL;
+        return;
+    }
+
+    auto gzip   = std::make_shared<Cachedfile> ();
+    gzip->path  = file->path;
+    gzip->ino   = file->ino;
+    gzip->mtime = file->mtime;
+    gzip->body.resize (deflateBound (&stream, file->body.size ()));
+
+    stream.next_in   = (Bytef*)file->body.data ();
+    stream.avail_in  = file->body.size ();
+    stream.next_out  = (Bytef*)gzip->body.data ();
+    stream.avail_out = gzip->body.size ();
+    int result       = deflate (&stream, Z_FINISH);
+    gzip->body.resize (stream.total_out);
+    gzip->size = stream.total_out;
+    deflateEnd (&stream);
+
+    if (result != Z_STREAM_END) {
+        ERROR << "Compressing " << file->path << " failed" << ENDL;
+        return;
+    }
+
+    // not worth sending if it didn't get any smaller, gzip_queued stays set so we don't retry
+    if (gzip->body.size () >= file->body.size ()) {
+        DEBUG << file->path << " doesn't compress, serving it as is" << ENDL;
+        return;
+    }
+
+    std::lock_guard<std::mutex> guard (lock);
+
+    auto it = entries.find (file->path);
+    if (it == entries.end () || it->second.file != file) {
+        return;
+    }
+
+    DEBUG << "Compressed " << file->path << " from " << file->body.size () << " to "
+          << gzip->body.size () << " bytes" << ENDL;
+
+    it->second.gzip = gzip;
+    used_bytes += gzip->body.size ();
+
+    // the variant counts against the cache like a file does, older entries make room for it
+    //  but the one it belongs to never does
+    while (used_bytes > max_bytes) {
+        auto oldest = lru.rbegin ();
+        if (oldest != lru.rend () && *oldest == file->path) {
+            ++oldest;
+        }
+        if (oldest == lru.rend ()) {
+            break;
+        }
+        DEBUG << "Evicting " << *oldest << " from file cache" << ENDL;
+        erase (*oldest);
+    }
+
+    // nothing else left to evict, keep serving the file as is
+    if (used_bytes > max_bytes) {
+        used_bytes -= gzip->body.size ();
+        it->second.gzip = nullptr;
+    }
+}
@@ -0,0 +1,116 @@
+/**
+ * @file Filecache.h
+ * @author Cristian Madrazo
+ * @brief In-memory cache of static files shared by all worker threads
+ * @version 1.0
+ *
+ */
+
+#ifndef FILECACHE_H
+#define FILECACHE_H
+
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/types.h>
+#include <unordered_map>
+#include <vector>
+
+#include "Statcache.h"
+#include "Threadpool.h"
+
+// a file loaded from disk along with the metadata used to tell if it changed
+struct Cachedfile {
+    // path the file was loaded from
+    std::string path;
+
+    // full contents of the file
+    std::vector<char> body;
+
+    // identity of the file on disk when it was loaded
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+};
+
+class Filecache {
+    private:
+    // maximum number of body bytes kept in memory
+    size_t max_bytes;
+
+    // number of body bytes currently kept in memory
+    size_t used_bytes;
+
+    // where files are stat()ed to tell if they changed
+    Statcache& stats;
+
+    // guards every member below
+    std::mutex lock;
+
+    // least recently used path at the back
+    std::list<std::string> lru;
+
+    // pool compressed variants are built on, nullptr means never compress
+    Threadpool* pool;
+
+    struct Entry {
+        std::shared_ptr<const Cachedfile> file;
+        std::list<std::string>::iterator lru_pos;
+
+        // gzip encoded copy of file, nullptr until the pool has built it
+        std::shared_ptr<const Cachedfile> gzip;
+
+        // true once compression was queued, stays true if it didn't make the file smaller
+        bool gzip_queued;
+    };
+
+    // loaded files by path
+    std::unordered_map<std::string, Entry> entries;
+
+    // loads currently in progress by path, every miss for a path that is already being
+    // loaded waits on the same future instead of reading the file again
+    std::unordered_map<std::string, std::shared_future<std::shared_ptr<const Cachedfile>>> flights;
+
+    // reads a file from disk, returns nullptr if it can't be opened or read
+    static std::shared_ptr<const Cachedfile> load (const std::string& path);
+
+    // adds a loaded file and evicts older entries until it fits, caller holds lock
+    void insert (const std::shared_ptr<const Cachedfile>& file);
+
+    // removes an entry, caller holds lock
+    void erase (const std::string& path);
+
+    // compresses file on a pool thread and attaches the result to its entry if it is
+    // still cached by then
+    void compress (std::shared_ptr<const Cachedfile> file);
+
+    public:
+    // Constructor
+    Filecache (size_t max_bytes, Statcache& stats);
+
+    // Returns the file at path, loading it if it isn't cached or changed on disk.
+    // Concurrent misses for the same path share a single load.
+    // Returns nullptr if the file can't be opened
+    std::shared_ptr<const Cachedfile> get (const std::string& path);
+
+    // Returns the file at path if it is already cached and still current, never loads it
+    std::shared_ptr<const Cachedfile> peek (const std::string& path);
+
+    // Sets the pool compressed variants are built on
+    void set_pool (Threadpool* pool);
+
+    // Returns the gzip encoded variant of a file returned by get(), or nullptr if there
+    // isn't one yet. The first call for a file queues its compression on the pool so
+    // callers never wait for it, they serve the identity encoding until it's ready
+    std::shared_ptr<const Cachedfile> get_gzip (const std::shared_ptr<const Cachedfile>& file);
+
+    // Reports how many files are cached and how many bytes they take
+    void usage (size_t& count, size_t& bytes);
+
+    // Drops the cached copy of a file so the next get() reloads it
+    void invalidate (const std::string& path);
+};
+
+#endif
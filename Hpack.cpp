@@ -0,0 +1,529 @@
+/**
+ * @file Hpack.cpp
+ * @author Cristian Madrazo
+ * @brief Implementations for Hpack
+ * @version 1.0
+ *
+ */
+
+#include "Hpack.h"
+
+#include <algorithm>
+#include <mutex>
+
+// every dynamic table entry is counted as its name, its value and this much overhead
+#define ENTRY_OVERHEAD 32
+
+// the 61 entries every HPACK table starts with, RFC 7541 appendix A
+static const Headerfield static_table[] = {
+    { ":authority", "" },
+    { ":method", "GET" },
+    { ":method", "POST" },
+    { ":path", "/" },
+    { ":path", "/index.html" },
+    { ":scheme", "http" },
+    { ":scheme", "https" },
+    { ":status", "200" },
+    { ":status", "204" },
+    { ":status", "206" },
+    { ":status", "304" },
+    { ":status", "400" },
+    { ":status", "404" },
+    { ":status", "500" },
+    { "accept-charset", "" },
+    { "accept-encoding", "gzip, deflate" },
+    { "accept-language", "" },
+    { "accept-ranges", "" },
+    { "accept", "" },
+    { "access-control-allow-origin", "" },
+    { "age", "" },
+    { "allow", "" },
+    { "authorization", "" },
+    { "cache-control", "" },
+    { "content-disposition", "" },
+    { "content-encoding", "" },
+    { "content-language", "" },
+    { "content-length", "" },
+    { "content-location", "" },
+    { "content-range", "" },
+    { "content-type", "" },
+    { "cookie", "" },
+    { "date", "" },
+    { "etag", "" },
+    { "expect", "" },
+    { "expires", "" },
+    { "from", "" },
+    { "host", "" },
+    { "if-match", "" },
+    { "if-modified-since", "" },
+    { "if-none-match", "" },
+    { "if-range", "" },
+    { "if-unmodified-since", "" },
+    { "last-modified", "" },
+    { "link", "" },
+    { "location", "" },
+    { "max-forwards", "" },
+    { "proxy-authenticate", "" },
+    { "proxy-authorization", "" },
+    { "range", "" },
+    { "referer", "" },
+    { "refresh", "" },
+    { "retry-after", "" },
+    { "server", "" },
+    { "set-cookie", "" },
+    { "strict-transport-security", "" },
+    { "transfer-encoding", "" },
+    { "user-agent", "" },
+    { "vary", "" },
+    { "via", "" },
+    { "www-authenticate", "" },
+};
+
+#define STATIC_COUNT (sizeof (static_table) / sizeof (static_table[0]))
+
+// Huffman code and its length in bits for every byte value and EOS, RFC 7541 appendix B
+static const struct {
+    uint32_t code;
+    uint8_t bits;
+} huffman_codes[257] = {
+    { 0x1ff8, 13 }, { 0x7fffd8, 23 }, { 0xfffffe2, 28 }, { 0xfffffe3, 28 },
+    { 0xfffffe4, 28 }, { 0xfffffe5, 28 }, { 0xfffffe6, 28 }, { 0xfffffe7, 28 },
+    { 0xfffffe8, 28 }, { 0xffffea, 24 }, { 0x3ffffffc, 30 }, { 0xfffffe9, 28 },
+    { 0xfffffea, 28 }, { 0x3ffffffd, 30 }, { 0xfffffeb, 28 }, { 0xfffffec, 28 },
+    { 0xfffffed, 28 }, { 0xfffffee, 28 }, { 0xfffffef, 28 }, { 0xffffff0, 28 },
+    { 0xffffff1, 28 }, { 0xffffff2, 28 }, { 0x3ffffffe, 30 }, { 0xffffff3, 28 },
+    { 0xffffff4, 28 }, { 0xffffff5, 28 }, { 0xffffff6, 28 }, { 0xffffff7, 28 },
+    { 0xffffff8, 28 }, { 0xffffff9, 28 }, { 0xffffffa, 28 }, { 0xffffffb, 28 },
+    { 0x14, 6 }, { 0x3f8, 10 }, { 0x3f9, 10 }, { 0xffa, 12 },
+    { 0x1ff9, 13 }, { 0x15, 6 }, { 0xf8, 8 }, { 0x7fa, 11 },
+    { 0x3fa, 10 }, { 0x3fb, 10 }, { 0xf9, 8 }, { 0x7fb, 11 },
+    { 0xfa, 8 }, { 0x16, 6 }, { 0x17, 6 }, { 0x18, 6 },
+    { 0x0, 5 }, { 0x1, 5 }, { 0x2, 5 }, { 0x19, 6 },
+    { 0x1a, 6 }, { 0x1b, 6 }, { 0x1c, 6 }, { 0x1d, 6 },
+    { 0x1e, 6 }, { 0x1f, 6 }, { 0x5c, 7 }, { 0xfb, 8 },
+    { 0x7ffc, 15 }, { 0x20, 6 }, { 0xffb, 12 }, { 0x3fc, 10 },
+    { 0x1ffa, 13 }, { 0x21, 6 }, { 0x5d, 7 }, { 0x5e, 7 },
+    { 0x5f, 7 }, { 0x60, 7 }, { 0x61, 7 }, { 0x62, 7 },
+    { 0x63, 7 }, { 0x64, 7 }, { 0x65, 7 }, { 0x66, 7 },
+    { 0x67, 7 }, { 0x68, 7 }, { 0x69, 7 }, { 0x6a, 7 },
+    { 0x6b, 7 }, { 0x6c, 7 }, { 0x6d, 7 }, { 0x6e, 7 },
+    { 0x6f, 7 }, { 0x70, 7 }, { 0x71, 7 }, { 0x72, 7 },
+    { 0xfc, 8 }, { 0x73, 7 }, { 0xfd, 8 }, { 0x1ffb, 13 },
+    { 0x7fff0, 19 }, { 0x1ffc, 13 }, { 0x3ffc, 14 }, { 0x22, 6 },
+    { 0x7ffd, 15 }, { 0x3, 5 }, { 0x23, 6 }, { 0x4, 5 },
+    { 0x24, 6 }, { 0x5, 5 }, { 0x25, 6 }, { 0x26, 6 },
+    { 0x27, 6 }, { 0x6, 5 }, { 0x74, 7 }, { 0x75, 7 },
+    { 0x28, 6 }, { 0x29, 6 }, { 0x2a, 6 }, { 0x7, 5 },
+    { 0x2b, 6 }, { 0x76, 7 }, { 0x2c, 6 }, { 0x8, 5 },
+    { 0x9, 5 }, { 0x2d, 6 }, { 0x77, 7 }, { 0x78, 7 },
+    { 0x79, 7 }, { 0x7a, 7 }, { 0x7b, 7 }, { 0x7ffe, 15 },
+    { 0x7fc, 11 }, { 0x3ffd, 14 }, { 0x1ffd, 13 }, { 0xffffffc, 28 },
+    { 0xfffe6, 20 }, { 0x3fffd2, 22 }, { 0xfffe7, 20 }, { 0xfffe8, 20 },
+    { 0x3fffd3, 22 }, { 0x3fffd4, 22 }, { 0x3fffd5, 22 }, { 0x7fffd9, 23 },
+    { 0x3fffd6, 22 }, { 0x7fffda, 23 }, { 0x7fffdb, 23 }, { 0x7fffdc, 23 },
+    { 0x7fffdd, 23 }, { 0x7fffde, 23 }, { 0xffffeb, 24 }, { 0x7fffdf, 23 },
+    { 0xffffec, 24 }, { 0xffffed, 24 }, { 0x3fffd7, 22 }, { 0x7fffe0, 23 },
+    { 0xffffee, 24 }, { 0x7fffe1, 23 }, { 0x7fffe2, 23 }, { 0x7fffe3, 23 },
+    { 0x7fffe4, 23 }, { 0x1fffdc, 21 }, { 0x3fffd8, 22 }, { 0x7fffe5, 23 },
+    { 0x3fffd9, 22 }, { 0x7fffe6, 23 }, { 0x7fffe7, 23 }, { 0xffffef, 24 },
+    { 0x3fffda, 22 }, { 0x1fffdd, 21 }, { 0xfffe9, 20 }, { 0x3fffdb, 22 },
+    { 0x3fffdc, 22 }, { 0x7fffe8, 23 }, { 0x7fffe9, 23 }, { 0x1fffde, 21 },
+    { 0x7fffea, 23 }, { 0x3fffdd, 22 }, { 0x3fffde, 22 }, { 0xfffff0, 24 },
+    { 0x1fffdf, 21 }, { 0x3fffdf, 22 }, { 0x7fffeb, 23 }, { 0x7fffec, 23 },
+    { 0x1fffe0, 21 }, { 0x1fffe1, 21 }, { 0x3fffe0, 22 }, { 0x1fffe2, 21 },
+    { 0x7fffed, 23 }, { 0x3fffe1, 22 }, { 0x7fffee, 23 }, { 0x7fffef, 23 },
+    { 0xfffea, 20 }, { 0x3fffe2, 22 }, { 0x3fffe3, 22 }, { 0x3fffe4, 22 },
+    { 0x7ffff0, 23 }, { 0x3fffe5, 22 }, { 0x3fffe6, 22 }, { 0x7ffff1, 23 },
+    { 0x3ffffe0, 26 }, { 0x3ffffe1, 26 }, { 0xfffeb, 20 }, { 0x7fff1, 19 },
+    { 0x3fffe7, 22 }, { 0x7ffff2, 23 }, { 0x3fffe8, 22 }, { 0x1ffffec, 25 },
+    { 0x3ffffe2, 26 }, { 0x3ffffe3, 26 }, { 0x3ffffe4, 26 }, { 0x7ffffde, 27 },
+    { 0x7ffffdf, 27 }, { 0x3ffffe5, 26 }, { 0xfffff1, 24 }, { 0x1ffffed, 25 },
+    { 0x7fff2, 19 }, { 0x1fffe3, 21 }, { 0x3ffffe6, 26 }, { 0x7ffffe0, 27 },
+    { 0x7ffffe1, 27 }, { 0x3ffffe7, 26 }, { 0x7ffffe2, 27 }, { 0xfffff2, 24 },
+    { 0x1fffe4, 21 }, { 0x1fffe5, 21 }, { 0x3ffffe8, 26 }, { 0x3ffffe9, 26 },
+    { 0xffffffd, 28 }, { 0x7ffffe3, 27 }, { 0x7ffffe4, 27 }, { 0x7ffffe5, 27 },
+    { 0xfffec, 20 }, { 0xfffff3, 24 }, { 0xfffed, 20 }, { 0x1fffe6, 21 },
+    { 0x3fffe9, 22 }, { 0x1fffe7, 21 }, { 0x1fffe8, 21 }, { 0x7ffff3, 23 },
+    { 0x3fffea, 22 }, { 0x3fffeb, 22 }, { 0x1ffffee, 25 }, { 0x1ffffef, 25 },
+    { 0xfffff4, 24 }, { 0xfffff5, 24 }, { 0x3ffffea, 26 }, { 0x7ffff4, 23 },
+    { 0x3ffffeb, 26 }, { 0x7ffffe6, 27 }, { 0x3ffffec, 26 }, { 0x3ffffed, 26 },
+    { 0x7ffffe7, 27 }, { 0x7ffffe8, 27 }, { 0x7ffffe9, 27 }, { 0x7ffffea, 27 },
+    { 0x7ffffeb, 27 }, { 0xffffffe, 28 }, { 0x7ffffec, 27 }, { 0x7ffffed, 27 },
+    { 0x7ffffee, 27 }, { 0x7ffffef, 27 }, { 0x7fffff0, 27 }, { 0x3ffffee, 26 },
+    { 0x3fffffff, 30 },
+};
+
+#define HUFFMAN_EOS 256
+
+// node of the Huffman decoding tree, leaves have a symbol and no children
+struct Huffmannode {
+    int child[2];
+    int symbol;
+};
+
+// builds the decoding tree from the code table once, node 0 is the root
+static const std::vector<Huffmannode>& huffman_tree () {
+    static std::vector<Huffmannode> tree;
+    static std::once_flag built;
+
+    std::call_once (built, [] () {
+        tree.push_back ({ { -1, -1 }, -1 });
+        for (int symbol = 0; symbol <= HUFFMAN_EOS; symbol++) {
+            int node = 0;
+            for (int bit = huffman_codes[symbol].bits - 1; bit >= 0; bit--) {
+                int branch = (huffman_codes[symbol].code >> bit) & 1;
+                if (tree[node].child[branch] < 0) {
+                    tree[node].child[branch] = tree.size ();
+                    tree.push_back ({ { -1, -1 }, -1 });
+                }
+                node = tree[node].child[branch];
+            }
+            tree[node].symbol = symbol;
+        }
+    });
+
+    return tree;
+}
+
+// Decodes a Huffman coded string
+bool huffman_decode (const uint8_t* data, size_t len, std::string& out) {
+    const std::vector<Huffmannode>& tree = huffman_tree ();
+
+    // bits since the last symbol, the string may only end on a partial code of all ones
+    int node          = 0;
+    int pending_bits  = 0;
+    bool pending_ones = true;
+
+    for (size_t i = 0; i < len; i++) {
+        for (int bit = 7; bit >= 0; bit--) {
+            int branch = (data[i] >> bit) & 1;
+            node       = tree[node].child[branch];
+            if (node < 0) {
+                return false;
+            }
+            pending_bits++;
+            pending_ones = pending_ones && branch == 1;
+
+            if (tree[node].symbol >= 0) {
+                if (tree[node].symbol == HUFFMAN_EOS) {
+                    return false;
+                }
+                out += (char)tree[node].symbol;
+                node         = 0;
+                pending_bits = 0;
+                pending_ones = true;
+            }
+        }
+    }
+
+    return pending_bits < 8 && pending_ones;
+}
+
+// Returns the number of bytes huffman_encode() would produce
+size_t huffman_length (const std::string& in) {
+    size_t bits = 0;
+    for (unsigned char c : in) {
+        bits += huffman_codes[c].bits;
+    }
+    return (bits + 7) / 8;
+}
+
+// Huffman codes a string
+void huffman_encode (const std::string& in, std::string& out) {
+    uint64_t buffer = 0;
+    int bits        = 0;
+
+    for (unsigned char c : in) {
+        buffer = (buffer << huffman_codes[c].bits) | huffman_codes[c].code;
+        bits += huffman_codes[c].bits;
+        while (bits >= 8) {
+            bits -= 8;
+            out += (char)(buffer >> bits);
+        }
+    }
+
+    // the last byte is padded with the most significant bits of EOS, which are all ones
+    if (bits > 0) {
+        out += (char)((buffer << (8 - bits)) | (0xff >> bits));
+    }
+}
+
+// appends an integer with an n bit prefix, first holds the bits above the prefix
+static void encode_integer (std::string& out, uint8_t first, int prefix, uint64_t value) {
+    uint64_t limit = (1 << prefix) - 1;
+    if (value < limit) {
+        out += (char)(first | value);
+        return;
+    }
+
+    out += (char)(first | limit);
+    value -= limit;
+    while (value >= 128) {
+        out += (char)((value & 0x7f) | 0x80);
+        value >>= 7;
+    }
+    out += (char)value;
+}
+
+// reads an integer with an n bit prefix, returns false if it is cut short or too big
+static bool decode_integer (const std::string& in, size_t& pos, int prefix, uint64_t& value) {
+    if (pos >= in.size ()) {
+        return false;
+    }
+
+    uint64_t limit = (1 << prefix) - 1;
+    value          = (uint8_t)in[pos++] & limit;
+    if (value < limit) {
+        return true;
+    }
+
+    for (int shift = 0; pos < in.size () && shift <= 56; shift += 7) {
+        uint8_t byte = in[pos++];
+        value += (uint64_t)(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// appends a string literal, Huffman coded when that is shorter
+static void encode_string (std::string& out, const std::string& value) {
+    size_t coded = huffman_length (value);
+    if (coded < value.size ()) {
+        encode_integer (out, 0x80, 7, coded);
+        huffman_encode (value, out);
+    } else {
+        encode_integer (out, 0x00, 7, value.size ());
+        out += value;
+    }
+}
+
+// reads a string literal, returns false if it is cut short or badly coded
+static bool decode_string (const std::string& in, size_t& pos, std::string& value) {
+    if (pos >= in.size ()) {
+        return false;
+    }
+
+    bool huffman = in[pos] & 0x80;
+    uint64_t len;
+    if (!decode_integer (in, pos, 7, len) || len > in.size () - pos) {
+        return false;
+    }
+
+    value.clear ();
+    if (huffman) {
+        if (!huffman_decode ((const uint8_t*)in.data () + pos, len, value)) {
+            return false;
+        }
+    } else {
+        value.assign (in, pos, len);
+    }
+
+    pos += len;
+    return true;
+}
+
+// Constructor
+Hpacktable::Hpacktable (size_t max_size) {
+    this->size     = 0;
+    this->max_size = max_size;
+}
+
+// drops the oldest entries until the table fits max_size
+void Hpacktable::evict () {
+    while (size > max_size && !entries.empty ()) {
+        size -= entries.back ().name.size () + entries.back ().value.size () + ENTRY_OVERHEAD;
+        entries.pop_back ();
+    }
+}
+
+// Looks up an index
+bool Hpacktable::get (size_t index, Headerfield& field) const {
+    if (index == 0) {
+        return false;
+    }
+    if (index <= STATIC_COUNT) {
+        field = static_table[index - 1];
+        return true;
+    }
+
+    index -= STATIC_COUNT + 1;
+    if (index >= entries.size ()) {
+        return false;
+    }
+    field = entries[index];
+    return true;
+}
+
+// Returns the index of an entry matching both name and value
+size_t Hpacktable::find (const std::string& name, const std::string& value, size_t& name_index) const {
+    name_index = 0;
+
+    for (size_t i = 0; i < STATIC_COUNT; i++) {
+        if (static_table[i].name == name) {
+            if (static_table[i].value == value) {
+                return i + 1;
+            }
+            if (name_index == 0) {
+                name_index = i + 1;
+            }
+        }
+    }
+
+    for (size_t i = 0; i < entries.size (); i++) {
+        if (entries[i].name == name) {
+            if (entries[i].value == value) {
+                return STATIC_COUNT + 1 + i;
+            }
+            if (name_index == 0) {
+                name_index = STATIC_COUNT + 1 + i;
+            }
+        }
+    }
+
+    return 0;
+}
+
+// Adds an entry, evicting older ones to make room
+void Hpacktable::add (const Headerfield& field) {
+    size_t entry_size = field.name.size () + field.value.size () + ENTRY_OVERHEAD;
+    if (entry_size > max_size) {
+        entries.clear ();
+        size = 0;
+        return;
+    }
+
+    entries.push_front (field);
+    size += entry_size;
+    evict ();
+}
+
+// Changes the maximum size
+void Hpacktable::resize (size_t max_size) {
+    this->max_size = max_size;
+    evict ();
+}
+
+// Constructor
+Hpackdecoder::Hpackdecoder (size_t max_size) : table (max_size) {
+    this->max_size = max_size;
+}
+
+// Decodes a complete header block into fields
+bool Hpackdecoder::decode (const std::string& block, std::vector<Headerfield>& fields, bool& oversized) {
+    // one byte referencing a big table entry expands to all of it, so what the fields add
+    //  up to is capped and not just the size of the block
+    size_t list_size = 0;
+    bool first_field = true;
+    oversized        = false;
+
+    // keeps a decoded field unless the list has grown too big
+    auto keep = [&] (const Headerfield& field) {
+        first_field = false;
+        list_size += field.name.size () + field.value.size () + 32;
+        if (list_size > HPACK_LIST_SIZE) {
+            oversized = true;
+            fields.clear ();
+        }
+        if (!oversized) {
+            fields.push_back (field);
+        }
+    };
+
+    size_t pos = 0;
+    while (pos < block.size ()) {
+        uint8_t first = block[pos];
+        uint64_t index;
+        Headerfield field;
+
+        // indexed field
+        if (first & 0x80) {
+            if (!decode_integer (block, pos, 7, index) || !table.get (index, field)) {
+                return false;
+            }
+            keep (field);
+            continue;
+        }
+
+        // dynamic table size update, only allowed before the first field
+        if ((first & 0xe0) == 0x20) {
+            if (!decode_integer (block, pos, 5, index) || index > max_size || !first_field) {
+                return false;
+            }
+            table.resize (index);
+            continue;
+        }
+
+        // literal field, with incremental indexing or without (never indexed is the same to us)
+        bool indexed = first & 0x40;
+        if (!decode_integer (block, pos, indexed ? 6 : 4, index)) {
+            return false;
+        }
+        if (index == 0) {
+            if (!decode_string (block, pos, field.name)) {
+                return false;
+            }
+        } else if (!table.get (index, field)) {
+            return false;
+        }
+        if (!decode_string (block, pos, field.value)) {
+            return false;
+        }
+
+        if (indexed) {
+            table.add (field);
+        }
+        keep (field);
+    }
+
+    return true;
+}
+
+// Constructor
+Hpackencoder::Hpackencoder () {
+    this->resize_pending = false;
+    this->pending_size   = HPACK_TABLE_SIZE;
+}
+
+// Applies the peer's SETTINGS_HEADER_TABLE_SIZE
+void Hpackencoder::set_max_size (size_t max_size) {
+    max_size = std::min (max_size, (size_t)HPACK_TABLE_SIZE);
+    if (max_size != pending_size) {
+        table.resize (max_size);
+        resize_pending = true;
+        pending_size   = max_size;
+    }
+}
+
+// Appends the header block for fields
+void Hpackencoder::encode (const std::vector<Headerfield>& fields, std::string& block) {
+    if (resize_pending) {
+        encode_integer (block, 0x20, 5, pending_size);
+        resize_pending = false;
+    }
+
+    for (const Headerfield& field : fields) {
+        size_t name_index;
+        size_t index = table.find (field.name, field.value, name_index);
+        if (index != 0) {
+            encode_integer (block, 0x80, 7, index);
+            continue;
+        }
+
+        // values that differ on every response would only push useful entries out
+        bool changing = field.name == "content-length" || field.name == "etag" ||
+        field.name == "last-modified" || field.name == "date" || field.name == "content-range";
+
+        encode_integer (block, changing ? 0x00 : 0x40, changing ? 4 : 6, name_index);
+        if (name_index == 0) {
+            encode_string (block, field.name);
+        }
+        encode_string (block, field.value);
+
+        if (!changing) {
+            table.add (field);
+        }
+    }
+}
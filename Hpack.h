@@ -0,0 +1,127 @@
+/**
+ * @file Hpack.h
+ * @author Cristian Madrazo
+ * @brief HPACK header compression for HTTP/2 (RFC 7541)
+ * @version 1.0
+ *
+ */
+
+#ifndef HPACK_H
+#define HPACK_H
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <vector>
+
+// default size of a dynamic table, and the largest one we ever keep
+#define HPACK_TABLE_SIZE 4096
+
+// largest decoded header list we accept, counted like table entries are
+#define HPACK_LIST_SIZE (64 * 1024)
+
+// a header field, names are lowercase
+struct Headerfield {
+    std::string name;
+    std::string value;
+};
+
+// the static table followed by a dynamic table of recently sent fields, indexes are 1 based
+// and the dynamic table starts right after the 61 static entries, newest first
+class Hpacktable {
+    private:
+    // dynamic entries, newest at the front
+    std::deque<Headerfield> entries;
+
+    // sum of name, value and the 32 bytes of overhead every entry is counted with
+    size_t size;
+    size_t max_size;
+
+    // drops the oldest entries until the table fits max_size
+    void evict ();
+
+    public:
+    // Constructor
+    Hpacktable (size_t max_size = HPACK_TABLE_SIZE);
+
+    // Looks up an index, returns false if there is no such entry
+    bool get (size_t index, Headerfield& field) const;
+
+    // Returns the index of an entry matching both name and value, or 0. name_index is set to
+    // an entry with the same name, or 0
+    size_t find (const std::string& name, const std::string& value, size_t& name_index) const;
+
+    // Adds an entry, evicting older ones to make room. An entry bigger than the whole table
+    // just empties it
+    void add (const Headerfield& field);
+
+    // Changes the maximum size, evicting entries that no longer fit
+    void resize (size_t max_size);
+};
+
+class Hpackdecoder {
+    private:
+    Hpacktable table;
+
+    // largest table size the peer may ask for, what we announced in SETTINGS
+    size_t max_size;
+
+    public:
+    // Constructor
+    Hpackdecoder (size_t max_size = HPACK_TABLE_SIZE);
+
+    // Decodes a complete header block into fields. Returns false on any compression
+    // error, the table is out of step with the peer then and the connection has to go.
+    // Once the fields add up to more than HPACK_LIST_SIZE the rest of the block is still
+    // decoded to keep the table in step, but no more fields are kept and oversized is set
+    bool decode (const std::string& block, std::vector<Headerfield>& fields, bool& oversized);
+};
+
+class Hpackencoder {
+    private:
+    Hpacktable table;
+
+    // size the next header block has to announce, set when the peer shrank the table
+    bool resize_pending;
+    size_t pending_size;
+
+    public:
+    // Constructor
+    Hpackencoder ();
+
+    // Applies the peer's SETTINGS_HEADER_TABLE_SIZE, we never use more than HPACK_TABLE_SIZE
+    void set_max_size (size_t max_size);
+
+    // Appends the header block for fields. Fields that repeat across responses are added to
+    // the dynamic table, ones that change every time (lengths, dates, validators) are not
+    void encode (const std::vector<Headerfield>& fields, std::string& block);
+};
+
+/**
+ * @brief Decodes a Huffman coded string
+ *
+ * @param data coded bytes
+ * @param len number of coded bytes
+ * @param out decoded string is appended here
+ * @return false if the coding is invalid, including EOS or more than 7 bits of padding
+ */
+bool huffman_decode (const uint8_t* data, size_t len, std::string& out);
+
+/**
+ * @brief Huffman codes a string
+ *
+ * @param in string to code
+ * @param out coded bytes are appended here
+ */
+void huffman_encode (const std::string& in, std::string& out);
+
+/**
+ * @brief Returns the number of bytes huffman_encode() would produce
+ *
+ * @param in string to code
+ * @return coded length in bytes
+ */
+size_t huffman_length (const std::string& in);
+
+#endif
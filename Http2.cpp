@@ -0,0 +1,765 @@
+/**
+ * @file Http2.cpp
+ * @author Cristian Madrazo
+ * @brief Implementations for Http2connection
+ * @version 1.0
+ *
+ */
+
+#include "Http2.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <poll.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <vector>
+
+#include "Stringlib.h"
+#include "logging.h"
+
+#define FRAME_HEADER_LEN 9
+
+// largest frame we accept, the protocol default which we never raise
+#define MAX_FRAME_SIZE 16384
+
+// flow control window every stream and the connection start with
+#define DEFAULT_WINDOW 65535
+#define MAX_WINDOW 0x7fffffffLL
+
+// streams the client may have open at once, announced in our SETTINGS
+#define MAX_STREAMS 100
+
+// largest header block we collect from CONTINUATION frames
+#define MAX_HEADER_BLOCK (64 * 1024)
+
+// a connection with nothing in flight is closed after this long
+#define IDLE_TIMEOUT_MS 30000
+
+#define READ_SIZE (16 * 1024)
+
+// frame types
+#define FRAME_DATA 0x0
+#define FRAME_HEADERS 0x1
+#define FRAME_PRIORITY 0x2
+#define FRAME_RST_STREAM 0x3
+#define FRAME_SETTINGS 0x4
+#define FRAME_PUSH_PROMISE 0x5
+#define FRAME_PING 0x6
+#define FRAME_GOAWAY 0x7
+#define FRAME_WINDOW_UPDATE 0x8
+#define FRAME_CONTINUATION 0x9
+
+// frame flags
+#define FLAG_END_STREAM 0x1
+#define FLAG_ACK 0x1
+#define FLAG_END_HEADERS 0x4
+#define FLAG_PADDED 0x8
+#define FLAG_PRIORITY 0x20
+
+// settings
+#define SETTINGS_HEADER_TABLE_SIZE 0x1
+#define SETTINGS_ENABLE_PUSH 0x2
+#define SETTINGS_MAX_CONCURRENT_STREAMS 0x3
+#define SETTINGS_INITIAL_WINDOW_SIZE 0x4
+#define SETTINGS_MAX_FRAME_SIZE 0x5
+#define SETTINGS_MAX_HEADER_LIST_SIZE 0x6
+
+// error codes
+#define H2_NO_ERROR 0x0
+#define H2_PROTOCOL_ERROR 0x1
+#define H2_FLOW_CONTROL_ERROR 0x3
+#define H2_STREAM_CLOSED 0x5
+#define H2_FRAME_SIZE_ERROR 0x6
+#define H2_REFUSED_STREAM 0x7
+#define H2_COMPRESSION_ERROR 0x9
+
+static void put16 (std::string& out, uint16_t value) {
+    out += (char)(value >> 8);
+    out += (char)value;
+}
+
+static void put32 (std::string& out, uint32_t value) {
+    out += (char)(value >> 24);
+    out += (char)(value >> 16);
+    out += (char)(value >> 8);
+    out += (char)value;
+}
+
+static uint32_t get32 (const std::string& in, size_t pos) {
+    return (uint32_t)(uint8_t)in[pos] << 24 | (uint32_t)(uint8_t)in[pos + 1] << 16 |
+    (uint32_t)(uint8_t)in[pos + 2] << 8 | (uint8_t)in[pos + 3];
+}
+
+// the 9 bytes in front of every frame
+static std::string frame_header (size_t len, uint8_t type, uint8_t flags, uint32_t stream) {
+    std::string header;
+    header += (char)(len >> 16);
+    header += (char)(len >> 8);
+    header += (char)len;
+    header += (char)type;
+    header += (char)flags;
+    put32 (header, stream & 0x7fffffff);
+    return header;
+}
+
+// sends every buffer, picking partial writes up where they left off
+static bool send_buffers (int sockFd, struct iovec* iov, int count) {
+    int index = 0;
+    while (index < count) {
+        struct msghdr msg = {};
+        msg.msg_iov       = iov + index;
+        msg.msg_iovlen    = count - index;
+
+        ssize_t sent = sendmsg (sockFd, &msg, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent < 0) {
+            return false;
+        }
+
+        while (index < count && (size_t)sent >= iov[index].iov_len) {
+            sent -= iov[index].iov_len;
+            index++;
+        }
+        if (index < count) {
+            iov[index].iov_base = (char*)iov[index].iov_base + sent;
+            iov[index].iov_len -= sent;
+        }
+    }
+
+    return true;
+}
+
+// Constructor, an empty 200
+Http2response::Http2response () {
+    this->status = 200;
+    this->data   = nullptr;
+    this->len    = 0;
+    this->fd     = -1;
+    this->offset = 0;
+}
+
+// Constructor
+Http2connection::Http2connection (int sockFd, Http2handler handler) {
+    this->sockFd              = sockFd;
+    this->handler             = handler;
+    this->preface_seen        = false;
+    this->peer_frame_size     = MAX_FRAME_SIZE;
+    this->peer_initial_window = DEFAULT_WINDOW;
+    this->send_window         = DEFAULT_WINDOW;
+    this->last_stream         = 0;
+    this->goaway              = false;
+    this->closing             = false;
+    this->header_stream       = 0;
+    this->next_turn           = 0;
+}
+
+// Destructor, closes the files of any streams still open
+Http2connection::~Http2connection () {
+    while (!streams.empty ()) {
+        closeStream (streams.begin ());
+    }
+}
+
+// queues a frame in output
+void Http2connection::queueFrame (uint8_t type, uint8_t flags, uint32_t stream, const std::string& payload) {
+    output += frame_header (payload.size (), type, flags, stream);
+    output += payload;
+}
+
+// sends everything in output
+bool Http2connection::flush () {
+    if (output.empty ()) {
+        return true;
+    }
+
+    struct iovec iov = { (void*)output.data (), output.size () };
+    bool sent        = send_buffers (sockFd, &iov, 1);
+    output.clear ();
+    return sent;
+}
+
+// tells the client why the connection is closing
+void Http2connection::connectionError (uint32_t code) {
+    DEBUG << "Closing HTTP/2 connection with error " << code << ENDL;
+
+    std::string payload;
+    put32 (payload, last_stream);
+    put32 (payload, code);
+    queueFrame (FRAME_GOAWAY, 0, 0, payload);
+
+    goaway  = true;
+    closing = true;
+}
+
+// abandons a stream and tells the client
+void Http2connection::resetStream (uint32_t id, uint32_t code) {
+    std::string payload;
+    put32 (payload, code);
+    queueFrame (FRAME_RST_STREAM, 0, id, payload);
+
+    auto it = streams.find (id);
+    if (it != streams.end ()) {
+        closeStream (it);
+    }
+}
+
+// applies a SETTINGS payload
+uint32_t Http2connection::applySettings (const std::string& payload) {
+    for (size_t pos = 0; pos + 6 <= payload.size (); pos += 6) {
+        uint16_t id    = (uint8_t)payload[pos] << 8 | (uint8_t)payload[pos + 1];
+        uint32_t value = get32 (payload, pos + 2);
+
+        switch (id) {
+        case (SETTINGS_HEADER_TABLE_SIZE): encoder.set_max_size (value); break;
+
+        case (SETTINGS_ENABLE_PUSH):
+            if (value > 1) {
+                return H2_PROTOCOL_ERROR;
+            }
+            break;
+
+        // open streams see the change in their windows too
+        case (SETTINGS_INITIAL_WINDOW_SIZE): {
+            if (value > MAX_WINDOW) {
+                return H2_FLOW_CONTROL_ERROR;
+            }
+            int64_t delta = (int64_t)value - peer_initial_window;
+            for (auto& entry : streams) {
+                entry.second.window += delta;
+                if (entry.second.window > MAX_WINDOW) {
+                    return H2_FLOW_CONTROL_ERROR;
+                }
+            }
+            peer_initial_window = value;
+            break;
+        }
+
+        case (SETTINGS_MAX_FRAME_SIZE):
+            if (value < MAX_FRAME_SIZE || value > 0xffffff) {
+                return H2_PROTOCOL_ERROR;
+            }
+            peer_frame_size = value;
+            break;
+
+        // unknown settings are ignored, and we never open streams ourselves
+        default: break;
+        }
+    }
+
+    return H2_NO_ERROR;
+}
+
+// takes whole frames off the front of input and handles them
+void Http2connection::parseInput () {
+    size_t preface_len = strlen (HTTP2_PREFACE);
+    if (!preface_seen) {
+        if (input.compare (0, std::min (input.size (), preface_len), HTTP2_PREFACE, std::min (input.size (), preface_len)) != 0) {
+            DEBUG << "Client didn't send the HTTP/2 preface" << ENDL;
+            connectionError (H2_PROTOCOL_ERROR);
+            return;
+        }
+        if (input.size () < preface_len) {
+            return;
+        }
+        input.erase (0, preface_len);
+        preface_seen = true;
+    }
+
+    size_t pos = 0;
+    while (!closing && input.size () - pos >= FRAME_HEADER_LEN) {
+        uint32_t len = (uint32_t)(uint8_t)input[pos] << 16 | (uint32_t)(uint8_t)input[pos + 1] << 8 |
+        (uint8_t)input[pos + 2];
+        uint8_t type  = input[pos + 3];
+        uint8_t flags = input[pos + 4];
+        uint32_t id   = get32 (input, pos + 5) & 0x7fffffff;
+
+        if (len > MAX_FRAME_SIZE) {
+            connectionError (H2_FRAME_SIZE_ERROR);
+            break;
+        }
+        if (input.size () - pos - FRAME_HEADER_LEN < len) {
+            break;
+        }
+
+        handleFrame (type, flags, id, input.substr (pos + FRAME_HEADER_LEN, len));
+        pos += FRAME_HEADER_LEN + len;
+    }
+
+    input.erase (0, pos);
+}
+
+// handles one frame
+bool Http2connection::handleFrame (uint8_t type, uint8_t flags, uint32_t id, const std::string& payload) {
+
+    // a header block has to be finished before anything else happens on the connection
+    if (header_stream != 0 && (type != FRAME_CONTINUATION || id != header_stream)) {
+        connectionError (H2_PROTOCOL_ERROR);
+        return false;
+    }
+
+    switch (type) {
+
+    // request bodies aren't used, but the window they took up is handed back
+    case (FRAME_DATA): {
+        if (id == 0) {
+            connectionError (H2_PROTOCOL_ERROR);
+            return false;
+        }
+        if (!payload.empty ()) {
+            std::string increment;
+            put32 (increment, payload.size ());
+            queueFrame (FRAME_WINDOW_UPDATE, 0, 0, increment);
+            if (streams.count (id)) {
+                queueFrame (FRAME_WINDOW_UPDATE, 0, id, increment);
+            }
+        }
+        return true;
+    }
+
+    case (FRAME_HEADERS): {
+        if (id == 0 || id % 2 == 0) {
+            connectionError (H2_PROTOCOL_ERROR);
+            return false;
+        }
+
+        // padding and priority are skipped, every stream gets an equal turn
+        size_t start = 0, padding = 0;
+        if (flags & FLAG_PADDED) {
+            if (payload.empty ()) {
+                connectionError (H2_PROTOCOL_ERROR);
+                return false;
+            }
+            padding = (uint8_t)payload[0];
+            start   = 1;
+        }
+        if (flags & FLAG_PRIORITY) {
+            start += 5;
+        }
+        if (start + padding > payload.size ()) {
+            connectionError (H2_PROTOCOL_ERROR);
+            return false;
+        }
+
+        header_block  = payload.substr (start, payload.size () - start - padding);
+        header_stream = id;
+        if (flags & FLAG_END_HEADERS) {
+            return startStream (id);
+        }
+        return true;
+    }
+
+    case (FRAME_CONTINUATION): {
+        if (header_stream == 0 || header_block.size () + payload.size () > MAX_HEADER_BLOCK) {
+            connectionError (H2_PROTOCOL_ERROR);
+            return false;
+        }
+
+        header_block += payload;
+        if (flags & FLAG_END_HEADERS) {
+            return startStream (id);
+        }
+        return true;
+    }
+
+    case (FRAME_PRIORITY): {
+        if (id == 0) {
+            connectionError (H2_PROTOCOL_ERROR);
+            return false;
+        }
+        return true;
+    }
+
+    case (FRAME_RST_STREAM): {
+        if (id == 0 || id > last_stream) {
+            connectionError (H2_PROTOCOL_ERROR);
+            return false;
+        }
+        if (payload.size () != 4) {
+            connectionError (H2_FRAME_SIZE_ERROR);
+            return false;
+        }
+
+        auto it = streams.find (id);
+        if (it != streams.end ()) {
+            DEBUG << "Client cancelled stream " << id << ENDL;
+            closeStream (it);
+        }
+        return true;
+    }
+
+    case (FRAME_SETTINGS): {
+        if (id != 0) {
+            connectionError (H2_PROTOCOL_ERROR);
+            return false;
+        }
+        if ((flags & FLAG_ACK) ? !payload.empty () : payload.size () % 6 != 0) {
+            connectionError (H2_FRAME_SIZE_ERROR);
+            return false;
+        }
+        if (flags & FLAG_ACK) {
+            return true;
+        }
+
+        uint32_t code = applySettings (payload);
+        if (code != H2_NO_ERROR) {
+            connectionError (code);
+            return false;
+        }
+        queueFrame (FRAME_SETTINGS, FLAG_ACK, 0, "");
+        return true;
+    }
+
+    // only servers push
+    case (FRAME_PUSH_PROMISE): {
+        connectionError (H2_PROTOCOL_ERROR);
+        return false;
+    }
+
+    case (FRAME_PING): {
+        if (id != 0) {
+            connectionError (H2_PROTOCOL_ERROR);
+            return false;
+        }
+        if (payload.size () != 8) {
+            connectionError (H2_FRAME_SIZE_ERROR);
+            return false;
+        }
+        if (!(flags & FLAG_ACK)) {
+            queueFrame (FRAME_PING, FLAG_ACK, 0, payload);
+        }
+        return true;
+    }
+
+    // streams already open are still answered
+    case (FRAME_GOAWAY): {
+        if (id != 0) {
+            connectionError (H2_PROTOCOL_ERROR);
+            return false;
+        }
+        goaway = true;
+        return true;
+    }
+
+    case (FRAME_WINDOW_UPDATE): {
+        if (payload.size () != 4) {
+            connectionError (H2_FRAME_SIZE_ERROR);
+            return false;
+        }
+
+        uint32_t increment = get32 (payload, 0) & 0x7fffffff;
+        if (id == 0) {
+            send_window += increment;
+            if (increment == 0 || send_window > MAX_WINDOW) {
+                connectionError (increment == 0 ? H2_PROTOCOL_ERROR : H2_FLOW_CONTROL_ERROR);
+                return false;
+            }
+            return true;
+        }
+
+        auto it = streams.find (id);
+        if (it != streams.end ()) {
+            it->second.window += increment;
+            if (increment == 0 || it->second.window > MAX_WINDOW) {
+                resetStream (id, increment == 0 ? H2_PROTOCOL_ERROR : H2_FLOW_CONTROL_ERROR);
+            }
+        }
+        return true;
+    }
+
+    // unknown frame types are ignored
+    default: return true;
+    }
+}
+
+// decodes a complete header block and opens its stream
+bool Http2connection::startStream (uint32_t id) {
+    std::string block;
+    block.swap (header_block);
+    header_stream = 0;
+
+    // the block is decoded even if the stream is refused, the tables have to stay in step
+    std::vector<Headerfield> fields;
+    bool oversized;
+    if (!decoder.decode (block, fields, oversized)) {
+        connectionError (H2_COMPRESSION_ERROR);
+        return false;
+    }
+
+    // trailers of a stream that is still open
+    if (id <= last_stream) {
+        if (streams.count (id)) {
+            return true;
+        }
+        connectionError (H2_STREAM_CLOSED);
+        return false;
+    }
+    last_stream = id;
+
+    if (goaway) {
+        return true;
+    }
+    if (streams.size () >= MAX_STREAMS || oversized) {
+        DEBUG << "HTTP/2 stream " << id << " refused" << (oversized ? ", its headers are too big" : "") << ENDL;
+        resetStream (id, H2_REFUSED_STREAM);
+        return true;
+    }
+
+    // pseudo headers carry the request line, paths lose their leading slashes like
+    //  readRequest() does
+    Request request;
+    request.version = "HTTP/2";
+    bool has_path   = false;
+    for (const Headerfield& field : fields) {
+        if (field.name == ":method") {
+            request.method = field.value;
+        } else if (field.name == ":path") {
+            request.path = remove_padding (field.value, '/', true, false);
+            has_path     = true;
+        } else if (!field.name.empty () && field.name[0] != ':') {
+            std::string& value = request.headers[field.name];
+            value += (value.empty () ? "" : (field.name == "cookie" ? "; " : ", ")) + field.value;
+        }
+    }
+
+    if (request.method.empty () || !has_path) {
+        resetStream (id, H2_PROTOCOL_ERROR);
+        return true;
+    }
+
+    openStream (id, request);
+    return true;
+}
+
+// opens a stream for a request and has the handler answer it
+void Http2connection::openStream (uint32_t id, const Request& request) {
+    DEBUG << "HTTP/2 stream " << id << ": " << request.method << " " << request.path << ENDL;
+
+    Stream& stream      = streams[id];
+    stream.request      = request;
+    stream.window       = peer_initial_window;
+    stream.sent         = 0;
+    stream.headers_sent = false;
+
+    handler (request, stream.response);
+    stream.body = request.method != "HEAD" && stream.response.status != 304;
+}
+
+// sends the response headers of a stream
+bool Http2connection::sendHeaders (uint32_t id, Stream& stream) {
+    std::vector<Headerfield> fields = { { ":status", std::to_string (stream.response.status) } };
+
+    // header lines are turned into lowercase fields, ones tied to an HTTP/1 connection are
+    //  dropped and the length always comes from the body
+    for (const std::string& line : string_tokenize (stream.response.headers, '\n')) {
+        size_t colon = line.find (':');
+        if (colon == std::string::npos) {
+            continue;
+        }
+
+        std::string name = string_to_lower (line.substr (0, colon));
+        if (name == "connection" || name == "keep-alive" || name == "transfer-encoding" ||
+        name == "upgrade" || name == "proxy-connection" || name == "content-length") {
+            continue;
+        }
+        std::string value = remove_padding (remove_padding (line.substr (colon + 1), '\r'), ' ');
+        fields.push_back ({ name, value });
+    }
+    if (stream.response.status != 304) {
+        fields.push_back ({ "content-length", std::to_string (stream.response.len) });
+    }
+
+    std::string block;
+    encoder.encode (fields, block);
+
+    // one HEADERS frame and as many CONTINUATION frames as the peer's frame size needs
+    bool end_stream = !stream.body || stream.response.len == 0;
+    size_t pos      = 0;
+    do {
+        size_t len    = std::min (block.size () - pos, (size_t)peer_frame_size);
+        uint8_t flags = pos + len == block.size () ? FLAG_END_HEADERS : 0;
+        if (pos == 0 && end_stream) {
+            flags |= FLAG_END_STREAM;
+        }
+        queueFrame (pos == 0 ? FRAME_HEADERS : FRAME_CONTINUATION, flags, id, block.substr (pos, len));
+        pos += len;
+    } while (pos < block.size ());
+
+    stream.headers_sent = true;
+    return flush ();
+}
+
+// sends the next DATA frame of a stream
+bool Http2connection::sendData (uint32_t id, Stream& stream) {
+    size_t remaining = stream.response.len - stream.sent;
+    size_t len = std::min ({ remaining, (size_t)peer_frame_size, (size_t)stream.window, (size_t)send_window });
+    if (len == 0) {
+        return true;
+    }
+
+    // control frames go out first
+    if (!flush ()) {
+        return false;
+    }
+
+    std::string header = frame_header (len, FRAME_DATA, len == remaining ? FLAG_END_STREAM : 0, id);
+
+    if (stream.response.fd >= 0) {
+        if (send (sockFd, header.data (), header.size (), MSG_NOSIGNAL | MSG_MORE) != (ssize_t)header.size ()) {
+            return false;
+        }
+
+        off_t offset = stream.response.offset + stream.sent;
+        size_t left  = len;
+        while (left > 0) {
+            ssize_t sent = sendfile (sockFd, stream.response.fd, &offset, left);
+            if (sent < 0 && errno == EINTR) {
+                continue;
+            }
+            if (sent <= 0) {
+                return false;
+            }
+            left -= sent;
+        }
+    } else {
+        struct iovec iov[2] = {
+            { (void*)header.data (), header.size () },
+            { (void*)(stream.response.data + stream.sent), len },
+        };
+        if (!send_buffers (sockFd, iov, 2)) {
+            return false;
+        }
+    }
+
+    stream.sent += len;
+    stream.window -= len;
+    send_window -= len;
+    return true;
+}
+
+// true if a stream has something it is allowed to send right now
+bool Http2connection::ready (const Stream& stream) const {
+    return !stream.headers_sent ||
+    (stream.body && stream.sent < stream.response.len && stream.window > 0 && send_window > 0);
+}
+
+// drops a finished or reset stream
+void Http2connection::closeStream (std::map<uint32_t, Stream>::iterator it) {
+    if (it->second.response.fd >= 0) {
+        close (it->second.response.fd);
+    }
+    streams.erase (it);
+}
+
+// Takes over an HTTP/1.1 request that asked to upgrade to h2c as stream 1
+bool Http2connection::upgrade (const Request& request, const std::string& settings) {
+    std::string payload;
+    if (!base64_decode (settings, payload) || payload.size () % 6 != 0 || applySettings (payload) != H2_NO_ERROR) {
+        return false;
+    }
+
+    // the 101 response acknowledges these settings, and the request becomes stream 1
+    last_stream = 1;
+    Request upgraded (request);
+    upgraded.version = "HTTP/2";
+    openStream (1, upgraded);
+    return true;
+}
+
+// Serves the connection until the client closes it, goes idle or breaks the protocol
+void Http2connection::serve (const std::string& preread) {
+    std::string settings;
+    put16 (settings, SETTINGS_MAX_CONCURRENT_STREAMS);
+    put32 (settings, MAX_STREAMS);
+    put16 (settings, SETTINGS_MAX_HEADER_LIST_SIZE);
+    put32 (settings, HPACK_LIST_SIZE);
+    queueFrame (FRAME_SETTINGS, 0, 0, settings);
+
+    input = preread;
+    parseInput ();
+
+    while (true) {
+        if (closing || (goaway && streams.empty ())) {
+            flush ();
+            return;
+        }
+
+        bool work = !output.empty ();
+        for (const auto& entry : streams) {
+            work = work || (preface_seen && ready (entry.second));
+        }
+
+        // only wait for the client when every stream is stuck on flow control or done
+        struct pollfd pfd = { sockFd, POLLIN, 0 };
+        int polled        = poll (&pfd, 1, work ? 0 : IDLE_TIMEOUT_MS);
+        if (polled < 0 && errno != EINTR) {
+            return;
+        }
+        if (polled == 0 && !work) {
+            DEBUG << "HTTP/2 connection idle, closing it" << ENDL;
+            connectionError (H2_NO_ERROR);
+            continue;
+        }
+
+        if (polled > 0) {
+            char buffer[READ_SIZE];
+            ssize_t bytesRead = recv (sockFd, buffer, READ_SIZE, 0);
+            if (bytesRead < 0 && errno == EINTR) {
+                continue;
+            }
+            if (bytesRead <= 0) {
+                DEBUG << "HTTP/2 client closed the connection" << ENDL;
+                return;
+            }
+
+            input.append (buffer, bytesRead);
+            parseInput ();
+            if (closing) {
+                continue;
+            }
+        }
+
+        if (!flush ()) {
+            return;
+        }
+
+        // an upgraded stream waits for the client to show it speaks HTTP/2 too
+        if (!preface_seen) {
+            continue;
+        }
+
+        // every stream gets one frame per round so responses interleave, starting after
+        //  the stream that went last in the previous round
+        std::vector<uint32_t> turns;
+        for (auto it = streams.upper_bound (next_turn); it != streams.end (); it++) {
+            turns.push_back (it->first);
+        }
+        for (auto it = streams.begin (); it != streams.end () && it->first <= next_turn; it++) {
+            turns.push_back (it->first);
+        }
+
+        for (uint32_t id : turns) {
+            auto it = streams.find (id);
+            if (it == streams.end () || !ready (it->second)) {
+                continue;
+            }
+
+            Stream& stream = it->second;
+            bool sent      = stream.headers_sent ? sendData (id, stream) : sendHeaders (id, stream);
+            if (!sent) {
+                DEBUG << "HTTP/2 client stopped reading" << ENDL;
+                return;
+            }
+            next_turn = id;
+
+            if (stream.headers_sent && (!stream.body || stream.sent == stream.response.len)) {
+                closeStream (it);
+            }
+        }
+    }
+}
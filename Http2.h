@@ -0,0 +1,157 @@
+/**
+ * @file Http2.h
+ * @author Cristian Madrazo
+ * @brief Cleartext HTTP/2 (h2c) connections with many requests in flight at once
+ * @version 1.0
+ *
+ */
+
+#ifndef HTTP2_H
+#define HTTP2_H
+
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <sys/types.h>
+
+#include "Hpack.h"
+#include "Request.h"
+
+// every HTTP/2 connection starts with the client sending this
+#define HTTP2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+
+// the response to one stream, filled in by the server's handler
+struct Http2response {
+    int status;
+
+    // header lines as they would appear in an HTTP/1.x response, "Name: value\r\n" each,
+    // without the status line or Content-Length
+    std::string headers;
+
+    // the body is either in memory at data, kept alive by keep or owned, or sent with
+    // sendfile() from fd at offset. len is the body size either way, also for HEAD requests
+    // which get no body
+    const char* data;
+    size_t len;
+    int fd;
+    off_t offset;
+    std::shared_ptr<const void> keep;
+    std::string owned;
+
+    // Constructor, an empty 200
+    Http2response ();
+};
+
+// fills in the response to a request, called once per stream
+typedef void (*Http2handler) (const Request& request, Http2response& response);
+
+class Http2connection {
+    private:
+    int sockFd;
+    Http2handler handler;
+
+    Hpackdecoder decoder;
+    Hpackencoder encoder;
+
+    // received bytes that don't make a whole frame yet
+    std::string input;
+    bool preface_seen;
+
+    // control frames waiting to be sent, they go out before any more response data
+    std::string output;
+
+    // what the peer told us in SETTINGS
+    uint32_t peer_frame_size;
+    int64_t peer_initial_window;
+
+    // how much DATA the peer still lets us send on the connection as a whole
+    int64_t send_window;
+
+    // highest stream the client opened, streams can't be reused
+    uint32_t last_stream;
+
+    // no new streams after a GOAWAY, the connection closes once output is flushed on closing
+    bool goaway;
+    bool closing;
+
+    // header block being collected from HEADERS and CONTINUATION frames, header_stream is 0
+    // when there is none
+    uint32_t header_stream;
+    std::string header_block;
+
+    struct Stream {
+        Request request;
+        Http2response response;
+
+        // how much DATA the peer still lets us send on this stream
+        int64_t window;
+
+        // body bytes sent so far
+        size_t sent;
+        bool headers_sent;
+
+        // false for HEAD, only the headers are sent
+        bool body;
+    };
+
+    // open streams by id, served round robin starting after next_turn
+    std::map<uint32_t, Stream> streams;
+    uint32_t next_turn;
+
+    // queues a frame in output
+    void queueFrame (uint8_t type, uint8_t flags, uint32_t stream, const std::string& payload);
+
+    // sends everything in output, returns false if the client went away
+    bool flush ();
+
+    // tells the client why the connection is closing and closes it once that is sent
+    void connectionError (uint32_t code);
+
+    // abandons a stream and tells the client
+    void resetStream (uint32_t id, uint32_t code);
+
+    // applies a SETTINGS payload, returns 0 or the error code to close the connection with
+    uint32_t applySettings (const std::string& payload);
+
+    // takes whole frames off the front of input and handles them
+    void parseInput ();
+
+    // handles one frame, returns false once the connection can't go on
+    bool handleFrame (uint8_t type, uint8_t flags, uint32_t id, const std::string& payload);
+
+    // decodes a complete header block and opens its stream
+    bool startStream (uint32_t id);
+
+    // opens a stream for a request and has the handler answer it
+    void openStream (uint32_t id, const Request& request);
+
+    // sends the response headers, or the next DATA frame of a stream. Returns false if the
+    // client went away
+    bool sendHeaders (uint32_t id, Stream& stream);
+    bool sendData (uint32_t id, Stream& stream);
+
+    // true if a stream has something it is allowed to send right now
+    bool ready (const Stream& stream) const;
+
+    // drops a finished or reset stream, closing its file
+    void closeStream (std::map<uint32_t, Stream>::iterator it);
+
+    public:
+    // Constructor, requests are answered by handler
+    Http2connection (int sockFd, Http2handler handler);
+
+    // Destructor, closes the files of any streams still open
+    ~Http2connection ();
+
+    // Takes over an HTTP/1.1 request that asked to upgrade to h2c as stream 1, settings is
+    // the HTTP2-Settings header. Returns false if settings is invalid, otherwise the caller
+    // sends 101 Switching Protocols and then calls serve()
+    bool upgrade (const Request& request, const std::string& settings);
+
+    // Serves the connection until the client closes it, goes idle or breaks the protocol.
+    // preread holds bytes already read from the socket, starting with the preface
+    void serve (const std::string& preread);
+};
+
+#endif
@@ -0,0 +1,181 @@
+/**
+ * @file Mapcache.cpp
+ * @author Cristian Madrazo
+ * @brief Implementations for Mapcache
+ * @version 1.0
+ *
+ */
+
+#include "Mapcache.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "logging.h"
+
+// Destructor, unmaps the file
+Mappedfile::~Mappedfile () {
+    if (data != nullptr) {
+        munmap ((void*)data, size);
+    }
+}
+
+// Constructor
+Mapcache::Mapcache (size_t max_bytes, Statcache& stats, bool populate) : stats (stats) {
+    this->max_bytes  = max_bytes;
+    this->used_bytes = 0;
+    this->populate   = populate;
+}
+
+// Turns MAP_POPULATE on or off for mappings created from now on
+void Mapcache::set_populate (bool populate) {
+    std::lock_guard<std::mutex> guard (lock);
+    this->populate = populate;
+}
+
+// maps a file, returns nullptr if it can't be opened or mapped
+std::shared_ptr<const Mappedfile> Mapcache::map (const std::string& path) {
+    int fd = open (path.c_str (), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return nullptr;
+    }
+
+    struct stat st;
+    if (fstat (fd, &st) < 0) {
+        close (fd);
+        return nullptr;
+    }
+
+    auto file   = std::make_shared<Mappedfile> ();
+    file->path  = path;
+    file->data  = nullptr;
+    file->ino   = st.st_ino;
+    file->size  = st.st_size;
+    file->mtime = st.st_mtim;
+
+    // mmap() refuses zero length mappings, an empty file is just an empty body
+    if (st.st_size > 0) {
+        int flags  = MAP_SHARED | (populate ? MAP_POPULATE : 0);
+        void* addr = mmap (nullptr, st.st_size, PROT_READ, flags, fd, 0);
+        if (addr == MAP_FAILED) {
+            ERROR << "Failed to mmap " << path << ENDL;
+            close (fd);
+            return nullptr;
+        }
+
+        // the whole file is about to be sent front to back
+        madvise (addr, st.st_size, MADV_WILLNEED);
+        madvise (addr, st.st_size, MADV_SEQUENTIAL);
+        file->data = (const char*)addr;
+    }
+
+    // the mapping keeps the file alive on its own
+    close (fd);
+
+    DEBUG << "Mapped " << path << " (" << st.st_size << " bytes)" << ENDL;
+    return file;
+}
+
+// adds a mapping and evicts older entries until it fits, caller holds lock
+void Mapcache::insert (const std::shared_ptr<const Mappedfile>& file) {
+
+    // files bigger than the whole cache are served but never kept
+    if ((size_t)file->size > max_bytes) {
+        return;
+    }
+
+    erase (file->path);
+
+    while (used_bytes + file->size > max_bytes && !lru.empty ()) {
+        DEBUG << "Evicting mapping of " << lru.back () << ENDL;
+        erase (lru.back ());
+    }
+
+    lru.push_front (file->path);
+    entries[file->path] = Entry{ file, lru.begin () };
+    used_bytes += file->size;
+}
+
+// removes an entry, caller holds lock
+void Mapcache::erase (const std::string& path) {
+    auto it = entries.find (path);
+    if (it == entries.end ()) {
+        return;
+    }
+
+    used_bytes -= it->second.file->size;
+    lru.erase (it->second.lru_pos);
+    entries.erase (it);
+}
+
+// Returns a mapping of the file at path, mapping it if it isn't cached or changed on disk
+std::shared_ptr<const Mappedfile> Mapcache::get (const std::string& path) {
+    Fileinfo info;
+    if (!stats.get (path, info)) {
+        invalidate (path);
+        return nullptr;
+    }
+
+    {
+        std::lock_guard<std::mutex> guard (lock);
+
+        auto it = entries.find (path);
+        if (it != entries.end ()) {
+            const Mappedfile& cached = *it->second.file;
+            if (same_version (info, cached.ino, cached.size, cached.mtime)) {
+                lru.splice (lru.begin (), lru, it->second.lru_pos);
+                return it->second.file;
+            }
+
+            // connections still sending the old mapping keep it until they finish
+            DEBUG << path << " changed on disk, remapping" << ENDL;
+            erase (path);
+        }
+    }
+
+    // mapping is cheap next to reading, so racing misses just map twice and the last one wins
+    std::shared_ptr<const Mappedfile> file = map (path);
+
+    // the stat cache is behind the file we just mapped, let it catch up
+    if (file && !same_version (info, file->ino, file->size, file->mtime)) {
+        stats.invalidate (path);
+    }
+
+    if (file) {
+        std::lock_guard<std::mutex> guard (lock);
+        insert (file);
+    }
+
+    return file;
+}
+
+// Returns the cached mapping of the file at path if it is still current, never maps it
+std::shared_ptr<const Mappedfile> Mapcache::peek (const std::string& path) {
+    Fileinfo info;
+    if (!stats.get (path, info)) {
+        return nullptr;
+    }
+
+    std::lock_guard<std::mutex> guard (lock);
+    auto it = entries.find (path);
+    if (it == entries.end () || !same_version (info, it->second.file->ino, it->second.file->size, it->second.file->mtime)) {
+        return nullptr;
+    }
+
+    return it->second.file;
+}
+
+// Reports how many mappings are cached and how many bytes they take
+void Mapcache::usage (size_t& count, size_t& bytes) {
+    std::lock_guard<std::mutex> guard (lock);
+    count = entries.size ();
+    bytes = used_bytes;
+}
+
+// Drops the cached mapping of a file so the next get() maps it again
+void Mapcache::invalidate (const std::string& path) {
+    std::lock_guard<std::mutex> guard (lock);
+    erase (path);
+}
@@ -0,0 +1,98 @@
+/**
+ * @file Mapcache.h
+ * @author Cristian Madrazo
+ * @brief Cache of memory mapped static files shared by all worker threads
+ * @version 1.0
+ *
+ */
+
+#ifndef MAPCACHE_H
+#define MAPCACHE_H
+
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sys/types.h>
+#include <unordered_map>
+
+#include "Statcache.h"
+
+// a read only mapping of a whole file, unmapped when the last reference goes away
+struct Mappedfile {
+    // path the file was mapped from
+    std::string path;
+
+    // start of the mapping, nullptr for empty files
+    const char* data;
+
+    // identity of the file on disk when it was mapped
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+
+    // Destructor, unmaps the file
+    ~Mappedfile ();
+};
+
+class Mapcache {
+    private:
+    // maximum number of bytes kept mapped by the cache itself, mappings still in use by a
+    // connection stay alive after eviction until that connection lets go of them
+    size_t max_bytes;
+
+    // number of bytes currently mapped by the cache
+    size_t used_bytes;
+
+    // if true mappings are pre-faulted with MAP_POPULATE
+    bool populate;
+
+    // where files are stat()ed to tell if they changed
+    Statcache& stats;
+
+    // guards every member below
+    std::mutex lock;
+
+    // least recently used path at the back
+    std::list<std::string> lru;
+
+    struct Entry {
+        std::shared_ptr<const Mappedfile> file;
+        std::list<std::string>::iterator lru_pos;
+    };
+
+    // mapped files by path
+    std::unordered_map<std::string, Entry> entries;
+
+    // maps a file, returns nullptr if it can't be opened or mapped
+    std::shared_ptr<const Mappedfile> map (const std::string& path);
+
+    // adds a mapping and evicts older entries until it fits, caller holds lock
+    void insert (const std::shared_ptr<const Mappedfile>& file);
+
+    // removes an entry, caller holds lock
+    void erase (const std::string& path);
+
+    public:
+    // Constructor
+    Mapcache (size_t max_bytes, Statcache& stats, bool populate = false);
+
+    // Turns MAP_POPULATE on or off for mappings created from now on
+    void set_populate (bool populate);
+
+    // Returns a mapping of the file at path, mapping it if it isn't cached or changed on disk.
+    // Returns nullptr if the file can't be opened or mapped
+    std::shared_ptr<const Mappedfile> get (const std::string& path);
+
+    // Returns the cached mapping of the file at path if it is still current, never maps it.
+    // Returns nullptr otherwise
+    std::shared_ptr<const Mappedfile> peek (const std::string& path);
+
+    // Reports how many mappings are cached and how many bytes they take
+    void usage (size_t& count, size_t& bytes);
+
+    // Drops the cached mapping of a file so the next get() maps it again
+    void invalidate (const std::string& path);
+};
+
+#endif
@@ -0,0 +1,1076 @@
+/**
+ * @file Proxy.cpp
+ * @author Cristian Madrazo
+ * @brief Implementations for Proxy
+ * @version 1.0
+ *
+ */
+
+#include "Proxy.h"
+
+#include <algorithm>
+#include <chrono>
+#include <ctime>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <fcntl.h>
+#include <map>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <set>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "Stringlib.h"
+#include "logging.h"
+
+// longest chunk size line we accept from an upstream
+#define LINE_MAX_BYTES 1024
+
+#define READ_SIZE (16 * 1024)
+
+// what a worker keeps between requests, every worker has its own so nothing is shared
+struct Workerstate {
+    // idle keep-alive connections by upstream name
+    std::map<std::string, std::vector<int>> idle;
+
+    // idle pipes bodies are spliced through, every relay takes one of its own
+    std::vector<std::pair<int, int>> pipes;
+
+    // Destructor
+    ~Workerstate () {
+        for (auto& pool : idle) {
+            for (int fd : pool.second) {
+                close (fd);
+            }
+        }
+        for (auto& pipe : pipes) {
+            close (pipe.first);
+            close (pipe.second);
+        }
+    }
+
+    // takes an idle pipe or creates one, returns false if it can't be created
+    bool takePipe (int pipeFds[2]) {
+        if (pipes.empty ()) {
+            return pipe2 (pipeFds, O_CLOEXEC) == 0;
+        }
+        pipeFds[0] = pipes.back ().first;
+        pipeFds[1] = pipes.back ().second;
+        pipes.pop_back ();
+        return true;
+    }
+
+    // puts back a pipe a relay emptied, closes one that may still hold bytes of a failed one
+    void givePipe (int pipeFds[2], bool empty) {
+        if (!empty || pipes.size () >= PROXY_PIPE_POOL) {
+            close (pipeFds[0]);
+            close (pipeFds[1]);
+            return;
+        }
+        pipes.emplace_back (pipeFds[0], pipeFds[1]);
+    }
+};
+
+static thread_local Workerstate worker;
+
+// sends all of data, more hints that further output follows. Returns false if the other end
+// went away or timed out, or there is none, written is set to how much got out either way
+static Task<bool> send_all (Stream* stream, const std::string& data, bool more = false, size_t* written = nullptr) {
+    struct iovec iov;
+    iov.iov_base = (void*)data.data ();
+    iov.iov_len  = data.size ();
+
+    // what is left in iov after a failed write never got out
+    bool sent = stream != nullptr && co_await stream->write (&iov, 1, more) == 0;
+    if (written != nullptr) {
+        *written = sent ? data.size () : data.size () - iov.iov_len;
+    }
+    co_return sent;
+}
+
+// appends what the socket has to pending, returns the bytes read, 0 at EOF or -1
+static Task<ssize_t> read_some (Stream& stream, std::string& pending) {
+    char buffer[READ_SIZE];
+    ssize_t bytesRead = co_await stream.read (buffer, sizeof (buffer));
+    if (bytesRead > 0) {
+        pending.append (buffer, bytesRead);
+    }
+    co_return bytesRead;
+}
+
+// takes one CRLF terminated line off pending, reading more until it is all there
+static Task<bool> read_line (Stream& stream, std::string& pending, std::string& line) {
+    size_t end;
+    while ((end = pending.find ("\r\n")) == std::string::npos) {
+        if (pending.size () > LINE_MAX_BYTES || co_await read_some (stream, pending) <= 0) {
+            co_return false;
+        }
+    }
+    line = pending.substr (0, end);
+    pending.erase (0, end + 2);
+    co_return true;
+}
+
+// moves count bytes, or everything up to EOF if count is -1, between sockets through a pipe
+// of the worker's. Returns false if either side failed, timed out or is missing, setting
+// source_failed if it was reading from that did
+static Task<bool> relay (Stream* from, Stream* to, off_t count, bool* source_failed = nullptr) {
+    int pipeFds[2];
+    if (from == nullptr || to == nullptr) {
+        co_return false;
+    }
+    if (!worker.takePipe (pipeFds)) {
+        ERROR << "Failed to create proxy pipe" << ENDL;
+        co_return false;
+    }
+
+    while (count != 0) {
+        size_t want = count < 0 ? PROXY_PIPE_BYTES : std::min (count, (off_t)PROXY_PIPE_BYTES);
+        ssize_t in  = co_await from->splice_to (pipeFds[1], want);
+        if (in == 0 && count < 0) {
+            break;
+        }
+        if (in <= 0) {
+            if (source_failed != nullptr) {
+                *source_failed = true;
+            }
+            worker.givePipe (pipeFds, true);
+            co_return false;
+        }
+        if (count > 0) {
+            count -= in;
+        }
+
+        // empty the pipe before filling it again
+        while (in > 0) {
+            ssize_t out = co_await to->splice_from (pipeFds[0], in, count != 0);
+            if (out <= 0) {
+                worker.givePipe (pipeFds, false);
+                co_return false;
+            }
+            in -= out;
+        }
+    }
+
+    worker.givePipe (pipeFds, true);
+    co_return true;
+}
+
+// awaits task, then stops loop so whoever runs it gets the status
+static Task<void> settle (Task<int> task, int& status, Reactor& loop) {
+    status = co_await task;
+    loop.stop ();
+}
+
+// runs task on loop until it is done, for threads that block instead of awaiting
+static int finish (Reactor& loop, Task<int> task) {
+    int status = 502;
+    settle (std::move (task), status, loop).spawn ();
+    loop.run ();
+    return status;
+}
+
+// adds the names listed in a Connection header to the hop-by-hop headers that aren't passed on,
+// returns true if it asks for the connection to close
+static bool connection_options (const std::string& value, std::set<std::string>& hop) {
+    bool close = false;
+    for (std::string option : string_tokenize (value, ',')) {
+        option = string_to_lower (remove_padding (option, ' '));
+        close |= option == "close";
+        hop.insert (option);
+    }
+    return close;
+}
+
+// headers that only apply to one connection and are never forwarded
+static const std::set<std::string> HOP_BY_HOP = { "connection", "keep-alive", "proxy-connection", "proxy-authenticate",
+    "proxy-authorization", "te", "trailer", "transfer-encoding", "upgrade", "expect" };
+
+// milliseconds on the steady clock, what ejections are timed with
+static int64_t now_ms () {
+    return std::chrono::duration_cast<std::chrono::milliseconds> (std::chrono::steady_clock::now ().time_since_epoch ())
+    .count ();
+}
+
+// a cheap per worker random number in [0, 1), only used to thin out traffic to ramping upstreams
+static double random_fraction () {
+    static thread_local uint64_t state = (uint64_t)(uintptr_t)&state * 0x9e3779b97f4a7c15ULL | 1;
+    state ^= state << 13;
+    state ^= state >> 7;
+    state ^= state << 17;
+    return (state >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// FNV-1a with a final mix so nearby keys land far apart on the ring
+static uint32_t hash_key (const std::string& key) {
+    uint32_t hash = 2166136261u;
+    for (unsigned char c : key) {
+        hash = (hash ^ c) * 16777619u;
+    }
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6b;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+// share of requests an upstream takes, 0 while ejected and growing back to 1 after
+static double weight (const Upstream& upstream, int64_t now) {
+    int64_t until = upstream.ejected_until.load (std::memory_order_relaxed);
+    if (now < until) {
+        return 0;
+    }
+    if (until == 0 || now - until >= PROXY_RAMP_MS) {
+        return 1;
+    }
+    return std::max (0.1, (double)(now - until) / PROXY_RAMP_MS);
+}
+
+// parses an HTTP date, returns -1 if it isn't one
+static int64_t parse_date (const std::string& value) {
+    struct tm parsed = {};
+    const char* end  = strptime (value.c_str (), "%a, %d %b %Y %H:%M:%S GMT", &parsed);
+    if (end == nullptr || *end != '\0') {
+        return -1;
+    }
+    return timegm (&parsed);
+}
+
+// works out from its headers until when a response may be served from the cache, and how
+// long after that it may still be served while it is refreshed. Returns false if it may not
+// be stored at all, only responses with an explicit lifetime are
+static bool freshness (int status, const std::vector<std::pair<std::string, std::string>>& fields, int64_t& expires,
+int64_t& stale_until) {
+    if (status != 200 && status != 203 && status != 301 && status != 404 && status != 410) {
+        return false;
+    }
+
+    int64_t now = time (nullptr);
+    long max_age = -1, shared_max_age = -1, stale = 0, age = 0;
+    int64_t date = -1, expires_at = -1;
+    bool has_expires = false;
+    for (const auto& field : fields) {
+        std::string name = string_to_lower (field.first);
+        if (name == "cache-control") {
+            for (std::string directive : string_tokenize (field.second, ',')) {
+                directive = string_to_lower (remove_padding (directive, ' '));
+                if (directive == "no-store" || directive == "private" || directive.compare (0, 8, "no-cache") == 0) {
+                    return false;
+                } else if (directive.compare (0, 8, "max-age=") == 0) {
+                    max_age = atol (directive.c_str () + 8);
+                } else if (directive.compare (0, 9, "s-maxage=") == 0) {
+                    shared_max_age = atol (directive.c_str () + 9);
+                } else if (directive.compare (0, 23, "stale-while-revalidate=") == 0) {
+                    stale = atol (directive.c_str () + 23);
+                }
+            }
+        } else if (name == "expires") {
+            has_expires = true;
+            expires_at  = parse_date (field.second);
+        } else if (name == "date") {
+            date = parse_date (field.second);
+        } else if (name == "age") {
+            age = atol (field.second.c_str ());
+        } else if (name == "set-cookie" || name == "vary") {
+            // one client's response, or one that differs by request headers we don't key on
+            return false;
+        }
+    }
+
+    // an Expires that can't be parsed means already expired
+    long lifetime;
+    if (shared_max_age >= 0) {
+        lifetime = shared_max_age;
+    } else if (max_age >= 0) {
+        lifetime = max_age;
+    } else if (has_expires) {
+        lifetime = expires_at < 0 ? 0 : expires_at - (date >= 0 ? date : now);
+    } else {
+        return false;
+    }
+
+    lifetime -= age;
+    if (lifetime <= 0 && stale <= 0) {
+        return false;
+    }
+    expires     = now + lifetime;
+    stale_until = expires + std::max (stale, 0L);
+    return true;
+}
+
+// Constructor
+Upstream::Upstream () : outstanding (0), failures (0), ejected_until (0), requests (0) {
+    this->addrlen = 0;
+}
+
+// Constructor
+Upstreamgroup::Upstreamgroup () : next (0) {
+    this->policy = BALANCE_ROUND_ROBIN;
+}
+
+// adds an upstream or finds one with the same address
+int Proxy::addUpstream (const std::string& address) {
+    // routes naming the same address share its pool and health
+    for (size_t index = 0; index < upstreams.size (); index++) {
+        if (upstreams[index].name == address) {
+            return index;
+        }
+    }
+
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    memset (&addr, 0, sizeof (addr));
+
+    if (address.compare (0, 5, "unix:") == 0) {
+        std::string path = address.substr (5);
+        struct sockaddr_un* sun = (struct sockaddr_un*)&addr;
+        if (path.empty () || path.size () >= sizeof (sun->sun_path)) {
+            return -1;
+        }
+        sun->sun_family = AF_UNIX;
+        memcpy (sun->sun_path, path.c_str (), path.size () + 1);
+        addrlen = offsetof (struct sockaddr_un, sun_path) + path.size () + 1;
+    } else {
+        size_t colon = address.rfind (':');
+        if (colon == std::string::npos || colon == 0) {
+            return -1;
+        }
+        std::string host = address.substr (0, colon);
+        std::string port = address.substr (colon + 1);
+        if (host.front () == '[' && host.back () == ']') {
+            host = host.substr (1, host.size () - 2);
+        }
+
+        struct addrinfo hints = {};
+        hints.ai_family       = AF_UNSPEC;
+        hints.ai_socktype     = SOCK_STREAM;
+        struct addrinfo* found;
+        if (getaddrinfo (host.c_str (), port.c_str (), &hints, &found) != 0) {
+            return -1;
+        }
+        memcpy (&addr, found->ai_addr, found->ai_addrlen);
+        addrlen = found->ai_addrlen;
+        freeaddrinfo (found);
+    }
+
+    upstreams.emplace_back ();
+    upstreams.back ().name    = address;
+    upstreams.back ().addr    = addr;
+    upstreams.back ().addrlen = addrlen;
+    return upstreams.size () - 1;
+}
+
+// forwards requests under prefix to the upstreams in spec
+bool Proxy::add_route (const std::string& prefix, const std::string& spec) {
+    std::string addresses = spec;
+    Balancing policy      = BALANCE_ROUND_ROBIN;
+
+    size_t at = spec.find ('@');
+    if (at != std::string::npos) {
+        std::string name = spec.substr (0, at);
+        if (name == "least") {
+            policy = BALANCE_LEAST_OUTSTANDING;
+        } else if (name == "hash") {
+            policy = BALANCE_HASH;
+        } else if (name != "rr") {
+            return false;
+        }
+        addresses = spec.substr (at + 1);
+    }
+
+    std::vector<size_t> members;
+    for (const std::string& address : string_tokenize (addresses, ',')) {
+        int index = addUpstream (address);
+        if (index < 0) {
+            return false;
+        }
+        members.push_back (index);
+    }
+    if (members.empty ()) {
+        return false;
+    }
+
+    groups.emplace_back ();
+    Upstreamgroup& group = groups.back ();
+    group.policy         = policy;
+    group.members        = members;
+
+    // every upstream owns the arcs ending at its points, so adding or losing one only moves
+    // the keys on its own arcs
+    if (policy == BALANCE_HASH) {
+        for (size_t member : members) {
+            for (int point = 0; point < PROXY_HASH_POINTS; point++) {
+                group.ring.emplace_back (hash_key (upstreams[member].name + "#" + std::to_string (point)), member);
+            }
+        }
+        std::sort (group.ring.begin (), group.ring.end ());
+    }
+
+    routes.emplace_back ("/" + remove_padding (prefix, '/', true, false), groups.size () - 1);
+    std::stable_sort (routes.begin (), routes.end (),
+    [] (const auto& a, const auto& b) { return a.first.size () > b.first.size (); });
+    return true;
+}
+
+// picks an upstream that wasn't tried yet
+size_t Proxy::select (Upstreamgroup& group, const std::string& key, const std::vector<size_t>& tried) const {
+    int64_t now = now_ms ();
+
+    // the members in the order the policy prefers them
+    std::vector<size_t> order;
+    if (group.policy == BALANCE_HASH) {
+        // walk the ring clockwise from the key, taking each upstream the first time it shows up
+        uint32_t point = hash_key (key);
+        auto it = std::lower_bound (group.ring.begin (), group.ring.end (), std::make_pair (point, (size_t)0));
+        for (size_t i = 0; i < group.ring.size () && order.size () < group.members.size (); i++, it++) {
+            if (it == group.ring.end ()) {
+                it = group.ring.begin ();
+            }
+            if (std::find (order.begin (), order.end (), it->second) == order.end ()) {
+                order.push_back (it->second);
+            }
+        }
+    } else {
+        // rotating the start spreads round robin turns, and ties in load
+        unsigned start = group.next.fetch_add (1, std::memory_order_relaxed);
+        for (size_t i = 0; i < group.members.size (); i++) {
+            order.push_back (group.members[(start + i) % group.members.size ()]);
+        }
+    }
+
+    auto untried = [&] (size_t upstream) { return std::find (tried.begin (), tried.end (), upstream) == tried.end (); };
+
+    if (group.policy == BALANCE_LEAST_OUTSTANDING) {
+        // fewest requests in flight, a ramping upstream counts as busier than it is
+        double best_load = 0;
+        int best         = -1;
+        for (size_t upstream : order) {
+            double share = weight (upstreams[upstream], now);
+            if (share == 0 || !untried (upstream)) {
+                continue;
+            }
+            double load = (upstreams[upstream].outstanding.load (std::memory_order_relaxed) + 1) / share;
+            if (best < 0 || load < best_load) {
+                best      = upstream;
+                best_load = load;
+            }
+        }
+        if (best >= 0) {
+            return best;
+        }
+    } else {
+        // the first upstream that is in rotation, a ramping one only takes its share
+        for (size_t upstream : order) {
+            double share = weight (upstreams[upstream], now);
+            if (untried (upstream) && share > 0 && (share >= 1 || random_fraction () < share)) {
+                return upstream;
+            }
+        }
+        for (size_t upstream : order) {
+            if (untried (upstream) && weight (upstreams[upstream], now) > 0) {
+                return upstream;
+            }
+        }
+    }
+
+    // everything is ejected, trying one beats failing every request
+    for (size_t upstream : order) {
+        if (untried (upstream)) {
+            return upstream;
+        }
+    }
+    return order.front ();
+}
+
+// counts a request's outcome towards an upstream's health
+void Proxy::record (Upstream& upstream, bool ok) {
+    if (ok) {
+        upstream.failures.store (0, std::memory_order_relaxed);
+        return;
+    }
+
+    if (upstream.failures.fetch_add (1, std::memory_order_relaxed) + 1 >= PROXY_EJECT_FAILURES) {
+        upstream.failures.store (0, std::memory_order_relaxed);
+        upstream.ejected_until.store (now_ms () + PROXY_EJECT_MS, std::memory_order_relaxed);
+        WARNING << "Ejecting upstream " << upstream.name << " after " << PROXY_EJECT_FAILURES << " failures" << ENDL;
+    }
+}
+
+// calls f with every upstream
+void Proxy::for_each (const std::function<void (const Upstream&)>& f) const {
+    for (const Upstream& upstream : upstreams) {
+        f (upstream);
+    }
+}
+
+// true if no routes were added
+bool Proxy::empty () const {
+    return routes.empty ();
+}
+
+// returns the upstream for a path, a prefix only matches whole path segments
+int Proxy::route (const std::string& target) const {
+    for (const auto& route : routes) {
+        const std::string& prefix = route.first;
+        if (target.compare (0, prefix.size (), prefix) != 0) {
+            continue;
+        }
+        if (prefix.back () == '/' || target.size () == prefix.size () || target[prefix.size ()] == '/' ||
+        target[prefix.size ()] == '?') {
+            return route.second;
+        }
+    }
+    return -1;
+}
+
+// connects a new socket to an upstream
+Task<bool> Proxy::connectUpstream (Stream& stream, size_t upstream) const {
+    const Upstream& target = upstreams[upstream];
+
+    // an upstream that doesn't accept is given up on sooner than one that is slow to answer
+    stream.set_timeout (std::chrono::milliseconds (PROXY_CONNECT_MS));
+    if (co_await stream.connect ((const struct sockaddr*)&target.addr, target.addrlen) < 0) {
+        co_return false;
+    }
+    stream.set_timeout (std::chrono::seconds (PROXY_TIMEOUT_SECONDS));
+
+    if (target.addr.ss_family != AF_UNIX) {
+        int on = 1;
+        setsockopt (stream.get_fd (), IPPROTO_TCP, TCP_NODELAY, &on, sizeof (on));
+    }
+
+    DEBUG << "Connected to upstream " << target.name << ENDL;
+    co_return true;
+}
+
+// returns a pooled connection that is still open, or -1
+int Proxy::checkout (size_t upstream) const {
+    std::vector<int>& idle = worker.idle[upstreams[upstream].name];
+    while (!idle.empty ()) {
+        int fd = idle.back ();
+        idle.pop_back ();
+
+        // an idle connection has nothing to read, EOF means the upstream closed it
+        char byte;
+        ssize_t peeked = recv (fd, &byte, 1, MSG_PEEK | MSG_DONTWAIT);
+        if (peeked < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return fd;
+        }
+        close (fd);
+    }
+
+    return -1;
+}
+
+// puts a connection back in the pool
+void Proxy::checkin (size_t upstream, int fd) const {
+    std::vector<int>& idle = worker.idle[upstreams[upstream].name];
+    if (idle.size () >= PROXY_POOL_SIZE) {
+        close (fd);
+        return;
+    }
+    idle.push_back (fd);
+}
+
+// sends the request and relays the response
+Task<int> Proxy::exchange (Stream* client, const Request& request, const std::string& head, off_t length, Stream& upstream,
+const std::string* cache_key, bool& reusable, bool& retry, bool& unsent, bool& client_failed) const {
+    reusable      = false;
+    retry         = false;
+    unsent        = false;
+    client_failed = false;
+
+    // the head goes out with whatever arrived of the body, a request can only be sent again
+    // if none of its body had to be read from the client
+    off_t buffered  = std::min ((off_t)request.body.size (), length);
+    bool replayable = buffered == length;
+    size_t written;
+    if (!co_await send_all (&upstream, head + request.body.substr (0, buffered), !replayable, &written)) {
+        retry  = true;
+        unsent = written == 0;
+        co_return 502;
+    }
+    if (!replayable && !co_await relay (client, &upstream, length - buffered, &client_failed)) {
+        co_return 502;
+    }
+
+    // read the response head, interim 1xx responses are dropped
+    std::string pending;
+    size_t end;
+    int status;
+    while (true) {
+        while ((end = pending.find ("\r\n\r\n")) == std::string::npos) {
+            if (pending.size () > PROXY_HEAD_MAX) {
+                co_return 502;
+            }
+            ssize_t got = co_await read_some (upstream, pending);
+            if (got < 0 && errno == ETIMEDOUT) {
+                co_return 504;
+            }
+            if (got <= 0) {
+                retry = replayable && pending.empty ();
+                co_return 502;
+            }
+        }
+
+        if (pending.compare (0, 7, "HTTP/1.") != 0 || pending.size () < 12 || pending[8] != ' ') {
+            co_return 502;
+        }
+        status = atoi (pending.c_str () + 9);
+        if (status < 100 || status > 999) {
+            co_return 502;
+        }
+        if (status >= 200 || status == 101) {
+            break;
+        }
+        pending.erase (0, end + 4);
+    }
+
+    std::vector<std::string> lines = string_tokenize (pending.substr (0, end), '\n');
+    std::string rest                = pending.substr (end + 4);
+
+    // an HTTP/1.0 upstream closes after every response unless it says otherwise
+    bool upstream_close  = pending.compare (0, 8, "HTTP/1.0") == 0;
+    bool chunked         = false;
+    off_t content_length = -1;
+    std::set<std::string> hop = HOP_BY_HOP;
+    std::vector<std::pair<std::string, std::string>> fields;
+    for (size_t i = 1; i < lines.size (); i++) {
+        std::string line = remove_padding (lines[i], '\r', false, true);
+        size_t colon     = line.find (':');
+        if (colon == std::string::npos) {
+            continue;
+        }
+        std::string name  = line.substr (0, colon);
+        std::string value = remove_padding (line.substr (colon + 1), ' ');
+        std::string lower = string_to_lower (name);
+
+        if (lower == "connection") {
+            upstream_close = connection_options (value, hop);
+        } else if (lower == "transfer-encoding") {
+            std::string codings = string_to_lower (value);
+            chunked = codings.size () >= 7 && codings.compare (codings.size () - 7, 7, "chunked") == 0;
+            if (!chunked) {
+                upstream_close = true;
+            }
+        } else if (lower == "content-length") {
+            char* digits_end;
+            content_length = strtoll (value.c_str (), &digits_end, 10);
+            if (value.empty () || *digits_end != '\0' || content_length < 0) {
+                co_return 502;
+            }
+        }
+        fields.emplace_back (name, value);
+    }
+
+    // HTTP/1.0 clients can't take chunked bodies, theirs end when the connection closes
+    bool client11 = request.version == "HTTP/1.1";
+    bool dechunk  = chunked && !client11;
+    if (chunked) {
+        content_length = -1;
+    }
+
+    // header lines passed on, and the ones kept with a cached copy which gets its own Age
+    std::string status_text = remove_padding (lines[0].substr (8), '\r', false, true);
+    std::string forwarded, stored;
+    for (const auto& field : fields) {
+        std::string lower = string_to_lower (field.first);
+        bool drop         = hop.count (lower) > 0;
+        if (lower == "transfer-encoding" || lower == "trailer") {
+            drop = dechunk;
+        }
+        if (drop || lower == "content-length") {
+            continue;
+        }
+        forwarded += field.first + ": " + field.second + "\r\n";
+        if (lower != "age") {
+            stored += field.first + ": " + field.second + "\r\n";
+        }
+    }
+
+    std::string reply = (client11 ? "HTTP/1.1" : "HTTP/1.0") + status_text + "\r\n" + forwarded;
+    if (!chunked && content_length >= 0) {
+        reply += "Content-Length: " + std::to_string (content_length) + "\r\n";
+    }
+
+    // the server answers one request per connection
+    reply += "Connection: close\r\n\r\n";
+
+    bool body = request.method != "HEAD" && status != 204 && status != 304 && status != 101;
+    if (!body) {
+        reusable = !upstream_close && rest.empty () && status != 101;
+        co_await send_all (client, reply);
+        co_return 0;
+    }
+
+    // a cacheable response is read whole and stored before it is sent from memory
+    int64_t expires, stale_until;
+    stored = status_text + "\r\n" + stored;
+    if (cache_key && !chunked && content_length >= 0 &&
+    cache_key->size () + stored.size () + content_length <= cache->max_item () &&
+    freshness (status, fields, expires, stale_until)) {
+        std::string content = rest;
+        while ((off_t)content.size () < content_length) {
+            ssize_t got = co_await read_some (upstream, content);
+            if (got < 0 && errno == ETIMEDOUT) {
+                co_return 504;
+            }
+            if (got <= 0) {
+                co_return 502;
+            }
+        }
+
+        // anything past the body means the connection is out of step
+        reusable = !upstream_close && (off_t)content.size () == content_length;
+        content.resize (content_length);
+
+        if (cache->put (*cache_key, stored, content.data (), content.size (), expires, stale_until)) {
+            DEBUG << "Cached " << *cache_key << " for " << expires - time (nullptr) << " seconds" << ENDL;
+        }
+        co_await send_all (client, reply + content);
+        co_return 0;
+    }
+
+    if (!chunked && content_length >= 0) {
+        off_t ready = std::min ((off_t)rest.size (), content_length);
+        if (co_await send_all (client, reply + rest.substr (0, ready), ready < content_length) &&
+        co_await relay (&upstream, client, content_length - ready)) {
+            reusable = !upstream_close && (off_t)rest.size () == ready;
+        }
+        co_return 0;
+    }
+
+    // without a length the body ends when the upstream closes
+    if (!chunked) {
+        if (co_await send_all (client, reply + rest, true)) {
+            co_await relay (&upstream, client, -1);
+        }
+        co_return 0;
+    }
+
+    // chunk size lines are read to find where the body ends, the data in between is spliced
+    if (!co_await send_all (client, reply, true)) {
+        co_return 0;
+    }
+    std::string line;
+    while (true) {
+        if (!co_await read_line (upstream, rest, line)) {
+            co_return 0;
+        }
+        char* digits_end;
+        unsigned long long size = strtoull (line.c_str (), &digits_end, 16);
+        if (digits_end == line.c_str ()) {
+            co_return 0;
+        }
+        if (!dechunk && !co_await send_all (client, line + "\r\n", true)) {
+            co_return 0;
+        }
+        if (size == 0) {
+            break;
+        }
+
+        off_t ready = std::min ((off_t)rest.size (), (off_t)size);
+        if (!co_await send_all (client, rest.substr (0, ready), true) || !co_await relay (&upstream, client, size - ready)) {
+            co_return 0;
+        }
+        rest.erase (0, ready);
+
+        if (!co_await read_line (upstream, rest, line) || !line.empty () || (!dechunk && !co_await send_all (client, "\r\n", true))) {
+            co_return 0;
+        }
+    }
+
+    // trailer fields up to the blank line that ends the body
+    do {
+        if (!co_await read_line (upstream, rest, line)) {
+            co_return 0;
+        }
+        if (!dechunk && !co_await send_all (client, line + "\r\n", !line.empty ())) {
+            co_return 0;
+        }
+    } while (!line.empty ());
+
+    reusable = !upstream_close && rest.empty ();
+    co_return 0;
+}
+
+// Constructor
+Proxy::Proxy () {
+    this->cache = nullptr;
+    this->pool  = nullptr;
+}
+
+// sets the cache responses are kept in
+void Proxy::set_cache (Shmcache* cache, Threadpool* pool) {
+    this->cache = cache->enabled () ? cache : nullptr;
+    this->pool  = pool;
+}
+
+// sends a cached response, refreshing it in the background if it is stale
+Task<bool> Proxy::serveCached (Stream& client, const Request& request, size_t route, const std::string& key) {
+    int64_t now = time (nullptr);
+    Shmentry entry;
+    if (!cache->get (key, now, entry)) {
+        co_return false;
+    }
+
+    // only one worker refreshes a stale entry, everyone keeps getting the stale copy meanwhile
+    bool stale = now >= entry.expires;
+    if (stale && pool && cache->claim (entry)) {
+        DEBUG << "Refreshing stale " << key << ENDL;
+        Request refresh = request;
+        refresh.method  = "GET";
+        refresh.body.clear ();
+        for (const char* name : { "if-none-match", "if-modified-since", "range", "if-range", "content-length", "expect" }) {
+            refresh.headers.erase (name);
+        }
+        pool->submit ([this, refresh, route, key] () {
+            Reactor loop;
+            finish (loop, dispatch (loop, nullptr, refresh, route, &key));
+        });
+    }
+
+    std::string head = (request.version == "HTTP/1.1" ? "HTTP/1.1" : "HTTP/1.0") + std::string (entry.head, entry.head_len) +
+    "Age: " + std::to_string (std::max ((int64_t)0, now - entry.stored)) + "\r\nX-Cache: " + (stale ? "STALE" : "HIT") +
+    "\r\nContent-Length: " + std::to_string (entry.body_len) + "\r\nConnection: close\r\n\r\n";
+    bool body = request.method != "HEAD" && entry.body_len > 0;
+    if (co_await send_all (&client, head, body) && body) {
+        co_await send_all (&client, std::string (entry.body, entry.body_len));
+    }
+
+    cache->release (entry);
+    co_return true;
+}
+
+// suspends the awaiting coroutine until the flight for key lands
+bool Proxy::Landing::await_suspend (std::coroutine_handle<> handle) {
+    std::lock_guard<std::mutex> guard (proxy.flights_lock);
+    auto flight = proxy.flights.find (key);
+    if (flight == proxy.flights.end ()) {
+        return false;
+    }
+    flight->second.emplace_back (&loop, handle);
+    return true;
+}
+
+// ends the flight for key, resuming every coroutine that waited for it
+void Proxy::land (const std::string& key) {
+    std::vector<std::pair<Reactor*, std::coroutine_handle<>>> waiters;
+    {
+        std::lock_guard<std::mutex> guard (flights_lock);
+        auto flight = flights.find (key);
+        waiters     = std::move (flight->second);
+        flights.erase (flight);
+    }
+
+    // each waiter goes on with its own connection on its own worker
+    for (auto& waiter : waiters) {
+        std::coroutine_handle<> handle = waiter.second;
+        waiter.first->post ([handle] () { handle.resume (); });
+    }
+}
+
+// forwards a request, answering from the cache when it can
+Task<int> Proxy::forward (Reactor& loop, Stream& client, const Request& request, size_t route) {
+    // only plain reads of shared content are cached
+    auto control = request.headers.find ("cache-control");
+    std::string directives = control != request.headers.end () ? string_to_lower (control->second) : "";
+    if (!cache || (request.method != "GET" && request.method != "HEAD") || request.headers.count ("authorization") ||
+    request.headers.count ("content-length") || request.headers.count ("transfer-encoding") ||
+    directives.find ("no-store") != std::string::npos) {
+        co_return co_await dispatch (loop, &client, request, route, nullptr);
+    }
+
+    // a client asking for a fresh copy skips the lookup, what it gets is still stored
+    auto pragma = request.headers.find ("pragma");
+    bool lookup = directives.find ("no-cache") == std::string::npos && directives.find ("max-age=0") == std::string::npos &&
+    (pragma == request.headers.end () || string_to_lower (pragma->second) != "no-cache");
+
+    std::string key = "/" + request.path;
+    if (lookup && co_await serveCached (client, request, route, key)) {
+        co_return 0;
+    }
+
+    // HEAD misses go straight through, they bring no body to store
+    if (request.method != "GET") {
+        co_return co_await dispatch (loop, &client, request, route, nullptr);
+    }
+
+    // concurrent misses for a key wait for the first one to fill it, then try the cache again
+    bool waiting;
+    {
+        std::lock_guard<std::mutex> guard (flights_lock);
+        waiting = flights.count (key) > 0;
+        if (!waiting) {
+            flights[key];
+        }
+    }
+    if (waiting) {
+        DEBUG << "Waiting on in-flight upstream request for " << key << ENDL;
+        co_await Landing{ *this, key, loop };
+        if (co_await serveCached (client, request, route, key)) {
+            co_return 0;
+        }
+        co_return co_await dispatch (loop, &client, request, route, nullptr);
+    }
+
+    int status = co_await dispatch (loop, &client, request, route, &key);
+    land (key);
+    co_return status;
+}
+
+// forward() for a blocking socket
+int Proxy::forward (int sockFd, const Request& request, size_t route) {
+    Reactor loop;
+    Stream client (loop, sockFd);
+    client.set_timeout (std::chrono::seconds (PROXY_TIMEOUT_SECONDS));
+
+    int status = finish (loop, forward (loop, client, request, route));
+    client.release ();
+    return status;
+}
+
+// forwards a request to a route's upstreams and relays the response
+Task<int> Proxy::dispatch (Reactor& loop, Stream* client, const Request& request, size_t route, const std::string* cache_key) {
+    // the body has to be sent on as it arrives, so it needs a length up front
+    if (request.headers.count ("transfer-encoding")) {
+        co_return 411;
+    }
+    off_t length = 0;
+    auto declared = request.headers.find ("content-length");
+    if (declared != request.headers.end ()) {
+        char* digits_end;
+        length = strtoll (declared->second.c_str (), &digits_end, 10);
+        if (declared->second.empty () || *digits_end != '\0' || length < 0) {
+            co_return 400;
+        }
+    }
+
+    std::set<std::string> hop = HOP_BY_HOP;
+    hop.insert ("x-forwarded-for");
+    auto options = request.headers.find ("connection");
+    if (options != request.headers.end ()) {
+        connection_options (options->second, hop);
+    }
+
+    std::string head = request.method + " /" + request.path + " HTTP/1.1\r\n";
+    for (const auto& field : request.headers) {
+        if (hop.count (field.first) == 0) {
+            head += field.first + ": " + field.second + "\r\n";
+        }
+    }
+
+    // tell the upstream who the client is, after any proxies in front of us
+    struct sockaddr_storage peer;
+    socklen_t peerlen = sizeof (peer);
+    char address[INET6_ADDRSTRLEN] = "unknown";
+    if (client != nullptr && getpeername (client->get_fd (), (struct sockaddr*)&peer, &peerlen) == 0) {
+        if (peer.ss_family == AF_INET) {
+            inet_ntop (AF_INET, &((struct sockaddr_in*)&peer)->sin_addr, address, sizeof (address));
+        } else if (peer.ss_family == AF_INET6) {
+            inet_ntop (AF_INET6, &((struct sockaddr_in6*)&peer)->sin6_addr, address, sizeof (address));
+        }
+    }
+    auto forwarded = request.headers.find ("x-forwarded-for");
+    head += "x-forwarded-for: " + (forwarded != request.headers.end () ? forwarded->second + ", " : "") + address + "\r\n";
+
+    // the client waits for the go ahead before sending a body we haven't got yet
+    auto expect = request.headers.find ("expect");
+    if (expect != request.headers.end () && string_to_lower (expect->second) == "100-continue" &&
+    (off_t)request.body.size () < length) {
+        co_await send_all (client, "HTTP/1.1 100 Continue\r\n\r\n");
+    }
+
+    // the hash policy keys on the path alone, the query string doesn't change what is cached
+    std::string key = "/" + request.path.substr (0, request.path.find ('?'));
+
+    // an upstream that can't be reached is swapped for another, once anything was sent the
+    // request stays where it is
+    Upstreamgroup& group = groups[route];
+    std::vector<size_t> tried;
+    int status = 502;
+    while (tried.size () < group.members.size ()) {
+        size_t upstream = select (group, key, tried);
+        tried.push_back (upstream);
+
+        bool connected;
+        status = co_await attempt (loop, upstream, client, request, head, length, cache_key, connected);
+        if (connected) {
+            co_return status;
+        }
+    }
+    co_return status;
+}
+
+// forwards a request to one upstream
+Task<int> Proxy::attempt (Reactor& loop, size_t index, Stream* client, const Request& request, const std::string& head,
+off_t length, const std::string* cache_key, bool& connected) {
+    Upstream& upstream = upstreams[index];
+    upstream.requests.fetch_add (1, std::memory_order_relaxed);
+    upstream.outstanding.fetch_add (1, std::memory_order_relaxed);
+
+    std::string request_head = head;
+    if (request.headers.count ("host") == 0) {
+        request_head += "host: " + upstream.name + "\r\n";
+    }
+    request_head += "\r\n";
+
+    // a pooled connection the upstream closed before answering is tried again on a new one
+    int status;
+    bool client_failed = false;
+    for (int retries = 0;; retries++) {
+        int upstreamFd = checkout (index);
+        bool reused    = upstreamFd >= 0;
+        if (!reused) {
+            upstreamFd = socket (upstream.addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        }
+
+        // closed when it goes out of scope, unless it is pooled again
+        Stream stream (loop, upstreamFd);
+        stream.set_timeout (std::chrono::seconds (PROXY_TIMEOUT_SECONDS));
+        if (!reused && (upstreamFd < 0 || !co_await connectUpstream (stream, index))) {
+            WARNING << "Could not connect to upstream " << upstream.name << ENDL;
+            status    = errno == ETIMEDOUT ? 504 : 502;
+            connected = false;
+            break;
+        }
+        connected = true;
+
+        bool reusable, retry, unsent;
+        status = co_await exchange (client, request, request_head, length, stream, cache_key, reusable, retry, unsent, client_failed);
+        if (reusable) {
+            checkin (index, stream.release ());
+        }
+
+        if (status != 0 && retry && reused && retries == 0) {
+            // the rest of the pool was most likely closed at the same time
+            DEBUG << "Pooled connection to " << upstream.name << " was closed, retrying" << ENDL;
+            for (int fd : worker.idle[upstream.name]) {
+                close (fd);
+            }
+            worker.idle[upstream.name].clear ();
+            continue;
+        }
+
+        // nothing reached the upstream, which is as good as not reaching it at all so the
+        //  next one gets the request
+        if (unsent) {
+            WARNING << "Could not send to upstream " << upstream.name << ENDL;
+            connected = false;
+        }
+        break;
+    }
+
+    // gateway errors are the upstream's fault, anything else is an answer. A client that
+    //  went away while its body was relayed says nothing about the upstream
+    if (!client_failed) {
+        record (upstream, status != 502 && status != 504);
+    }
+    upstream.outstanding.fetch_sub (1, std::memory_order_relaxed);
+    co_return status;
+}
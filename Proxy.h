@@ -0,0 +1,207 @@
+/**
+ * @file Proxy.h
+ * @author Cristian Madrazo
+ * @brief Forwards requests under configured path prefixes to upstream servers
+ * @version 1.0
+ *
+ */
+
+#ifndef PROXY_H
+#define PROXY_H
+
+#include <atomic>
+#include <coroutine>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unordered_map>
+#include <vector>
+
+#include "Reactor.h"
+#include "Request.h"
+#include "Shmcache.h"
+#include "Stream.h"
+#include "Task.h"
+#include "Threadpool.h"
+
+// idle connections each worker keeps open to every upstream
+#define PROXY_POOL_SIZE 8
+
+// an upstream that takes longer than this to accept, read or answer gets a 504
+#define PROXY_CONNECT_MS 3000
+#define PROXY_TIMEOUT_SECONDS 30
+
+// largest response head we read from an upstream
+#define PROXY_HEAD_MAX (64 * 1024)
+
+// bytes moved through a pipe per splice() call
+#define PROXY_PIPE_BYTES (64 * 1024)
+
+// idle pipes each worker keeps for relaying bodies
+#define PROXY_PIPE_POOL 8
+
+// consecutive errors or timeouts that take an upstream out of rotation, and for how long
+#define PROXY_EJECT_FAILURES 3
+#define PROXY_EJECT_MS 10000
+
+// after an ejection an upstream's share of requests grows back to full over this long
+#define PROXY_RAMP_MS 30000
+
+// points every upstream gets on a consistent hash ring
+#define PROXY_HASH_POINTS 100
+
+// how a route spreads requests over its upstreams
+enum Balancing { BALANCE_ROUND_ROBIN, BALANCE_LEAST_OUTSTANDING, BALANCE_HASH };
+
+// a server requests are forwarded to
+struct Upstream {
+    // as given on the command line, host:port or unix:/path
+    std::string name;
+
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+
+    // passive health, every worker updates it without locking. ejected_until is a steady
+    // clock time in milliseconds, 0 if the upstream was never ejected
+    std::atomic<int> outstanding;
+    std::atomic<int> failures;
+    std::atomic<int64_t> ejected_until;
+    std::atomic<unsigned long> requests;
+
+    // Constructor
+    Upstream ();
+};
+
+// the upstreams behind one route and how requests are spread over them, fixed once workers
+// start apart from the round robin cursor
+struct Upstreamgroup {
+    Balancing policy;
+    std::vector<size_t> members;
+
+    // hash ring for BALANCE_HASH, points sorted with the upstream each belongs to
+    std::vector<std::pair<uint32_t, size_t>> ring;
+
+    std::atomic<unsigned> next;
+
+    // Constructor
+    Upstreamgroup ();
+};
+
+class Proxy {
+    private:
+    // deques so entries never move, they hold atomics
+    std::deque<Upstream> upstreams;
+    std::deque<Upstreamgroup> groups;
+
+    // path prefix and the group it goes to, longest prefix first
+    std::vector<std::pair<std::string, size_t>> routes;
+
+    // where cacheable responses are kept, nullptr if they aren't, and the pool stale ones are
+    // refreshed on
+    Shmcache* cache;
+    Threadpool* pool;
+
+    // upstream requests filling the cache by key, with the coroutines waiting for each and the
+    // loop every one of them is resumed on. Every miss for a key that is already being fetched
+    // waits for it instead of going upstream too
+    std::mutex flights_lock;
+    std::unordered_map<std::string, std::vector<std::pair<Reactor*, std::coroutine_handle<>>>> flights;
+
+    // suspends the awaiting coroutine until the flight for key lands, not at all if it already
+    // has
+    struct Landing {
+        Proxy& proxy;
+        const std::string& key;
+        Reactor& loop;
+
+        bool await_ready () const noexcept {
+            return false;
+        }
+        bool await_suspend (std::coroutine_handle<> handle);
+        void await_resume () noexcept {
+        }
+    };
+
+    // ends the flight for key, resuming every coroutine that waited for it on its own loop
+    void land (const std::string& key);
+
+    // adds an upstream, or finds one with the same address. Returns -1 if it can't be resolved
+    int addUpstream (const std::string& address);
+
+    // picks the upstream for a request that hasn't been tried yet, skipping ejected ones
+    // unless nothing else is left
+    size_t select (Upstreamgroup& group, const std::string& key, const std::vector<size_t>& tried) const;
+
+    // counts a request's outcome towards an upstream's health
+    void record (Upstream& upstream, bool ok);
+
+    // connects a new socket to an upstream, returns false if it can't be reached in time
+    Task<bool> connectUpstream (Stream& stream, size_t upstream) const;
+
+    // returns an idle pooled connection to an upstream that is still open, or -1 if there is
+    // none
+    int checkout (size_t upstream) const;
+
+    // puts a connection that finished a response back in this worker's pool
+    void checkin (size_t upstream, int fd) const;
+
+    // sends a cached response if there is one that may still be served, queueing a refresh
+    // if it is stale. Returns false on a miss
+    Task<bool> serveCached (Stream& client, const Request& request, size_t route, const std::string& key);
+
+    // forwards a request to a route's upstreams, bypassing the cache. The response is stored
+    // under cache_key if it isn't nullptr and the response allows it. client is nullptr for a
+    // background refresh with no one to relay to
+    Task<int> dispatch (Reactor& loop, Stream* client, const Request& request, size_t route, const std::string* cache_key);
+
+    // forwards a request to one upstream, retrying once if a pooled connection turns out to
+    // be closed. Returns like forward(), connected is false if the upstream couldn't be reached
+    Task<int> attempt (Reactor& loop, size_t upstream, Stream* client, const Request& request, const std::string& head,
+    off_t length, const std::string* cache_key, bool& connected);
+
+    // sends the request and relays the response, returns 0 once the response was relayed or
+    // the status to answer with if nothing was sent to the client. retry is set when a pooled
+    // connection turned out to be closed before it answered, unsent when not a byte of the
+    // request reached the upstream and client_failed when reading the body from the client
+    // is what failed
+    Task<int> exchange (Stream* client, const Request& request, const std::string& head, off_t length, Stream& upstream,
+    const std::string* cache_key, bool& reusable, bool& retry, bool& unsent, bool& client_failed) const;
+
+    public:
+    // Constructor, responses aren't cached until set_cache() is called
+    Proxy ();
+
+    // Caches responses that allow it in cache, stale ones are refreshed on pool
+    void set_cache (Shmcache* cache, Threadpool* pool);
+
+    // Forwards requests whose path starts with prefix to the upstreams in spec, a comma
+    // separated list of host:port or unix:/path addresses that may start with a balancing
+    // policy and '@' (rr, least or hash). Returns false if spec is invalid
+    bool add_route (const std::string& prefix, const std::string& spec);
+
+    // true if no routes were added
+    bool empty () const;
+
+    // Returns the route for a request path, with its leading '/', or -1 to serve it locally
+    int route (const std::string& target) const;
+
+    // Forwards a request to one of a route's upstreams and relays the response to the client,
+    // the body through a pipe with splice() so it is never copied into user space. GET and
+    // HEAD are answered from the cache when they can. Every wait is on loop, the one client
+    // is served by. Returns 0 once a response was relayed, or the status code to answer with
+    // if nothing was sent
+    Task<int> forward (Reactor& loop, Stream& client, const Request& request, size_t route);
+
+    // forward() for a blocking socket, the thread waits on an event loop of its own until it
+    // is done
+    int forward (int sockFd, const Request& request, size_t route);
+
+    // Calls f with every upstream, for reporting
+    void for_each (const std::function<void (const Upstream&)>& f) const;
+};
+
+#endif
@@ -0,0 +1,28 @@
+/**
+ * @file Request.h
+ * @author Cristian Madrazo
+ * @brief A parsed request, whichever protocol it arrived over
+ * @version 1.0
+ *
+ */
+
+#ifndef REQUEST_H
+#define REQUEST_H
+
+#include <map>
+#include <string>
+
+// a parsed request line and its header fields
+struct Request {
+    std::string method;
+    std::string path;
+    std::string version;
+
+    // header fields by lowercased name, values have surrounding whitespace removed
+    std::map<std::string, std::string> headers;
+
+    // bytes read past the end of the headers, the start of the body if there is one
+    std::string body;
+};
+
+#endif
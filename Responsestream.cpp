@@ -0,0 +1,157 @@
+/**
+ * @file Responsestream.cpp
+ * @author Cristian Madrazo
+ * @brief Implementations for Responsestream
+ * @version 1.0
+ *
+ */
+
+#include "Responsestream.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include "logging.h"
+
+// Constructor
+Responsestream::Responsestream (int sockFd, bool chunked, bool body) {
+    this->sockFd   = sockFd;
+    this->chunked  = chunked;
+    this->body     = body;
+    this->failed   = false;
+    this->finished = false;
+    this->capture  = nullptr;
+}
+
+// Constructor, collects the body into capture instead of sending it
+Responsestream::Responsestream (std::string& capture) {
+    this->sockFd   = -1;
+    this->chunked  = false;
+    this->body     = true;
+    this->failed   = false;
+    this->finished = false;
+    this->capture  = &capture;
+}
+
+// Destructor, finishes the response if the producer didn't
+Responsestream::~Responsestream () {
+    finish ();
+}
+
+// Sets the status line and headers
+void Responsestream::begin (const std::string& headers) {
+    head = headers;
+    if (chunked) {
+        head += "Transfer-Encoding: chunked\r\n";
+    }
+    head += "\r\n";
+}
+
+// sends the head, a chunk header, data and the chunk trailer in one writev
+bool Responsestream::send (const char* data, size_t len) {
+    if (failed) {
+        return false;
+    }
+    if (capture != nullptr) {
+        capture->append (data, len);
+        return true;
+    }
+
+    // a zero length chunk ends the body, so empty writes only ever send the head
+    char size_line[24];
+    int size_len = 0;
+    if (chunked && body && (len > 0 || finished)) {
+        size_len = snprintf (size_line, sizeof (size_line), "%zx\r\n", len);
+    }
+
+    const char* trailer = finished && len > 0 ? "\r\n0\r\n\r\n" : "\r\n";
+    size_t trailer_len  = size_len == 0 ? 0 : (finished && len > 0 ? 7 : 2);
+
+    struct iovec iov[4];
+    iov[0] = { (void*)head.data (), head.size () };
+    iov[1] = { size_line, (size_t)size_len };
+    iov[2] = { (void*)data, len };
+    iov[3] = { (void*)trailer, trailer_len };
+
+    // a blocking socket is the backpressure, sendmsg() waits until the client has
+    // drained enough of the send buffer
+    int index = 0;
+    while (index < 4) {
+        struct msghdr msg = {};
+        msg.msg_iov       = iov + index;
+        msg.msg_iovlen    = 4 - index;
+
+        ssize_t sent = sendmsg (sockFd, &msg, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            DEBUG << "Client stopped reading the stream" << ENDL;
+            failed = true;
+            return false;
+        }
+
+        while (index < 4 && (size_t)sent >= iov[index].iov_len) {
+            sent -= iov[index].iov_len;
+            index++;
+        }
+        if (index < 4) {
+            iov[index].iov_base = (char*)iov[index].iov_base + sent;
+            iov[index].iov_len -= sent;
+        }
+    }
+
+    head.clear ();
+    return true;
+}
+
+// Queues body bytes, sending them once STREAM_BUFFER_BYTES are waiting
+bool Responsestream::write (const char* data, size_t len) {
+    if (failed || finished) {
+        return false;
+    }
+    if (!body) {
+        return true;
+    }
+
+    // big writes skip the buffer instead of being copied into it
+    if (len >= STREAM_BUFFER_BYTES) {
+        return flush () && send (data, len);
+    }
+
+    pending.append (data, len);
+    if (pending.size () >= STREAM_BUFFER_BYTES) {
+        return flush ();
+    }
+    return true;
+}
+
+bool Responsestream::write (const std::string& data) {
+    return write (data.data (), data.size ());
+}
+
+// Sends everything queued so far as one chunk
+bool Responsestream::flush () {
+    if (pending.empty () && head.empty ()) {
+        return !failed;
+    }
+
+    bool sent = send (pending.data (), pending.size ());
+    pending.clear ();
+    return sent;
+}
+
+// Sends what is left and ends the body
+bool Responsestream::finish () {
+    if (finished) {
+        return !failed;
+    }
+
+    // the last chunk goes out together with the zero length chunk that ends the body
+    finished  = true;
+    bool sent = send (pending.data (), pending.size ());
+    pending.clear ();
+    return sent;
+}
@@ -0,0 +1,74 @@
+/**
+ * @file Responsestream.h
+ * @author Cristian Madrazo
+ * @brief Sends a response body as it is produced, without knowing its size up front
+ * @version 1.0
+ *
+ */
+
+#ifndef RESPONSESTREAM_H
+#define RESPONSESTREAM_H
+
+#include <string>
+#include <sys/types.h>
+
+// bytes buffered before a chunk is sent, a bigger write goes out on its own
+#define STREAM_BUFFER_BYTES (16 * 1024)
+
+class Responsestream {
+    private:
+    int sockFd;
+
+    // frame the body with chunked encoding, otherwise it ends when the connection closes
+    bool chunked;
+
+    // false for HEAD, writes are accepted and dropped
+    bool body;
+
+    // status line and headers, sent along with the first chunk
+    std::string head;
+
+    // body bytes written but not yet sent
+    std::string pending;
+
+    // if set the body is collected here instead of being sent, for protocols that frame
+    // bodies themselves
+    std::string* capture;
+
+    // set once the client stopped reading or finish() was called, every write after
+    // that fails
+    bool failed;
+    bool finished;
+
+    // sends the head, a chunk header, data and the chunk trailer in one writev,
+    // blocking until the socket takes it all. Returns false if the client went away
+    bool send (const char* data, size_t len);
+
+    public:
+    // Constructor, chunked should only be set for HTTP/1.1 clients
+    Responsestream (int sockFd, bool chunked, bool body = true);
+
+    // Constructor, collects the body into capture instead of sending it
+    Responsestream (std::string& capture);
+
+    // Destructor, finishes the response if the producer didn't
+    ~Responsestream ();
+
+    // Sets the status line and headers, without the blank line. Must be called before
+    // the first write, Transfer-Encoding is added when the stream is chunked
+    void begin (const std::string& headers);
+
+    // Queues body bytes, sending them once STREAM_BUFFER_BYTES are waiting so a fast
+    // producer is held back by the socket. Returns false once the client went away, the
+    // producer should stop
+    bool write (const char* data, size_t len);
+    bool write (const std::string& data);
+
+    // Sends everything queued so far as one chunk
+    bool flush ();
+
+    // Sends what is left and ends the body
+    bool finish ();
+};
+
+#endif
@@ -0,0 +1,519 @@
+/**
+ * @file Shmcache.cpp
+ * @author Cristian Madrazo
+ * @brief Implementations for Shmcache
+ * @version 1.0
+ *
+ */
+
+#include "Shmcache.h"
+
+#include <cerrno>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "logging.h"
+
+// identifies a segment laid out by this code, bumped whenever Header or Item change
+#define SHM_MAGIC 0x5745425f43414348ULL
+#define SHM_VERSION 1
+
+// item states
+#define ITEM_FREE 0
+#define ITEM_WRITING 1
+#define ITEM_LINKED 2
+#define ITEM_UNLINKED 3
+
+// laid out at the start of the segment, followed by the class of every page, the index
+// buckets and the pages themselves
+struct Shmcache::Header {
+    uint64_t magic;
+    uint64_t version;
+    uint64_t size;
+
+    // where the rest of the layout starts, offsets from the start of the segment
+    uint64_t classes_off;
+    uint64_t buckets_off;
+    uint64_t pages_off;
+    uint64_t buckets;
+    uint64_t pages;
+
+    // guards pages_used, free_head and hand
+    pthread_mutex_t alloc_lock;
+
+    // guard the buckets and the chains, refs and state of the items in them
+    pthread_mutex_t stripes[SHM_STRIPES];
+
+    // pages handed to a size class so far, the rest are untouched
+    uint64_t pages_used;
+
+    // free chunks of every class, linked through Item::next
+    uint64_t free_head[SHM_CLASSES];
+
+    // chunk the eviction clock hand of every class last looked at
+    uint64_t hand[SHM_CLASSES];
+
+    std::atomic<uint64_t> items;
+    std::atomic<uint64_t> bytes;
+    std::atomic<uint64_t> hits;
+    std::atomic<uint64_t> misses;
+    std::atomic<uint64_t> evictions;
+};
+
+// a cached response at the start of a chunk, followed by its key, head and body
+struct Shmcache::Item {
+    // next item in the bucket chain, or next free chunk
+    uint64_t next;
+    uint64_t hash;
+
+    std::atomic<uint32_t> state;
+
+    // readers holding the item, under its stripe lock
+    uint32_t refs;
+    uint32_t cls;
+
+    // set by every read, cleared as the clock hand passes
+    std::atomic<uint32_t> accessed;
+
+    // wall clock seconds a refresh was claimed, 0 if none is under way
+    std::atomic<int64_t> revalidating;
+
+    uint32_t key_len;
+    uint32_t head_len;
+    uint64_t body_len;
+    int64_t stored;
+    int64_t expires;
+    int64_t stale_until;
+
+    char* data () {
+        return (char*)(this + 1);
+    }
+};
+
+// locks a mutex that a crashed previous holder may have left locked
+static void lock_robust (pthread_mutex_t* mutex) {
+    if (pthread_mutex_lock (mutex) == EOWNERDEAD) {
+        pthread_mutex_consistent (mutex);
+    }
+}
+
+// sets up a mutex every process mapping the segment can use
+static void init_shared (pthread_mutex_t* mutex) {
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init (&attr);
+    pthread_mutexattr_setpshared (&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust (&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init (mutex, &attr);
+    pthread_mutexattr_destroy (&attr);
+}
+
+// FNV-1a, 64 bits
+static uint64_t hash_key (const std::string& key) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (unsigned char c : key) {
+        hash = (hash ^ c) * 1099511628211ULL;
+    }
+    return hash;
+}
+
+static uint64_t align (uint64_t value, uint64_t to) {
+    return (value + to - 1) / to * to;
+}
+
+static size_t chunk_size (int cls) {
+    return (size_t)SHM_MIN_CHUNK << cls;
+}
+
+// Constructor
+Shmcache::Shmcache () {
+    this->header = nullptr;
+    this->base   = nullptr;
+    this->size   = 0;
+}
+
+// Destructor
+Shmcache::~Shmcache () {
+    if (base) {
+        munmap (base, size);
+    }
+}
+
+Shmcache::Item* Shmcache::item (uint64_t offset) const {
+    return (Item*)(base + offset);
+}
+
+pthread_mutex_t* Shmcache::stripe (uint64_t hash) const {
+    return &header->stripes[(hash & (header->buckets - 1)) % SHM_STRIPES];
+}
+
+uint64_t* Shmcache::bucket (uint64_t hash) const {
+    return (uint64_t*)(base + header->buckets_off) + (hash & (header->buckets - 1));
+}
+
+// maps the segment
+bool Shmcache::open (const std::string& name, size_t size) {
+    size = size / SHM_PAGE_BYTES * SHM_PAGE_BYTES;
+    if (size < 4 * SHM_PAGE_BYTES) {
+        return false;
+    }
+
+    int fd = shm_open (name.c_str (), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        return false;
+    }
+
+    // a segment of another size is started over, truncating it first zeroes it
+    struct stat info;
+    bool resized = fstat (fd, &info) < 0 || (size_t)info.st_size != size;
+    if (resized && (ftruncate (fd, 0) < 0 || ftruncate (fd, size) < 0)) {
+        close (fd);
+        return false;
+    }
+
+    void* mapped = mmap (nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close (fd);
+    if (mapped == MAP_FAILED) {
+        return false;
+    }
+
+    this->base   = (char*)mapped;
+    this->size   = size;
+    this->header = (Header*)mapped;
+
+    if (resized || header->magic != SHM_MAGIC || header->version != SHM_VERSION || header->size != size) {
+        format ();
+        DEBUG << "Formatted shared cache " << name << ", " << header->pages << " pages" << ENDL;
+    } else {
+        recover ();
+        DEBUG << "Reattached shared cache " << name << " with " << header->items << " responses" << ENDL;
+    }
+    return true;
+}
+
+// sets up an empty segment
+void Shmcache::format () {
+    uint64_t buckets = 1024;
+    while (buckets < size / 8192) {
+        buckets *= 2;
+    }
+
+    uint64_t classes_off = align (sizeof (Header), 64);
+    uint64_t buckets_off = align (classes_off + size / SHM_PAGE_BYTES, 64);
+    uint64_t pages_off   = align (buckets_off + buckets * sizeof (uint64_t), SHM_PAGE_BYTES);
+    memset (base, 0, pages_off);
+
+    header->size        = size;
+    header->classes_off = classes_off;
+    header->buckets_off = buckets_off;
+    header->pages_off   = pages_off;
+    header->buckets     = buckets;
+    header->pages       = (size - pages_off) / SHM_PAGE_BYTES;
+
+    init_shared (&header->alloc_lock);
+    for (pthread_mutex_t& mutex : header->stripes) {
+        init_shared (&mutex);
+    }
+
+    // written last, a segment is only trusted once everything above is in place
+    header->version = SHM_VERSION;
+    header->magic   = SHM_MAGIC;
+}
+
+// takes over a segment left by a previous run
+void Shmcache::recover () {
+    // no one else maps the segment yet, locks held by a dead process are simply reset
+    init_shared (&header->alloc_lock);
+    for (pthread_mutex_t& mutex : header->stripes) {
+        init_shared (&mutex);
+    }
+
+    // only linked items survive, chunks that were being written or waiting on a reader
+    // go back on the free lists which are rebuilt from scratch
+    uint8_t* classes = (uint8_t*)base + header->classes_off;
+    uint64_t items = 0, bytes = 0;
+    for (int cls = 0; cls < SHM_CLASSES; cls++) {
+        header->free_head[cls] = 0;
+        header->hand[cls]      = 0;
+    }
+    for (uint64_t page = 0; page < header->pages_used; page++) {
+        if (classes[page] == 0) {
+            continue;
+        }
+        int cls = classes[page] - 1;
+        for (uint64_t offset = 0; offset < SHM_PAGE_BYTES; offset += chunk_size (cls)) {
+            uint64_t chunk = header->pages_off + page * SHM_PAGE_BYTES + offset;
+            Item* it       = item (chunk);
+            if (it->state == ITEM_LINKED) {
+                it->refs         = 0;
+                it->revalidating = 0;
+                items++;
+                bytes += it->head_len + it->body_len;
+                continue;
+            }
+            it->state              = ITEM_FREE;
+            it->next               = header->free_head[cls];
+            header->free_head[cls] = chunk;
+        }
+    }
+    header->items = items;
+    header->bytes = bytes;
+}
+
+// true once open() succeeded
+bool Shmcache::enabled () const {
+    return header != nullptr;
+}
+
+// largest response that fits a chunk
+size_t Shmcache::max_item () const {
+    return SHM_PAGE_BYTES - sizeof (Item);
+}
+
+// returns a free chunk of a class
+uint64_t Shmcache::allocate (int cls) {
+    lock_robust (&header->alloc_lock);
+
+    uint64_t chunk = header->free_head[cls];
+    if (chunk != 0) {
+        header->free_head[cls] = item (chunk)->next;
+    } else if (header->pages_used < header->pages) {
+        // carve a fresh page into chunks, keep the first and free the rest
+        uint64_t page = header->pages_used++;
+        ((uint8_t*)base + header->classes_off)[page] = cls + 1;
+        chunk = header->pages_off + page * SHM_PAGE_BYTES;
+        for (uint64_t offset = SHM_PAGE_BYTES - chunk_size (cls); offset > 0; offset -= chunk_size (cls)) {
+            Item* it               = item (chunk + offset);
+            it->state              = ITEM_FREE;
+            it->next               = header->free_head[cls];
+            header->free_head[cls] = chunk + offset;
+        }
+    } else {
+        chunk = evict (cls);
+    }
+
+    if (chunk != 0) {
+        Item* it         = item (chunk);
+        it->cls          = cls;
+        it->refs         = 0;
+        it->accessed     = 0;
+        it->revalidating = 0;
+        it->state        = ITEM_WRITING;
+    }
+
+    pthread_mutex_unlock (&header->alloc_lock);
+    return chunk;
+}
+
+// runs the clock hand over a class's chunks for an item to evict
+uint64_t Shmcache::evict (int cls) {
+    uint8_t* classes = (uint8_t*)base + header->classes_off;
+    uint64_t chunks  = 0;
+    for (uint64_t page = 0; page < header->pages_used; page++) {
+        chunks += classes[page] == cls + 1 ? SHM_PAGE_BYTES / chunk_size (cls) : 0;
+    }
+
+    // two passes, the first may only clear the accessed bits
+    uint64_t hand = header->hand[cls];
+    for (uint64_t step = 0; step < 2 * chunks; step++) {
+        uint64_t next = hand ? hand + chunk_size (cls) : 0;
+
+        // at the end of a page move on to the next page of this class
+        if (hand == 0 || (next - header->pages_off) % SHM_PAGE_BYTES == 0) {
+            uint64_t first = hand ? (hand - header->pages_off) / SHM_PAGE_BYTES + 1 : 0;
+            for (uint64_t i = 0; i < header->pages_used; i++) {
+                uint64_t page = (first + i) % header->pages_used;
+                if (classes[page] == cls + 1) {
+                    next = header->pages_off + page * SHM_PAGE_BYTES;
+                    break;
+                }
+            }
+        }
+        hand = next;
+
+        // the hash of a linked item can't change while the allocator lock is held
+        Item* it = item (hand);
+        if (it->state.load (std::memory_order_acquire) != ITEM_LINKED || it->accessed.exchange (0)) {
+            continue;
+        }
+
+        pthread_mutex_t* lock = stripe (it->hash);
+        lock_robust (lock);
+        bool evicted = it->state == ITEM_LINKED && it->refs == 0;
+        if (evicted) {
+            unlink (it, hand);
+        }
+        pthread_mutex_unlock (lock);
+
+        if (evicted) {
+            header->evictions++;
+            header->hand[cls] = hand;
+            return hand;
+        }
+    }
+
+    header->hand[cls] = hand;
+    return 0;
+}
+
+// returns a chunk to its free list
+void Shmcache::reclaim (uint64_t offset) {
+    lock_robust (&header->alloc_lock);
+    Item* it                   = item (offset);
+    it->state                  = ITEM_FREE;
+    it->next                   = header->free_head[it->cls];
+    header->free_head[it->cls] = offset;
+    pthread_mutex_unlock (&header->alloc_lock);
+}
+
+// removes an item from its bucket
+void Shmcache::unlink (Item* it, uint64_t offset) {
+    uint64_t* link = bucket (it->hash);
+    while (*link != 0 && *link != offset) {
+        link = &item (*link)->next;
+    }
+    if (*link == offset) {
+        *link = it->next;
+    }
+
+    it->state = ITEM_UNLINKED;
+    header->items--;
+    header->bytes -= it->head_len + it->body_len;
+}
+
+// looks up and pins a response that can still be served at now
+bool Shmcache::get (const std::string& key, int64_t now, Shmentry& entry) {
+    uint64_t hash         = hash_key (key);
+    pthread_mutex_t* lock = stripe (hash);
+    lock_robust (lock);
+
+    for (uint64_t offset = *bucket (hash); offset != 0; offset = item (offset)->next) {
+        Item* it = item (offset);
+        if (it->hash != hash || it->key_len != key.size () || memcmp (it->data (), key.data (), key.size ()) != 0) {
+            continue;
+        }
+
+        // too old to serve even stale, the caller goes upstream so it counts as a miss
+        if (now >= it->stale_until) {
+            break;
+        }
+
+        it->refs++;
+        it->accessed.store (1, std::memory_order_relaxed);
+        pthread_mutex_unlock (lock);
+
+        entry.head        = it->data () + it->key_len;
+        entry.head_len    = it->head_len;
+        entry.body        = entry.head + it->head_len;
+        entry.body_len    = it->body_len;
+        entry.stored      = it->stored;
+        entry.expires     = it->expires;
+        entry.stale_until = it->stale_until;
+        entry.offset      = offset;
+        header->hits++;
+        return true;
+    }
+
+    pthread_mutex_unlock (lock);
+    header->misses++;
+    return false;
+}
+
+// unpins an entry, the last reader of a replaced item frees it
+void Shmcache::release (const Shmentry& entry) {
+    Item* it              = item (entry.offset);
+    pthread_mutex_t* lock = stripe (it->hash);
+    lock_robust (lock);
+    it->refs--;
+    bool dead = it->refs == 0 && it->state == ITEM_UNLINKED;
+    pthread_mutex_unlock (lock);
+
+    if (dead) {
+        reclaim (entry.offset);
+    }
+}
+
+// stores a response
+bool Shmcache::put (const std::string& key, const std::string& head, const char* body, size_t body_len, int64_t expires,
+int64_t stale_until) {
+    size_t total = sizeof (Item) + key.size () + head.size () + body_len;
+    int cls      = 0;
+    while (cls < SHM_CLASSES && chunk_size (cls) < total) {
+        cls++;
+    }
+    if (cls == SHM_CLASSES) {
+        return false;
+    }
+
+    uint64_t offset = allocate (cls);
+    if (offset == 0) {
+        DEBUG << "No room in the shared cache for " << key << ENDL;
+        return false;
+    }
+
+    // the item is filled in before anyone can see it
+    Item* it        = item (offset);
+    it->hash        = hash_key (key);
+    it->key_len     = key.size ();
+    it->head_len    = head.size ();
+    it->body_len    = body_len;
+    it->stored      = time (nullptr);
+    it->expires     = expires;
+    it->stale_until = stale_until;
+    memcpy (it->data (), key.data (), key.size ());
+    memcpy (it->data () + key.size (), head.data (), head.size ());
+    memcpy (it->data () + key.size () + head.size (), body, body_len);
+
+    pthread_mutex_t* lock = stripe (it->hash);
+    lock_robust (lock);
+
+    // an older copy is unlinked, and freed now unless someone is still sending it
+    uint64_t replaced = 0;
+    for (uint64_t old = *bucket (it->hash); old != 0; old = item (old)->next) {
+        Item* other = item (old);
+        if (other->hash == it->hash && other->key_len == key.size () && memcmp (other->data (), key.data (), key.size ()) == 0) {
+            unlink (other, old);
+            replaced = other->refs == 0 ? old : 0;
+            break;
+        }
+    }
+
+    it->next        = *bucket (it->hash);
+    *bucket (it->hash) = offset;
+    it->state.store (ITEM_LINKED, std::memory_order_release);
+    header->items++;
+    header->bytes += head.size () + body_len;
+    pthread_mutex_unlock (lock);
+
+    if (replaced != 0) {
+        reclaim (replaced);
+    }
+    return true;
+}
+
+// claims the refresh of a stale entry
+bool Shmcache::claim (const Shmentry& entry) {
+    Item* it      = item (entry.offset);
+    int64_t now   = time (nullptr);
+    int64_t since = it->revalidating.load ();
+    if (since != 0 && now - since < SHM_REVALIDATE_SECONDS) {
+        return false;
+    }
+    return it->revalidating.compare_exchange_strong (since, now);
+}
+
+// reports usage and counters
+void Shmcache::usage (size_t& count, size_t& bytes, uint64_t& hits, uint64_t& misses, uint64_t& evictions) const {
+    count = bytes = hits = misses = evictions = 0;
+    if (!header) {
+        return;
+    }
+    count     = header->items;
+    bytes     = header->bytes;
+    hits      = header->hits;
+    misses    = header->misses;
+    evictions = header->evictions;
+}
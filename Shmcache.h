@@ -0,0 +1,129 @@
+/**
+ * @file Shmcache.h
+ * @author Cristian Madrazo
+ * @brief Cache of proxied responses in a shared memory segment that outlives the server
+ * @version 1.0
+ *
+ */
+
+#ifndef SHMCACHE_H
+#define SHMCACHE_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <pthread.h>
+#include <string>
+
+// the segment is carved into pages, each page into chunks of one size class
+#define SHM_PAGE_BYTES (1024 * 1024)
+
+// chunk sizes double from the smallest to a whole page
+#define SHM_MIN_CHUNK 512
+#define SHM_CLASSES 12
+
+// locks guarding the hash index, a bucket is guarded by bucket % SHM_STRIPES
+#define SHM_STRIPES 64
+
+// a revalidation that hasn't finished after this long is assumed lost and may be retried
+#define SHM_REVALIDATE_SECONDS 30
+
+// a cached response handed to a reader, it stays pinned in the segment until released
+struct Shmentry {
+    // status line without the version, and header lines, each ending in CRLF
+    const char* head;
+    size_t head_len;
+
+    const char* body;
+    size_t body_len;
+
+    // wall clock seconds it was stored, stops being fresh and stops being servable at all
+    int64_t stored;
+    int64_t expires;
+    int64_t stale_until;
+
+    // where the item is in the segment, for release()
+    uint64_t offset;
+};
+
+class Shmcache {
+    private:
+    // laid out at the start of the segment
+    struct Header;
+
+    // every cached response, placed at the start of a chunk
+    struct Item;
+
+    Header* header;
+    char* base;
+    size_t size;
+
+    // item at an offset into the segment
+    Item* item (uint64_t offset) const;
+
+    // lock guarding the bucket a hash falls in
+    pthread_mutex_t* stripe (uint64_t hash) const;
+
+    // index bucket a hash falls in
+    uint64_t* bucket (uint64_t hash) const;
+
+    // sets up an empty segment
+    void format ();
+
+    // makes a segment left by a previous run usable, dropping items its readers or writers
+    // were in the middle of
+    void recover ();
+
+    // returns a free chunk of a size class, evicting the least recently used items of that
+    // class if there is none. Returns 0 if the class has no chunks to evict either
+    uint64_t allocate (int cls);
+
+    // evicts an item of a class that no one is reading and wasn't read since the clock hand
+    // last passed it, caller holds the allocator lock. Returns 0 if every item is pinned
+    uint64_t evict (int cls);
+
+    // returns a chunk to its class's free list
+    void reclaim (uint64_t offset);
+
+    // removes an item from its bucket, caller holds its stripe lock
+    void unlink (Item* it, uint64_t offset);
+
+    public:
+    // Constructor, the cache stays disabled until open() succeeds
+    Shmcache ();
+
+    // Destructor, unmaps the segment but leaves it for the next run
+    ~Shmcache ();
+
+    // Maps the shared memory segment called name, size bytes big, creating it or taking
+    // over the one a previous run left if it has the same size. Returns false if it can't
+    bool open (const std::string& name, size_t size);
+
+    // true once open() succeeded
+    bool enabled () const;
+
+    // largest response, head and body together, that can be stored
+    size_t max_item () const;
+
+    // Looks up a response that can still be served at now, even stale, and pins it for the
+    // caller, who has to release() it. Returns false on a miss, which includes a response
+    // past its stale_until
+    bool get (const std::string& key, int64_t now, Shmentry& entry);
+
+    // Unpins an entry returned by get()
+    void release (const Shmentry& entry);
+
+    // Stores a response, replacing any older one with the same key. Returns false if it is
+    // too big or no room could be made
+    bool put (const std::string& key, const std::string& head, const char* body, size_t body_len, int64_t expires,
+    int64_t stale_until);
+
+    // Claims the job of refreshing a stale entry, returns false if another worker already has
+    bool claim (const Shmentry& entry);
+
+    // Reports how many responses are cached and how many bytes they take, and the hit,
+    // miss and eviction counts since the segment was created
+    void usage (size_t& count, size_t& bytes, uint64_t& hits, uint64_t& misses, uint64_t& evictions) const;
+};
+
+#endif
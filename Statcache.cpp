@@ -0,0 +1,66 @@
+/**
+ * @file Statcache.cpp
+ * @author Cristian Madrazo
+ * @brief Implementations for Statcache
+ * @version 1.0
+ *
+ */
+
+#include "Statcache.h"
+
+#include <sys/stat.h>
+
+// the table is dropped whole once it grows past this, every path just gets stat()ed again
+#define STATCACHE_MAX_ENTRIES 4096
+
+// Constructor
+Statcache::Statcache (std::chrono::milliseconds ttl) {
+    this->ttl = ttl;
+}
+
+// Fills info for the regular file at path, calling stat() only if the cached result is stale
+bool Statcache::get (const std::string& path, Fileinfo& info) {
+    auto now = std::chrono::steady_clock::now ();
+
+    {
+        std::lock_guard<std::mutex> guard (lock);
+        auto it = entries.find (path);
+        if (it != entries.end () && now - it->second.fetched < ttl) {
+            info = it->second.info;
+            return it->second.exists;
+        }
+    }
+
+    Entry entry;
+    struct stat st;
+    entry.exists  = stat (path.c_str (), &st) == 0 && S_ISREG (st.st_mode);
+    entry.fetched = now;
+    if (entry.exists) {
+        entry.info.ino   = st.st_ino;
+        entry.info.size  = st.st_size;
+        entry.info.mtime = st.st_mtim;
+    }
+
+    std::lock_guard<std::mutex> guard (lock);
+    if (entries.size () >= STATCACHE_MAX_ENTRIES) {
+        entries.clear ();
+    }
+    entries[path] = entry;
+    info          = entry.info;
+    return entry.exists;
+}
+
+// Returns true if get() would answer for path without calling stat()
+bool Statcache::fresh (const std::string& path) {
+    auto now = std::chrono::steady_clock::now ();
+
+    std::lock_guard<std::mutex> guard (lock);
+    auto it = entries.find (path);
+    return it != entries.end () && now - it->second.fetched < ttl;
+}
+
+// Forgets the result for path so the next get() calls stat()
+void Statcache::invalidate (const std::string& path) {
+    std::lock_guard<std::mutex> guard (lock);
+    entries.erase (path);
+}
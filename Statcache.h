@@ -0,0 +1,65 @@
+/**
+ * @file Statcache.h
+ * @author Cristian Madrazo
+ * @brief Short lived cache of stat() results shared by all worker threads
+ * @version 1.0
+ *
+ */
+
+#ifndef STATCACHE_H
+#define STATCACHE_H
+
+#include <chrono>
+#include <ctime>
+#include <mutex>
+#include <string>
+#include <sys/types.h>
+#include <unordered_map>
+
+// the parts of stat() used to serve a file and tell if it changed
+struct Fileinfo {
+    ino_t ino;
+    off_t size;
+    struct timespec mtime;
+};
+
+// Returns true if info describes the same version of a file as ino, size and mtime
+inline bool same_version (const Fileinfo& info, ino_t ino, off_t size, const struct timespec& mtime) {
+    return info.ino == ino && info.size == size && info.mtime.tv_sec == mtime.tv_sec &&
+    info.mtime.tv_nsec == mtime.tv_nsec;
+}
+
+class Statcache {
+    private:
+    // how long a result is trusted before stat() is called again
+    std::chrono::milliseconds ttl;
+
+    struct Entry {
+        // false if the file didn't exist or wasn't a regular file
+        bool exists;
+        Fileinfo info;
+        std::chrono::steady_clock::time_point fetched;
+    };
+
+    // guards entries
+    std::mutex lock;
+
+    // results by path, missing files are cached too
+    std::unordered_map<std::string, Entry> entries;
+
+    public:
+    // Constructor
+    Statcache (std::chrono::milliseconds ttl);
+
+    // Fills info for the regular file at path, calling stat() only if the cached result is
+    // older than the ttl. Returns false if there is no such file
+    bool get (const std::string& path, Fileinfo& info);
+
+    // Returns true if get() would answer for path without calling stat()
+    bool fresh (const std::string& path);
+
+    // Forgets the result for path so the next get() calls stat()
+    void invalidate (const std::string& path);
+};
+
+#endif
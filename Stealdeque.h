@@ -0,0 +1,139 @@
+/**
+ * @file Stealdeque.h
+ * @author Cristian Madrazo
+ * @brief Chase-Lev work stealing deque, its owner pushes and pops at the bottom while any
+ * other thread steals from the top
+ * @version 1.0
+ *
+ */
+
+#ifndef STEALDEQUE_H
+#define STEALDEQUE_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// slots a deque starts with, it doubles whenever the owner pushes onto a full one
+#define STEALDEQUE_SLOTS 64
+
+// keeps the owner's and the thieves' index on cache lines of their own
+#define STEALDEQUE_LINE 64
+
+// T is copied in and out of atomic slots, so it should be small and trivially copyable,
+//  like a pointer
+template <typename T> class Stealdeque {
+    private:
+    struct Array {
+        int64_t mask;
+        std::unique_ptr<std::atomic<T>[]> slots;
+
+        explicit Array (int64_t size) : mask (size - 1), slots (new std::atomic<T>[size]) {
+        }
+
+        T get (int64_t index) const {
+            return slots[index & mask].load (std::memory_order_relaxed);
+        }
+
+        void put (int64_t index, T item) {
+            slots[index & mask].store (item, std::memory_order_relaxed);
+        }
+    };
+
+    // next slot to steal, thieves and the owner taking the last item race to move it
+    alignas (STEALDEQUE_LINE) std::atomic<int64_t> top;
+
+    // next slot to push, only the owner moves it
+    alignas (STEALDEQUE_LINE) std::atomic<int64_t> bottom;
+
+    std::atomic<Array*> array;
+
+    // arrays outgrown, a thief may still be reading one so they are only freed with the deque
+    std::vector<std::unique_ptr<Array>> retired;
+
+    // copies the items between top and bottom into an array twice the size, owner only
+    Array* grow (Array* old, int64_t back, int64_t front) {
+        Array* bigger = new Array ((old->mask + 1) * 2);
+        for (int64_t i = front; i < back; i++) {
+            bigger->put (i, old->get (i));
+        }
+        retired.emplace_back (old);
+        array.store (bigger, std::memory_order_release);
+        return bigger;
+    }
+
+    public:
+    // Constructor
+    Stealdeque () : top (0), bottom (0), array (new Array (STEALDEQUE_SLOTS)) {
+    }
+
+    // Destructor, items still queued are dropped
+    ~Stealdeque () {
+        delete array.load (std::memory_order_relaxed);
+    }
+
+    Stealdeque (const Stealdeque&)            = delete;
+    Stealdeque& operator= (const Stealdeque&) = delete;
+
+    // Adds item at the bottom, only from the owner thread
+    void push (T item) {
+        int64_t back  = bottom.load (std::memory_order_relaxed);
+        int64_t front = top.load (std::memory_order_acquire);
+        Array* slots  = array.load (std::memory_order_relaxed);
+        if (back - front > slots->mask) {
+            slots = grow (slots, back, front);
+        }
+        slots->put (back, item);
+        std::atomic_thread_fence (std::memory_order_release);
+        bottom.store (back + 1, std::memory_order_relaxed);
+    }
+
+    // Takes the item pushed last, only from the owner thread. Returns false if the deque is
+    //  empty
+    bool pop (T& item) {
+        int64_t back = bottom.load (std::memory_order_relaxed) - 1;
+        Array* slots = array.load (std::memory_order_relaxed);
+        bottom.store (back, std::memory_order_relaxed);
+        std::atomic_thread_fence (std::memory_order_seq_cst);
+        int64_t front = top.load (std::memory_order_relaxed);
+
+        if (front > back) {
+            bottom.store (back + 1, std::memory_order_relaxed);
+            return false;
+        }
+
+        item = slots->get (back);
+        if (front == back) {
+            // the last item, a thief may be taking it at the same time
+            bool won = top.compare_exchange_strong (front, front + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+            bottom.store (back + 1, std::memory_order_relaxed);
+            return won;
+        }
+        return true;
+    }
+
+    // Takes the item pushed first, from any thread. Returns false if the deque is empty or
+    //  another thread took the item first
+    bool steal (T& item) {
+        int64_t front = top.load (std::memory_order_acquire);
+        std::atomic_thread_fence (std::memory_order_seq_cst);
+        int64_t back = bottom.load (std::memory_order_acquire);
+        if (front >= back) {
+            return false;
+        }
+
+        Array* slots = array.load (std::memory_order_acquire);
+        item         = slots->get (front);
+        return top.compare_exchange_strong (front, front + 1, std::memory_order_seq_cst, std::memory_order_relaxed);
+    }
+
+    // items waiting, from any thread it may already be out of date
+    size_t size () const {
+        int64_t back  = bottom.load (std::memory_order_relaxed);
+        int64_t front = top.load (std::memory_order_relaxed);
+        return back > front ? back - front : 0;
+    }
+};
+
+#endif
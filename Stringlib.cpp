@@ -7,6 +7,7 @@
  */
 
 #include "Stringlib.h"
+#include <cstdint>
 #include <cstring>
 #include <iostream>
 #include <vector>
@@ -293,3 +294,73 @@ std::string remove_padding (const std::string str, char pad, bool front, bool ba
 
     return return_string;
 }
+
+// encodes bytes as padded base64
+std::string base64_encode (const std::string str) {
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+    std::string out;
+    size_t i = 0;
+    for (; i + 3 <= str.size (); i += 3) {
+        uint32_t bits = (uint8_t)str[i] << 16 | (uint8_t)str[i + 1] << 8 | (uint8_t)str[i + 2];
+        out += alphabet[bits >> 18];
+        out += alphabet[(bits >> 12) & 0x3f];
+        out += alphabet[(bits >> 6) & 0x3f];
+        out += alphabet[bits & 0x3f];
+    }
+
+    // one or two bytes left over become two or three characters and padding
+    if (i < str.size ()) {
+        uint32_t bits = (uint8_t)str[i] << 16;
+        if (i + 1 < str.size ()) {
+            bits |= (uint8_t)str[i + 1] << 8;
+        }
+        out += alphabet[bits >> 18];
+        out += alphabet[(bits >> 12) & 0x3f];
+        out += i + 1 < str.size () ? alphabet[(bits >> 6) & 0x3f] : '=';
+        out += '=';
+    }
+
+    return out;
+}
+
+// decodes base64 in either alphabet, padding optional
+bool base64_decode (const std::string str, std::string& out) {
+    out.clear ();
+    uint32_t bits = 0;
+    int count     = 0;
+
+    size_t end = str.find_last_not_of ('=');
+    end        = end == std::string::npos ? 0 : end + 1;
+    if (str.size () - end > 2) {
+        return false;
+    }
+
+    for (size_t i = 0; i < end; i++) {
+        char c = str[i];
+        int value;
+        if (c >= 'A' && c <= 'Z') {
+            value = c - 'A';
+        } else if (c >= 'a' && c <= 'z') {
+            value = c - 'a' + 26;
+        } else if (c >= '0' && c <= '9') {
+            value = c - '0' + 52;
+        } else if (c == '+' || c == '-') {
+            value = 62;
+        } else if (c == '/' || c == '_') {
+            value = 63;
+        } else {
+            return false;
+        }
+
+        bits = (bits << 6) | value;
+        count += 6;
+        if (count >= 8) {
+            count -= 8;
+            out += (char)((bits >> count) & 0xff);
+        }
+    }
+
+    // a single leftover character can't encode a whole byte
+    return count < 6;
+}
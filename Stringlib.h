@@ -185,4 +185,22 @@ std::string string_to_literal (const std::string str);
 std::string
 remove_padding (const std::string str, char pad, bool front = true, bool back = true);
 
+/**
+ * @brief Encodes bytes as base64 in the standard alphabet, with '=' padding
+ *
+ * @param str bytes to encode
+ * @return base64 text
+ */
+std::string base64_encode (const std::string str);
+
+/**
+ * @brief Decodes base64, in either the standard or the URL safe alphabet, with or without
+ * trailing '=' padding
+ *
+ * @param str base64 text
+ * @param out decoded bytes
+ * @return false if str isn't valid base64
+ */
+bool base64_decode (const std::string str, std::string& out);
+
 #endif
@@ -0,0 +1,172 @@
+/**
+ * @file Threadpool.cpp
+ * @author Cristian Madrazo
+ * @brief Implementations for Threadpool
+ * @version 1.0
+ *
+ */
+
+#include "Threadpool.h"
+
+thread_local Threadpool::Thread* Threadpool::current = nullptr;
+
+// Constructor, starts no threads until start()
+Threadpool::Threadpool () : pending (0), sleeping (0) {
+    stopping = false;
+}
+
+// Constructor, starts num_threads threads
+Threadpool::Threadpool (int num_threads) : Threadpool () {
+    start (num_threads);
+}
+
+// Destructor, runs every queued task then joins the threads
+Threadpool::~Threadpool () {
+    stop ();
+}
+
+// Starts num_threads threads, at most once. Tasks submitted before wait for them
+void Threadpool::start (int num_threads) {
+    if (!threads.empty ()) {
+        return;
+    }
+
+    // every thread exists before any runs, thieves walk the list without a lock
+    for (int i = 0; i < num_threads; i++) {
+        threads.push_back (std::make_unique<Thread> ());
+        threads.back ()->pool   = this;
+        threads.back ()->index  = i;
+        threads.back ()->ran    = 0;
+        threads.back ()->stolen = 0;
+    }
+    for (std::unique_ptr<Thread>& thread : threads) {
+        thread->thread = std::thread (&Threadpool::run, this, thread.get ());
+    }
+}
+
+// Runs every queued task then joins the threads, nothing may be submitted afterwards
+void Threadpool::stop () {
+    {
+        std::lock_guard<std::mutex> guard (lock);
+        stopping = true;
+    }
+    wakeup.notify_all ();
+
+    for (std::unique_ptr<Thread>& thread : threads) {
+        if (thread->thread.joinable ()) {
+            thread->thread.join ();
+        }
+    }
+}
+
+// Queues a task to run on one of the pool threads
+void Threadpool::submit (std::function<void ()> task) {
+    Job* job = new Job (std::move (task));
+    pending++;
+
+    // a task a pool task submits stays with its thread until another one is idle
+    if (current != nullptr && current->pool == this) {
+        current->tasks.push (job);
+    } else {
+        std::lock_guard<std::mutex> guard (lock);
+        injected.push_back (job);
+    }
+
+    // pending went up before sleeping is read, a thread going to sleep either sees the
+    //  task or is counted here
+    if (sleeping > 0) {
+        { std::lock_guard<std::mutex> guard (lock); }
+        wakeup.notify_one ();
+    }
+}
+
+// Queues a task to run on one of the pool threads, then done to run on reactor's thread
+// once it has
+void Threadpool::submit (std::function<void ()> task, Reactor& reactor, std::function<void ()> done) {
+    submit ([task = std::move (task), &reactor, done = std::move (done)] () mutable {
+        task ();
+        reactor.post (std::move (done));
+    });
+}
+
+// next task for self: its own newest, else the oldest submitted from outside, else the
+// oldest of another thread's. nullptr if there is none
+Threadpool::Job* Threadpool::take (Thread* self) {
+    Job* job;
+    if (self->tasks.pop (job)) {
+        return job;
+    }
+
+    {
+        std::lock_guard<std::mutex> guard (lock);
+        if (!injected.empty ()) {
+            job = injected.front ();
+            injected.pop_front ();
+            return job;
+        }
+    }
+
+    // each thread starts looking at its neighbour, so thieves spread over the victims
+    for (size_t i = 1; i < threads.size (); i++) {
+        Thread* victim = threads[(self->index + i) % threads.size ()].get ();
+        if (victim->tasks.steal (job)) {
+            self->stolen++;
+            return job;
+        }
+    }
+    return nullptr;
+}
+
+// body of every pool thread
+void Threadpool::run (Thread* self) {
+    current = self;
+
+    while (true) {
+        Job* job = take (self);
+        if (job != nullptr) {
+            pending--;
+            (*job) ();
+            delete job;
+            self->ran++;
+            continue;
+        }
+
+        // a task counted in pending may still be on its way onto a deque, then this just
+        //  looks again
+        std::unique_lock<std::mutex> guard (lock);
+        sleeping++;
+        wakeup.wait (guard, [this] { return stopping || pending > 0; });
+        sleeping--;
+
+        if (stopping && pending == 0) {
+            return;
+        }
+    }
+}
+
+// Reports the tasks waiting, and how many ran and were stolen from another thread
+void Threadpool::usage (size_t& queued, uint64_t& ran, uint64_t& stolen) {
+    queued = pending;
+    ran    = 0;
+    stolen = 0;
+    for (std::unique_ptr<Thread>& thread : threads) {
+        ran += thread->ran;
+        stolen += thread->stolen;
+    }
+}
+
+// number of pool threads
+size_t Threadpool::size () const {
+    return threads.size ();
+}
+
+// hands work to the pool, the coroutine is resumed on reactor's thread when it is done
+void Threadpool::Offload::await_suspend (std::coroutine_handle<> handle) {
+    pool.submit (std::move (work), reactor, [handle] () { handle.resume (); });
+}
+
+// Returns an awaitable that runs work on the pool and resumes the awaiting coroutine on
+// reactor once it is done
+Threadpool::Offload Threadpool::offload (Reactor& reactor, std::function<void ()> work) {
+    return Offload{*this, reactor, std::move (work)};
+}
@@ -0,0 +1,122 @@
+/**
+ * @file Threadpool.h
+ * @author Cristian Madrazo
+ * @brief Work stealing pool of threads for work that shouldn't hold up a connection
+ * @version 1.0
+ *
+ */
+
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <coroutine>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "Reactor.h"
+#include "Stealdeque.h"
+
+class Threadpool {
+    private:
+    using Job = std::function<void ()>;
+
+    // one pool thread, tasks it submits go on its own deque where idle threads steal them
+    struct Thread {
+        Threadpool* pool;
+        size_t index;
+        Stealdeque<Job*> tasks;
+        std::atomic<uint64_t> ran;
+        std::atomic<uint64_t> stolen;
+        std::thread thread;
+    };
+
+    // the pool thread running on this thread, nullptr on any other thread
+    static thread_local Thread* current;
+
+    // guards injected and stopping, and lets idle threads sleep
+    std::mutex lock;
+
+    // signalled when a task is queued while threads sleep, or the pool is stopping
+    std::condition_variable wakeup;
+
+    // tasks submitted from outside the pool, oldest at the front
+    std::deque<Job*> injected;
+
+    // tasks queued anywhere in the pool, threads only sleep once it is 0
+    std::atomic<size_t> pending;
+
+    // threads waiting on wakeup, submit() only takes the lock to wake one if any are
+    std::atomic<int> sleeping;
+
+    // set by stop(), threads finish every queued task and exit
+    bool stopping;
+
+    std::vector<std::unique_ptr<Thread>> threads;
+
+    // next task for self: its own newest, else the oldest submitted from outside, else
+    //  the oldest of another thread's. nullptr if there is none
+    Job* take (Thread* self);
+
+    // body of every pool thread
+    void run (Thread* self);
+
+    public:
+    // Constructor, starts no threads until start()
+    Threadpool ();
+
+    // Constructor, starts num_threads threads
+    Threadpool (int num_threads);
+
+    // Destructor, runs every queued task then joins the threads
+    ~Threadpool ();
+
+    Threadpool (const Threadpool&)            = delete;
+    Threadpool& operator= (const Threadpool&) = delete;
+
+    // Starts num_threads threads, at most once. Tasks submitted before wait for them
+    void start (int num_threads);
+
+    // Runs every queued task then joins the threads, nothing may be submitted afterwards
+    void stop ();
+
+    // Queues a task to run on one of the pool threads
+    void submit (std::function<void ()> task);
+
+    // Queues a task to run on one of the pool threads, then done to run on reactor's
+    //  thread once it has
+    void submit (std::function<void ()> task, Reactor& reactor, std::function<void ()> done);
+
+    // Reports the tasks waiting, and how many ran and were stolen from another thread
+    void usage (size_t& queued, uint64_t& ran, uint64_t& stolen);
+
+    // number of pool threads
+    size_t size () const;
+
+    // suspends the awaiting coroutine while work runs on the pool, it is resumed on
+    //  reactor's thread
+    struct Offload {
+        Threadpool& pool;
+        Reactor& reactor;
+        std::function<void ()> work;
+
+        bool await_ready () const noexcept {
+            return false;
+        }
+        void await_suspend (std::coroutine_handle<> handle);
+        void await_resume () noexcept {
+        }
+    };
+
+    // Returns an awaitable that runs work on the pool and resumes the awaiting coroutine on
+    //  reactor once it is done
+    Offload offload (Reactor& reactor, std::function<void ()> work);
+};
+
+#endif
@@ -0,0 +1,465 @@
+/**
+ * @file Websocket.cpp
+ * @author Cristian Madrazo
+ * @brief Implementations for Websocket
+ * @version 1.0
+ *
+ */
+
+#include "Websocket.h"
+
+#include <cerrno>
+#include <cstring>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "Stringlib.h"
+#include "logging.h"
+
+// appended to the client's key before hashing it in the handshake
+#define WEBSOCKET_GUID "258EAFA5-E914-47DA-95CA-C5AB0DC85B11"
+
+// a quiet client is pinged after this long, and dropped if it stays quiet as long again
+#define PING_INTERVAL_MS 30000
+
+// how long we wait for the client to answer a close frame we sent
+#define CLOSE_TIMEOUT_MS 1000
+
+#define READ_SIZE (16 * 1024)
+
+// returns the SHA-1 digest of data, only used for the handshake
+static std::string sha1 (const std::string& data) {
+    uint32_t h[5] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 };
+
+    // pad with a 1 bit, zeros and the bit length so the message is whole 64 byte blocks
+    std::string message = data;
+    message += (char)0x80;
+    while (message.size () % 64 != 56) {
+        message += (char)0;
+    }
+    uint64_t bits = (uint64_t)data.size () * 8;
+    for (int shift = 56; shift >= 0; shift -= 8) {
+        message += (char)(bits >> shift);
+    }
+
+    for (size_t block = 0; block < message.size (); block += 64) {
+        uint32_t w[80];
+        for (int i = 0; i < 16; i++) {
+            const uint8_t* p = (const uint8_t*)message.data () + block + i * 4;
+            w[i]             = (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+        }
+        for (int i = 16; i < 80; i++) {
+            uint32_t x = w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16];
+            w[i]       = x << 1 | x >> 31;
+        }
+
+        uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+        for (int i = 0; i < 80; i++) {
+            uint32_t f, k;
+            if (i < 20) {
+                f = (b & c) | (~b & d);
+                k = 0x5a827999;
+            } else if (i < 40) {
+                f = b ^ c ^ d;
+                k = 0x6ed9eba1;
+            } else if (i < 60) {
+                f = (b & c) | (b & d) | (c & d);
+                k = 0x8f1bbcdc;
+            } else {
+                f = b ^ c ^ d;
+                k = 0xca62c1d6;
+            }
+            uint32_t temp = (a << 5 | a >> 27) + f + e + k + w[i];
+            e             = d;
+            d             = c;
+            c             = b << 30 | b >> 2;
+            b             = a;
+            a             = temp;
+        }
+        h[0] += a;
+        h[1] += b;
+        h[2] += c;
+        h[3] += d;
+        h[4] += e;
+    }
+
+    std::string digest;
+    for (uint32_t word : h) {
+        for (int shift = 24; shift >= 0; shift -= 8) {
+            digest += (char)(word >> shift);
+        }
+    }
+    return digest;
+}
+
+// true if data is well formed UTF-8, text messages have to be
+static bool valid_utf8 (const std::string& data) {
+    const uint8_t* p   = (const uint8_t*)data.data ();
+    const uint8_t* end = p + data.size ();
+    while (p < end) {
+        // skip ASCII a word at a time, it is most of what gets echoed
+        while (end - p >= 8) {
+            uint64_t word;
+            memcpy (&word, p, 8);
+            if (word & 0x8080808080808080ULL) {
+                break;
+            }
+            p += 8;
+        }
+        if (p == end) {
+            break;
+        }
+        if (*p < 0x80) {
+            p++;
+            continue;
+        }
+
+        int length;
+        uint32_t point;
+        if ((*p & 0xe0) == 0xc0) {
+            length = 2;
+            point  = *p & 0x1f;
+        } else if ((*p & 0xf0) == 0xe0) {
+            length = 3;
+            point  = *p & 0x0f;
+        } else if ((*p & 0xf8) == 0xf0) {
+            length = 4;
+            point  = *p & 0x07;
+        } else {
+            return false;
+        }
+        if (end - p < length) {
+            return false;
+        }
+        for (int i = 1; i < length; i++) {
+            if ((p[i] & 0xc0) != 0x80) {
+                return false;
+            }
+            point = point << 6 | (p[i] & 0x3f);
+        }
+
+        // no overlong forms, surrogates or code points past Unicode
+        static const uint32_t smallest[] = { 0, 0, 0x80, 0x800, 0x10000 };
+        if (point < smallest[length] || (point >= 0xd800 && point <= 0xdfff) || point > 0x10ffff) {
+            return false;
+        }
+        p += length;
+    }
+    return true;
+}
+
+// true for the close codes a client may send
+static bool valid_close_code (uint16_t code) {
+    return (code >= 1000 && code <= 1003) || (code >= 1007 && code <= 1011) ||
+    (code >= 3000 && code <= 4999);
+}
+
+// sends all of data, returns false if the client went away
+static bool send_all (int sockFd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t sent = ::send (sockFd, data, len, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return false;
+        }
+        data += sent;
+        len -= sent;
+    }
+    return true;
+}
+
+// returns the Sec-WebSocket-Accept value for a key
+std::string websocket_accept (const std::string& key) {
+    return base64_encode (sha1 (key + WEBSOCKET_GUID));
+}
+
+// unmasks a payload in place, the key repeats every 4 bytes so every step below starts on a
+// multiple of 4 and can use the key as is
+void websocket_unmask (char* data, size_t len, const uint8_t key[4]) {
+    uint32_t key32;
+    memcpy (&key32, key, 4);
+    size_t i = 0;
+
+#ifdef __SSE2__
+    __m128i mask16 = _mm_set1_epi32 ((int)key32);
+    for (; i + 16 <= len; i += 16) {
+        __m128i block = _mm_loadu_si128 ((const __m128i*)(data + i));
+        _mm_storeu_si128 ((__m128i*)(data + i), _mm_xor_si128 (block, mask16));
+    }
+#endif
+
+    uint64_t mask8 = (uint64_t)key32 << 32 | key32;
+    for (; i + 8 <= len; i += 8) {
+        uint64_t word;
+        memcpy (&word, data + i, 8);
+        word ^= mask8;
+        memcpy (data + i, &word, 8);
+    }
+
+    for (; i < len; i++) {
+        data[i] ^= key[i & 3];
+    }
+}
+
+// Constructor
+Websocket::Websocket (int sockFd, const std::string& preread) {
+    this->sockFd  = sockFd;
+    this->input   = preread;
+    this->closed  = false;
+    this->pinged  = false;
+}
+
+// reads more into input, pinging a client that has gone quiet
+bool Websocket::fill () {
+    while (true) {
+        struct pollfd pfd = { sockFd, POLLIN, 0 };
+        int polled        = poll (&pfd, 1, closed ? CLOSE_TIMEOUT_MS : PING_INTERVAL_MS);
+        if (polled < 0 && errno == EINTR) {
+            continue;
+        }
+        if (polled < 0) {
+            return false;
+        }
+
+        if (polled == 0) {
+            // once closing or after an unanswered ping there is nothing left to wait for
+            if (closed || pinged) {
+                DEBUG << "WebSocket client stopped responding" << ENDL;
+                return false;
+            }
+            pinged = true;
+            if (!send (WS_PING, "")) {
+                return false;
+            }
+            continue;
+        }
+
+        char buffer[READ_SIZE];
+        ssize_t bytesRead = read (sockFd, buffer, sizeof (buffer));
+        if (bytesRead < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytesRead <= 0) {
+            return false;
+        }
+
+        // anything at all shows the client is still there
+        pinged = false;
+        input.append (buffer, bytesRead);
+        return true;
+    }
+}
+
+// reads one frame, returns 0, a close code to fail the connection with, or -1 if the
+// client went away
+int Websocket::readFrame (bool& fin, uint8_t& opcode, std::string& payload) {
+    while (input.size () < 2) {
+        if (!fill ()) {
+            return -1;
+        }
+    }
+
+    uint8_t first  = input[0];
+    uint8_t second = input[1];
+    fin            = first & 0x80;
+    opcode         = first & 0x0f;
+
+    // no extensions are negotiated so the reserved bits stay clear, and clients must mask
+    if ((first & 0x70) || !(second & 0x80)) {
+        return WS_CLOSE_PROTOCOL_ERROR;
+    }
+    if ((opcode > WS_BINARY && opcode < WS_CLOSE) || opcode > WS_PONG) {
+        return WS_CLOSE_PROTOCOL_ERROR;
+    }
+
+    size_t header = 2;
+    uint64_t len  = second & 0x7f;
+    if (len == 126) {
+        header += 2;
+    } else if (len == 127) {
+        header += 8;
+    }
+    header += 4;
+    while (input.size () < header) {
+        if (!fill ()) {
+            return -1;
+        }
+    }
+
+    if (len >= 126) {
+        len = 0;
+        for (size_t i = 2; i < header - 4; i++) {
+            len = len << 8 | (uint8_t)input[i];
+        }
+    }
+
+    // control frames are small and never fragmented
+    if (opcode >= WS_CLOSE && (!fin || len > 125)) {
+        return WS_CLOSE_PROTOCOL_ERROR;
+    }
+    if (len > WEBSOCKET_MAX_MESSAGE) {
+        return WS_CLOSE_TOO_BIG;
+    }
+
+    while (input.size () < header + len) {
+        if (!fill ()) {
+            return -1;
+        }
+    }
+
+    uint8_t key[4];
+    memcpy (key, input.data () + header - 4, 4);
+    payload.assign (input, header, len);
+    websocket_unmask (&payload[0], len, key);
+    input.erase (0, header + len);
+    return 0;
+}
+
+// reads the next complete message
+bool Websocket::receive (std::string& message, uint8_t& opcode) {
+    message.clear ();
+    bool fragmented = false;
+
+    while (true) {
+        bool fin;
+        uint8_t frame_opcode;
+        std::string payload;
+        int error = readFrame (fin, frame_opcode, payload);
+        if (error < 0) {
+            return false;
+        }
+        if (error > 0) {
+            close (error, "");
+            return false;
+        }
+
+        if (frame_opcode == WS_PING) {
+            if (!send (WS_PONG, payload)) {
+                return false;
+            }
+            continue;
+        }
+        if (frame_opcode == WS_PONG) {
+            continue;
+        }
+
+        if (frame_opcode == WS_CLOSE) {
+            // answer with the client's own code, or a plain close if it gave none
+            uint16_t code = WS_CLOSE_NORMAL;
+            if (payload.size () == 1) {
+                code = WS_CLOSE_PROTOCOL_ERROR;
+            } else if (payload.size () >= 2) {
+                code = (uint8_t)payload[0] << 8 | (uint8_t)payload[1];
+                if (!valid_close_code (code)) {
+                    code = WS_CLOSE_PROTOCOL_ERROR;
+                } else if (!valid_utf8 (payload.substr (2))) {
+                    code = WS_CLOSE_INVALID_DATA;
+                }
+            }
+            closed = true;
+            std::string reply;
+            reply += (char)(code >> 8);
+            reply += (char)code;
+            sendFrame (WS_CLOSE, reply);
+            return false;
+        }
+
+        // a continuation needs a message to continue, and a new message can't start while
+        // another one is unfinished
+        if ((frame_opcode == WS_CONTINUATION) != fragmented) {
+            close (WS_CLOSE_PROTOCOL_ERROR, "");
+            return false;
+        }
+        if (frame_opcode != WS_CONTINUATION) {
+            opcode = frame_opcode;
+        }
+        if (message.size () + payload.size () > WEBSOCKET_MAX_MESSAGE) {
+            close (WS_CLOSE_TOO_BIG, "");
+            return false;
+        }
+        message += payload;
+
+        if (!fin) {
+            fragmented = true;
+            continue;
+        }
+        if (opcode == WS_TEXT && !valid_utf8 (message)) {
+            close (WS_CLOSE_INVALID_DATA, "");
+            return false;
+        }
+        return true;
+    }
+}
+
+// sends one unmasked frame
+bool Websocket::sendFrame (uint8_t opcode, const std::string& payload) {
+    char header[10];
+    size_t header_len = 2;
+    header[0]         = (char)(0x80 | opcode);
+    if (payload.size () < 126) {
+        header[1] = (char)payload.size ();
+    } else if (payload.size () <= 0xffff) {
+        header[1]  = 126;
+        header[2]  = (char)(payload.size () >> 8);
+        header[3]  = (char)payload.size ();
+        header_len = 4;
+    } else {
+        header[1] = 127;
+        for (int i = 0; i < 8; i++) {
+            header[2 + i] = (char)((uint64_t)payload.size () >> (56 - 8 * i));
+        }
+        header_len = 10;
+    }
+
+    // small frames go out in one packet, big ones aren't worth copying
+    if (payload.size () <= READ_SIZE) {
+        std::string frame (header, header_len);
+        frame += payload;
+        return send_all (sockFd, frame.data (), frame.size ());
+    }
+    return send_all (sockFd, header, header_len) &&
+    send_all (sockFd, payload.data (), payload.size ());
+}
+
+// sends a whole message
+bool Websocket::send (uint8_t opcode, const std::string& payload) {
+    if (closed) {
+        return false;
+    }
+    return sendFrame (opcode, payload);
+}
+
+// sends a close frame and waits a moment for the client to answer it
+void Websocket::close (uint16_t code, const std::string& reason) {
+    if (closed) {
+        return;
+    }
+    closed = true;
+
+    std::string payload;
+    payload += (char)(code >> 8);
+    payload += (char)code;
+    payload += reason.substr (0, 123);
+    if (!sendFrame (WS_CLOSE, payload)) {
+        return;
+    }
+
+    // after a protocol error the client's frames can't be trusted to make sense
+    if (code == WS_CLOSE_PROTOCOL_ERROR || code == WS_CLOSE_TOO_BIG) {
+        return;
+    }
+    while (true) {
+        bool fin;
+        uint8_t opcode;
+        std::string ignored;
+        if (readFrame (fin, opcode, ignored) != 0 || opcode == WS_CLOSE) {
+            return;
+        }
+    }
+}
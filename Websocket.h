@@ -0,0 +1,93 @@
+/**
+ * @file Websocket.h
+ * @author Cristian Madrazo
+ * @brief Server side of the WebSocket protocol (RFC 6455) over an upgraded connection
+ * @version 1.0
+ *
+ */
+
+#ifndef WEBSOCKET_H
+#define WEBSOCKET_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// largest message accepted, fragments included
+#define WEBSOCKET_MAX_MESSAGE (1024 * 1024)
+
+// frame opcodes
+#define WS_CONTINUATION 0x0
+#define WS_TEXT 0x1
+#define WS_BINARY 0x2
+#define WS_CLOSE 0x8
+#define WS_PING 0x9
+#define WS_PONG 0xa
+
+// close status codes
+#define WS_CLOSE_NORMAL 1000
+#define WS_CLOSE_GOING_AWAY 1001
+#define WS_CLOSE_PROTOCOL_ERROR 1002
+#define WS_CLOSE_INVALID_DATA 1007
+#define WS_CLOSE_TOO_BIG 1009
+
+class Websocket {
+    private:
+    int sockFd;
+
+    // received bytes that don't make a whole frame yet
+    std::string input;
+
+    // set once a close frame was sent, nothing else may follow it
+    bool closed;
+
+    // set while a ping we sent for a quiet client is unanswered
+    bool pinged;
+
+    // reads more from the socket into input, pinging a client that has gone quiet.
+    // Returns false if the client went away or never answered the ping
+    bool fill ();
+
+    // reads one frame and unmasks its payload. Returns 0, a close code if the frame breaks
+    // the protocol, or -1 if the client went away
+    int readFrame (bool& fin, uint8_t& opcode, std::string& payload);
+
+    // sends one frame, returns false if the client went away
+    bool sendFrame (uint8_t opcode, const std::string& payload);
+
+    public:
+    // Constructor, preread holds bytes the client sent after its handshake
+    Websocket (int sockFd, const std::string& preread);
+
+    // Reads the next complete message, answering pings and putting fragments back together
+    // on the way. opcode is set to WS_TEXT or WS_BINARY. Returns false once the connection is
+    // over: the client closed it, went away or broke the protocol, which has been answered
+    // with a close frame already
+    bool receive (std::string& message, uint8_t& opcode);
+
+    // Sends a whole message in one unmasked frame, returns false if the client went away
+    bool send (uint8_t opcode, const std::string& payload);
+
+    // Sends a close frame with a status code and reason
+    void close (uint16_t code, const std::string& reason);
+};
+
+/**
+ * @brief Returns the Sec-WebSocket-Accept value that answers a client's Sec-WebSocket-Key
+ *
+ * @param key the client's Sec-WebSocket-Key
+ * @return base64 SHA-1 of key and the protocol's GUID
+ */
+std::string websocket_accept (const std::string& key);
+
+/**
+ * @brief Unmasks a frame payload in place, 16 bytes at a time where SSE2 is available and a
+ * word at a time otherwise
+ *
+ * @param data payload
+ * @param len payload length
+ * @param key the frame's 4 byte masking key
+ */
+void websocket_unmask (char* data, size_t len, const uint8_t key[4]);
+
+#endif
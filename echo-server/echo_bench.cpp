@@ -0,0 +1,635 @@
+// **************************************************************************************
+// * Echo Benchmark (echo_bench.cpp)
+// * -- Drives echo_s with many concurrent connections and reports throughput and latency.
+// **************************************************************************************
+#include "echo_bench.h"
+
+// **************************************************************************************
+// constants and macros
+#define BUFFER_SIZE (64 * 1024)
+#define DEFAULT_HOST "127.0.0.1"
+#define DEFAULT_PORT 1748
+#define MAX_EVENTS 256
+
+// in-flight messages still unanswered this long after the run ends are counted as lost
+#define GRACE_MS 1000
+
+// a churn session the server doesn't answer within this long counts as failed
+#define CHURN_TIMEOUT_SECONDS 5
+
+// latency histogram: every power of two of nanoseconds is split into this many buckets,
+//  so any percentile is within 1/HISTOGRAM_SUB_BUCKETS of the real value
+#define HISTOGRAM_SUB_BUCKETS 64
+#define HISTOGRAM_POWERS 40
+
+// how messages are delimited, must match the -f the server runs with
+enum Framing {
+  FRAME_CHUNK,  // raw bytes
+  FRAME_LINE,   // ending in a newline
+  FRAME_LENGTH, // after a 4 byte big endian length
+};
+
+// what the benchmark does with its connections
+enum Scenario {
+  SCENARIO_ECHO,  // keep every connection open and echo as fast as the depth allows
+  SCENARIO_CHURN, // connect, echo one message, CLOSE, repeat
+};
+
+// **************************************************************************************
+// * Settings shared by every thread, fixed once the run starts
+// **************************************************************************************
+struct Settings {
+  struct sockaddr_storage addr;
+  socklen_t addrlen = 0;
+
+  int connections = 1;
+  int threads = 1;
+  size_t payload = 64;
+  int depth = 1;
+  int seconds = 5;
+  Framing framing = FRAME_CHUNK;
+  Scenario scenario = SCENARIO_ECHO;
+
+  // the message every connection sends, framing included
+  std::string message;
+};
+Settings settings;
+
+// set when the run is over, threads stop starting new messages
+std::atomic<bool> stop_run(false);
+
+// **************************************************************************************
+// * Round trip times, log-linear so it needs no allocation per sample
+// **************************************************************************************
+class Histogram {
+  private:
+  std::vector<uint64_t> counts;
+  uint64_t total = 0;
+  uint64_t largest = 0;
+
+  // bucket a latency falls in, exact below HISTOGRAM_SUB_BUCKETS nanoseconds
+  static size_t bucket(uint64_t ns) {
+    if (ns < HISTOGRAM_SUB_BUCKETS) {
+      return ns;
+    }
+    int power = 63 - __builtin_clzll(ns);
+    int shift = power - __builtin_ctz(HISTOGRAM_SUB_BUCKETS);
+    size_t index = (size_t)(shift + 1) * HISTOGRAM_SUB_BUCKETS + ((ns >> shift) - HISTOGRAM_SUB_BUCKETS);
+    return std::min(index, (size_t)HISTOGRAM_POWERS * HISTOGRAM_SUB_BUCKETS - 1);
+  }
+
+  // smallest latency that falls in a bucket
+  static uint64_t lowest(size_t index) {
+    if (index < HISTOGRAM_SUB_BUCKETS) {
+      return index;
+    }
+    size_t shift = index / HISTOGRAM_SUB_BUCKETS - 1;
+    return (HISTOGRAM_SUB_BUCKETS + index % HISTOGRAM_SUB_BUCKETS) << shift;
+  }
+
+  public:
+  Histogram() : counts(HISTOGRAM_POWERS * HISTOGRAM_SUB_BUCKETS, 0) {}
+
+  void record(uint64_t ns) {
+    counts[bucket(ns)]++;
+    total++;
+    largest = std::max(largest, ns);
+  }
+
+  void merge(const Histogram& other) {
+    for (size_t i = 0; i < counts.size(); i++) {
+      counts[i] += other.counts[i];
+    }
+    total += other.total;
+    largest = std::max(largest, other.largest);
+  }
+
+  uint64_t count() const {
+    return total;
+  }
+
+  uint64_t max() const {
+    return largest;
+  }
+
+  // latency that fraction of the samples are at or below
+  uint64_t percentile(double fraction) const {
+    uint64_t wanted = std::max<uint64_t>(1, (uint64_t)(fraction * total + 0.5));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < counts.size(); i++) {
+      seen += counts[i];
+      if (seen >= wanted) {
+        return std::min(lowest(i), largest);
+      }
+    }
+    return largest;
+  }
+};
+
+// **************************************************************************************
+// * What one thread measured
+// **************************************************************************************
+struct Results {
+  Histogram rtt;
+  uint64_t messages = 0;
+  uint64_t bytes = 0;
+  uint64_t mismatches = 0;
+  uint64_t failures = 0;
+  uint64_t sessions = 0;
+};
+
+// **************************************************************************************
+// * One benchmark connection, owned by its thread's event loop
+// **************************************************************************************
+struct Connection {
+  int fd = -1;
+
+  // bytes still to be written, from sent onwards
+  std::string out;
+  size_t sent = 0;
+
+  // bytes written and not echoed yet, from matched onwards, that the echo is checked against
+  std::string expected;
+  size_t matched = 0;
+
+  // stream offset each unanswered message ends at, and when it was queued
+  std::deque<std::pair<uint64_t, std::chrono::steady_clock::time_point>> inflight;
+  uint64_t queued_bytes = 0;
+  uint64_t echoed_bytes = 0;
+};
+
+// **************************************************************************************
+// * buildMessage()
+// * - Returns the message every connection sends: payload bytes of lowercase letters, so it
+// * never starts with a command and never holds a newline, framed for the server.
+// **************************************************************************************
+std::string buildMessage(size_t payload, Framing framing) {
+  std::string body(payload, 'a');
+  for (size_t i = 0; i < payload; i++) {
+    body[i] = 'a' + i % 26;
+  }
+
+  if (framing == FRAME_LINE) {
+    if (!body.empty()) {
+      body.back() = '\n';
+    }
+    else {
+      body = "\n";
+    }
+  }
+  else if (framing == FRAME_LENGTH) {
+    uint32_t length = htonl(payload);
+    body.insert(0, (const char*)&length, sizeof(length));
+  }
+  return body;
+}
+
+// **************************************************************************************
+// * closeCommand()
+// * - Returns the CLOSE command framed for the server.
+// **************************************************************************************
+std::string closeCommand() {
+  if (settings.framing == FRAME_LINE) {
+    return "CLOSE\n";
+  }
+  if (settings.framing == FRAME_LENGTH) {
+    std::string command = "CLOSE";
+    uint32_t length = htonl(command.size());
+    return std::string((const char*)&length, sizeof(length)) + command;
+  }
+  return "CLOSE";
+}
+
+// **************************************************************************************
+// * connectServer()
+// * - Opens a connection to the server, blocking until it is established.
+// * - Returns -1 if it can't.
+// **************************************************************************************
+int connectServer() {
+  int fd = socket(settings.addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  if (connect(fd, (struct sockaddr *)&settings.addr, settings.addrlen) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  // small pipelined messages are measured, not coalesced by Nagle
+  int on = 1;
+  setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+  return fd;
+}
+
+// **************************************************************************************
+// * fillConnection()
+// * - Queues messages until depth of them are unanswered.
+// **************************************************************************************
+void fillConnection(Connection& conn) {
+  auto now = std::chrono::steady_clock::now();
+  while ((int)conn.inflight.size() < settings.depth && !stop_run) {
+    conn.out += settings.message;
+    conn.expected += settings.message;
+    conn.queued_bytes += settings.message.size();
+    conn.inflight.emplace_back(conn.queued_bytes, now);
+  }
+}
+
+// **************************************************************************************
+// * writeConnection()
+// * - Writes as much queued output as the socket takes.
+// * - Returns false if the connection failed.
+// **************************************************************************************
+bool writeConnection(Connection& conn) {
+  while (conn.sent < conn.out.size()) {
+    ssize_t bytes_sent = send(conn.fd, conn.out.data() + conn.sent, conn.out.size() - conn.sent, MSG_NOSIGNAL);
+    if (bytes_sent < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+    conn.sent += bytes_sent;
+  }
+  conn.out.clear();
+  conn.sent = 0;
+  return true;
+}
+
+// **************************************************************************************
+// * readConnection()
+// * - Reads echo, checks it against what was sent and records the round trip of every
+// * message it completes.
+// * - Returns false if the connection failed or was closed.
+// **************************************************************************************
+bool readConnection(Connection& conn, Results& results) {
+  char buffer[BUFFER_SIZE];
+  while (true) {
+    ssize_t bytesRead = read(conn.fd, buffer, BUFFER_SIZE);
+    if (bytesRead < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return errno == EAGAIN || errno == EWOULDBLOCK;
+    }
+    if (bytesRead == 0) {
+      return false;
+    }
+
+    size_t left = conn.expected.size() - conn.matched;
+    if ((size_t)bytesRead > left || memcmp(buffer, conn.expected.data() + conn.matched, bytesRead) != 0) {
+      results.mismatches++;
+      return false;
+    }
+    conn.matched += bytesRead;
+    conn.echoed_bytes += bytesRead;
+
+    // drop what was checked once it is most of the buffer
+    if (conn.matched > conn.expected.size() / 2) {
+      conn.expected.erase(0, conn.matched);
+      conn.matched = 0;
+    }
+
+    auto now = std::chrono::steady_clock::now();
+    while (!conn.inflight.empty() && conn.inflight.front().first <= conn.echoed_bytes) {
+      auto rtt = std::chrono::duration_cast<std::chrono::nanoseconds>(now - conn.inflight.front().second);
+      results.rtt.record(rtt.count());
+      results.messages++;
+      results.bytes += settings.message.size();
+      conn.inflight.pop_front();
+    }
+  }
+}
+
+// **************************************************************************************
+// * runEcho()
+// * - Keeps count connections busy echoing until the run is over. Run by every thread in
+// * the echo scenario.
+// **************************************************************************************
+void runEcho(int count, Results& results) {
+  int epollFd = epoll_create1(EPOLL_CLOEXEC);
+  if (epollFd < 0) {
+    FATAL << "Epoll_create1() failed" << ENDL;
+    results.failures += count;
+    return;
+  }
+
+  std::vector<Connection> conns(count);
+  for (int i = 0; i < count; i++) {
+    conns[i].fd = connectServer();
+    if (conns[i].fd < 0) {
+      ERROR << "Could not connect: " << strerror(errno) << ENDL;
+      results.failures++;
+      continue;
+    }
+    fcntl(conns[i].fd, F_SETFL, fcntl(conns[i].fd, F_GETFL) | O_NONBLOCK);
+
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLET;
+    event.data.u32 = i;
+    epoll_ctl(epollFd, EPOLL_CTL_ADD, conns[i].fd, &event);
+
+    fillConnection(conns[i]);
+    writeConnection(conns[i]);
+  }
+
+  // after the run, wait a little for the answers to messages already sent
+  bool draining = false;
+  std::chrono::steady_clock::time_point deadline;
+  struct epoll_event events[MAX_EVENTS];
+  int open = std::count_if(conns.begin(), conns.end(), [](const Connection& conn) { return conn.fd >= 0; });
+
+  while (open > 0) {
+    if (stop_run && !draining) {
+      draining = true;
+      deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(GRACE_MS);
+    }
+    if (draining) {
+      bool waiting = false;
+      for (const Connection& conn : conns) {
+        waiting |= conn.fd >= 0 && !conn.inflight.empty();
+      }
+      if (!waiting || std::chrono::steady_clock::now() >= deadline) {
+        break;
+      }
+    }
+
+    int ready = epoll_wait(epollFd, events, MAX_EVENTS, 100);
+    for (int i = 0; i < ready; i++) {
+      Connection& conn = conns[events[i].data.u32];
+      if (conn.fd < 0) {
+        continue;
+      }
+
+      bool ok = readConnection(conn, results);
+      if (ok) {
+        fillConnection(conn);
+        ok = writeConnection(conn);
+      }
+      if (!ok) {
+        ERROR << "Connection " << conn.fd << " failed" << ENDL;
+        results.failures++;
+        close(conn.fd);
+        conn.fd = -1;
+        open--;
+      }
+    }
+  }
+
+  for (Connection& conn : conns) {
+    if (conn.fd >= 0) {
+      close(conn.fd);
+    }
+  }
+  close(epollFd);
+}
+
+// **************************************************************************************
+// * receiveAll()
+// * - Reads from a blocking socket until len bytes arrived, or until it closes if len is 0.
+// * - Returns what was read.
+// **************************************************************************************
+std::string receiveAll(int fd, size_t len) {
+  std::string received;
+  char buffer[BUFFER_SIZE];
+  while (len == 0 || received.size() < len) {
+    ssize_t bytesRead = read(fd, buffer, len == 0 ? BUFFER_SIZE : std::min((size_t)BUFFER_SIZE, len - received.size()));
+    if (bytesRead < 0 && errno == EINTR) {
+      continue;
+    }
+    if (bytesRead <= 0) {
+      break;
+    }
+    received.append(buffer, bytesRead);
+  }
+  return received;
+}
+
+// **************************************************************************************
+// * runChurn()
+// * - Connects, echoes one message, sends CLOSE and waits for the server to hang up, over
+// * and over until the run is over. Each round trip recorded spans the whole session.
+// * Run by every thread in the churn scenario, one connection at a time.
+// **************************************************************************************
+void runChurn(Results& results) {
+  std::string command = closeCommand();
+  struct timeval timeout = {CHURN_TIMEOUT_SECONDS, 0};
+
+  while (!stop_run) {
+    auto start = std::chrono::steady_clock::now();
+    int fd = connectServer();
+    if (fd < 0) {
+      results.failures++;
+      continue;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    // CLOSE only goes once the message is back, so it starts a chunk of its own
+    bool ok = send(fd, settings.message.data(), settings.message.size(), MSG_NOSIGNAL) == (ssize_t)settings.message.size();
+    std::string echo = ok ? receiveAll(fd, settings.message.size()) : "";
+    ok = ok && send(fd, command.data(), command.size(), MSG_NOSIGNAL) == (ssize_t)command.size();
+
+    // the server answers CLOSE, then hangs up
+    std::string closed = ok ? receiveAll(fd, 0) : "";
+    close(fd);
+
+    if (!ok) {
+      results.failures++;
+      continue;
+    }
+    if (echo != settings.message || closed != command) {
+      results.mismatches++;
+      continue;
+    }
+
+    auto rtt = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start);
+    results.rtt.record(rtt.count());
+    results.sessions++;
+    results.messages++;
+    results.bytes += settings.message.size();
+  }
+}
+
+// **************************************************************************************
+// * report()
+// * - Prints what every thread measured together.
+// **************************************************************************************
+void report(const Results& total, double seconds) {
+  auto us = [](uint64_t ns) { return ns / 1000.0; };
+
+  std::cout << std::fixed << std::setprecision(1);
+  std::cout << "connections: " << settings.connections << " threads: " << settings.threads
+            << " payload: " << settings.payload << " depth: " << settings.depth << std::endl;
+  std::cout << "messages:    " << total.messages << " in " << seconds << "s, " << total.messages / seconds << " msgs/s"
+            << std::endl;
+  std::cout << std::setprecision(3);
+  std::cout << "throughput:  " << total.bytes * 8 / seconds / 1e9 << " Gbit/s each way" << std::endl;
+  if (settings.scenario == SCENARIO_CHURN) {
+    std::cout << std::setprecision(1);
+    std::cout << "sessions:    " << total.sessions / seconds << " connects/s" << std::endl;
+  }
+  std::cout << std::setprecision(1);
+  std::cout << "rtt (us):    p50 " << us(total.rtt.percentile(0.50)) << "  p90 " << us(total.rtt.percentile(0.90))
+            << "  p99 " << us(total.rtt.percentile(0.99)) << "  p99.9 " << us(total.rtt.percentile(0.999))
+            << "  max " << us(total.rtt.max()) << std::endl;
+  std::cout << "errors:      " << total.mismatches << " mismatched, " << total.failures << " failed" << std::endl;
+}
+
+// **************************************************************************************
+// * resolve()
+// * - Looks up the server's address.
+// * - Returns false if it can't be resolved.
+// **************************************************************************************
+bool resolve(const std::string& host, int port) {
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+
+  struct addrinfo* found = nullptr;
+  if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &found) != 0 || found == nullptr) {
+    return false;
+  }
+  memcpy(&settings.addr, found->ai_addr, found->ai_addrlen);
+  settings.addrlen = found->ai_addrlen;
+  freeaddrinfo(found);
+  return true;
+}
+
+// **************************************************************************************
+// * main()
+// * - Parses the settings, runs the scenario on every thread and reports the results
+// **************************************************************************************
+int main(int argc, char *argv[]) {
+
+  // every connection holds a descriptor, allow as many as the hard limit does
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+
+  // ********************************************************************
+  // * Process the command line arguments
+  // ********************************************************************
+  Argparser parser(argc, argv);
+  parser.add_option('d', true, false, 1, 1);
+  parser.add_option('a', true, false, 1, 1);
+  parser.add_option('p', true, false, 1, 1);
+  parser.add_option('c', true, false, 1, 1);
+  parser.add_option('w', true, false, 1, 1);
+  parser.add_option('s', true, false, 1, 1);
+  parser.add_option('n', true, false, 1, 1);
+  parser.add_option('t', true, false, 1, 1);
+  parser.add_option('f', true, false, 1, 1);
+  parser.add_option('m', true, false, 1, 1);
+  parser.parse();
+
+  std::vector<int> arg_values = parser.get_values_int('d');
+  LOG_LEVEL = arg_values.size() > 0 ? arg_values.at(0) : 0;
+
+  // where echo_s is
+  std::vector<std::string> host_values = parser.get_values_string('a');
+  std::string host = host_values.size() > 0 ? host_values.at(0) : DEFAULT_HOST;
+  arg_values = parser.get_values_int('p');
+  int port = arg_values.size() > 0 ? arg_values.at(0) : DEFAULT_PORT;
+  if (!resolve(host, port)) {
+    FATAL << "Could not resolve " << host << ENDL;
+    return -1;
+  }
+
+  // how hard to push it
+  arg_values = parser.get_values_int('c');
+  if (arg_values.size() > 0) {
+    settings.connections = arg_values.at(0);
+  }
+  arg_values = parser.get_values_int('w');
+  if (arg_values.size() > 0) {
+    settings.threads = arg_values.at(0);
+  }
+  arg_values = parser.get_values_int('s');
+  if (arg_values.size() > 0) {
+    settings.payload = arg_values.at(0);
+  }
+  arg_values = parser.get_values_int('n');
+  if (arg_values.size() > 0) {
+    settings.depth = arg_values.at(0);
+  }
+  arg_values = parser.get_values_int('t');
+  if (arg_values.size() > 0) {
+    settings.seconds = arg_values.at(0);
+  }
+  if (settings.connections <= 0 || settings.threads <= 0 || settings.payload == 0 || settings.depth <= 0 ||
+      settings.seconds <= 0) {
+    FATAL << "Connections, threads, payload, depth and seconds all have to be positive" << ENDL;
+    return -1;
+  }
+  settings.threads = std::min(settings.threads, settings.connections);
+
+  // how messages are delimited, has to match the server
+  std::vector<std::string> framing_values = parser.get_values_string('f');
+  if (framing_values.size() > 0) {
+    if (framing_values.at(0) == "line") {
+      settings.framing = FRAME_LINE;
+    }
+    else if (framing_values.at(0) == "length") {
+      settings.framing = FRAME_LENGTH;
+    }
+    else if (framing_values.at(0) != "chunk") {
+      FATAL << "Unknown framing " << framing_values.at(0) << ENDL;
+      return -1;
+    }
+  }
+  settings.message = buildMessage(settings.payload, settings.framing);
+
+  // churn runs one thread per connection, each connecting over and over
+  std::vector<std::string> mode_values = parser.get_values_string('m');
+  if (mode_values.size() > 0) {
+    if (mode_values.at(0) == "churn") {
+      settings.scenario = SCENARIO_CHURN;
+      settings.threads = settings.connections;
+      settings.depth = 1;
+    }
+    else if (mode_values.at(0) != "echo") {
+      FATAL << "Unknown scenario " << mode_values.at(0) << ENDL;
+      return -1;
+    }
+  }
+
+  // ********************************************************************
+  // * Every thread gets an even share of the connections and its own
+  // * results, merged once the run is over.
+  // ********************************************************************
+  std::vector<Results> results(settings.threads);
+  std::vector<std::thread> threads;
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < settings.threads; i++) {
+    int count = settings.connections / settings.threads + (i < settings.connections % settings.threads ? 1 : 0);
+    if (settings.scenario == SCENARIO_CHURN) {
+      threads.emplace_back(runChurn, std::ref(results[i]));
+    }
+    else {
+      threads.emplace_back(runEcho, count, std::ref(results[i]));
+    }
+  }
+
+  std::this_thread::sleep_for(std::chrono::seconds(settings.seconds));
+  stop_run = true;
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  for (std::thread& thread : threads) {
+    thread.join();
+  }
+
+  Results total;
+  for (const Results& result : results) {
+    total.rtt.merge(result.rtt);
+    total.messages += result.messages;
+    total.bytes += result.bytes;
+    total.mismatches += result.mismatches;
+    total.failures += result.failures;
+    total.sessions += result.sessions;
+  }
+  report(total, seconds);
+
+  return total.mismatches > 0 ? 1 : 0;
+}
@@ -0,0 +1,26 @@
+// ********************************************************
+// * A common set of system include files needed for socket() programming
+// ********************************************************
+#include <filesystem>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <iomanip>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "Argparser.h"
+#include "logging.h"
@@ -6,54 +6,624 @@
 
 // **************************************************************************************
 // constants and macros
-#define BUFFER_SIZE 1024
+#define BUFFER_SIZE (16 * 1024)
 #define DEFAULT_PORT 1748
+#define MAX_EVENTS 256
+
+// a session whose client isn't reading stops being read once this much echo is queued
+#define MAX_PENDING (1024 * 1024)
+
+// after QUIT, sessions still open this long are closed anyway
+#define DRAIN_SECONDS 30
+
+// in splice mode, bytes each session's pipe holds between reading and echoing them
+#define PIPE_BYTES (64 * 1024)
+
+// longest command, the bytes peeked at the start of a chunk in splice mode
+#define COMMAND_LEN 5
+
+// how echoed bytes get from the socket back to it
+enum Echomode {
+  ECHO_COPY,   // read() into a buffer and send() it back
+  ECHO_SPLICE, // splice() through a pipe, the data never enters user space
+};
+Echomode echo_mode = ECHO_COPY;
+
+// where one message ends and the next starts, commands are only spotted at a message start
+enum Framing {
+  FRAME_CHUNK,  // whatever one read() returns
+  FRAME_LINE,   // up to and including a newline
+  FRAME_LENGTH, // a 4 byte big endian payload length, then the payload
+};
+Framing framing = FRAME_CHUNK;
+
+// a longer frame, or a line this long without a newline, ends the session
+#define MAX_FRAME (1024 * 1024)
+
+// bytes before a length prefixed frame's payload
+#define LENGTH_PREFIX 4
+
+// frames sent back with one sendmsg()
+#define MAX_BATCH 64
+
+// datagrams received and echoed with one recvmmsg() and sendmmsg() in UDP mode, each into
+//  a buffer big enough for the largest datagram, or a GRO batch of them
+#define UDP_BATCH 64
+#define UDP_BUFFER_SIZE (64 * 1024)
+
+// receive and send buffer of every UDP socket, so bursts aren't dropped between batches
+#define UDP_SOCKET_BUFFER (4 * 1024 * 1024)
+
+// set once a datagram asks to quit, every UDP thread stops
+std::atomic<bool> quit_datagrams(false);
+
+// the sockets sharing the UDP port, one per thread
+std::vector<Listener> datagram_sockets;
+
+// echo at least this big is sent with MSG_ZEROCOPY, 0 unless -z turns it on
+size_t zerocopy_min_bytes = 0;
+
+// **************************************************************************************
+// * One echo session, owned by the event loop. The connection queues the echo, the
+// * session adds what echoing needs on top of it
+// **************************************************************************************
+struct Session {
+  Connection connection;
+
+  // in splice mode the echo waits in a pipe instead, piped bytes of it out of capacity
+  int pipeFds[2] = {-1, -1};
+  size_t piped = 0;
+  size_t capacity = 0;
+
+  // start of a frame still missing its end, when framing
+  std::string inbox;
+
+  // the session ends once its echo is flushed
+  bool closing = false;
+
+  Session(Reactor& reactor, int fd, Reactor::Handler handler) : connection(reactor, fd, std::move(handler)) {}
+
+  ~Session() {
+    if (pipeFds[0] >= 0) {
+      close(pipeFds[0]);
+      close(pipeFds[1]);
+    }
+  }
+};
+
+// every open session by socket
+std::unordered_map<int, Session> sessions;
+
+// **************************************************************************************
+// * watch()
+// * - Registers for reading while the session can take more echo, and for writing while
+// * there is echo queued
+// **************************************************************************************
+void watch(Session& session) {
+  size_t limit = session.pipeFds[0] >= 0 ? session.capacity : MAX_PENDING;
+
+  // zero copy echo holds memory until the kernel lets go of it, not just until it is sent
+  size_t held = session.piped + session.connection.held();
+  session.connection.update(!session.closing && held < limit, session.piped > 0);
+}
+
+// **************************************************************************************
+// * closeSession()
+// * - Forgets a session, which closes its socket and takes it out of the event loop
+// **************************************************************************************
+void closeSession(int fd) {
+  DEBUG << "Closing session " << fd << ENDL;
+  sessions.erase(fd);
+}
+
+// **************************************************************************************
+// * openPipe()
+// * - Gives a session the pipe its echo goes through in splice mode.
+// * - Returns false if the pipe can't be created.
+// **************************************************************************************
+bool openPipe(Session& session) {
+  if (pipe2(session.pipeFds, O_NONBLOCK | O_CLOEXEC) < 0) {
+    session.pipeFds[0] = session.pipeFds[1] = -1;
+    return false;
+  }
+
+  // the kernel may round the size up, or refuse it past /proc/sys/fs/pipe-max-size
+  fcntl(session.pipeFds[1], F_SETPIPE_SZ, PIPE_BYTES);
+  int size = fcntl(session.pipeFds[1], F_GETPIPE_SZ);
+  session.capacity = size > 0 ? size : PIPE_BYTES;
+  return true;
+}
+
+// **************************************************************************************
+// * flushSession()
+// * - Writes as much queued echo as the socket takes.
+// * - Returns false if the session is over, because it failed or it was closing and is done.
+// **************************************************************************************
+bool flushSession(Session& session) {
+  int fd = session.connection.get_fd();
+  while (session.piped > 0) {
+    ssize_t moved = splice(session.pipeFds[0], nullptr, fd, nullptr, session.piped,
+                           SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (moved < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        return true;
+      }
+      DEBUG << "Splice to session " << fd << " failed" << ENDL;
+      return false;
+    }
+    session.piped -= moved;
+  }
+
+  if (!session.connection.flush()) {
+    return false;
+  }
+
+  // a closing session still waits for the kernel to be done with its zero copy echo
+  return !session.closing || !session.connection.idle();
+}
+
+// **************************************************************************************
+// * checkCommands()
+// * - Looks for a command at the start of a chunk or frame of data.
+// * - Returns 1 if it starts with "QUIT", 0 otherwise. A chunk or frame starting with
+// * "CLOSE" or "QUIT" is the last one echoed to the session.
+// **************************************************************************************
+int checkCommands(Session& session, const char* data, size_t len) {
+  //
+  // Check for quit command
+  if (len >= 4 && memcmp(data, "QUIT", 4) == 0) {
+    DEBUG << "Chunk starts with QUIT command" << ENDL;
+    session.closing = true;
+    return 1;
+  }
+
+  //
+  // Check for close command
+  if (len >= 5 && memcmp(data, "CLOSE", 5) == 0) {
+    DEBUG << "Chunk starts with CLOSE command" << ENDL;
+    session.closing = true;
+  }
+
+  return 0;
+}
+
+// **************************************************************************************
+// * spliceConnection()
+// * - Moves one chunk of data from a session into its pipe, peeking at its start for
+// * commands first so the data itself is never copied.
+// * - Returns like processConnection().
+// **************************************************************************************
+int spliceConnection(Session& session) {
+  int fd = session.connection.get_fd();
+  char prefix[COMMAND_LEN];
+  ssize_t peeked = recv(fd, prefix, COMMAND_LEN, MSG_PEEK);
+  if (peeked < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+    return 0;
+  }
+  if (peeked <= 0) {
+    DEBUG << "Session " << fd << " disconnected" << ENDL;
+    session.closing = true;
+    return 0;
+  }
+
+  ssize_t moved = splice(fd, nullptr, session.pipeFds[1], nullptr, session.capacity - session.piped,
+                         SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+  if (moved < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+    return 0;
+  }
+  if (moved <= 0) {
+    DEBUG << "Session " << fd << " disconnected" << ENDL;
+    session.closing = true;
+    return 0;
+  }
+
+  INFO << "New chunk of " << moved << " bytes spliced" << ENDL;
+  session.piped += moved;
+  return checkCommands(session, prefix, peeked);
+}
+
+// **************************************************************************************
+// * frameLength()
+// * - Returns the length of the complete frame at the start of data, or 0 if more data is
+// * needed to finish it. Returns -1 if the frame is too long to ever be accepted.
+// **************************************************************************************
+ssize_t frameLength(const char* data, size_t len) {
+  if (framing == FRAME_LINE) {
+    const char* newline = (const char*)memchr(data, '\n', std::min(len, (size_t)MAX_FRAME));
+    if (newline != nullptr) {
+      return newline - data + 1;
+    }
+    return len >= MAX_FRAME ? -1 : 0;
+  }
+
+  if (len < LENGTH_PREFIX) {
+    return 0;
+  }
+  uint32_t payload;
+  memcpy(&payload, data, LENGTH_PREFIX);
+  payload = ntohl(payload);
+  if (payload > MAX_FRAME) {
+    return -1;
+  }
+  return len >= LENGTH_PREFIX + payload ? LENGTH_PREFIX + payload : 0;
+}
+
+// **************************************************************************************
+// * processFrames()
+// * - Echoes every complete frame in data, batching them into as few sends as possible,
+// * and keeps an incomplete one at the end in the session's inbox for the next read.
+// * - Returns like processConnection().
+// **************************************************************************************
+int processFrames(Session& session, const char* data, size_t len) {
+  // a frame split over reads is put back together in the inbox, otherwise frames are
+  //  sent straight from the read buffer
+  bool buffered = !session.inbox.empty();
+  if (buffered) {
+    session.inbox.append(data, len);
+    data = session.inbox.data();
+    len = session.inbox.size();
+  }
+
+  struct iovec iov[MAX_BATCH];
+  int count = 0;
+  int frames = 0;
+  int quit = 0;
+  size_t used = 0;
+
+  while (used < len && !session.closing) {
+    ssize_t frame = frameLength(data + used, len - used);
+    if (frame < 0) {
+      WARNING << "Session " << session.connection.get_fd() << " sent a frame over " << MAX_FRAME << " bytes" << ENDL;
+      session.closing = true;
+      break;
+    }
+    if (frame == 0) {
+      break;
+    }
+
+    const char* payload = data + used + (framing == FRAME_LENGTH ? LENGTH_PREFIX : 0);
+    quit = checkCommands(session, payload, data + used + frame - payload);
+
+    iov[count].iov_base = (void*)(data + used);
+    iov[count].iov_len = frame;
+    used += frame;
+    frames++;
+    if (++count == MAX_BATCH) {
+      session.connection.queue(iov, count);
+      count = 0;
+    }
+  }
+  session.connection.queue(iov, count);
+  INFO << "Echoed " << frames << " frames" << ENDL;
+
+  // whatever is left is the start of the next frame, unless nothing more will be read
+  if (session.closing) {
+    session.inbox.clear();
+  }
+  else if (buffered) {
+    session.inbox.erase(0, used);
+  }
+  else {
+    session.inbox.assign(data + used, len - used);
+  }
+  return quit;
+}
 
 // **************************************************************************************
 // * processConnection()
-// * - Handles reading the line from the network and sending it back to the client.
-// * - Returns true if the client sends "QUIT" command, false if the client sends "CLOSE".
+// * - Handles one chunk of data from a session, queueing it to be sent back.
+// * - Returns 1 if the chunk starts with the "QUIT" command, 0 otherwise.
 // **************************************************************************************
-int processConnection(int sockFd) {
-  bool quitProgram = true;
-  bool keepGoing = true;
+int processConnection(Session& session) {
+  if (session.pipeFds[0] >= 0) {
+    return spliceConnection(session);
+  }
+
   char buffer[BUFFER_SIZE];
-  while (keepGoing) {
 
-    //
-    // Call read() call to get a buffer/line from the client.
-    // Hint - don't forget to zero out the buffer each time you use it.
-    // int bytesRead;
-    
-    bzero(buffer, BUFFER_SIZE);
-    int bytesRead = read(sockFd, buffer, BUFFER_SIZE);
+  // Call receive() to get a buffer/line from the client.
+  ssize_t bytesRead = session.connection.receive(buffer, BUFFER_SIZE);
+  if (bytesRead < 0) {
+    return 0;
+  }
 
-    std::string message = buffer;
-    INFO << "New chunk of data received with: " << message << ENDL;
+  // the client hung up or the connection failed, nothing more will be read
+  if (bytesRead == 0) {
+    DEBUG << "Session " << session.connection.get_fd() << " disconnected" << ENDL;
+    session.closing = true;
+    return 0;
+  }
+
+  if (framing != FRAME_CHUNK) {
+    return processFrames(session, buffer, bytesRead);
+  }
 
-    //
-    // Check for quit command
-    if (message.substr(0, 4) == "QUIT") {
-      DEBUG << "Chunk starts with QUIT command" << ENDL;
-      keepGoing = false;
-      quitProgram = true;
+  INFO << "New chunk of data received with: " << std::string(buffer, bytesRead) << ENDL;
+  session.connection.queue(buffer, bytesRead);
+  return checkCommands(session, buffer, bytesRead);
+}
+
+// **************************************************************************************
+// * serveSession()
+// * - Reads, echoes and flushes a session the event loop says is ready, ending it once it
+// * is done.
+// * - Returns 1 if the session sent QUIT, 0 otherwise.
+// **************************************************************************************
+int serveSession(int fd, uint32_t events) {
+  auto found = sessions.find(fd);
+  if (found == sessions.end()) {
+    return 0;
+  }
+  Session& session = found->second;
+
+  if ((events & EPOLLERR) && session.connection.has_pinned()) {
+    session.connection.reap_completions();
+  }
+
+  int quit = 0;
+  if ((events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && !session.closing) {
+    quit = processConnection(session);
+  }
+
+  if (!flushSession(session)) {
+    closeSession(fd);
+    return quit;
+  }
+  watch(session);
+  return quit;
+}
+
+// **************************************************************************************
+// * acceptSessions()
+// * - Accepts every connection waiting on the listener and adds it to the event loop.
+// * Each session runs handler when it is ready.
+// **************************************************************************************
+void acceptSessions(Reactor& reactor, const Listener& listener, std::function<void(int, uint32_t)> handler) {
+  while (true) {
+    int new_socket = listener.accept(true);
+    if (new_socket < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) {
+        continue;
+      }
+      if (errno != EAGAIN && errno != EWOULDBLOCK) {
+        ERROR << "Accept() failed: " << strerror(errno) << ENDL;
+      }
+      return;
+    }
+
+    DEBUG << "Connection accepted" << ENDL;
+
+    Session& session = sessions.try_emplace(new_socket, reactor, new_socket,
+                                            [handler, new_socket](uint32_t events) { handler(new_socket, events); })
+                           .first->second;
+
+    if (echo_mode == ECHO_SPLICE && !openPipe(session)) {
+      ERROR << "Could not create a pipe for session " << new_socket << ENDL;
+      closeSession(new_socket);
+      continue;
+    }
+
+    if (zerocopy_min_bytes > 0 && echo_mode == ECHO_COPY) {
+      session.connection.set_zerocopy(zerocopy_min_bytes);
+    }
+  }
+}
+
+// **************************************************************************************
+// * serveSessions()
+// * - Runs the event loop, echoing on every session at once until a session sends QUIT.
+// * - After QUIT no new connections are accepted, and the loop returns once the sessions
+// * already open have ended or DRAIN_SECONDS have passed.
+// **************************************************************************************
+int serveSessions(Listener& listener) {
+  Reactor reactor;
+  bool draining = false;
+
+  std::function<void(int, uint32_t)> handler = [&](int fd, uint32_t events) {
+    if (serveSession(fd, events) && !draining) {
+      // stop taking new sessions, the open ones finish first. The QUIT session is already
+      // gone unless it still has replies to flush
+      INFO << "QUIT received, draining " << sessions.size() - sessions.count(fd) << " other sessions" << ENDL;
+      draining = true;
+      reactor.remove(listener.get_fd());
+      listener.close();
+      reactor.after(std::chrono::seconds(DRAIN_SECONDS), [&]() {
+        WARNING << "Closing " << sessions.size() << " sessions still open after QUIT" << ENDL;
+        reactor.stop();
+      });
     }
 
-    //
-    // Check for close command
-    if (message.substr(0, 5) == "CLOSE") {
-      DEBUG << "Chunk starts with CLOSE command" << ENDL;
-      keepGoing = false;
-      quitProgram = false;
+    if (draining && sessions.empty()) {
+      reactor.stop();
     }
+  };
 
-    //
-    // Call write() to send line back to the client.
-    ssize_t bytes_sent = write(sockFd, buffer, strlen(buffer));
+  if (!reactor.add(listener.get_fd(), EPOLLIN, [&](uint32_t) { acceptSessions(reactor, listener, handler); })) {
+    FATAL << "Could not watch the listening socket" << ENDL;
+    return -1;
+  }
 
+  int status = reactor.run();
+  sessions.clear();
+  return status;
+}
+
+// **************************************************************************************
+// * bindDatagram()
+// * - Binds a UDP socket to port that shares it with the other UDP threads' sockets, the
+// * kernel spreads datagrams over them by their source address. The first one picks a
+// * random port if port is taken.
+// * - Returns false if it can't.
+// **************************************************************************************
+bool bindDatagram(Listener& socket, uint16_t port, bool random, bool gso) {
+  if (!socket.bind_udp(port, random, true)) {
+    return false;
   }
 
-  return quitProgram;
+  int on = 1;
+  int size = UDP_SOCKET_BUFFER;
+  setsockopt(socket.get_fd(), SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+  setsockopt(socket.get_fd(), SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+
+  // datagrams from one sender arrive coalesced, and go back out as one GSO send
+  if (gso && setsockopt(socket.get_fd(), SOL_UDP, UDP_GRO, &on, sizeof(on)) < 0) {
+    WARNING << "UDP GRO isn't supported, datagrams are received one at a time" << ENDL;
+  }
+  return true;
+}
+
+// **************************************************************************************
+// * echoDatagrams()
+// * - Echoes datagrams on one socket in batches, until one starts with "QUIT" or the
+// * socket is shut down. Run by every UDP thread.
+// **************************************************************************************
+void echoDatagrams(int fd, bool gso) {
+  std::vector<char> buffers(UDP_BATCH * UDP_BUFFER_SIZE);
+  struct mmsghdr msgs[UDP_BATCH];
+  struct iovec iov[UDP_BATCH];
+  struct sockaddr_storage addrs[UDP_BATCH];
+
+  // room for the GRO segment size received, and the GSO one sent back
+  alignas(struct cmsghdr) char controls[UDP_BATCH][CMSG_SPACE(sizeof(int))];
+
+  while (!quit_datagrams) {
+    for (int i = 0; i < UDP_BATCH; i++) {
+      iov[i].iov_base = buffers.data() + i * UDP_BUFFER_SIZE;
+      iov[i].iov_len = UDP_BUFFER_SIZE;
+      memset(&msgs[i].msg_hdr, 0, sizeof(msgs[i].msg_hdr));
+      msgs[i].msg_hdr.msg_iov = &iov[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+      msgs[i].msg_hdr.msg_name = &addrs[i];
+      msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+      if (gso) {
+        msgs[i].msg_hdr.msg_control = controls[i];
+        msgs[i].msg_hdr.msg_controllen = sizeof(controls[i]);
+      }
+    }
+
+    // sleeps for the first datagram, then takes whatever else is already queued
+    int received = recvmmsg(fd, msgs, UDP_BATCH, MSG_WAITFORONE, nullptr);
+    if (received < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      if (!quit_datagrams) {
+        ERROR << "Recvmmsg() failed: " << strerror(errno) << ENDL;
+      }
+      break;
+    }
+    if (received == 0 || quit_datagrams) {
+      break;
+    }
+
+    // each echo goes back where it came from, the same bytes in the same buffer
+    bool quit = false;
+    for (int i = 0; i < received; i++) {
+      struct msghdr& header = msgs[i].msg_hdr;
+      iov[i].iov_len = msgs[i].msg_len;
+
+      int segment = 0;
+      if (gso) {
+        for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&header); cmsg != nullptr; cmsg = CMSG_NXTHDR(&header, cmsg)) {
+          if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+            memcpy(&segment, CMSG_DATA(cmsg), sizeof(segment));
+          }
+        }
+      }
+
+      // a coalesced batch is split back into datagrams of the size they arrived in
+      if (segment > 0 && msgs[i].msg_len > (unsigned)segment) {
+        header.msg_control = controls[i];
+        header.msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&header);
+        cmsg->cmsg_level = SOL_UDP;
+        cmsg->cmsg_type = UDP_SEGMENT;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+        uint16_t size = segment;
+        memcpy(CMSG_DATA(cmsg), &size, sizeof(size));
+      }
+      else {
+        header.msg_control = nullptr;
+        header.msg_controllen = 0;
+      }
+
+      if (msgs[i].msg_len >= 4 && memcmp(iov[i].iov_base, "QUIT", 4) == 0) {
+        DEBUG << "Datagram starts with QUIT command" << ENDL;
+        quit = true;
+      }
+    }
+    INFO << "Echoing " << received << " datagrams" << ENDL;
+
+    int sent = 0;
+    while (sent < received) {
+      int count = sendmmsg(fd, msgs + sent, received - sent, 0);
+      if (count < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        // one unreachable sender doesn't lose the echo for the rest of the batch
+        DEBUG << "Sendmmsg() failed: " << strerror(errno) << ENDL;
+        count = 1;
+      }
+      sent += count;
+    }
+
+    if (quit) {
+      quit_datagrams = true;
+
+      // wake up the other threads, and serveDatagrams() if this isn't its thread
+      for (const Listener& socket : datagram_sockets) {
+        socket.shutdown();
+      }
+    }
+  }
+}
+
+// **************************************************************************************
+// * serveDatagrams()
+// * - Echoes UDP datagrams with threads sockets sharing one port, until one starts with
+// * "QUIT".
+// **************************************************************************************
+int serveDatagrams(int threads, bool gso) {
+  std::vector<Listener>& sockets = datagram_sockets;
+  sockets.resize(threads);
+
+  // the first socket picks the port like the TCP listener does, the others join it
+  if (!bindDatagram(sockets[0], DEFAULT_PORT, true, gso)) {
+    FATAL << "Could not bind a UDP socket" << ENDL;
+    return -1;
+  }
+  uint16_t port = sockets[0].get_port();
+
+  for (int i = 1; i < threads; i++) {
+    if (!bindDatagram(sockets[i], port, false, gso)) {
+      FATAL << "Could not share UDP port " << port << ENDL;
+      sockets.clear();
+      return -1;
+    }
+  }
+  std::cout << "Using UDP port: " << port << std::endl;
+
+  std::vector<std::thread> workers;
+  for (size_t i = 1; i < sockets.size(); i++) {
+    workers.emplace_back(echoDatagrams, sockets[i].get_fd(), gso);
+  }
+  echoDatagrams(sockets[0].get_fd(), gso);
+
+  // wake up the threads still waiting for datagrams
+  quit_datagrams = true;
+  for (const Listener& socket : sockets) {
+    socket.shutdown();
+  }
+  for (std::thread& worker : workers) {
+    worker.join();
+  }
+
+  sockets.clear();
+  return 0;
 }
 
 // **************************************************************************************
@@ -63,15 +633,22 @@ int processConnection(int sockFd) {
 
 int main (int argc, char *argv[]) {
 
-  // Obtain a pseudo random number to seed the dist generator
-  std::random_device rd;  
-  std::mt19937 eng(rd());
+  // every session holds a descriptor, allow as many as the hard limit does
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
 
   // ********************************************************************
   // * Process the command line arguments
   // ********************************************************************
   Argparser parser(argc, argv);
   parser.add_option('d', true, false, 1, 1);
+  parser.add_option('m', true, false, 1, 1);
+  parser.add_option('f', true, false, 1, 1);
+  parser.add_option('u', true, false, 2, 1);
+  parser.add_option('z', true, false, 1, 1);
   parser.parse();
   std::vector<int> arg_values = parser.get_values_int('d');
 
@@ -82,106 +659,77 @@ int main (int argc, char *argv[]) {
     LOG_LEVEL = arg_values.at(0);
   }
 
-  // *******************************************************************
-  // * Creating the inital socket is the same as in a client.
-  // ********************************************************************
-  int listenFd = -1;
-  // Call socket() to create the socket you will use for lisening.
-  if ((listenFd = socket(AF_INET, SOCK_STREAM, 0)) < 0 ) {
-    
-    FATAL << "Failed to create listening socket" << ENDL;
-    return -1;
+  // how data is echoed, defaults to copying through a buffer
+  std::vector<std::string> mode_values = parser.get_values_string('m');
+  if (mode_values.size() > 0) {
+    if (mode_values.at(0) == "splice") {
+      echo_mode = ECHO_SPLICE;
+    }
+    else if (mode_values.at(0) != "copy") {
+      FATAL << "Unknown echo mode " << mode_values.at(0) << ENDL;
+      return -1;
+    }
   }
 
-  DEBUG << "Calling Socket() assigned file descriptor " << listenFd << ENDL;
-  
-  // ********************************************************************
-  // * The bind() and calls take a structure that specifies the
-  // * address to be used for the connection. On the cient it contains
-  // * the address of the server to connect to. On the server it specifies
-  // * which IP address and port to lisen for connections.
-  // ********************************************************************
-  struct sockaddr_in servaddr;
-  memset(&servaddr, 0, sizeof(servaddr));
-
-  // *** assign 3 fields in the servadd struct sin_family, sin_addr.s_addr and sin_port
-  // *** the value your port can be any value > 1024.
-  servaddr.sin_family = AF_INET;  // IPv4
-  servaddr.sin_addr.s_addr = INADDR_ANY;  // listen to any address
-  servaddr.sin_port = htons(DEFAULT_PORT); // htons converts the int to network byte order
-  
-
-
-  // ********************************************************************
-  // * Binding configures the socket with the parameters we have
-  // * specified in the servaddr structure.  This step is implicit in
-  // * the connect() call, but must be explicitly listed for servers.
-  // ********************************************************************
-  bool bindSuccesful = false;
-
-  std::uniform_int_distribution<> distr(1025, 65535);
-  while (!bindSuccesful) {
-    // ** Call bind()
-    // You may have to call bind multiple times if another process is already using the port
-    // your program selects.
-    if (bind(listenFd, (struct sockaddr *)&servaddr, sizeof(servaddr)) < 0) {
-      DEBUG << "Bind failed" << ENDL;
-      servaddr.sin_port = htons(distr(eng));
+  // how messages are delimited, defaults to one per read
+  std::vector<std::string> framing_values = parser.get_values_string('f');
+  if (framing_values.size() > 0) {
+    if (framing_values.at(0) == "line") {
+      framing = FRAME_LINE;
     }
-    else {
-      bindSuccesful = true;
-      DEBUG << "Bind succesfull" << ENDL;
+    else if (framing_values.at(0) == "length") {
+      framing = FRAME_LENGTH;
+    }
+    else if (framing_values.at(0) != "chunk") {
+      FATAL << "Unknown framing " << framing_values.at(0) << ENDL;
+      return -1;
+    }
+
+    // frames are found by looking at the data, which splice mode never does
+    if (framing != FRAME_CHUNK && echo_mode == ECHO_SPLICE) {
+      FATAL << "Framing needs the copy echo mode" << ENDL;
+      return -1;
     }
   }
-  std::cout << "Using port: " << ntohs(servaddr.sin_port) << std::endl;
-  // *** DON'T FORGET TO PRINT OUT WHAT PORT YOUR SERVER PICKED SO YOU KNOW HOW TO CONNECT.
 
+  // send echo of at least the given KiB with MSG_ZEROCOPY
+  arg_values = parser.get_values_int('z');
+  if (arg_values.size() > 0) {
+    if (arg_values.at(0) <= 0) {
+      FATAL << "The zero copy threshold has to be at least 1 KiB" << ENDL;
+      return -1;
+    }
+    zerocopy_min_bytes = (size_t)arg_values.at(0) * 1024;
+  }
 
-  // ********************************************************************
-  // * Setting the socket to the listening state is the second step
-  // * needed to being accepting connections.  This creates a queue for
-  // * connections and starts the kernel listening for connections.
-  // ********************************************************************
-  int listenQueueLength = 1;
-  // ** Cal listen()
-  if (listen(listenFd, listenQueueLength) < 0) {
-        FATAL << "Listen() failed" << std::endl << ENDL;
-        close(listenFd);
-        return -1;
+  // echo datagrams instead of TCP sessions, with this many threads
+  std::vector<std::string> udp_values = parser.get_values_string('u');
+  if (udp_values.size() > 0) {
+    int threads = atoi(udp_values.at(0).c_str());
+    if (threads <= 0) {
+      FATAL << "Invalid UDP thread count " << udp_values.at(0) << ENDL;
+      return -1;
     }
+    bool gso = udp_values.size() > 1 && udp_values.at(1) == "gso";
+    return serveDatagrams(threads, gso);
+  }
 
   // ********************************************************************
-  // * The accept call will sleep, waiting for a connection.  When 
-  // * a connection request comes in the accept() call creates a NEW
-  // * socket with a new fd that will be used for the communication.
+  // * The listener binds DEFAULT_PORT, or a random port above 1024 if
+  // * another process is already using it, and starts listening.
   // ********************************************************************
-  bool quitProgram = false;
-  while (!quitProgram) {
-    int connFd = 0;
-
-    // Call the accept() call to check the listening queue for connection requests.
-    // If a client has already tried to connect accept() will complete the
-    // connection and return a file descriptor that you can read from and
-    // write to. If there is no connection waiting accept() will block and
-    // not return until there is a connection.
-    // ** call accept() 
-    int addrlen = sizeof(servaddr);
-    DEBUG << "Calling accept(" << listenFd << ", " << (struct sockaddr *)&servaddr << ", " << (socklen_t *)&addrlen << ENDL;
-    int new_socket = accept(listenFd, (struct sockaddr *)&servaddr, (socklen_t *)&addrlen);
-    if (new_socket < 0) {
-        FATAL << "Accept() failed" << ENDL;
-        close(listenFd);
-        return -1;
-    }
-
-    DEBUG << "Connection accepted" << ENDL;
-    
-    // Now we have a connection, so you can call processConnection() to do the work.
-    quitProgram = processConnection(new_socket);
-   
-    close(new_socket);
+  Listener listener;
+  if (!listener.listen_tcp(DEFAULT_PORT)) {
+    return -1;
   }
+  std::cout << "Using port: " << listener.get_port() << std::endl;
+  // *** DON'T FORGET TO PRINT OUT WHAT PORT YOUR SERVER PICKED SO YOU KNOW HOW TO CONNECT.
 
-  close(listenFd);
-
+  // ********************************************************************
+  // * Every session is served by one event loop: the listening socket and
+  // * all client sockets are non-blocking and the reactor says which are
+  // * ready.
+  // ********************************************************************
+  listener.set_nonblocking();
+  return serveSessions(listener);
 }
@@ -3,9 +3,34 @@
 // ********************************************************
 #include <filesystem>
 #include <cstring>
+#include <cerrno>
 #include <unistd.h>
 #include <arpa/inet.h>
-#include <random>
+#include <netinet/udp.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// older headers lack the UDP offload options
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
 
 #include "Argparser.h"
+#include "Connection.h"
+#include "Listener.h"
+#include "Reactor.h"
 #include "logging.h"
@@ -0,0 +1,307 @@
+/**
+ * @file Connection.cpp
+ * @author Cristian Madrazo
+ * @brief Implementations for Connection
+ * @version 1.0
+ *
+ */
+
+#include "Connection.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "logging.h"
+
+// Reads the zero copy completions queued on fd's error queue without waiting, calling
+// completed with the range of send ids each one covers. Sets copied if the kernel copied
+// any of them after all. Returns the number of sends completed
+uint32_t zerocopy_completions (int fd, std::function<void (uint32_t first, uint32_t last)> completed, bool* copied) {
+    uint32_t count = 0;
+
+    while (true) {
+        char control[CMSG_SPACE (sizeof (struct sock_extended_err) + sizeof (struct sockaddr_in6))];
+        struct msghdr msg;
+        memset (&msg, 0, sizeof (msg));
+        msg.msg_control    = control;
+        msg.msg_controllen = sizeof (control);
+        if (recvmsg (fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+            break;
+        }
+
+        for (struct cmsghdr* cmsg = CMSG_FIRSTHDR (&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR (&msg, cmsg)) {
+            if ((cmsg->cmsg_level != SOL_IP || cmsg->cmsg_type != IP_RECVERR) &&
+            (cmsg->cmsg_level != SOL_IPV6 || cmsg->cmsg_type != IPV6_RECVERR)) {
+                continue;
+            }
+            struct sock_extended_err err;
+            memcpy (&err, CMSG_DATA (cmsg), sizeof (err));
+            if (err.ee_origin != SO_EE_ORIGIN_ZEROCOPY || err.ee_errno != 0) {
+                continue;
+            }
+
+            // one notification covers the range of sends from ee_info to ee_data
+            count += err.ee_data - err.ee_info + 1;
+            if (copied != nullptr && (err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED)) {
+                *copied = true;
+            }
+            if (completed) {
+                completed (err.ee_info, err.ee_data);
+            }
+        }
+    }
+
+    return count;
+}
+
+// Constructor, takes over fd, makes it non-blocking and has handler called whenever it is
+// readable
+Connection::Connection (Reactor& reactor, int fd, Reactor::Handler handler)
+: reactor (reactor), fd (fd) {
+    sent         = 0;
+    zerocopy_min = 0;
+    next_id      = 0;
+    events       = EPOLLIN;
+
+    fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+    if (!reactor.add (fd, events, std::move (handler))) {
+        ERROR << "Could not watch connection " << fd << ENDL;
+    }
+}
+
+// Destructor, stops watching the socket and closes it
+Connection::~Connection () {
+    DEBUG << "Closing connection " << fd << ENDL;
+    reactor.remove (fd);
+    close (fd);
+}
+
+// Reads up to len bytes. Returns the bytes read, 0 if the peer hung up or the read failed,
+// or -1 if nothing is waiting
+ssize_t Connection::receive (char* buf, size_t len) {
+    while (true) {
+        ssize_t bytes_read = read (fd, buf, len);
+        if (bytes_read >= 0) {
+            return bytes_read;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return -1;
+        }
+        DEBUG << "Read from connection " << fd << " failed" << ENDL;
+        return 0;
+    }
+}
+
+// Queues data to be sent behind whatever is already queued
+void Connection::queue (const char* data, size_t len) {
+    pending.append (data, len);
+}
+
+// Queues buffers to be sent, with one gathered sendmsg() straight from them if nothing is
+// queued already. Modifies iov as it goes
+void Connection::queue (struct iovec* iov, int count) {
+    int first = 0;
+    bool idle = sent == pending.size () && (pinned.empty () || pinned.back ().sent == pinned.back ().data.size ());
+    while (first < count && idle) {
+        struct msghdr msg;
+        memset (&msg, 0, sizeof (msg));
+        msg.msg_iov    = iov + first;
+        msg.msg_iovlen = count - first;
+
+        ssize_t bytes_sent = sendmsg (fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (bytes_sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            // queued, flush() sees the error again if it wasn't EAGAIN
+            break;
+        }
+
+        // skip what went out, the rest of a partly sent buffer is queued below
+        while (first < count && (size_t)bytes_sent >= iov[first].iov_len) {
+            bytes_sent -= iov[first].iov_len;
+            first++;
+        }
+        if (first < count) {
+            iov[first].iov_base = (char*)iov[first].iov_base + bytes_sent;
+            iov[first].iov_len -= bytes_sent;
+            break;
+        }
+    }
+
+    for (; first < count; first++) {
+        pending.append ((const char*)iov[first].iov_base, iov[first].iov_len);
+    }
+}
+
+// sends as much of the zero copy buffer being sent as the socket takes, 1 if it was all
+// sent, 0 if the socket is full and -1 if the send failed
+int Connection::send_pinned () {
+    Pinned& buffer = pinned.back ();
+    while (buffer.sent < buffer.data.size ()) {
+        ssize_t bytes_sent = send (fd, buffer.data.data () + buffer.sent, buffer.data.size () - buffer.sent,
+        MSG_NOSIGNAL | MSG_ZEROCOPY);
+
+        // out of memory to track pinned pages, this part is copied the usual way
+        if (bytes_sent < 0 && errno == ENOBUFS) {
+            bytes_sent = send (fd, buffer.data.data () + buffer.sent, buffer.data.size () - buffer.sent, MSG_NOSIGNAL);
+        } else if (bytes_sent >= 0) {
+            if (buffer.sends == 0) {
+                buffer.first = next_id;
+            }
+            buffer.sends++;
+            next_id++;
+        }
+
+        if (bytes_sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return 0;
+            }
+            DEBUG << "Zero copy write to connection " << fd << " failed" << ENDL;
+            return -1;
+        }
+        buffer.sent += bytes_sent;
+    }
+    return 1;
+}
+
+// Sends as much queued output as the socket takes, output of at least set_zerocopy() bytes
+// with MSG_ZEROCOPY. Returns false if sending failed
+bool Connection::flush () {
+    // zero copy output already underway goes out before anything queued behind it
+    if (!pinned.empty ()) {
+        int status = send_pinned ();
+        if (status <= 0) {
+            return status == 0;
+        }
+    }
+
+    // big enough output is handed to the kernel as is, and kept until it is done with it
+    if (zerocopy_min > 0 && pending.size () - sent >= zerocopy_min) {
+        pinned.emplace_back ();
+        pinned.back ().data = std::move (pending);
+        pinned.back ().sent = sent;
+        pending.clear ();
+        sent = 0;
+
+        int status = send_pinned ();
+        if (status <= 0) {
+            return status == 0;
+        }
+    }
+
+    while (sent < pending.size ()) {
+        ssize_t bytes_sent = send (fd, pending.data () + sent, pending.size () - sent, MSG_NOSIGNAL);
+        if (bytes_sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                return true;
+            }
+            DEBUG << "Write to connection " << fd << " failed" << ENDL;
+            return false;
+        }
+        sent += bytes_sent;
+    }
+
+    pending.clear ();
+    sent = 0;
+    return true;
+}
+
+// Watches for reading if reading is set, and for writing while output is queued or more is
+// set, for output the caller queues elsewhere
+void Connection::update (bool reading, bool more) {
+    uint32_t wanted = 0;
+    if (reading) {
+        wanted |= EPOLLIN;
+    }
+    if (more || unsent () > 0) {
+        wanted |= EPOLLOUT;
+    }
+    if (wanted != events && reactor.modify (fd, wanted)) {
+        events = wanted;
+    }
+}
+
+// Sends queued output of at least min_bytes with MSG_ZEROCOPY. Returns false if the socket
+// can't, and output is then always copied
+bool Connection::set_zerocopy (size_t min_bytes) {
+    int on = 1;
+    if (setsockopt (fd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof (on)) < 0) {
+        return false;
+    }
+    zerocopy_min = min_bytes;
+    return true;
+}
+
+// Frees zero copy output the kernel reports it is done with, call on EPOLLERR
+void Connection::reap_completions () {
+    // credit every buffer the sends in each completed range were made from
+    zerocopy_completions (fd, [this] (uint32_t low_id, uint32_t high_id) {
+        for (Pinned& buffer : pinned) {
+            if (buffer.sends == 0) {
+                continue;
+            }
+            uint32_t low  = std::max (low_id, buffer.first);
+            uint32_t high = std::min (high_id, buffer.first + buffer.sends - 1);
+            if (low <= high) {
+                buffer.completed += high - low + 1;
+            }
+        }
+    });
+
+    while (!pinned.empty ()) {
+        const Pinned& buffer = pinned.front ();
+        if (buffer.sent < buffer.data.size () || buffer.completed < buffer.sends) {
+            break;
+        }
+        pinned.pop_front ();
+    }
+}
+
+// bytes queued but not sent yet
+size_t Connection::unsent () const {
+    size_t queued = pending.size () - sent;
+    for (const Pinned& buffer : pinned) {
+        queued += buffer.data.size () - buffer.sent;
+    }
+    return queued;
+}
+
+// bytes of memory held for output, including sent zero copy output not completed yet
+size_t Connection::held () const {
+    size_t bytes = pending.size () - sent;
+    for (const Pinned& buffer : pinned) {
+        bytes += buffer.data.size ();
+    }
+    return bytes;
+}
+
+// true once everything queued is sent and the kernel is done with it
+bool Connection::idle () const {
+    return sent == pending.size () && pinned.empty ();
+}
+
+// true while zero copy output waits for completions
+bool Connection::has_pinned () const {
+    return !pinned.empty ();
+}
+
+// socket descriptor
+int Connection::get_fd () const {
+    return fd;
+}
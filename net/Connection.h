@@ -0,0 +1,115 @@
+/**
+ * @file Connection.h
+ * @author Cristian Madrazo
+ * @brief Non-blocking stream socket served by a Reactor, with a queue for output the
+ * socket hasn't taken yet
+ * @version 1.0
+ *
+ */
+
+#ifndef CONNECTION_H
+#define CONNECTION_H
+
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <string>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "Reactor.h"
+
+// Reads the zero copy completions queued on fd's error queue without waiting, calling
+//  completed with the range of send ids each one covers. Sets copied if the kernel copied
+//  any of them after all. Returns the number of sends completed
+uint32_t zerocopy_completions (int fd, std::function<void (uint32_t first, uint32_t last)> completed,
+bool* copied = nullptr);
+
+class Connection {
+    private:
+    // output sent with MSG_ZEROCOPY, the kernel reads it from here until it reports every
+    //  send made from it as completed
+    struct Pinned {
+        std::string data;
+        size_t sent = 0;
+
+        // ids of the zero copy sends made from it, first to first + sends - 1
+        uint32_t first     = 0;
+        uint32_t sends     = 0;
+        uint32_t completed = 0;
+    };
+
+    Reactor& reactor;
+    int fd;
+
+    // output the socket hasn't taken yet, from sent onwards
+    std::string pending;
+    size_t sent;
+
+    // zero copy output, oldest first, only the last may still be sending. next_id is the id
+    //  the kernel gives the next zero copy send
+    size_t zerocopy_min;
+    std::deque<Pinned> pinned;
+    uint32_t next_id;
+
+    // events it is watched for
+    uint32_t events;
+
+    // sends as much of the zero copy buffer being sent as the socket takes, 1 if it was all
+    //  sent, 0 if the socket is full and -1 if the send failed
+    int send_pinned ();
+
+    public:
+    // Constructor, takes over fd, makes it non-blocking and has handler called whenever it
+    //  is readable
+    Connection (Reactor& reactor, int fd, Reactor::Handler handler);
+
+    // Destructor, stops watching the socket and closes it
+    ~Connection ();
+
+    Connection (const Connection&)            = delete;
+    Connection& operator= (const Connection&) = delete;
+
+    // Reads up to len bytes. Returns the bytes read, 0 if the peer hung up or the read
+    //  failed, or -1 if nothing is waiting
+    ssize_t receive (char* buf, size_t len);
+
+    // Queues data to be sent behind whatever is already queued
+    void queue (const char* data, size_t len);
+
+    // Queues buffers to be sent, with one gathered sendmsg() straight from them if nothing
+    //  is queued already. Modifies iov as it goes
+    void queue (struct iovec* iov, int count);
+
+    // Sends as much queued output as the socket takes, output of at least set_zerocopy()
+    //  bytes with MSG_ZEROCOPY. Returns false if sending failed
+    bool flush ();
+
+    // Watches for reading if reading is set, and for writing while output is queued or more
+    //  is set, for output the caller queues elsewhere
+    void update (bool reading, bool more = false);
+
+    // Sends queued output of at least min_bytes with MSG_ZEROCOPY. Returns false if the
+    //  socket can't, and output is then always copied
+    bool set_zerocopy (size_t min_bytes);
+
+    // Frees zero copy output the kernel reports it is done with, call on EPOLLERR
+    void reap_completions ();
+
+    // bytes queued but not sent yet
+    size_t unsent () const;
+
+    // bytes of memory held for output, including sent zero copy output not completed yet
+    size_t held () const;
+
+    // true once everything queued is sent and the kernel is done with it
+    bool idle () const;
+
+    // true while zero copy output waits for completions
+    bool has_pinned () const;
+
+    // socket descriptor
+    int get_fd () const;
+};
+
+#endif
@@ -0,0 +1,79 @@
+/**
+ * @file Framepool.cpp
+ * @author Cristian Madrazo
+ * @brief Implementations for Framepool
+ * @version 1.0
+ *
+ */
+
+#include "Framepool.h"
+
+#include <new>
+
+// Constructor
+Framepool::Framepool () {
+    for (Block*& list : free_lists) {
+        list = nullptr;
+    }
+    created = 0;
+    reused  = 0;
+}
+
+// Destructor, gives every free frame back to the heap
+Framepool::~Framepool () {
+    for (Block*& list : free_lists) {
+        while (list != nullptr) {
+            Block* next = list->next;
+            ::operator delete (list);
+            list = next;
+        }
+    }
+}
+
+// Returns memory for a frame of bytes, reusing a freed frame of the same size if any
+void* Framepool::allocate (size_t bytes) {
+    if (bytes == 0 || bytes > FRAMEPOOL_MAX_BYTES) {
+        return ::operator new (bytes);
+    }
+
+    size_t index = (bytes - 1) / FRAMEPOOL_GRAIN;
+    if (free_lists[index] != nullptr) {
+        Block* block       = free_lists[index];
+        free_lists[index] = block->next;
+        reused++;
+        return block;
+    }
+
+    created++;
+    return ::operator new ((index + 1) * FRAMEPOOL_GRAIN);
+}
+
+// Keeps a frame of bytes for the next allocate() of that size
+void Framepool::release (void* frame, size_t bytes) {
+    if (bytes == 0 || bytes > FRAMEPOOL_MAX_BYTES) {
+        ::operator delete (frame);
+        return;
+    }
+
+    // a frame freed on another thread than it was made on just moves to this thread's pool
+    size_t index       = (bytes - 1) / FRAMEPOOL_GRAIN;
+    Block* block       = (Block*)frame;
+    block->next        = free_lists[index];
+    free_lists[index] = block;
+}
+
+// frames taken from the heap so far
+size_t Framepool::get_created () const {
+    return created;
+}
+
+// allocations served without going to the heap so far
+size_t Framepool::get_reused () const {
+    return reused;
+}
+
+// the calling thread's pool, each worker thread gets its own so nothing is locked
+Framepool& Framepool::local () {
+    thread_local Framepool pool;
+    return pool;
+}
@@ -0,0 +1,59 @@
+/**
+ * @file Framepool.h
+ * @author Cristian Madrazo
+ * @brief Per thread free lists that coroutine frames are allocated from
+ * @version 1.0
+ *
+ */
+
+#ifndef FRAMEPOOL_H
+#define FRAMEPOOL_H
+
+#include <cstddef>
+
+// frames are rounded up to a multiple of this many bytes, each size has its own free list
+#define FRAMEPOOL_GRAIN 64
+
+// frames bigger than this come straight from the heap
+#define FRAMEPOOL_MAX_BYTES (8 * 1024)
+
+class Framepool {
+    private:
+    // a free frame, linked through its own first bytes
+    struct Block {
+        Block* next;
+    };
+
+    Block* free_lists[FRAMEPOOL_MAX_BYTES / FRAMEPOOL_GRAIN];
+
+    // frames taken from the heap, and allocations served from a free list instead
+    size_t created;
+    size_t reused;
+
+    public:
+    // Constructor
+    Framepool ();
+
+    // Destructor, gives every free frame back to the heap
+    ~Framepool ();
+
+    Framepool (const Framepool&)            = delete;
+    Framepool& operator= (const Framepool&) = delete;
+
+    // Returns memory for a frame of bytes, reusing a freed frame of the same size if any
+    void* allocate (size_t bytes);
+
+    // Keeps a frame of bytes for the next allocate() of that size
+    void release (void* frame, size_t bytes);
+
+    // frames taken from the heap so far
+    size_t get_created () const;
+
+    // allocations served without going to the heap so far
+    size_t get_reused () const;
+
+    // the calling thread's pool, each worker thread gets its own so nothing is locked
+    static Framepool& local ();
+};
+
+#endif
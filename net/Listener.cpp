@@ -0,0 +1,194 @@
+/**
+ * @file Listener.cpp
+ * @author Cristian Madrazo
+ * @brief Implementations for Listener
+ * @version 1.0
+ *
+ */
+
+#include "Listener.h"
+
+#include <arpa/inet.h>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <random>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "logging.h"
+
+// Constructor, nothing is open until one of the listen or bind calls succeeds
+Listener::Listener () {
+    fd   = -1;
+    port = 0;
+}
+
+// Destructor, closes the socket
+Listener::~Listener () {
+    close ();
+}
+
+// Move constructor, other is left closed
+Listener::Listener (Listener&& other) {
+    fd         = other.fd;
+    port       = other.port;
+    path       = std::move (other.path);
+    other.fd   = -1;
+    other.port = 0;
+    other.path.clear ();
+}
+
+// binds fd to port on any address, or to a random port if it is taken and random is set
+bool Listener::bind_port (uint16_t wanted, bool random) {
+    struct sockaddr_in servaddr;
+    memset (&servaddr, 0, sizeof (servaddr));
+    servaddr.sin_family      = AF_INET;
+    servaddr.sin_addr.s_addr = INADDR_ANY;
+    servaddr.sin_port        = htons (wanted);
+
+    // You may have to call bind multiple times if another process is already using the
+    // port
+    std::random_device rd;
+    std::mt19937 eng (rd ());
+    std::uniform_int_distribution<> distr (LISTENER_MIN_PORT, 65535);
+    while (::bind (fd, (struct sockaddr*)&servaddr, sizeof (servaddr)) < 0) {
+        if (!random || (errno != EADDRINUSE && errno != EACCES)) {
+            return false;
+        }
+        DEBUG << "Bind failed" << ENDL;
+        servaddr.sin_port = htons (distr (eng));
+    }
+
+    DEBUG << "Bind succesfull" << ENDL;
+    port = ntohs (servaddr.sin_port);
+    return true;
+}
+
+// Listens for TCP connections on any address at port, or at a random port if it is taken
+// and random is set. Returns false if it can't
+bool Listener::listen_tcp (uint16_t wanted, bool random) {
+    close ();
+
+    if ((fd = socket (AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        FATAL << "Failed to create listening socket" << ENDL;
+        return false;
+    }
+    DEBUG << "Calling Socket() assigned file descriptor " << fd << ENDL;
+
+    if (!bind_port (wanted, random) || ::listen (fd, SOMAXCONN) < 0) {
+        FATAL << "Could not listen on port " << wanted << ": " << strerror (errno) << ENDL;
+        close ();
+        return false;
+    }
+    return true;
+}
+
+// Listens for connections on a unix socket at path, replacing a socket file a previous run
+// left behind. Returns false if it can't
+bool Listener::listen_unix (const std::string& socket_path) {
+    close ();
+
+    struct sockaddr_un addr;
+    memset (&addr, 0, sizeof (addr));
+    addr.sun_family = AF_UNIX;
+    if (socket_path.size () >= sizeof (addr.sun_path)) {
+        FATAL << "Unix socket path " << socket_path << " is too long" << ENDL;
+        return false;
+    }
+    memcpy (addr.sun_path, socket_path.c_str (), socket_path.size ());
+
+    // only ever remove sockets, never a file that happens to have the name
+    struct stat info;
+    if (lstat (socket_path.c_str (), &info) == 0 && S_ISSOCK (info.st_mode)) {
+        unlink (socket_path.c_str ());
+    }
+
+    if ((fd = socket (AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) < 0) {
+        FATAL << "Failed to create unix socket" << ENDL;
+        return false;
+    }
+    if (::bind (fd, (struct sockaddr*)&addr, sizeof (addr)) < 0 || ::listen (fd, SOMAXCONN) < 0) {
+        FATAL << "Could not listen at " << socket_path << ": " << strerror (errno) << ENDL;
+        close ();
+        return false;
+    }
+
+    path = socket_path;
+    return true;
+}
+
+// Binds a UDP socket like listen_tcp(), with share_port every socket bound with it on the
+// same port gets a share of the datagrams. Returns false if it can't
+bool Listener::bind_udp (uint16_t wanted, bool random, bool share_port) {
+    close ();
+
+    if ((fd = socket (AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0)) < 0) {
+        FATAL << "Failed to create UDP socket" << ENDL;
+        return false;
+    }
+
+    int on = 1;
+    if (share_port) {
+        setsockopt (fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof (on));
+    }
+
+    if (!bind_port (wanted, random)) {
+        close ();
+        return false;
+    }
+    return true;
+}
+
+// Makes accept() return -1 instead of waiting when no connection is queued
+void Listener::set_nonblocking () const {
+    fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+}
+
+// Accepts a queued connection, non-blocking if asked. Returns -1 if there is none or
+// accept() failed, errno says which
+int Listener::accept (bool nonblocking) const {
+    DEBUG << "Calling accept(" << fd << ")" << ENDL;
+    return accept4 (fd, nullptr, nullptr, SOCK_CLOEXEC | (nonblocking ? SOCK_NONBLOCK : 0));
+}
+
+// Wakes up everything waiting on the socket, accept() fails from then on
+void Listener::shutdown () const {
+    if (fd >= 0) {
+        ::shutdown (fd, SHUT_RDWR);
+    }
+}
+
+// Closes the socket and removes a unix socket's file
+void Listener::close () {
+    if (fd >= 0) {
+        ::close (fd);
+    }
+    if (!path.empty ()) {
+        unlink (path.c_str ());
+    }
+    fd   = -1;
+    port = 0;
+    path.clear ();
+}
+
+// descriptor, -1 if not open
+int Listener::get_fd () const {
+    return fd;
+}
+
+// port it is bound to, 0 for a unix socket
+uint16_t Listener::get_port () const {
+    return port;
+}
+
+// socket file of a unix socket, empty otherwise
+const std::string& Listener::get_path () const {
+    return path;
+}
+
+// true for a unix socket
+bool Listener::is_unix () const {
+    return !path.empty ();
+}
@@ -0,0 +1,83 @@
+/**
+ * @file Listener.h
+ * @author Cristian Madrazo
+ * @brief Sockets the servers accept connections or receive datagrams on
+ * @version 1.0
+ *
+ */
+
+#ifndef LISTENER_H
+#define LISTENER_H
+
+#include <cstdint>
+#include <string>
+#include <sys/socket.h>
+
+// lowest port picked when the one asked for is taken
+#define LISTENER_MIN_PORT 1025
+
+class Listener {
+    private:
+    int fd;
+
+    // port it is bound to, 0 for a unix socket
+    uint16_t port;
+
+    // socket file of a unix socket, removed on close()
+    std::string path;
+
+    // binds fd to port on any address, or to a random port if it is taken and random is set
+    bool bind_port (uint16_t wanted, bool random);
+
+    public:
+    // Constructor, nothing is open until one of the listen or bind calls succeeds
+    Listener ();
+
+    // Destructor, closes the socket
+    ~Listener ();
+
+    Listener (const Listener&)            = delete;
+    Listener& operator= (const Listener&) = delete;
+
+    // Move constructor, other is left closed
+    Listener (Listener&& other);
+
+    // Listens for TCP connections on any address at port, or at a random port if it is
+    // taken and random is set. Returns false if it can't
+    bool listen_tcp (uint16_t port, bool random = true);
+
+    // Listens for connections on a unix socket at path, replacing a socket file a previous
+    // run left behind. Returns false if it can't
+    bool listen_unix (const std::string& path);
+
+    // Binds a UDP socket like listen_tcp(), with share_port every socket bound with it on
+    // the same port gets a share of the datagrams. Returns false if it can't
+    bool bind_udp (uint16_t port, bool random, bool share_port);
+
+    // Makes accept() return -1 instead of waiting when no connection is queued
+    void set_nonblocking () const;
+
+    // Accepts a queued connection, non-blocking if asked. Returns -1 if there is none or
+    // accept() failed, errno says which
+    int accept (bool nonblocking = false) const;
+
+    // Wakes up everything waiting on the socket, accept() fails from then on
+    void shutdown () const;
+
+    // Closes the socket and removes a unix socket's file
+    void close ();
+
+    // descriptor, -1 if not open
+    int get_fd () const;
+
+    // port it is bound to, 0 for a unix socket
+    uint16_t get_port () const;
+
+    // socket file of a unix socket, empty otherwise
+    const std::string& get_path () const;
+
+    // true for a unix socket
+    bool is_unix () const;
+};
+
+#endif
@@ -0,0 +1,215 @@
+/**
+ * @file Reactor.cpp
+ * @author Cristian Madrazo
+ * @brief Implementations for Reactor
+ * @version 1.0
+ *
+ */
+
+#include "Reactor.h"
+
+#include <cerrno>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "logging.h"
+
+// Constructor
+Reactor::Reactor () {
+    epollFd    = epoll_create1 (EPOLL_CLOEXEC);
+    wakeFd     = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+    next_timer = 1;
+    stopping   = false;
+
+    // the wake up descriptor is told apart from watches by a null pointer
+    struct epoll_event event;
+    event.events   = EPOLLIN;
+    event.data.ptr = nullptr;
+    if (epollFd < 0 || wakeFd < 0 || epoll_ctl (epollFd, EPOLL_CTL_ADD, wakeFd, &event) < 0) {
+        FATAL << "Could not set up the event loop" << ENDL;
+    }
+}
+
+// Destructor, stops watching every descriptor but closes none
+Reactor::~Reactor () {
+    for (auto& watch : watches) {
+        delete watch.second;
+    }
+    for (Watch* watch : retired) {
+        delete watch;
+    }
+    if (wakeFd >= 0) {
+        close (wakeFd);
+    }
+    if (epollFd >= 0) {
+        close (epollFd);
+    }
+}
+
+// Starts calling handler whenever fd is ready for events, which may include EPOLLET or
+// EPOLLEXCLUSIVE. Returns false if fd can't be watched
+bool Reactor::add (int fd, uint32_t events, Handler handler) {
+    if (watches.count (fd)) {
+        return false;
+    }
+
+    Watch* watch = new Watch{fd, std::move (handler), true};
+    struct epoll_event event;
+    event.events   = events;
+    event.data.ptr = watch;
+    if (epoll_ctl (epollFd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        delete watch;
+        return false;
+    }
+
+    watches[fd] = watch;
+    return true;
+}
+
+// Changes the events fd is watched for
+bool Reactor::modify (int fd, uint32_t events) {
+    auto found = watches.find (fd);
+    if (found == watches.end ()) {
+        return false;
+    }
+
+    struct epoll_event event;
+    event.events   = events;
+    event.data.ptr = found->second;
+    return epoll_ctl (epollFd, EPOLL_CTL_MOD, fd, &event) == 0;
+}
+
+// Stops watching fd, its handler isn't called again even for events already fetched. Safe
+// to call from a handler, including fd's own
+void Reactor::remove (int fd) {
+    auto found = watches.find (fd);
+    if (found == watches.end ()) {
+        return;
+    }
+
+    epoll_ctl (epollFd, EPOLL_CTL_DEL, fd, nullptr);
+    found->second->live = false;
+    retired.push_back (found->second);
+    watches.erase (found);
+}
+
+// Calls callback once after delay, returns an id for cancel()
+uint64_t Reactor::after (std::chrono::milliseconds delay, std::function<void ()> callback) {
+    uint64_t id                                 = next_timer++;
+    std::chrono::steady_clock::time_point when = std::chrono::steady_clock::now () + delay;
+    timers[{when, id}]                         = std::move (callback);
+    timer_due[id]                              = when;
+    return id;
+}
+
+// Cancels a timer that hasn't run yet
+void Reactor::cancel (uint64_t timer) {
+    auto found = timer_due.find (timer);
+    if (found == timer_due.end ()) {
+        return;
+    }
+    timers.erase ({found->second, timer});
+    timer_due.erase (found);
+}
+
+// runs the timers that are due, returns milliseconds until the next one or -1
+int Reactor::run_timers () {
+    while (!timers.empty () && !stopping) {
+        auto first = timers.begin ();
+        auto now   = std::chrono::steady_clock::now ();
+        if (first->first.first > now) {
+            // round up so the wait never ends just before the timer is due
+            auto wait = std::chrono::duration_cast<std::chrono::milliseconds> (first->first.first - now);
+            return wait.count () + 1;
+        }
+
+        std::function<void ()> callback = std::move (first->second);
+        timer_due.erase (first->first.second);
+        timers.erase (first);
+        callback ();
+    }
+    return -1;
+}
+
+// Runs handlers and timers until stop() is called. Returns -1 if waiting failed
+int Reactor::run () {
+    struct epoll_event events[REACTOR_EVENTS];
+
+    while (!stopping) {
+        int timeout = run_timers ();
+        if (stopping) {
+            break;
+        }
+
+        int ready = epoll_wait (epollFd, events, REACTOR_EVENTS, timeout);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            FATAL << "Epoll_wait() failed" << ENDL;
+            return -1;
+        }
+
+        for (int i = 0; i < ready && !stopping; i++) {
+            Watch* watch = (Watch*)events[i].data.ptr;
+            if (watch == nullptr) {
+                uint64_t count;
+                while (read (wakeFd, &count, sizeof (count)) > 0) {
+                }
+                run_posted ();
+                continue;
+            }
+            if (watch->live) {
+                watch->handler (events[i].events);
+            }
+        }
+
+        for (Watch* watch : retired) {
+            delete watch;
+        }
+        retired.clear ();
+    }
+
+    // whoever posted before stop() is still answered, a coroutine waiting on it included
+    run_posted ();
+    return 0;
+}
+
+// Makes run() return once the handlers already running are done, from any thread
+void Reactor::stop () {
+    stopping       = true;
+    uint64_t count = 1;
+    if (write (wakeFd, &count, sizeof (count)) < 0) {
+        DEBUG << "Event loop already has a wake up pending" << ENDL;
+    }
+}
+
+// Calls callback on the loop's thread as soon as it is free, from any thread
+void Reactor::post (std::function<void ()> callback) {
+    {
+        std::lock_guard<std::mutex> guard (posted_lock);
+        posted.push_back (std::move (callback));
+    }
+    uint64_t count = 1;
+    if (write (wakeFd, &count, sizeof (count)) < 0) {
+        DEBUG << "Event loop already has a wake up pending" << ENDL;
+    }
+}
+
+// Runs every callback posted so far on the calling thread. run() does this itself, also when
+// it returns, call it once run() has returned for callbacks posted since
+void Reactor::run_posted () {
+    std::vector<std::function<void ()>> ready;
+    {
+        std::lock_guard<std::mutex> guard (posted_lock);
+        ready.swap (posted);
+    }
+    for (std::function<void ()>& callback : ready) {
+        callback ();
+    }
+}
+
+// number of watched descriptors
+size_t Reactor::size () const {
+    return watches.size ();
+}
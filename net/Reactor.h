@@ -0,0 +1,106 @@
+/**
+ * @file Reactor.h
+ * @author Cristian Madrazo
+ * @brief Event loop that runs a handler whenever a watched descriptor is ready, and timers
+ * @version 1.0
+ *
+ */
+
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <sys/epoll.h>
+#include <unordered_map>
+#include <vector>
+
+// events handled per epoll_wait() call
+#define REACTOR_EVENTS 256
+
+class Reactor {
+    public:
+    // called with the epoll events a descriptor is ready for
+    using Handler = std::function<void (uint32_t events)>;
+
+    private:
+    // a watched descriptor, freed only once the events already fetched for it are handled
+    struct Watch {
+        int fd;
+        Handler handler;
+        bool live;
+    };
+
+    int epollFd;
+
+    // eventfd stop() and post() write to, so a loop waiting in another thread wakes up
+    int wakeFd;
+
+    // callbacks other threads posted, run by the loop's thread once it wakes up
+    std::mutex posted_lock;
+    std::vector<std::function<void ()>> posted;
+
+    std::unordered_map<int, Watch*> watches;
+
+    // watches removed while handling events, freed once the batch is done
+    std::vector<Watch*> retired;
+
+    // timers in the order they are due, and when each is due by id for cancel()
+    std::map<std::pair<std::chrono::steady_clock::time_point, uint64_t>, std::function<void ()>> timers;
+    std::unordered_map<uint64_t, std::chrono::steady_clock::time_point> timer_due;
+    uint64_t next_timer;
+
+    std::atomic<bool> stopping;
+
+    // runs the timers that are due, returns milliseconds until the next one or -1
+    int run_timers ();
+
+    public:
+    // Constructor
+    Reactor ();
+
+    // Destructor, stops watching every descriptor but closes none
+    ~Reactor ();
+
+    Reactor (const Reactor&)            = delete;
+    Reactor& operator= (const Reactor&) = delete;
+
+    // Starts calling handler whenever fd is ready for events, which may include EPOLLET or
+    // EPOLLEXCLUSIVE. Returns false if fd can't be watched
+    bool add (int fd, uint32_t events, Handler handler);
+
+    // Changes the events fd is watched for
+    bool modify (int fd, uint32_t events);
+
+    // Stops watching fd, its handler isn't called again even for events already fetched.
+    // Safe to call from a handler, including fd's own
+    void remove (int fd);
+
+    // Calls callback once after delay, returns an id for cancel()
+    uint64_t after (std::chrono::milliseconds delay, std::function<void ()> callback);
+
+    // Cancels a timer that hasn't run yet
+    void cancel (uint64_t timer);
+
+    // Runs handlers and timers until stop() is called. Returns -1 if waiting failed
+    int run ();
+
+    // Makes run() return once the handlers already running are done, from any thread
+    void stop ();
+
+    // Calls callback on the loop's thread as soon as it is free, from any thread
+    void post (std::function<void ()> callback);
+
+    // Runs every callback posted so far on the calling thread. run() does this itself, also
+    // when it returns, call it once run() has returned for callbacks posted since
+    void run_posted ();
+
+    // number of watched descriptors
+    size_t size () const;
+};
+
+#endif
@@ -0,0 +1,78 @@
+/**
+ * @file Ring.h
+ * @author Cristian Madrazo
+ * @brief Bounded lock-free queue between one producer thread and one consumer thread
+ * @version 1.0
+ *
+ */
+
+#ifndef RING_H
+#define RING_H
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+// keeps the producer's and the consumer's index on cache lines of their own
+#define RING_LINE 64
+
+template <typename T> class Ring {
+    private:
+    std::vector<T> slots;
+    size_t mask;
+
+    // next slot to pop, only the consumer moves it
+    alignas (RING_LINE) std::atomic<size_t> head;
+
+    // next slot to push, only the producer moves it
+    alignas (RING_LINE) std::atomic<size_t> tail;
+
+    public:
+    // Constructor, capacity is rounded up to a power of two
+    explicit Ring (size_t capacity) : head (0), tail (0) {
+        size_t size = 1;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        slots.resize (size);
+        mask = size - 1;
+    }
+
+    Ring (const Ring&)            = delete;
+    Ring& operator= (const Ring&) = delete;
+
+    // Adds item at the back, only from the producer thread. Returns false if the ring is full
+    bool push (const T& item) {
+        size_t back = tail.load (std::memory_order_relaxed);
+        if (back - head.load (std::memory_order_acquire) > mask) {
+            return false;
+        }
+        slots[back & mask] = item;
+        tail.store (back + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Takes the item at the front, only from the consumer thread. Returns false if the ring
+    //  is empty
+    bool pop (T& item) {
+        size_t front = head.load (std::memory_order_relaxed);
+        if (front == tail.load (std::memory_order_acquire)) {
+            return false;
+        }
+        item = slots[front & mask];
+        head.store (front + 1, std::memory_order_release);
+        return true;
+    }
+
+    // items waiting, from any thread it may already be out of date
+    size_t size () const {
+        return tail.load (std::memory_order_acquire) - head.load (std::memory_order_acquire);
+    }
+
+    // most items it holds at once
+    size_t capacity () const {
+        return mask + 1;
+    }
+};
+
+#endif
@@ -0,0 +1,282 @@
+/**
+ * @file Stream.cpp
+ * @author Cristian Madrazo
+ * @brief Implementations for Stream
+ * @version 1.0
+ *
+ */
+
+#include "Stream.h"
+
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "logging.h"
+
+// Constructor, takes over fd and makes it non-blocking
+Stream::Stream (Reactor& reactor, int fd) : reactor (reactor), fd (fd) {
+    watched   = false;
+    timer     = 0;
+    timed_out = false;
+    timeout   = std::chrono::milliseconds (0);
+
+    fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) | O_NONBLOCK);
+}
+
+// Destructor, stops watching the socket and closes it unless it was released
+Stream::~Stream () {
+    if (timer != 0) {
+        reactor.cancel (timer);
+    }
+    if (watched) {
+        reactor.remove (fd);
+    }
+    if (fd >= 0) {
+        close (fd);
+    }
+}
+
+// Gives up on any single wait for the socket that takes longer than timeout, the call
+// waiting then fails with ETIMEDOUT. 0 waits forever
+void Stream::set_timeout (std::chrono::milliseconds timeout) {
+    this->timeout = timeout;
+}
+
+// suspends the awaiting coroutine until the socket is ready for events
+Stream::Readiness Stream::ready (uint32_t events) {
+    return Readiness{*this, events};
+}
+
+// registers for one readiness report, the awaiting coroutine stays running if it can't
+bool Stream::Readiness::await_suspend (std::coroutine_handle<> handle) {
+    // one shot, so a report nobody waits for anymore never comes in
+    bool armed;
+    if (!stream.watched) {
+        armed = stream.reactor.add (stream.fd, events | EPOLLONESHOT, [this_stream = &stream] (uint32_t) {
+            this_stream->wake (false);
+        });
+        stream.watched = armed;
+    } else {
+        armed = stream.reactor.modify (stream.fd, events | EPOLLONESHOT);
+    }
+    if (!armed) {
+        stream.timed_out = true;
+        return false;
+    }
+
+    stream.waiting   = handle;
+    stream.timed_out = false;
+    if (stream.timeout.count () > 0) {
+        stream.timer = stream.reactor.after (stream.timeout, [this_stream = &stream] () {
+            this_stream->timer = 0;
+            this_stream->wake (true);
+        });
+    }
+    return true;
+}
+
+// true if the socket is ready, false if waiting timed out or failed
+bool Stream::Readiness::await_resume () {
+    if (stream.timed_out) {
+        errno = ETIMEDOUT;
+        return false;
+    }
+    return true;
+}
+
+// resumes the waiting coroutine, because the socket is ready or the timeout expired
+void Stream::wake (bool expired) {
+    if (!waiting) {
+        return;
+    }
+    if (timer != 0) {
+        reactor.cancel (timer);
+        timer = 0;
+    }
+
+    timed_out                         = expired;
+    std::coroutine_handle<> resumable = waiting;
+    waiting                           = nullptr;
+    resumable.resume ();
+}
+
+// Reads up to len bytes once some arrive. Returns the bytes read, 0 if the peer hung up or
+// -1 if reading failed
+Task<ssize_t> Stream::read (char* buf, size_t len) {
+    while (true) {
+        ssize_t bytes_read = ::read (fd, buf, len);
+        if (bytes_read >= 0) {
+            co_return bytes_read;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if ((errno != EAGAIN && errno != EWOULDBLOCK) || !co_await ready (EPOLLIN)) {
+            co_return -1;
+        }
+    }
+}
+
+// Writes all of data, more hints that further output follows. Returns 0 if succesful or -1
+// if writing failed
+Task<int> Stream::write (const char* data, size_t len, bool more) {
+    struct iovec iov;
+    iov.iov_base = (void*)data;
+    iov.iov_len  = len;
+    co_return co_await write (&iov, 1, more);
+}
+
+// Writes every byte described by iov, modifying it as it goes, so what is left in it wasn't
+// written. more hints that further output follows. Returns 0 if succesful or -1 if writing
+// failed
+Task<int> Stream::write (struct iovec* iov, int count, bool more) {
+    struct msghdr msg = {};
+    msg.msg_iov       = iov;
+    msg.msg_iovlen    = count;
+
+    while (msg.msg_iovlen > 0) {
+        ssize_t bytes_sent = sendmsg (fd, &msg, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+        if (bytes_sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if ((errno != EAGAIN && errno != EWOULDBLOCK) || !co_await ready (EPOLLOUT)) {
+                co_return -1;
+            }
+            continue;
+        }
+
+        // skip past whatever was fully sent and trim the one that was partially sent
+        while (msg.msg_iovlen > 0 && (size_t)bytes_sent >= msg.msg_iov->iov_len) {
+            bytes_sent -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (char*)msg.msg_iov->iov_base + bytes_sent;
+            msg.msg_iov->iov_len -= bytes_sent;
+        }
+    }
+
+    co_return 0;
+}
+
+// Connects the socket to addr, waiting for the handshake to finish. Returns 0 if succesful
+// or -1 with errno set if connecting failed
+Task<int> Stream::connect (const struct sockaddr* addr, socklen_t addrlen) {
+    if (::connect (fd, addr, addrlen) == 0) {
+        co_return 0;
+    }
+    if (errno != EINPROGRESS || !co_await ready (EPOLLOUT)) {
+        co_return -1;
+    }
+
+    // the handshake is over, SO_ERROR says how it went
+    int error     = 0;
+    socklen_t len = sizeof (error);
+    if (getsockopt (fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0) {
+        co_return -1;
+    }
+    if (error != 0) {
+        errno = error;
+        co_return -1;
+    }
+    co_return 0;
+}
+
+// Moves up to len bytes from the socket into the pipe pipeFd writes to once some arrive.
+// Returns the bytes moved, 0 if the peer hung up or -1 if moving failed
+Task<ssize_t> Stream::splice_to (int pipeFd, size_t len) {
+    while (true) {
+        ssize_t moved = splice (fd, nullptr, pipeFd, nullptr, len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (moved >= 0) {
+            co_return moved;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if ((errno != EAGAIN && errno != EWOULDBLOCK) || !co_await ready (EPOLLIN)) {
+            co_return -1;
+        }
+    }
+}
+
+// Moves up to len bytes from the pipe pipeFd reads from to the socket once it takes some,
+// more hints that further output follows. Returns the bytes moved or -1 if moving failed
+Task<ssize_t> Stream::splice_from (int pipeFd, size_t len, bool more) {
+    unsigned int flags = SPLICE_F_MOVE | SPLICE_F_NONBLOCK | (more ? SPLICE_F_MORE : 0);
+    while (true) {
+        ssize_t moved = splice (pipeFd, nullptr, fd, nullptr, len, flags);
+        if (moved >= 0) {
+            co_return moved;
+        }
+        if (errno == EINTR) {
+            continue;
+        }
+        if ((errno != EAGAIN && errno != EWOULDBLOCK) || !co_await ready (EPOLLOUT)) {
+            co_return -1;
+        }
+    }
+}
+
+// Sends count bytes of fileFd from offset with sendfile(). Returns 0 if succesful or -1 if
+// sending failed
+Task<int> Stream::sendfile (int fileFd, off_t offset, off_t count) {
+    off_t end = offset + count;
+    while (offset < end) {
+        ssize_t bytes_sent = ::sendfile (fd, fileFd, &offset, end - offset);
+        if (bytes_sent < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if ((errno != EAGAIN && errno != EWOULDBLOCK) || !co_await ready (EPOLLOUT)) {
+                co_return -1;
+            }
+            continue;
+        }
+
+        // the file got shorter since its size was taken
+        if (bytes_sent == 0) {
+            co_return -1;
+        }
+    }
+
+    co_return 0;
+}
+
+// Makes the socket blocking again, for code that doesn't await. Nothing may be awaited on
+// the stream afterwards
+void Stream::set_blocking () {
+    if (watched) {
+        reactor.remove (fd);
+        watched = false;
+    }
+    fcntl (fd, F_SETFL, fcntl (fd, F_GETFL) & ~O_NONBLOCK);
+}
+
+// Gives up the socket without closing it, made blocking again for code that doesn't await.
+// Returns its descriptor, nothing may be done with the stream afterwards
+int Stream::release () {
+    set_blocking ();
+    int released = fd;
+    fd           = -1;
+    return released;
+}
+
+// socket descriptor
+int Stream::get_fd () const {
+    return fd;
+}
+
+// schedules the awaiting coroutine to be resumed once delay has passed
+void Sleep::await_suspend (std::coroutine_handle<> handle) {
+    reactor.after (delay, [handle] () { handle.resume (); });
+}
+
+// Returns an awaitable that resumes the awaiting coroutine on reactor after delay
+Sleep sleep_for (Reactor& reactor, std::chrono::milliseconds delay) {
+    return Sleep{reactor, delay};
+}
@@ -0,0 +1,129 @@
+/**
+ * @file Stream.h
+ * @author Cristian Madrazo
+ * @brief Socket whose reads and writes are awaited by a coroutine instead of blocking the
+ * thread, backed by a Reactor
+ * @version 1.0
+ *
+ */
+
+#ifndef STREAM_H
+#define STREAM_H
+
+#include <chrono>
+#include <coroutine>
+#include <cstdint>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "Reactor.h"
+#include "Task.h"
+
+class Stream {
+    private:
+    Reactor& reactor;
+    int fd;
+
+    // registered with the reactor, only once the first wait needs it
+    bool watched;
+
+    // the coroutine waiting for the socket, and the timer that gives up on it
+    std::coroutine_handle<> waiting;
+    uint64_t timer;
+    bool timed_out;
+
+    // how long one wait may take, 0 for as long as it takes
+    std::chrono::milliseconds timeout;
+
+    // suspends the awaiting coroutine until the socket is ready for events, false if it
+    //  timed out or can't be watched
+    struct Readiness {
+        Stream& stream;
+        uint32_t events;
+
+        bool await_ready () const noexcept {
+            return false;
+        }
+        bool await_suspend (std::coroutine_handle<> handle);
+        bool await_resume ();
+    };
+
+    Readiness ready (uint32_t events);
+
+    // resumes the waiting coroutine, because the socket is ready or the timeout expired
+    void wake (bool expired);
+
+    public:
+    // Constructor, takes over fd and makes it non-blocking
+    Stream (Reactor& reactor, int fd);
+
+    // Destructor, stops watching the socket and closes it
+    ~Stream ();
+
+    Stream (const Stream&)            = delete;
+    Stream& operator= (const Stream&) = delete;
+
+    // Gives up on any single wait for the socket that takes longer than timeout, the call
+    //  waiting then fails with ETIMEDOUT. 0 waits forever
+    void set_timeout (std::chrono::milliseconds timeout);
+
+    // Reads up to len bytes once some arrive. Returns the bytes read, 0 if the peer hung up
+    //  or -1 if reading failed
+    Task<ssize_t> read (char* buf, size_t len);
+
+    // Writes all of data, more hints that further output follows. Returns 0 if succesful or
+    //  -1 if writing failed
+    Task<int> write (const char* data, size_t len, bool more = false);
+
+    // Writes every byte described by iov, modifying it as it goes, so what is left in it
+    //  wasn't written. more hints that further output follows. Returns 0 if succesful or -1
+    //  if writing failed
+    Task<int> write (struct iovec* iov, int count, bool more = false);
+
+    // Connects the socket to addr, waiting for the handshake to finish. Returns 0 if
+    //  succesful or -1 with errno set if connecting failed
+    Task<int> connect (const struct sockaddr* addr, socklen_t addrlen);
+
+    // Moves up to len bytes from the socket into the pipe pipeFd writes to once some arrive.
+    //  Returns the bytes moved, 0 if the peer hung up or -1 if moving failed
+    Task<ssize_t> splice_to (int pipeFd, size_t len);
+
+    // Moves up to len bytes from the pipe pipeFd reads from to the socket once it takes
+    //  some, more hints that further output follows. Returns the bytes moved or -1 if moving
+    //  failed
+    Task<ssize_t> splice_from (int pipeFd, size_t len, bool more = false);
+
+    // Sends count bytes of fileFd from offset with sendfile(). Returns 0 if succesful or -1
+    //  if sending failed
+    Task<int> sendfile (int fileFd, off_t offset, off_t count);
+
+    // Makes the socket blocking again, for code that doesn't await. Nothing may be awaited
+    //  on the stream afterwards
+    void set_blocking ();
+
+    // Gives up the socket without closing it, made blocking again for code that doesn't
+    //  await. Returns its descriptor, nothing may be done with the stream afterwards
+    int release ();
+
+    // socket descriptor
+    int get_fd () const;
+};
+
+// suspends the awaiting coroutine for a while, letting the reactor serve everything else
+struct Sleep {
+    Reactor& reactor;
+    std::chrono::milliseconds delay;
+
+    bool await_ready () const noexcept {
+        return delay.count () <= 0;
+    }
+    void await_suspend (std::coroutine_handle<> handle);
+    void await_resume () noexcept {
+    }
+};
+
+// Returns an awaitable that resumes the awaiting coroutine on reactor after delay
+Sleep sleep_for (Reactor& reactor, std::chrono::milliseconds delay);
+
+#endif
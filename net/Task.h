@@ -0,0 +1,177 @@
+/**
+ * @file Task.h
+ * @author Cristian Madrazo
+ * @brief Coroutine type for handlers that wait on the event loop, with frames from the
+ * thread's Framepool
+ * @version 1.0
+ *
+ */
+
+#ifndef TASK_H
+#define TASK_H
+
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+
+#include "Framepool.h"
+
+template <typename T = void> class Task;
+
+// what every Task's promise has in common, whatever it returns
+struct Taskpromise {
+    // resumed when the task finishes, the coroutine that awaited it
+    std::coroutine_handle<> continuation;
+
+    // started by spawn(), nothing awaits it and it frees itself when it finishes
+    bool detached = false;
+
+    // resumes whoever awaited the task, or frees a detached one
+    struct Finalawaiter {
+        bool await_ready () noexcept {
+            return false;
+        }
+
+        template <typename Promise> std::coroutine_handle<> await_suspend (std::coroutine_handle<Promise> handle) noexcept {
+            Taskpromise& promise = handle.promise ();
+            if (promise.continuation) {
+                return promise.continuation;
+            }
+            if (promise.detached) {
+                handle.destroy ();
+            }
+            return std::noop_coroutine ();
+        }
+
+        void await_resume () noexcept {
+        }
+    };
+
+    // frames come from the thread's pool, a worker reuses them connection after connection
+    static void* operator new (size_t bytes) {
+        return Framepool::local ().allocate (bytes);
+    }
+
+    static void operator delete (void* frame, size_t bytes) {
+        Framepool::local ().release (frame, bytes);
+    }
+
+    // a task only starts running once it is awaited or spawned
+    std::suspend_always initial_suspend () noexcept {
+        return {};
+    }
+
+    Finalawaiter final_suspend () noexcept {
+        return {};
+    }
+
+    // handlers report failures with return values, an exception escaping one is a bug
+    void unhandled_exception () {
+        std::terminate ();
+    }
+};
+
+// A coroutine returning T. co_await runs it until it finishes, suspending the awaiting
+//  coroutine whenever this one waits
+template <typename T> class Task {
+    public:
+    struct promise_type : Taskpromise {
+        std::optional<T> value;
+
+        Task get_return_object () {
+            return Task (std::coroutine_handle<promise_type>::from_promise (*this));
+        }
+
+        void return_value (T result) {
+            value = std::move (result);
+        }
+    };
+
+    private:
+    std::coroutine_handle<promise_type> handle;
+
+    public:
+    explicit Task (std::coroutine_handle<promise_type> handle) : handle (handle) {
+    }
+
+    Task (Task&& other) noexcept : handle (std::exchange (other.handle, nullptr)) {
+    }
+
+    Task (const Task&)            = delete;
+    Task& operator= (const Task&) = delete;
+
+    ~Task () {
+        if (handle) {
+            handle.destroy ();
+        }
+    }
+
+    bool await_ready () const noexcept {
+        return !handle || handle.done ();
+    }
+
+    // starts the task straight away, the awaiting coroutine continues once it finishes
+    std::coroutine_handle<> await_suspend (std::coroutine_handle<> awaiting) noexcept {
+        handle.promise ().continuation = awaiting;
+        return handle;
+    }
+
+    T await_resume () {
+        return std::move (*handle.promise ().value);
+    }
+};
+
+// A coroutine returning nothing
+template <> class Task<void> {
+    public:
+    struct promise_type : Taskpromise {
+        Task get_return_object () {
+            return Task (std::coroutine_handle<promise_type>::from_promise (*this));
+        }
+
+        void return_void () {
+        }
+    };
+
+    private:
+    std::coroutine_handle<promise_type> handle;
+
+    public:
+    explicit Task (std::coroutine_handle<promise_type> handle) : handle (handle) {
+    }
+
+    Task (Task&& other) noexcept : handle (std::exchange (other.handle, nullptr)) {
+    }
+
+    Task (const Task&)            = delete;
+    Task& operator= (const Task&) = delete;
+
+    ~Task () {
+        if (handle) {
+            handle.destroy ();
+        }
+    }
+
+    bool await_ready () const noexcept {
+        return !handle || handle.done ();
+    }
+
+    std::coroutine_handle<> await_suspend (std::coroutine_handle<> awaiting) noexcept {
+        handle.promise ().continuation = awaiting;
+        return handle;
+    }
+
+    void await_resume () {
+    }
+
+    // Runs the task until it first waits and lets it finish on its own, freeing its frame
+    //  when it does. The task is left empty
+    void spawn () {
+        std::coroutine_handle<promise_type> started = std::exchange (handle, nullptr);
+        started.promise ().detached                 = true;
+        started.resume ();
+    }
+};
+
+#endif
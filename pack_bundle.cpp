@@ -0,0 +1,45 @@
+// **************************************************************************************
+// * Pack Bundle (pack_bundle.cpp)
+// * -- Packs a document root into a single bundle file that web_server can serve from
+// **************************************************************************************
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "Argparser.h"
+#include "Bundle.h"
+#include "logging.h"
+
+// **************************************************************************************
+// * main()
+// * - Packs the directory given with -i into the bundle file given with -o
+// **************************************************************************************
+int main (int argc, char* argv[]) {
+
+    // ********************************************************************
+    // * Process the command line arguments
+    // ********************************************************************
+    Argparser parser (argc, argv);
+    parser.add_option ('d', true, false, 1, 1);
+    parser.add_option ('i', true, true, 1, 1);
+    parser.add_option ('o', true, true, 1, 1);
+    parser.parse ();
+    std::vector<int> arg_values = parser.get_values_int ('d');
+
+    if (arg_values.size () == 0) {
+        LOG_LEVEL = 2;
+    } else {
+        LOG_LEVEL = arg_values.at (0);
+    }
+
+    std::string dir = parser.get_values_string ('i').at (0);
+    std::string out = parser.get_values_string ('o').at (0);
+
+    int count = pack_bundle (dir, out);
+    if (count < 0) {
+        return 1;
+    }
+
+    std::cout << "Packed " << count << " files from " << dir << " into " << out << std::endl;
+    return 0;
+}
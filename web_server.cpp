@@ -11,6 +11,164 @@
 #define DEFAULT_HTTP_CODE 400
 #define PREVIEW_LEN 30
 #define EMPTY_MSG_LIMIT 5
+#define CACHE_MAX_BYTES (64 * 1024 * 1024)
+#define MAP_MAX_BYTES (1024L * 1024 * 1024)
+#define CPU_MIN_THREADS 2
+#define STAT_TTL std::chrono::milliseconds (1000)
+#define MAX_RANGES 16
+#define UPLOAD_PIPE_BYTES (64 * 1024)
+#define UPLOAD_TIMEOUT_SECONDS 10
+#define CHUNK_LINE_MAX 1024
+#define WEBSOCKET_PATH "echo"
+#define REFRESH_THREADS 2
+#define PROXY_CACHE_NAME "/web_server_cache"
+#define ZEROCOPY_WAIT_MS (30 * 1000)
+#define STREAM_TIMEOUT_MS (30 * 1000)
+#define HANDOFF_SLOTS 1024
+#define HANDOFF_RETRY_MS 5
+#define SESSION_THREADS 64
+
+// how sendResponse() gets file contents onto the socket
+enum Servemode {
+    SERVE_CACHE,    // copy from the in-memory file cache
+    SERVE_MMAP,     // writev() straight from a shared mapping of the file
+    SERVE_SENDFILE, // sendfile() from the page cache, no user space buffer at all
+};
+Servemode serve_mode = SERVE_CACHE;
+
+// bundle every file is served from when one is given with -b, reopened on SIGHUP so a
+//  deploy is just renaming a new bundle over the old one
+std::atomic<std::shared_ptr<const Bundle>> bundle;
+std::string bundle_path;
+std::atomic<bool> reload_bundle (false);
+
+// stat() results shared by every worker, files are seen to change within STAT_TTL
+Statcache stat_cache (STAT_TTL);
+
+// files served by every worker, loaded from disk once and shared
+Filecache file_cache (CACHE_MAX_BYTES, stat_cache);
+
+// CPU heavy work kept off the workers: compressing cached text files, loading files the
+//  cache doesn't have yet and reopening the bundle. Sized in main() to the cores the
+//  workers leave free, declared after file_cache so it is destroyed, and its queued work
+//  finished, before the cache is
+Threadpool cpu_pool;
+
+// files served by every worker in mmap mode, mapped once and shared
+Mapcache map_cache (MAP_MAX_BYTES, stat_cache);
+
+// largest accepted upload body, uploads are refused unless -u sets it
+off_t upload_max_bytes = 0;
+
+// bodies at least this big are sent with MSG_ZEROCOPY, 0 unless -z turns it on
+size_t zerocopy_min_bytes = 0;
+
+// a response sent with MSG_ZEROCOPY, held until the kernel reports every send made from it
+//  as completed. The headers are copied, the body's owner keeps its pages from being
+//  freed or reused
+struct Zerocopied {
+    std::string headers;
+    std::shared_ptr<const void> body;
+
+    // ids of the sends made from it, first to first + sends - 1
+    uint32_t first     = 0;
+    uint32_t sends     = 0;
+    uint32_t completed = 0;
+};
+
+// zero copy state of a socket, SO_ZEROCOPY is set on its first zero copy send. next_id is
+//  the id the kernel gives the next one
+struct Zerocopysocket {
+    bool enabled     = false;
+    uint32_t next_id = 0;
+    std::deque<Zerocopied> held;
+};
+
+// every socket a zero copy send was tried on by descriptor, until closeSocket() closes it.
+//  Only the thread serving a socket touches its state, the lock guards the map
+std::mutex zerocopy_lock;
+std::unordered_map<int, Zerocopysocket> zerocopy_sockets;
+
+// proxied responses kept across workers and restarts when -c is given, declared before
+//  proxy which uses it
+Shmcache proxy_cache;
+
+// path prefixes forwarded to upstream servers, set up by -p before workers start
+Proxy proxy;
+
+// refreshes stale proxied responses in the background, declared after proxy so its queued
+//  work is finished before proxy is destroyed
+Threadpool refresh_pool (REFRESH_THREADS);
+
+// set once any worker is told to stop, every worker exits its event loop
+std::atomic<bool> quit_program (false);
+
+// every listening socket, the TCP one first followed by any -l unix sockets. Set up before
+//  workers start
+std::vector<Listener> listeners;
+
+// a worker thread's event loop, and the connections it serves as coroutines with -e
+struct Worker {
+    Reactor loop;
+
+    // connections being served as coroutines, and whether the listeners are unwatched
+    //  because there are stream_limit of them
+    size_t streams = 0;
+    bool paused    = false;
+
+    // connections handed to the worker and not closed yet, including those still queued
+    std::atomic<size_t> connections;
+
+    // with -s, connections the acceptor hands over, and the eventfd it wakes the worker with
+    Ring<int> inbox;
+    int wakeFd;
+
+    // -1 once accept() failed
+    int status = 0;
+
+    Worker () : connections (0), inbox (HANDOFF_SLOTS) {
+        wakeFd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC);
+    }
+
+    ~Worker () {
+        close (wakeFd);
+    }
+};
+
+// every worker by worker number. Set up before workers start
+std::vector<std::unique_ptr<Worker>> worker_states;
+
+// connections each worker serves at once as coroutines, 0 unless -e serves them that way
+size_t stream_limit = 0;
+
+// handlers that block, HTTP/2 and WebSocket sessions, uploads and other methods, for
+//  connections coroutine workers read. Started in main() with -e, connections wait in its
+//  queue while every thread is busy
+Threadpool session_pool;
+
+// how -s picks the worker the acceptor hands a connection to
+enum Dispatch {
+    DISPATCH_NONE,  // no acceptor, workers accept for themselves
+    DISPATCH_LEAST, // fewest connections, queued or being served
+    DISPATCH_QUEUE, // fewest connections queued
+};
+Dispatch dispatch = DISPATCH_NONE;
+
+// the thread that accepts every connection with -s, and connections none of the workers
+//  could take yet
+struct Acceptor {
+    Reactor loop;
+    std::deque<int> backlog;
+    int status = 0;
+};
+std::unique_ptr<Acceptor> acceptor;
+
+// users allowed to connect over the unix sockets, anyone the socket file lets in if empty
+std::vector<uid_t> allowed_peers;
+
+// reported by the status page
+const std::chrono::steady_clock::time_point start_time = std::chrono::steady_clock::now ();
+std::atomic<unsigned long> connections_served (0);
 
 // **************************************************************************************
 // sig_handler()
@@ -21,6 +179,13 @@ void sig_handler (int signum) {
     INFO << "Caught signal " << signum << ENDL;
     INFO << "Closing file descriptors 3-31" << ENDL;
 
+    // the next run can bind the same paths
+    for (const Listener& listener : listeners) {
+        if (listener.is_unix ()) {
+            unlink (listener.get_path ().c_str ());
+        }
+    }
+
     for (int i = 3; i < 32; i++) {
         close (i);
     }
@@ -28,6 +193,35 @@ void sig_handler (int signum) {
     exit (1);
 }
 
+// **************************************************************************************
+// hup_handler()
+// handles SIGHUP by asking for the bundle to be reopened on the next request
+// **************************************************************************************
+void hup_handler (int signum) {
+    reload_bundle = true;
+}
+
+// **************************************************************************************
+// currentBundle()
+// returns the bundle to serve from, or nullptr if files come from the working directory
+// if SIGHUP asked for it the bundle is reopened on cpu_pool, the old one is served until
+//  that's done and kept if it fails
+// **************************************************************************************
+std::shared_ptr<const Bundle> currentBundle () {
+    if (reload_bundle.exchange (false) && !bundle_path.empty ()) {
+        cpu_pool.submit ([] () {
+            std::shared_ptr<const Bundle> fresh = Bundle::open (bundle_path);
+            if (fresh) {
+                bundle.store (fresh);
+            } else {
+                ERROR << "Reopening bundle failed, still serving the previous one" << ENDL;
+            }
+        });
+    }
+
+    return bundle.load ();
+}
+
 // **************************************************************************************
 // createPreview
 // creates a preview message, which is the first few characters and a " ... " appended
@@ -41,38 +235,6 @@ std::string create_preview (std::string message) {
     return message_preview;
 }
 
-// **************************************************************************************
-// sendFile()
-// Takes a socket and an ifstream object representing the file to send
-// Sends the file in chunks of BUFFER_SIZE (which should already be done by the inet lib
-//  but good practice)
-// Does not check for file errors! Do that before calling
-// **************************************************************************************
-int sendFile (int sockFd, std::ifstream& file) {
-
-    // set pointer to beginnign of file
-    file.seekg (0, std::ios::beg);
-
-    // Read the file and send it in chunks
-    char buffer[BUFFER_SIZE];
-    while (file.read (buffer, sizeof (buffer))) {
-
-
-        DEBUG << "Sending chunk of file to client: "
-              << create_preview (string_to_literal (std::string (buffer))) << ENDL;
-        send (sockFd, buffer, file.gcount (), 0);
-    }
-
-    // Send any remaining bytes
-    if (file.gcount () > 0) {
-        DEBUG << "Sending chunk of file to client: "
-              << create_preview (string_to_literal (std::string (buffer))) << ENDL;
-        send (sockFd, buffer, file.gcount (), 0);
-    }
-
-    return 0;
-}
-
 // **************************************************************************************
 // * sendLine()
 // * - Takes an arbitrary std::string, converts it to a char array, adds the
@@ -91,336 +253,2576 @@ int sendLine (int sockFd, std::string data) {
 }
 
 // **************************************************************************************
-// sendResponse
-// sends a typical http response packet to client
-// expecting header with status line and content type at least
-// will add content length and blank line
-// returns 0 if succesful or a status code of a suggested alternative
+// statusText()
+// the status code and its reason phrase, as status lines carry them. Every response
+//  the server sends gets its reason from here
 // **************************************************************************************
-int sendResponse (int sockFd, std::string filepath, std::string headers) {
+std::string statusText (int code) {
+    static const std::map<int, std::string> reasons = {
+        {100, "Continue"},
+        {101, "Switching Protocols"},
+        {200, "OK"},
+        {201, "Created"},
+        {204, "No Content"},
+        {206, "Partial Content"},
+        {304, "Not Modified"},
+        {400, "Bad Request"},
+        {403, "Forbidden"},
+        {404, "Not Found"},
+        {405, "Method Not Allowed"},
+        {411, "Length Required"},
+        {413, "Payload Too Large"},
+        {416, "Range Not Satisfiable"},
+        {426, "Upgrade Required"},
+        {500, "Internal Server Error"},
+        {501, "Not Implemented"},
+        {502, "Bad Gateway"},
+        {503, "Service Unavailable"},
+        {504, "Gateway Timeout"},
+        {505, "HTTP Version Not Supported"},
+    };
+
+    auto reason = reasons.find (code);
+    return std::to_string (code) + " " + (reason != reasons.end () ? reason->second : "Unknown");
+}
 
-    // Open the file in binary mode
-    std::ifstream file (filepath, std::ios::binary);
+// **************************************************************************************
+// sendBuffers()
+// Sends every byte described by iov with as few syscalls as the kernel allows, picking
+//  up partial writes where they left off
+// Modifies iov as it goes
+// **************************************************************************************
+int sendBuffers (int sockFd, struct iovec* iov, int count) {
+    struct msghdr msg;
+    memset (&msg, 0, sizeof (msg));
+    msg.msg_iov    = iov;
+    msg.msg_iovlen = count;
+
+    while (msg.msg_iovlen > 0) {
+        ssize_t bytes_sent = sendmsg (sockFd, &msg, MSG_NOSIGNAL);
+        if (bytes_sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_sent < 0) {
+            ERROR << "Error sending to client" << ENDL;
+            return -1;
+        }
 
-    // Check if the file opened successfully
-    if (!file) {
-        ERROR << "File \"" << filepath << "\" could not be opened, check permissions" << ENDL;
-        return 404;
+        // skip past whatever was fully sent and trim the one that was partially sent
+        while (msg.msg_iovlen > 0 && (size_t)bytes_sent >= msg.msg_iov->iov_len) {
+            bytes_sent -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (char*)msg.msg_iov->iov_base + bytes_sent;
+            msg.msg_iov->iov_len -= bytes_sent;
+        }
     }
 
-    // if file opened okay
-    else {
+    return 0;
+}
+
+// **************************************************************************************
+// reapCompletions()
+// Reads the zero copy completions queued for a socket without waiting and lets go of the
+//  buffers every send made from them is completed for
+// Returns true once nothing is held for the socket anymore
+// **************************************************************************************
+bool reapCompletions (int sockFd, Zerocopysocket& socket) {
+    bool copied = false;
+
+    // credit every buffer the sends in each completed range were made from
+    zerocopy_completions (sockFd, [&socket] (uint32_t low_id, uint32_t high_id) {
+        for (Zerocopied& buffer : socket.held) {
+            uint32_t low  = std::max (low_id, buffer.first);
+            uint32_t high = std::min (high_id, buffer.first + buffer.sends - 1);
+            if (buffer.sends > 0 && low <= high) {
+                buffer.completed += high - low + 1;
+            }
+        }
+    }, &copied);
+
+    // loopback, and devices that can't gather from user pages, copy anyway
+    if (copied) {
+        DEBUG << "Zero copy send was copied by the kernel" << ENDL;
+    }
 
-        // Get the size of the file
-        file.seekg (0, std::ios::end);
-        std::streamsize size = file.tellg ();
-        file.seekg (0, std::ios::beg);
+    while (!socket.held.empty () && socket.held.front ().completed >= socket.held.front ().sends) {
+        socket.held.pop_front ();
+    }
+    return socket.held.empty ();
+}
 
-        // Create a char buffer to hold the file contents
-        std::vector<char> buffer (size);
+// **************************************************************************************
+// sendZerocopy()
+// sendBuffers() with MSG_ZEROCOPY, the kernel sends straight from the pages behind iov
+//  instead of copying them into the socket buffer. The last buffer is the body, owner
+//  keeps it alive and the ones before it are copied, until the kernel is done with them
+// Sockets that can't send zero copy, like unix sockets, get an ordinary sendBuffers()
+// Modifies iov as it goes
+// **************************************************************************************
+int sendZerocopy (int sockFd, struct iovec* iov, int count, std::shared_ptr<const void> owner) {
+    Zerocopysocket* socket;
+    {
+        std::lock_guard<std::mutex> guard (zerocopy_lock);
+        auto found = zerocopy_sockets.find (sockFd);
+        if (found == zerocopy_sockets.end ()) {
+            int on = 1;
+            found  = zerocopy_sockets.emplace (sockFd, Zerocopysocket ()).first;
+            found->second.enabled = setsockopt (sockFd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof (on)) == 0;
+        }
+        socket = &found->second;
+    }
+    if (!socket->enabled) {
+        return sendBuffers (sockFd, iov, count);
+    }
 
-        // Read the contents of the file into the buffer and save it as string
-        if (file.read (buffer.data (), size)) {
+    // whatever earlier responses are done with goes first
+    reapCompletions (sockFd, *socket);
 
-            // send headers first which should contain status line
-            sendLine (sockFd, std::string (headers));
+    // the deque never moves what it holds, so the copied headers stay put while sending
+    Zerocopied& buffer = socket->held.emplace_back ();
+    buffer.body        = std::move (owner);
+    buffer.first       = socket->next_id;
+    for (int i = 0; i < count - 1; i++) {
+        buffer.headers.append ((const char*)iov[i].iov_base, iov[i].iov_len);
+    }
 
-            // send file size info to client
-            sendLine (sockFd, std::string ("Content-Length: " + std::to_string (size) + "\r\n"));
+    struct iovec copied[2];
+    copied[0].iov_base = (void*)buffer.headers.data ();
+    copied[0].iov_len  = buffer.headers.size ();
+    copied[1]          = iov[count - 1];
 
-            // Send blank line to separate body from headers
-            sendLine (sockFd, "\r\n");
+    struct msghdr msg;
+    memset (&msg, 0, sizeof (msg));
+    msg.msg_iov    = buffer.headers.empty () ? copied + 1 : copied;
+    msg.msg_iovlen = buffer.headers.empty () ? 1 : 2;
 
-            // // Send file contents
-            // std::string file_contents (buffer.data ());
-            // sendLine (sockFd, file_contents);
+    // every send that succeeds gets the next id, completions report ranges of them
+    int result = 0;
 
-            sendFile (sockFd, file);
+    while (msg.msg_iovlen > 0) {
+        ssize_t bytes_sent = sendmsg (sockFd, &msg, MSG_NOSIGNAL | MSG_ZEROCOPY);
+        if (bytes_sent < 0 && errno == EINTR) {
+            continue;
         }
 
-        // if error reading file that seems to exist and was opened succesfully
-        else {
-            return 500;
+        // out of memory to track pinned pages, the rest is copied the usual way
+        if (bytes_sent < 0 && errno == ENOBUFS) {
+            result = sendBuffers (sockFd, msg.msg_iov, msg.msg_iovlen);
+            break;
+        }
+        if (bytes_sent < 0) {
+            ERROR << "Error sending to client" << ENDL;
+            result = -1;
+            break;
+        }
+        buffer.sends++;
+        socket->next_id++;
+
+        // skip past whatever was fully sent and trim the one that was partially sent
+        while (msg.msg_iovlen > 0 && (size_t)bytes_sent >= msg.msg_iov->iov_len) {
+            bytes_sent -= msg.msg_iov->iov_len;
+            msg.msg_iov++;
+            msg.msg_iovlen--;
+        }
+        if (msg.msg_iovlen > 0) {
+            msg.msg_iov->iov_base = (char*)msg.msg_iov->iov_base + bytes_sent;
+            msg.msg_iov->iov_len -= bytes_sent;
         }
-
-        // Close the file
-        file.close ();
     }
 
-    return 0;
+    return result;
 }
 
 // **************************************************************************************
-// Uses sendLine() to send back the 505 error code and message.
-// Indicates unsuported http version
+// sendBody()
+// sendBuffers() for a response whose body is the last of the buffers, bytes long. Zero
+//  copy if the body is big enough for -z, owner then keeps it alive until the kernel is
+//  done with it
+// Modifies iov as it goes
 // **************************************************************************************
-void send505 (int sockFd) {
-
-    // set headers to send
-    std::string headers = "HTTP/1.0 505 HTTP Version Not Supported\r\n";
-    headers += "Content-Type: text/html; charset=UTF-8\r\n";
-
-    // Resource file
-    std::string filepath = "http/505.html";
-
-    int respond = sendResponse (sockFd, filepath, headers);
-
-    // if sending back nice response failed we send back bare bones response
-    if (sendResponse (sockFd, filepath, headers)) {
-        sendLine (sockFd, "HTTP/1.0 505 HTTP Version Not Supported\r\n\r\n");
+int sendBody (int sockFd, struct iovec* iov, int count, size_t bytes, std::shared_ptr<const void> owner) {
+    if (zerocopy_min_bytes > 0 && bytes >= zerocopy_min_bytes) {
+        return sendZerocopy (sockFd, iov, count, std::move (owner));
     }
+    return sendBuffers (sockFd, iov, count);
 }
 
 // **************************************************************************************
-// Uses sendLine() to send back the 500 error code and message.
-// Indicates an internal server error
+// closeSocket()
+// Closes a connection once the kernel is done with every zero copy send made on it. Until
+//  then the client is sent a FIN and loop watches the socket's error queue, resetting the
+//  connection if the sends aren't completed within ZEROCOPY_WAIT_MS
 // **************************************************************************************
-void send500 (int sockFd) {
-    ERROR << "Calling unimplemented function: HTTP/1.1 500 Internal Server Error to client" << ENDL;
+void closeSocket (Reactor& loop, int sockFd) {
+    Zerocopysocket* socket = nullptr;
+    {
+        std::lock_guard<std::mutex> guard (zerocopy_lock);
+        auto found = zerocopy_sockets.find (sockFd);
+        if (found != zerocopy_sockets.end ()) {
+            socket = &found->second;
+        }
+    }
+
+    // forgotten before it is closed, the descriptor may be reused right away
+    auto release = [sockFd] () {
+        {
+            std::lock_guard<std::mutex> guard (zerocopy_lock);
+            zerocopy_sockets.erase (sockFd);
+        }
+        close (sockFd);
+    };
+
+    if (socket == nullptr || reapCompletions (sockFd, *socket)) {
+        release ();
+        return;
+    }
+
+    // the client has the whole response already, only the buffers are still held
+    shutdown (sockFd, SHUT_WR);
+
+    loop.post ([&loop, sockFd, socket, release] () {
+        // a client that stopped reading would have the pages sent after we let go of them,
+        //  reset the connection on close instead so nothing more is sent from them
+        uint64_t timer = loop.after (std::chrono::milliseconds (ZEROCOPY_WAIT_MS), [&loop, sockFd, socket, release] () {
+            loop.remove (sockFd);
+            if (!reapCompletions (sockFd, *socket)) {
+                ERROR << "Zero copy send wasn't completed, resetting the connection" << ENDL;
+                struct linger reset = {1, 0};
+                setsockopt (sockFd, SOL_SOCKET, SO_LINGER, &reset, sizeof (reset));
+            }
+            release ();
+        });
+
+        // completions are reported as EPOLLERR, which is always watched for
+        loop.add (sockFd, 0, [&loop, sockFd, socket, release, timer] (uint32_t events) {
+            if (reapCompletions (sockFd, *socket)) {
+                loop.cancel (timer);
+                loop.remove (sockFd);
+                release ();
+            } else if (events & EPOLLHUP) {
+                // the client is gone too, EPOLLHUP would keep firing until the timer
+                loop.remove (sockFd);
+            }
+        });
+    });
 }
 
 // **************************************************************************************
-// * send400()
-// * - Uses sendLine() to send back the 400 error code and message.
+// sendFile()
+// Takes a socket and a cached file and sends its contents
+// Sends the file in chunks of at most BUFFER_SIZE so partial writes are picked up where
+//  they left off
 // **************************************************************************************
-void send400 (int sockFd) {
+int sendFile (int sockFd, std::shared_ptr<const Cachedfile> cached) {
+    const Cachedfile& file = *cached;
+    if (zerocopy_min_bytes > 0 && file.body.size () >= zerocopy_min_bytes) {
+        struct iovec iov;
+        iov.iov_base = (void*)file.body.data ();
+        iov.iov_len  = file.body.size ();
+        return sendBody (sockFd, &iov, 1, file.body.size (), cached);
+    }
 
-    // set headers to send
-    std::string headers = "HTTP/1.0 400 Bad Request\r\n";
-    headers += "Content-Type: text/html; charset=UTF-8\r\n";
+    size_t sent = 0;
+    while (sent < file.body.size ()) {
+        size_t len = std::min ((size_t)BUFFER_SIZE, file.body.size () - sent);
 
-    // Resource file
-    std::string filepath = "http/400.html";
+        DEBUG << "Sending chunk of file to client: "
+              << create_preview (string_to_literal (std::string (file.body.data () + sent, len)))
+              << ENDL;
 
-    // if sending back nice response failed we send back bare bones response
-    if (sendResponse (sockFd, filepath, headers)) {
-        sendLine (sockFd, "HTTP/1.0 400 Bad Request\r\n\r\n");
+        ssize_t bytes_sent = send (sockFd, file.body.data () + sent, len, MSG_NOSIGNAL);
+        if (bytes_sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_sent <= 0) {
+            ERROR << "Error sending file to client, giving up on " << file.path << ENDL;
+            return -1;
+        }
+
+        sent += bytes_sent;
     }
+
+    return 0;
 }
 
 // **************************************************************************************
-// * send404()
-// * - Uses sendLine() to send back the 404 error code and message.
+// sendMapped()
+// sendResponse() for mmap mode, headers and body go out together in one writev
 // **************************************************************************************
-void send404 (int sockFd) {
+int sendMapped (int sockFd, std::string filepath, std::string headers) {
+    std::shared_ptr<const Mappedfile> file = map_cache.get (filepath);
+    if (!file) {
+        ERROR << "File \"" << filepath << "\" could not be mapped, check permissions" << ENDL;
+        return 404;
+    }
 
-    // set headers to send
-    std::string headers = "HTTP/1.0 404 Not Found\r\n";
-    headers += "Content-Type: text/html; charset=UTF-8\r\n";
+    headers += "Content-Length: " + std::to_string (file->size) + "\r\n\r\n";
+    DEBUG << "Sending headers to client: " << string_to_literal (headers) << ENDL;
 
-    // Resource file
-    std::string filepath = "http/404.html";
+    struct iovec iov[2];
+    iov[0].iov_base = (void*)headers.data ();
+    iov[0].iov_len  = headers.size ();
+    iov[1].iov_base = (void*)file->data;
+    iov[1].iov_len  = file->size;
 
-    // if sending back nice response failed we send back bare bones response
-    if (sendResponse (sockFd, filepath, headers)) {
-        sendLine (sockFd, "HTTP/1.0 404 Not Found\r\n\r\n");
+    // the mapping stays alive until the kernel is done with it, even if it's evicted meanwhile
+    sendBody (sockFd, iov, 2, file->size, file);
+    return 0;
+}
+
+// **************************************************************************************
+// sendFileRange()
+// sends count bytes of fileFd starting at offset with sendfile(), the bytes go from the
+//  page cache to the socket without passing through user space
+// **************************************************************************************
+int sendFileRange (int sockFd, int fileFd, off_t offset, off_t count) {
+    off_t end = offset + count;
+    while (offset < end) {
+        ssize_t bytes_sent = sendfile (sockFd, fileFd, &offset, end - offset);
+        if (bytes_sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_sent <= 0) {
+            ERROR << "Error sending file to client" << ENDL;
+            return -1;
+        }
     }
+
+    return 0;
 }
 
 // **************************************************************************************
-// * send200()
-// * - Uses sendLine() to send back the 200 code and contents of the file
-// * - If file not found then send 404
+// sendUnbuffered()
+// sendResponse() for sendfile mode, the body is copied by the kernel from the page cache
 // **************************************************************************************
-void send200 (int sockFd, std::string filepath) {
-    DEBUG << "Verifying request" << ENDL;
+int sendUnbuffered (int sockFd, std::string filepath, std::string headers) {
+    int fileFd = open (filepath.c_str (), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fileFd < 0 || fstat (fileFd, &st) < 0) {
+        ERROR << "File \"" << filepath << "\" could not be opened, check permissions" << ENDL;
+        if (fileFd >= 0) {
+            close (fileFd);
+        }
+        return 404;
+    }
 
-    // Define the regex patterns for fileX.html and imageX.jpg
-    std::string f_pattern = R"(file[0-9]\.html)";
-    std::regex file_pattern (f_pattern);
-    std::string i_pattern = R"(image[0-9]\.jpg)";
-    std::regex image_pattern (i_pattern);
+    headers += "Content-Length: " + std::to_string (st.st_size) + "\r\n\r\n";
+    DEBUG << "Sending headers to client: " << string_to_literal (headers) << ENDL;
 
-    // Check if the filename matches the regex patterns
-    if (!(std::regex_match (filepath, file_pattern) || std::regex_match (filepath, image_pattern))) {
-        DEBUG << "Request format doesn't meet assignment guidelines" << ENDL;
+    // hold the headers back so they share a segment with the start of the body
+    int cork = 1;
+    setsockopt (sockFd, IPPROTO_TCP, TCP_CORK, &cork, sizeof (cork));
 
-        // we still send 404 because while the file may exist, the assignment
-        // specifies only certain files should be returned
-        send404 (sockFd);
+    struct iovec iov;
+    iov.iov_base = (void*)headers.data ();
+    iov.iov_len  = headers.size ();
+    if (sendBuffers (sockFd, &iov, 1) == 0) {
+        sendFileRange (sockFd, fileFd, 0, st.st_size);
     }
 
-    // Check if file doesn't exists in current working dir
-    else if (!std::filesystem::exists (filepath)) {
-        DEBUG << "Requested file doesn't exist" << ENDL;
-        send404 (sockFd);
-    }
+    cork = 0;
+    setsockopt (sockFd, IPPROTO_TCP, TCP_CORK, &cork, sizeof (cork));
 
-    // if file exists
-    else {
-        DEBUG << "Request verified succesfully" << ENDL;
+    close (fileFd);
+    return 0;
+}
 
-        std::string headers = "HTTP/1.0 200 OK\r\n";
+// **************************************************************************************
+// * acceptsGzip()
+// * - Returns true if the request's Accept-Encoding allows a gzip encoded response
+// **************************************************************************************
+bool acceptsGzip (const Request& request) {
+    auto field = request.headers.find ("accept-encoding");
+    if (field == request.headers.end ()) {
+        return false;
+    }
 
-        // send proper content header to client
-        // if html file
-        if (std::regex_match (filepath, file_pattern)) {
-            headers += "Content-Type: text/html; charset=UTF-8\r\n";
+    // eg. "gzip, deflate;q=0.5, br" or "gzip;q=0". gzip named outright wins over "*", which
+    //  only counts when gzip isn't listed
+    bool wildcard = false;
+    for (std::string coding : string_tokenize (field->second, ',')) {
+        std::vector<std::string> params = string_tokenize (coding, ';');
+        std::string name = string_to_lower (remove_padding (params.at (0), ' '));
+        if (name != "gzip" && name != "x-gzip" && name != "*") {
+            continue;
         }
-        // else must be jpg image
-        else {
-            headers += "Content-Type: image/jpeg\r\n";
+
+        bool allowed = true;
+        for (size_t i = 1; i < params.size (); i++) {
+            std::string param = remove_padding (params.at (i), ' ');
+            if (param.compare (0, 2, "q=") == 0 && std::atof (param.c_str () + 2) == 0) {
+                allowed = false;
+            }
+        }
+        if (name != "*") {
+            return allowed;
         }
+        wildcard = allowed;
+    }
+
+    return wildcard;
+}
 
-        int response = sendResponse (sockFd, filepath, headers);
+// **************************************************************************************
+// httpDate()
+// formats a time the way HTTP headers expect it, eg. "Sun, 06 Nov 1994 08:49:37 GMT"
+// **************************************************************************************
+std::string httpDate (time_t time) {
+    struct tm parts;
+    gmtime_r (&time, &parts);
 
-        switch (response) {
+    char buffer[64];
+    strftime (buffer, sizeof (buffer), "%a, %d %b %Y %H:%M:%S GMT", &parts);
+    return buffer;
+}
 
-        case (404): send404 (sockFd); break;
+// **************************************************************************************
+// makeEtag()
+// builds a strong ETag from a file's inode, size and modification time, gzip encoded
+//  variants get a tag of their own
+// **************************************************************************************
+std::string makeEtag (ino_t ino, off_t size, const struct timespec& mtime, bool gzip) {
+    char tag[96];
+    snprintf (tag, sizeof (tag), "\"%lx-%lx-%lx%s\"", (unsigned long)ino, (unsigned long)size,
+    (unsigned long)(mtime.tv_sec * 1000000000L + mtime.tv_nsec), gzip ? "-gz" : "");
+    return tag;
+}
 
-        case (500): send500 (sockFd); break;
+// **************************************************************************************
+// checkValidators()
+// adds ETag and Last-Modified for a file to headers
+// returns true if the request's If-None-Match or If-Modified-Since says the client's copy
+//  is still current
+// **************************************************************************************
+bool checkValidators (const Request& request,
+std::string& headers,
+const std::string& etag,
+const struct timespec& mtime) {
+
+    headers += "ETag: " + etag + "\r\n";
+    headers += "Last-Modified: " + httpDate (mtime.tv_sec) + "\r\n";
+
+    // If-None-Match takes precedence and uses the weak comparison, W/"x" matches "x"
+    auto field = request.headers.find ("if-none-match");
+    if (field != request.headers.end ()) {
+        for (std::string candidate : string_tokenize (field->second, ',')) {
+            candidate = remove_padding (candidate, ' ');
+            if (candidate.compare (0, 2, "W/") == 0) {
+                candidate = candidate.substr (2);
+            }
+            if (candidate == "*" || candidate == etag) {
+                return true;
+            }
+        }
+        return false;
+    }
 
-        default: return;
+    field = request.headers.find ("if-modified-since");
+    if (field != request.headers.end ()) {
+        struct tm parts;
+        memset (&parts, 0, sizeof (parts));
+        if (strptime (field->second.c_str (), "%a, %d %b %Y %H:%M:%S GMT", &parts) != nullptr) {
+            return mtime.tv_sec <= timegm (&parts);
         }
     }
+
+    return false;
 }
 
 // **************************************************************************************
-// readRequest()
-// Read the request and return a status code and file name if we can find one
-// Returns 0 if not a complete request
+// sendNotModified()
+// sends a header only 304 in place of the response headers describe, keeping everything
+//  but the status line and the content headers
 // **************************************************************************************
-int readRequest (int sockFd, std::string& filename) {
-    std::string full_message = "";
-    int default_code         = DEFAULT_HTTP_CODE;
-    bool quitProgram         = true;
-    bool keepGoing           = true;
-    char buffer[BUFFER_SIZE];
-    int empty_messages = 0;
+int sendNotModified (int sockFd, std::string headers) {
+    std::string response = "HTTP/1.0 " + statusText (304) + "\r\n";
 
-    while (keepGoing) {
+    std::vector<std::string> lines = string_tokenize (headers, '\n');
+    for (size_t i = 1; i < lines.size (); i++) {
+        if (lines.at (i).empty () || string_to_lower (lines.at (i)).compare (0, 8, "content-") == 0) {
+            continue;
+        }
+        response += lines.at (i) + "\n";
+    }
+    response += "\r\n";
 
-        std::string filepath;
+    DEBUG << "Client copy is current, sending 304" << ENDL;
+    sendLine (sockFd, response);
+    return 0;
+}
 
-        // Call read() call to get a buffer/line from the client.
-        // Hint - don't forget to zero out the buffer each time you use it.
-        // int bytesRead;
-        bzero (buffer, BUFFER_SIZE);
-        int bytesRead = read (sockFd, buffer, BUFFER_SIZE);
+// **************************************************************************************
+// parseRanges()
+// turns a Range header like "bytes=0-99,200-,-50" into inclusive [first, last] pairs for
+//  a body of size bytes
+// returns 1 if there is at least one satisfiable range, 0 if none are (send 416) and -1
+//  if the header can't be understood and should be ignored (send the whole body)
+// **************************************************************************************
+int parseRanges (const std::string& spec, off_t size, std::vector<std::pair<off_t, off_t>>& ranges) {
+    if (spec.compare (0, 6, "bytes=") != 0) {
+        return -1;
+    }
 
-        // Receive message
-        std::string message = buffer;
-        INFO << "New message received: " << create_preview (string_to_literal (message)) << ENDL;
+    std::vector<std::string> parts = string_tokenize (spec.substr (6), ',');
+    if (parts.size () > MAX_RANGES) {
+        return -1;
+    }
 
-        // if error reading from socket
-        if (bytesRead < 0) {
-            ERROR << "Error reading from socket, closing connection" << ENDL;
-            quitProgram = false;
-            break;
+    for (std::string part : parts) {
+        part        = remove_padding (part, ' ');
+        size_t dash = part.find ('-');
+        if (dash == std::string::npos) {
+            return -1;
         }
 
-        // if this message is empty then add 1 to keep track
-        if (bytesRead == 0) {
-            INFO << "Client disconnected, closing connection" << ENDL;
-            quitProgram = false;
-            break;
+        std::string first_str = part.substr (0, dash);
+        std::string last_str  = part.substr (dash + 1);
+        if ((first_str.empty () && last_str.empty ()) ||
+        first_str.find_first_not_of ("0123456789") != std::string::npos ||
+        last_str.find_first_not_of ("0123456789") != std::string::npos) {
+            return -1;
         }
 
-        // When client side connection closes unexpectedly on nc, we get hit with repeated
-        //  empty messages so the connection is closed after a certain limit
-        if (empty_messages >= EMPTY_MSG_LIMIT) {
-            keepGoing = false;
+        // strtoll() saturates a number too big for off_t instead of throwing, so a huge
+        //  first byte starts past the end and a huge last byte or suffix covers the file
+        off_t first, last;
+
+        // "-n" is the last n bytes
+        if (first_str.empty ()) {
+            off_t suffix = strtoll (last_str.c_str (), nullptr, 10);
+            if (suffix == 0) {
+                continue;
+            }
+            first = std::max ((off_t)0, size - suffix);
+            last  = size - 1;
+        } else {
+            first = strtoll (first_str.c_str (), nullptr, 10);
+            last  = last_str.empty () ? size - 1 : strtoll (last_str.c_str (), nullptr, 10);
+            if (!last_str.empty () && last < first) {
+                return -1;
+            }
+            last = std::min (last, size - 1);
         }
 
-        // Append message to full message
-        full_message += message;
+        // starts past the end, can't be satisfied but others in the list still might be
+        if (first >= size) {
+            continue;
+        }
 
-        // checks for end of request \r\n\r\n
-        if (string_exists (full_message, "\r\n\r\n")) {
-            message = full_message;
-            DEBUG << "CLRFCLRF found, processing full request: " << create_preview (string_to_literal (message))
-                  << ENDL;
-
-            // stores all header lines + request line
-            std::vector<std::string> headers;
-
-            // split headers if any
-            int t = 0;
-            for (int i = 0; i < message.size (); i++) {
-                if (message[i] == '\r' && i < message.size () - 1 && message[i + 1] == '\n') {
-                    std::string header = message.substr (t, i);
-                    headers.push_back (header);
-                    t = i + 2;
-                }
-            }
+        ranges.push_back ({ first, last });
+    }
 
-            // split up request line by spaces
-            std::vector<std::string> request_line = string_tokenize (headers.at (0), ' ');
+    return ranges.empty () ? 0 : 1;
+}
 
-            // Check if GET message meets assignment requirements and get filepath
-            //  (eg. space separated line starts with GET, then has filepath, then
-            //  specifies http 1.0)
-            // Also support 1.1 requests for this assignment since its a simple file request
-            //  and makes it easier to test on Safari but responses are sent back in 1.0
-            if (request_line.at (0).substr (0, 3) == "GET" &&
-            (request_line.at (2).substr (0, 8) == "HTTP/1.0" || request_line.at (2).substr (0, 8) == "HTTP/1.1")) {
-                filepath = request_line.at (1);
+// **************************************************************************************
+// ifRangeMatches()
+// returns true if the Range header should be honoured, that is there is no If-Range or it
+//  names the current version of the file by strong ETag or exact Last-Modified date
+// **************************************************************************************
+bool ifRangeMatches (const Request& request, const std::string& etag, time_t mtime) {
+    auto field = request.headers.find ("if-range");
+    if (field == request.headers.end ()) {
+        return true;
+    }
 
-                // clean up filepath a bit
-                filepath = remove_padding (filepath, '/', true, false);
-                // filepath = remove_padding(filepath, ' ', false, true);
+    // weak tags never match here
+    if (field->second[0] == '"' || field->second.compare (0, 2, "W/") == 0) {
+        return field->second == etag;
+    }
 
-                DEBUG << "Request line parsed succesfully, HTTP/1.0 requesting " << filepath << ENDL;
+    struct tm parts;
+    memset (&parts, 0, sizeof (parts));
+    if (strptime (field->second.c_str (), "%a, %d %b %Y %H:%M:%S GMT", &parts) == nullptr) {
+        return false;
+    }
+    return timegm (&parts) == mtime;
+}
 
-                filename  = filepath;
-                keepGoing = false;
-                return 200;
-            }
+// the answer to a Range request, worked out before anything is sent so the blocking and
+//  the coroutine paths send the same bytes
+struct Rangeplan {
+    // status line and headers, all of a 416
+    std::string head;
 
-            // if GET message is valid but http version is not 1.0 like assignment specifies
-            else if ((request_line.at (0).substr (0, 3) == "GET" && request_line.at (2).substr (0, 5) == "HTTP/")) {
-                DEBUG << "Request line parsed succesfully, unsupported HTTP version. Preparing to "
-                         "return 505"
-                      << ENDL;
-                keepGoing = false;
-                return 505;
-            }
+    // what goes before each range, empty for a single range
+    std::vector<std::string> part_headers;
 
-            // If request line can't be parsed than we send back Bad-Request
-            else {
-                DEBUG << "Request line was not parsed succesfully, preparing to return 400" << ENDL;
-                keepGoing = false;
-                return 400;
-            }
-        }
+    // first and last byte of each range
+    std::vector<std::pair<off_t, off_t>> ranges;
 
-        // \r\n\r\n not found
-        else {
-            DEBUG << "Message did not contain CLRFCLRF, waiting for more messages from this connection" << ENDL;
+    // ends a multipart body, empty for a single range
+    std::string closing;
+};
 
-            // this is implicit but it's restated for clarity
-            keepGoing = true;
+// **************************************************************************************
+// planRanges()
+// works out the answer to a Range request for a body size bytes long: a 206 for one
+//  range, a 206 multipart/byteranges for several and a 416 if none can be satisfied.
+//  headers keep everything but the status line and the content type
+// returns -1 if the Range header should be ignored and the whole body sent instead, 0 if
+//  plan holds a header only 416 or 1 if it holds a 206
+// **************************************************************************************
+int planRanges (const std::string& spec, off_t size, const std::string& headers, Rangeplan& plan) {
+    int parsed = parseRanges (spec, size, plan.ranges);
+    if (parsed < 0) {
+        DEBUG << "Ignoring Range header " << spec << ENDL;
+        return -1;
+    }
+
+    // keep everything but the status line and the content type, which depend on the ranges
+    std::string content_type;
+    std::string kept;
+    std::vector<std::string> lines = string_tokenize (headers, '\n');
+    for (size_t i = 1; i < lines.size (); i++) {
+        if (lines.at (i).empty ()) {
+            continue;
+        }
+        if (string_to_lower (lines.at (i)).compare (0, 13, "content-type:") == 0) {
+            content_type = remove_padding (remove_padding (lines.at (i).substr (13), '\r'), ' ');
+            continue;
         }
+        kept += lines.at (i) + "\n";
     }
 
-    return quitProgram;
-}
+    if (parsed == 0) {
+        DEBUG << "Range " << spec << " can't be satisfied, sending 416" << ENDL;
+        plan.head = "HTTP/1.0 " + statusText (416) + "\r\n" + kept + "Content-Range: bytes */" +
+        std::to_string (size) + "\r\nContent-Length: 0\r\n\r\n";
+        return 0;
+    }
 
-int processConnection (int sockFd) {
-    // file name being requested, will be parsed
-    std::string filename;
-    std::string full_message = "";
+    plan.head         = "HTTP/1.0 " + statusText (206) + "\r\n" + kept;
+    std::string total = "/" + std::to_string (size);
 
-    // get status code from request
-    int status_code = readRequest (sockFd, filename);
+    if (plan.ranges.size () == 1) {
+        off_t first = plan.ranges.at (0).first;
+        off_t count = plan.ranges.at (0).second - first + 1;
 
-    switch (status_code) {
-    // request OK
-    case (200): send200 (sockFd, filename); break;
+        plan.head += "Content-Type: " + content_type + "\r\n";
+        plan.head += "Content-Range: bytes " + std::to_string (first) + "-" +
+        std::to_string (plan.ranges.at (0).second) + total + "\r\n";
+        plan.head += "Content-Length: " + std::to_string (count) + "\r\n\r\n";
+        plan.part_headers.push_back ("");
 
-    // bad request
-    case (400): send400 (sockFd); break;
+        DEBUG << "Sending range " << first << "-" << plan.ranges.at (0).second << ENDL;
+        return 1;
+    }
+
+    std::random_device rd;
+    char boundary[32];
+    snprintf (boundary, sizeof (boundary), "%08x%08x", rd (), rd ());
+
+    // every part header is known up front so the whole length can be sent first
+    off_t length = 0;
+    for (const std::pair<off_t, off_t>& range : plan.ranges) {
+        plan.part_headers.push_back (std::string ("\r\n--") + boundary + "\r\nContent-Type: " +
+        content_type + "\r\nContent-Range: bytes " + std::to_string (range.first) + "-" +
+        std::to_string (range.second) + total + "\r\n\r\n");
+        length += plan.part_headers.back ().size () + range.second - range.first + 1;
+    }
+    plan.closing = std::string ("\r\n--") + boundary + "--\r\n";
+    length += plan.closing.size ();
+
+    plan.head += std::string ("Content-Type: multipart/byteranges; boundary=") + boundary + "\r\n";
+    plan.head += "Content-Length: " + std::to_string (length) + "\r\n\r\n";
+
+    DEBUG << "Sending " << plan.ranges.size () << " ranges as multipart/byteranges" << ENDL;
+    return 1;
+}
+
+// **************************************************************************************
+// sendRanges()
+// answers a Range request for a body that sits at base in fileFd and is size bytes long,
+//  as planRanges() works it out. Every range goes out with sendfile() at its own offset
+// returns 1 if the Range header was ignored and the whole body should be sent instead
+// **************************************************************************************
+int sendRanges (int sockFd, int fileFd, off_t base, off_t size, const std::string& spec, std::string headers) {
+    Rangeplan plan;
+    int planned = planRanges (spec, size, headers, plan);
+    if (planned < 0) {
+        return 1;
+    }
+    if (planned == 0) {
+        sendLine (sockFd, plan.head);
+        return 0;
+    }
+
+    // hold everything back so part headers share segments with the bodies around them
+    int cork = 1;
+    setsockopt (sockFd, IPPROTO_TCP, TCP_CORK, &cork, sizeof (cork));
+
+    sendLine (sockFd, plan.head);
+    for (size_t i = 0; i < plan.ranges.size (); i++) {
+        if (!plan.part_headers.at (i).empty ()) {
+            sendLine (sockFd, plan.part_headers.at (i));
+        }
+        off_t count = plan.ranges.at (i).second - plan.ranges.at (i).first + 1;
+        if (sendFileRange (sockFd, fileFd, base + plan.ranges.at (i).first, count) < 0) {
+            break;
+        }
+    }
+    if (!plan.closing.empty ()) {
+        sendLine (sockFd, plan.closing);
+    }
+
+    cork = 0;
+    setsockopt (sockFd, IPPROTO_TCP, TCP_CORK, &cork, sizeof (cork));
+    return 0;
+}
+
+// **************************************************************************************
+// sendFileRanges()
+// sendRanges() for a file in the working directory
+// **************************************************************************************
+int sendFileRanges (int sockFd, std::string filepath, const std::string& spec, std::string headers) {
+    int fileFd = open (filepath.c_str (), O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fileFd < 0 || fstat (fileFd, &st) < 0) {
+        if (fileFd >= 0) {
+            close (fileFd);
+        }
+        return 1;
+    }
+
+    int result = sendRanges (sockFd, fileFd, 0, st.st_size, spec, headers);
+    close (fileFd);
+    return result;
+}
+
+// **************************************************************************************
+// sendHeaders()
+// sends headers followed by the Content-Length and the blank line that ends them
+// **************************************************************************************
+int sendHeaders (int sockFd, std::string headers, off_t length) {
+    return sendLine (sockFd, headers + "Content-Length: " + std::to_string (length) + "\r\n\r\n");
+}
+
+// **************************************************************************************
+// sendBundled()
+// sendResponse() when serving from a bundle, the precomputed headers and the body go out
+//  in one writev straight from the mapping
+// **************************************************************************************
+int sendBundled (int sockFd, std::shared_ptr<const Bundle> served, const Bundlefile& file, std::string headers, bool body) {
+
+    // the bundle has its own content headers, everything else from the caller is kept
+    std::string status_line;
+    for (std::string line : string_tokenize (headers, '\n')) {
+        if (line.empty () || string_to_lower (line).compare (0, 8, "content-") == 0) {
+            continue;
+        }
+        status_line += line + "\n";
+    }
+
+    struct iovec iov[4];
+    iov[0].iov_base = (void*)status_line.data ();
+    iov[0].iov_len  = status_line.size ();
+    iov[1].iov_base = (void*)file.headers;
+    iov[1].iov_len  = file.headers_len;
+    iov[2].iov_base = (void*)"\r\n";
+    iov[2].iov_len  = 2;
+    iov[3].iov_base = (void*)file.body;
+    iov[3].iov_len  = file.body_len;
+
+    sendBody (sockFd, iov, body ? 4 : 3, body ? file.body_len : 0, served);
+    return 0;
+}
+
+// **************************************************************************************
+// sendResponse
+// sends a typical http response packet to client
+// expecting header with status line and content type at least
+// will add content length and blank line
+// if request is given its Accept-Encoding and conditional headers are honoured and the
+//  response carries validators
+// if body is false only the headers are sent, the file isn't opened unless it has to be
+// returns 0 if succesful or a status code of a suggested alternative
+// **************************************************************************************
+int sendResponse (int sockFd,
+std::string filepath,
+std::string headers,
+const Request* request = nullptr,
+bool body              = true) {
+
+    // text responses can differ by Accept-Encoding, let caches know
+    bool compressible = is_compressible (mime_type (filepath));
+    if (compressible) {
+        headers += "Vary: Accept-Encoding\r\n";
+    }
+    bool accept_gzip = request != nullptr && compressible && acceptsGzip (*request);
+
+    // byte ranges always refer to the identity encoding, compressed variants are skipped
+    std::string range;
+    if (request != nullptr) {
+        headers += "Accept-Ranges: bytes\r\n";
+
+        auto field = request->headers.find ("range");
+        if (body && field != request->headers.end ()) {
+            range       = field->second;
+            accept_gzip = false;
+        }
+    }
+
+    // a bundle replaces the working directory entirely, sidecars included
+    std::shared_ptr<const Bundle> served = currentBundle ();
+    if (served) {
+        Bundlefile file;
+        bool gzip = accept_gzip && served->find (filepath + ".gz", file);
+        if (!gzip && !served->find (filepath, file)) {
+            DEBUG << "File \"" << filepath << "\" is not in bundle " << served->source () << ENDL;
+            return 404;
+        }
+
+        struct timespec mtime = { file.mtime, 0 };
+        std::string etag      = makeEtag (0, file.body_len, mtime, gzip);
+        if (request != nullptr && checkValidators (*request, headers, etag, mtime)) {
+            return sendNotModified (sockFd, headers);
+        }
+
+        if (!range.empty () && ifRangeMatches (*request, etag, file.mtime) &&
+        sendRanges (sockFd, served->descriptor (), file.body_offset, file.body_len, range, headers) == 0) {
+            return 0;
+        }
+
+        DEBUG << "Sending bundled " << filepath << (gzip ? ".gz" : "") << " to client" << ENDL;
+        return sendBundled (sockFd, served, file, headers, body);
+    }
+
+    // a precompressed sidecar next to the file wins over compressing it ourselves
+    Fileinfo info;
+    bool gzip = accept_gzip && stat_cache.get (filepath + ".gz", info);
+    if (gzip) {
+        DEBUG << "Serving precompressed " << filepath << ".gz" << ENDL;
+        headers += "Content-Encoding: gzip\r\n";
+        filepath += ".gz";
+        accept_gzip = false;
+    }
+
+    // headers alone come from the stat cache unless the file is cached anyway
+    std::shared_ptr<const Cachedfile> file;
+    if (serve_mode == SERVE_CACHE) {
+        file = body ? file_cache.get (filepath) : file_cache.peek (filepath);
+    }
+
+    if (!file) {
+        if (serve_mode == SERVE_CACHE && body) {
+            ERROR << "File \"" << filepath << "\" could not be opened, check permissions" << ENDL;
+            return 404;
+        }
+        if (!gzip && !stat_cache.get (filepath, info)) {
+            ERROR << "File \"" << filepath << "\" could not be found" << ENDL;
+            return 404;
+        }
+        if (request != nullptr) {
+            std::string etag = makeEtag (info.ino, info.size, info.mtime, gzip);
+            if (checkValidators (*request, headers, etag, info.mtime)) {
+                return sendNotModified (sockFd, headers);
+            }
+            if (!range.empty () && ifRangeMatches (*request, etag, info.mtime.tv_sec) &&
+            sendFileRanges (sockFd, filepath, range, headers) == 0) {
+                return 0;
+            }
+        }
+        if (!body) {
+            return sendHeaders (sockFd, headers, info.size);
+        }
+        if (serve_mode == SERVE_MMAP) {
+            return sendMapped (sockFd, filepath, headers);
+        }
+        return sendUnbuffered (sockFd, filepath, headers);
+    }
+
+    // use the compressed variant once the pool has built it, never wait for it
+    std::shared_ptr<const Cachedfile> content = file;
+    if (accept_gzip) {
+        std::shared_ptr<const Cachedfile> variant = file_cache.get_gzip (file);
+        if (variant) {
+            headers += "Content-Encoding: gzip\r\n";
+            content = variant;
+            gzip    = true;
+        }
+    }
+
+    // validators always describe the file on disk the body came from
+    if (request != nullptr) {
+        std::string etag = makeEtag (file->ino, file->size, file->mtime, gzip);
+        if (checkValidators (*request, headers, etag, file->mtime)) {
+            return sendNotModified (sockFd, headers);
+        }
+        if (!range.empty () && ifRangeMatches (*request, etag, file->mtime.tv_sec) &&
+        sendFileRanges (sockFd, filepath, range, headers) == 0) {
+            return 0;
+        }
+    }
+
+    // send headers first which should contain status line, file size and the blank line
+    // that separates them from the body
+    sendHeaders (sockFd, headers, content->size);
+
+    if (body) {
+        sendFile (sockFd, content);
+    }
+
+    return 0;
+}
+
+// **************************************************************************************
+// sendError()
+// sends an error status with its page from http/, or a bare status line if the page
+//  can't be sent. Only the headers are sent if body is false
+// **************************************************************************************
+void sendError (int sockFd, std::string status, std::string filepath, bool body) {
+
+    // set headers to send
+    std::string headers = "HTTP/1.0 " + status + "\r\n";
+    headers += "Content-Type: text/html; charset=UTF-8\r\n";
+
+    // if sending back nice response failed we send back bare bones response
+    if (sendResponse (sockFd, filepath, headers, nullptr, body)) {
+        sendLine (sockFd, "HTTP/1.0 " + status + "\r\nContent-Length: 0\r\n\r\n");
+    }
+}
+
+// **************************************************************************************
+// Uses sendError() to send back the 505 error code and message.
+// Indicates unsuported http version
+// **************************************************************************************
+void send505 (int sockFd, bool body = true) {
+    sendError (sockFd, statusText (505), "http/505.html", body);
+}
+
+// **************************************************************************************
+// Uses sendLine() to send back the 500 error code and message.
+// Indicates an internal server error
+// **************************************************************************************
+void send500 (int sockFd) {
+    ERROR << "Calling unimplemented function: HTTP/1.1 500 Internal Server Error to client" << ENDL;
+}
+
+// **************************************************************************************
+// * send400()
+// * - Uses sendError() to send back the 400 error code and message.
+// **************************************************************************************
+void send400 (int sockFd, bool body = true) {
+    sendError (sockFd, statusText (400), "http/400.html", body);
+}
+
+// **************************************************************************************
+// * send404()
+// * - Uses sendError() to send back the 404 error code and message.
+// **************************************************************************************
+void send404 (int sockFd, bool body = true) {
+    sendError (sockFd, statusText (404), "http/404.html", body);
+}
+
+// **************************************************************************************
+// isServable()
+// true for the only file names the assignment allows to be served, fileX.html and imageX.jpg
+// **************************************************************************************
+bool isServable (const std::string& filepath) {
+    static const std::regex file_pattern (R"(file[0-9]\.html)");
+    static const std::regex image_pattern (R"(image[0-9]\.jpg)");
+
+    return std::regex_match (filepath, file_pattern) || std::regex_match (filepath, image_pattern);
+}
+
+// **************************************************************************************
+// sendListing()
+// streams an index of every servable file, from the bundle when there is one
+// **************************************************************************************
+void sendListing (Responsestream& stream) {
+    stream.write ("<html>\n<body>\n<ul>\n");
+
+    // servable names never need escaping
+    auto entry = [&stream] (const std::string& name, unsigned long long size) {
+        stream.write ("<li><a href=\"/" + name + "\">" + name + "</a> " + std::to_string (size) + " bytes</li>\n");
+    };
+
+    std::shared_ptr<const Bundle> served = currentBundle ();
+    if (served) {
+        served->for_each ([&entry] (const std::string& path, const Bundlefile& file) {
+            if (isServable (path)) {
+                entry (path, file.body_len);
+            }
+        });
+    } else {
+        DIR* dir = opendir (".");
+        if (dir != nullptr) {
+            Fileinfo info;
+            for (struct dirent* ent = readdir (dir); ent != nullptr; ent = readdir (dir)) {
+                if (isServable (ent->d_name) && stat_cache.get (ent->d_name, info)) {
+                    entry (ent->d_name, info.size);
+                }
+            }
+            closedir (dir);
+        }
+    }
+
+    stream.write ("</ul>\n</body>\n</html>\n");
+}
+
+// **************************************************************************************
+// sendMetrics()
+// streams the server's counters, one "name value" pair per line
+// **************************************************************************************
+void sendMetrics (Responsestream& stream) {
+    size_t count, bytes;
+    auto uptime = std::chrono::steady_clock::now () - start_time;
+
+    stream.write ("uptime_seconds " + std::to_string (std::chrono::duration_cast<std::chrono::seconds> (uptime).count ()) + "\n");
+    stream.write ("connections_served " + std::to_string (connections_served) + "\n");
+
+    // one line per worker, connections it is serving and those the acceptor queued for it
+    for (size_t i = 0; i < worker_states.size (); i++) {
+        stream.write ("worker " + std::to_string (i) + " connections=" + std::to_string (worker_states[i]->connections.load ()) +
+        " queued=" + std::to_string (worker_states[i]->inbox.size ()) + "\n");
+    }
+
+    // work waiting on cpu_pool, and how much of it idle threads took from busy ones
+    uint64_t ran, stolen;
+    cpu_pool.usage (count, ran, stolen);
+    stream.write ("cpu_pool_threads " + std::to_string (cpu_pool.size ()) + "\n");
+    stream.write ("cpu_pool_queued " + std::to_string (count) + "\n");
+    stream.write ("cpu_pool_tasks " + std::to_string (ran) + "\n");
+    stream.write ("cpu_pool_steals " + std::to_string (stolen) + "\n");
+
+    file_cache.usage (count, bytes);
+    stream.write ("file_cache_files " + std::to_string (count) + "\n");
+    stream.write ("file_cache_bytes " + std::to_string (bytes) + "\n");
+
+    map_cache.usage (count, bytes);
+    stream.write ("map_cache_files " + std::to_string (count) + "\n");
+    stream.write ("map_cache_bytes " + std::to_string (bytes) + "\n");
+
+    std::shared_ptr<const Bundle> served = currentBundle ();
+    stream.write ("bundle_files " + std::to_string (served ? served->count () : 0) + "\n");
+
+    uint64_t hits, misses, evictions;
+    proxy_cache.usage (count, bytes, hits, misses, evictions);
+    stream.write ("proxy_cache_responses " + std::to_string (count) + "\n");
+    stream.write ("proxy_cache_bytes " + std::to_string (bytes) + "\n");
+    stream.write ("proxy_cache_hits " + std::to_string (hits) + "\n");
+    stream.write ("proxy_cache_misses " + std::to_string (misses) + "\n");
+    stream.write ("proxy_cache_evictions " + std::to_string (evictions) + "\n");
+
+    // one line per proxy upstream, state is up, ramping back in or ejected
+    int64_t now = std::chrono::duration_cast<std::chrono::milliseconds> (std::chrono::steady_clock::now ().time_since_epoch ())
+                  .count ();
+    proxy.for_each ([&] (const Upstream& upstream) {
+        int64_t until     = upstream.ejected_until.load ();
+        std::string state = now < until ? "ejected" : until != 0 && now - until < PROXY_RAMP_MS ? "ramping" : "up";
+        stream.write ("upstream " + upstream.name + " requests=" + std::to_string (upstream.requests.load ()) +
+        " outstanding=" + std::to_string (upstream.outstanding.load ()) + " state=" + state + "\n");
+    });
+}
+
+// a page produced on the fly and the type it is served as
+struct Generator {
+    const char* type;
+    void (*produce) (Responsestream& stream);
+};
+
+// pages streamed instead of read from a file, by path
+const std::map<std::string, Generator> generated = {
+    { "", { "text/html; charset=UTF-8", sendListing } },
+    { "status", { "text/plain; charset=UTF-8", sendMetrics } },
+};
+
+// **************************************************************************************
+// sendGenerated()
+// streams a generated page as it is produced, chunked for HTTP/1.1 clients and ended by
+//  closing the connection for HTTP/1.0 ones
+// **************************************************************************************
+void sendGenerated (int sockFd, const Request& request, const Generator& page) {
+    bool chunked = request.version.substr (0, 8) == "HTTP/1.1";
+    Responsestream stream (sockFd, chunked, request.method != "HEAD");
+
+    // chunked encoding only exists in HTTP/1.1, so that is the version we answer with
+    std::string headers = std::string (chunked ? "HTTP/1.1 " : "HTTP/1.0 ") + statusText (200) + "\r\n";
+    headers += "Content-Type: " + std::string (page.type) + "\r\n";
+    headers += "Cache-Control: no-store\r\n";
+    headers += "Connection: close\r\n";
+    stream.begin (headers);
+
+    DEBUG << "Streaming generated page /" << request.path << ENDL;
+    page.produce (stream);
+    stream.finish ();
+}
+
+// **************************************************************************************
+// * send200()
+// * - Uses sendLine() to send back the 200 code and contents of the file
+// * - If file not found then send 404
+// **************************************************************************************
+void send200 (int sockFd, const Request& request) {
+    DEBUG << "Verifying request" << ENDL;
+
+    // HEAD gets exactly the headers GET would, without the body
+    bool body = request.method != "HEAD";
+
+    std::string filepath = request.path;
+    Fileinfo info;
+
+    // pages produced on the fly are streamed, there is no file behind them
+    auto page = generated.find (filepath);
+    if (page != generated.end ()) {
+        sendGenerated (sockFd, request, page->second);
+    }
+
+    // Check if the filename matches the assignment's patterns
+    else if (!isServable (filepath)) {
+        DEBUG << "Request format doesn't meet assignment guidelines" << ENDL;
+
+        // we still send 404 because while the file may exist, the assignment
+        // specifies only certain files should be returned
+        send404 (sockFd, body);
+    }
+
+    // Check if file doesn't exists in current working dir
+    // (a bundle is checked when the response is sent)
+    else if (!currentBundle () && !stat_cache.get (filepath, info)) {
+        DEBUG << "Requested file doesn't exist" << ENDL;
+        send404 (sockFd, body);
+    }
+
+    // if file exists
+    else {
+        DEBUG << "Request verified succesfully" << ENDL;
+
+        std::string headers = "HTTP/1.0 " + statusText (200) + "\r\n";
+
+        // send proper content header to client
+        headers += "Content-Type: " + mime_type (filepath) + "\r\n";
+
+        int response = sendResponse (sockFd, filepath, headers, &request, body);
+
+        switch (response) {
+
+        case (404): send404 (sockFd, body); break;
+
+        case (500): send500 (sockFd); break;
+
+        default: return;
+        }
+    }
+}
+
+// **************************************************************************************
+// fillHttp2 ()
+// points an HTTP/2 response at a file the way sendResponse() would send it, from the
+//  bundle, a sidecar, or whichever serving mode is in use. Content headers and validators
+//  are added to the response's headers
+// if request is nullptr the file is sent as is, for error pages
+// returns 0 if succesful or a status code of a suggested alternative
+// **************************************************************************************
+int fillHttp2 (const std::string& filepath, const Request* request, Http2response& response) {
+    std::string& headers = response.headers;
+
+    bool compressible = is_compressible (mime_type (filepath));
+    if (compressible) {
+        headers += "Vary: Accept-Encoding\r\n";
+    }
+    bool accept_gzip = request != nullptr && compressible && acceptsGzip (*request);
+    bool body        = request == nullptr || request->method != "HEAD";
+
+    std::shared_ptr<const Bundle> served = currentBundle ();
+    if (served) {
+        Bundlefile file;
+        bool gzip = accept_gzip && served->find (filepath + ".gz", file);
+        if (!gzip && !served->find (filepath, file)) {
+            return 404;
+        }
+
+        headers += std::string (file.headers, file.headers_len);
+        struct timespec mtime = { file.mtime, 0 };
+        if (request != nullptr && checkValidators (*request, headers, makeEtag (0, file.body_len, mtime, gzip), mtime)) {
+            response.status = 304;
+            return 0;
+        }
+
+        response.data = file.body;
+        response.len  = file.body_len;
+        response.keep = served;
+        return 0;
+    }
+
+    headers += "Content-Type: " + mime_type (filepath) + "\r\n";
+
+    // a precompressed sidecar next to the file wins over compressing it ourselves
+    Fileinfo info;
+    std::string path = filepath;
+    bool gzip        = accept_gzip && stat_cache.get (filepath + ".gz", info);
+    if (gzip) {
+        headers += "Content-Encoding: gzip\r\n";
+        path += ".gz";
+        accept_gzip = false;
+    }
+
+    // headers alone come from the stat cache
+    if (!body || serve_mode != SERVE_CACHE) {
+        if (!gzip && !stat_cache.get (path, info)) {
+            return 404;
+        }
+        if (request != nullptr && checkValidators (*request, headers, makeEtag (info.ino, info.size, info.mtime, gzip), info.mtime)) {
+            response.status = 304;
+            return 0;
+        }
+        response.len = info.size;
+    }
+
+    if (!body) {
+        return 0;
+    }
+
+    switch (serve_mode) {
+    case (SERVE_MMAP): {
+        std::shared_ptr<const Mappedfile> file = map_cache.get (path);
+        if (!file || (size_t)file->size != response.len) {
+            return 404;
+        }
+        response.data = file->data;
+        response.keep = file;
+        return 0;
+    }
+
+    case (SERVE_SENDFILE): {
+        response.fd = open (path.c_str (), O_RDONLY | O_CLOEXEC);
+        return response.fd < 0 ? 404 : 0;
+    }
+
+    default: break;
+    }
+
+    std::shared_ptr<const Cachedfile> file = file_cache.get (path);
+    if (!file) {
+        return 404;
+    }
+
+    // use the compressed variant once the pool has built it, never wait for it
+    std::shared_ptr<const Cachedfile> content = file;
+    if (accept_gzip) {
+        std::shared_ptr<const Cachedfile> variant = file_cache.get_gzip (file);
+        if (variant) {
+            headers += "Content-Encoding: gzip\r\n";
+            content = variant;
+            gzip    = true;
+        }
+    }
+
+    if (request != nullptr && checkValidators (*request, headers, makeEtag (file->ino, file->size, file->mtime, gzip), file->mtime)) {
+        response.status = 304;
+        return 0;
+    }
+
+    response.data = content->body.data ();
+    response.len  = content->body.size ();
+    response.keep = content;
+    return 0;
+}
+
+// **************************************************************************************
+// respondHttp2()
+// answers a request made on an HTTP/2 stream, from the same pages and files as HTTP/1
+// uploads aren't accepted over HTTP/2
+// **************************************************************************************
+void respondHttp2 (const Request& request, Http2response& response) {
+    if (request.method != "GET" && request.method != "HEAD") {
+        response.status  = request.method == "OPTIONS" ? 200 : 405;
+        response.headers = "Allow: GET, HEAD, OPTIONS\r\n";
+        return;
+    }
+
+    // proxied paths are only forwarded for HTTP/1 clients
+    if (proxy.route ("/" + request.path) >= 0) {
+        response.status = 502;
+        return;
+    }
+
+    // the whole generated page is collected, HTTP/2 frames it as it goes out
+    auto page = generated.find (request.path);
+    if (page != generated.end ()) {
+        response.headers = "Content-Type: " + std::string (page->second.type) + "\r\nCache-Control: no-store\r\n";
+
+        Responsestream stream (response.owned);
+        page->second.produce (stream);
+        stream.finish ();
+
+        response.data = response.owned.data ();
+        response.len  = response.owned.size ();
+        return;
+    }
+
+    if (!isServable (request.path) || fillHttp2 (request.path, &request, response) != 0) {
+        DEBUG << "HTTP/2 request for " << request.path << " not found" << ENDL;
+        response        = Http2response ();
+        response.status = 404;
+        fillHttp2 ("http/404.html", nullptr, response);
+    }
+}
+
+// **************************************************************************************
+// wantsHttp2()
+// true for an HTTP/1.1 request asking to upgrade the connection to h2c, only requests
+//  without a body are upgraded
+// **************************************************************************************
+bool wantsHttp2 (const Request& request) {
+    auto upgrade = request.headers.find ("upgrade");
+    if (request.version.substr (0, 8) != "HTTP/1.1" || upgrade == request.headers.end () ||
+    request.headers.count ("http2-settings") == 0 || (request.method != "GET" && request.method != "HEAD")) {
+        return false;
+    }
+
+    for (std::string protocol : string_tokenize (upgrade->second, ',')) {
+        if (string_to_lower (remove_padding (protocol, ' ')) == "h2c") {
+            return true;
+        }
+    }
+    return false;
+}
+
+// **************************************************************************************
+// serveHttp2()
+// serves the rest of a connection as HTTP/2, either after the prior knowledge preface or
+//  by upgrading an HTTP/1.1 request which then becomes the first stream
+// **************************************************************************************
+void serveHttp2 (int sockFd, const Request& request) {
+    Http2connection connection (sockFd, respondHttp2);
+
+    // readRequest() already took the first half of the preface off
+    if (request.version == "HTTP/2.0") {
+        connection.serve ("PRI * HTTP/2.0\r\n\r\n" + request.body);
+        return;
+    }
+
+    if (!connection.upgrade (request, request.headers.at ("http2-settings"))) {
+        DEBUG << "Invalid HTTP2-Settings, not upgrading" << ENDL;
+        send400 (sockFd);
+        return;
+    }
+
+    DEBUG << "Upgrading connection to h2c" << ENDL;
+    sendLine (sockFd, "HTTP/1.1 " + statusText (101) + "\r\nConnection: Upgrade\r\nUpgrade: h2c\r\n\r\n");
+    connection.serve (request.body);
+}
+
+// **************************************************************************************
+// wantsWebsocket()
+// true for a request to upgrade the echo endpoint to a WebSocket
+// **************************************************************************************
+bool wantsWebsocket (const Request& request) {
+    auto upgrade = request.headers.find ("upgrade");
+    if (request.path != WEBSOCKET_PATH || upgrade == request.headers.end ()) {
+        return false;
+    }
+
+    for (std::string protocol : string_tokenize (upgrade->second, ',')) {
+        if (string_to_lower (remove_padding (protocol, ' ')) == "websocket") {
+            return true;
+        }
+    }
+    return false;
+}
+
+// **************************************************************************************
+// serveWebsocket()
+// completes the WebSocket handshake and echoes every message back like echo_s does, a
+//  message starting with CLOSE ends the session and one starting with QUIT shuts down the
+//  server. Returns 1 for QUIT
+// **************************************************************************************
+int serveWebsocket (int sockFd, const Request& request) {
+    auto key     = request.headers.find ("sec-websocket-key");
+    auto version = request.headers.find ("sec-websocket-version");
+
+    std::string nonce;
+    if (request.method != "GET" || request.version != "HTTP/1.1" || key == request.headers.end () ||
+    !base64_decode (remove_padding (key->second, ' '), nonce) || nonce.size () != 16) {
+        DEBUG << "Invalid WebSocket handshake" << ENDL;
+        send400 (sockFd);
+        return 0;
+    }
+    if (version == request.headers.end () || remove_padding (version->second, ' ') != "13") {
+        DEBUG << "Unsupported WebSocket version" << ENDL;
+        sendLine (sockFd, "HTTP/1.1 " + statusText (426) + "\r\nSec-WebSocket-Version: 13\r\nContent-Length: 0\r\n\r\n");
+        return 0;
+    }
+
+    DEBUG << "Upgrading connection to a WebSocket" << ENDL;
+    sendLine (sockFd, "HTTP/1.1 " + statusText (101) + "\r\nUpgrade: websocket\r\nConnection: Upgrade\r\n"
+                      "Sec-WebSocket-Accept: " +
+                      websocket_accept (remove_padding (key->second, ' ')) + "\r\n\r\n");
+
+    Websocket websocket (sockFd, request.body);
+    std::string message;
+    uint8_t opcode;
+    while (websocket.receive (message, opcode)) {
+        DEBUG << "WebSocket message of " << message.size () << " bytes" << ENDL;
+        if (!websocket.send (opcode, message)) {
+            return 0;
+        }
+
+        if (message.compare (0, 4, "QUIT") == 0) {
+            DEBUG << "QUIT received, shutting down" << ENDL;
+            websocket.close (WS_CLOSE_GOING_AWAY, "server shutting down");
+            return 1;
+        }
+        if (message.compare (0, 5, "CLOSE") == 0) {
+            DEBUG << "CLOSE received, ending session" << ENDL;
+            websocket.close (WS_CLOSE_NORMAL, "");
+            return 0;
+        }
+    }
+
+    return 0;
+}
+
+// defined below the method table it lists
+std::string allowedMethods ();
+
+// **************************************************************************************
+// * sendOptions()
+// * - Answers OPTIONS with the methods the server supports
+// **************************************************************************************
+void sendOptions (int sockFd, const Request& request) {
+    sendLine (sockFd, "HTTP/1.0 " + statusText (200) + "\r\nAllow: " + allowedMethods () + "\r\nContent-Length: 0\r\n\r\n");
+}
+
+// handler for each supported method, a request line with any other method gets a 405
+// main() adds PUT and POST when uploads are enabled, it is only read once workers start
+std::map<std::string, void (*) (int, const Request&)> methods = {
+    { "GET", send200 },
+    { "HEAD", send200 },
+    { "OPTIONS", sendOptions },
+};
+
+// **************************************************************************************
+// * allowedMethods()
+// * - Returns the supported methods as a comma separated list for the Allow header
+// **************************************************************************************
+std::string allowedMethods () {
+    std::string allow;
+    for (const auto& method : methods) {
+        allow += (allow.empty () ? "" : ", ") + method.first;
+    }
+    return allow;
+}
+
+// **************************************************************************************
+// * send405()
+// * - Tells the client the method isn't supported and which ones are
+// **************************************************************************************
+void send405 (int sockFd) {
+    sendLine (sockFd, "HTTP/1.0 " + statusText (405) + "\r\nAllow: " + allowedMethods () + "\r\nContent-Length: 0\r\n\r\n");
+}
+
+// **************************************************************************************
+// sendStatus()
+// sends a status line with an empty body, for answers that need no explanation page
+// **************************************************************************************
+void sendStatus (int sockFd, std::string status) {
+    sendLine (sockFd, "HTTP/1.0 " + status + "\r\nContent-Length: 0\r\n\r\n");
+}
+
+// **************************************************************************************
+// proxyRequest()
+// forwards a request to its upstream and relays the answer, or explains why it couldn't be
+// **************************************************************************************
+void proxyRequest (int sockFd, const Request& request, size_t route) {
+    switch (proxy.forward (sockFd, request, route)) {
+    case (0): break;
+    case (411): sendStatus (sockFd, statusText (411)); break;
+    case (504): sendStatus (sockFd, statusText (504)); break;
+    case (502): sendStatus (sockFd, statusText (502)); break;
+    default: sendStatus (sockFd, statusText (400)); break;
+    }
+}
+
+// **************************************************************************************
+// writeAll()
+// writes len bytes to a file, returns false if it can't be written
+// **************************************************************************************
+bool writeAll (int fd, const char* data, size_t len) {
+    while (len > 0) {
+        ssize_t written = write (fd, data, len);
+        if (written < 0 && errno == EINTR) {
+            continue;
+        }
+        if (written <= 0) {
+            return false;
+        }
+        data += written;
+        len -= written;
+    }
+
+    return true;
+}
+
+// **************************************************************************************
+// spliceBody()
+// moves count bytes from the socket to a file through a pipe so they never enter user space
+// returns false if the client went away or timed out, or the file can't be written
+// **************************************************************************************
+bool spliceBody (int sockFd, int fileFd, const int pipeFds[2], off_t count) {
+    while (count > 0) {
+        ssize_t in = splice (sockFd, nullptr, pipeFds[1], nullptr, std::min (count, (off_t)UPLOAD_PIPE_BYTES),
+        SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (in < 0 && errno == EINTR) {
+            continue;
+        }
+        if (in <= 0) {
+            return false;
+        }
+        count -= in;
+
+        // empty the pipe before filling it again
+        while (in > 0) {
+            ssize_t out = splice (pipeFds[0], nullptr, fileFd, nullptr, in, SPLICE_F_MOVE);
+            if (out < 0 && errno == EINTR) {
+                continue;
+            }
+            if (out <= 0) {
+                return false;
+            }
+            in -= out;
+        }
+    }
+
+    return true;
+}
+
+// **************************************************************************************
+// readLine()
+// takes one CRLF terminated line off the front of pending, reading more from the socket
+//  until it is all there
+// returns false if the line is too long or the client went away
+// **************************************************************************************
+bool readLine (int sockFd, std::string& pending, std::string& line) {
+    size_t end;
+    while ((end = pending.find ("\r\n")) == std::string::npos) {
+        if (pending.size () > CHUNK_LINE_MAX) {
+            return false;
+        }
+
+        char buffer[BUFFER_SIZE];
+        ssize_t bytesRead = read (sockFd, buffer, BUFFER_SIZE);
+        if (bytesRead < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytesRead <= 0) {
+            return false;
+        }
+        pending.append (buffer, bytesRead);
+    }
+
+    line = pending.substr (0, end);
+    pending.erase (0, end + 2);
+    return true;
+}
+
+// **************************************************************************************
+// receiveBody()
+// writes a request body to fileFd, what arrived with the headers is written first and the
+//  rest is spliced straight from the socket. A length of -1 means the body is chunked, only
+//  the chunk size lines are read into user space then
+// returns 0 if succesful or the status code to answer with
+// **************************************************************************************
+int receiveBody (int sockFd, const Request& request, int fileFd, off_t length) {
+    int pipeFds[2];
+    if (pipe2 (pipeFds, O_CLOEXEC) < 0) {
+        ERROR << "Failed to create upload pipe" << ENDL;
+        return 500;
+    }
+
+    std::string pending = request.body;
+    int status          = 0;
+
+    if (length >= 0) {
+        off_t buffered = std::min ((off_t)pending.size (), length);
+        if (!writeAll (fileFd, pending.data (), buffered) || !spliceBody (sockFd, fileFd, pipeFds, length - buffered)) {
+            status = 400;
+        }
+    }
+
+    // each chunk is a hex size line, the data and a CRLF, a zero size chunk ends the body
+    off_t total = 0;
+    std::string line;
+    while (length < 0 && status == 0) {
+        if (!readLine (sockFd, pending, line)) {
+            status = 400;
+            break;
+        }
+
+        // chunk extensions after a ';' are ignored
+        char* end;
+        unsigned long long size = strtoull (line.c_str (), &end, 16);
+        if (end == line.c_str ()) {
+            status = 400;
+            break;
+        }
+        if (size == 0) {
+            break;
+        }
+        if (size > (unsigned long long)(upload_max_bytes - total)) {
+            status = 413;
+            break;
+        }
+        total += size;
+
+        off_t buffered = std::min ((off_t)pending.size (), (off_t)size);
+        if (!writeAll (fileFd, pending.data (), buffered) || !spliceBody (sockFd, fileFd, pipeFds, size - buffered)) {
+            status = 400;
+            break;
+        }
+        pending.erase (0, buffered);
+
+        if (!readLine (sockFd, pending, line) || !line.empty ()) {
+            status = 400;
+        }
+    }
+
+    // trailer fields up to the blank line that ends a chunked body are dropped
+    while (length < 0 && status == 0) {
+        if (!readLine (sockFd, pending, line)) {
+            status = 400;
+        } else if (line.empty ()) {
+            break;
+        }
+    }
+
+    close (pipeFds[0]);
+    close (pipeFds[1]);
+    return status;
+}
+
+// **************************************************************************************
+// receiveUpload()
+// stores a PUT or POST body as the file named by the request path. The body goes to a
+//  temporary file next to it which is renamed over the file once complete, so it is never
+//  served half written, then every cache is told the file changed
+// **************************************************************************************
+void receiveUpload (int sockFd, const Request& request) {
+    std::string filepath = request.path;
+
+    // only files the server would serve can be uploaded
+    if (!isServable (filepath)) {
+        DEBUG << "Refusing upload of " << filepath << ENDL;
+        sendStatus (sockFd, statusText (403));
+        return;
+    }
+
+    off_t length  = -1;
+    auto encoding = request.headers.find ("transfer-encoding");
+    auto field    = request.headers.find ("content-length");
+
+    // a body framed two ways is read one way here and maybe the other by something in front
+    //  of us, so it is refused outright. Transfer-Encoding, when present, always decides
+    if (encoding != request.headers.end () && field != request.headers.end ()) {
+        DEBUG << "Refusing upload with both Transfer-Encoding and Content-Length" << ENDL;
+        send400 (sockFd);
+        return;
+    }
+    if (encoding != request.headers.end ()) {
+        std::vector<std::string> codings = string_tokenize (string_to_lower (encoding->second), ',');
+        for (std::string& coding : codings) {
+            coding = remove_padding (coding, ' ');
+        }
+
+        // without chunked last the body can't be framed at all
+        if (codings.empty () || codings.back () != "chunked") {
+            send400 (sockFd);
+            return;
+        }
+
+        // chunked on top of another coding, which we don't undo
+        if (codings.size () > 1) {
+            sendStatus (sockFd, statusText (501));
+            return;
+        }
+        length = -1;
+    } else if (field != request.headers.end ()) {
+        const std::string& value = field->second;
+        if (value.empty () || value.size () > 18 || value.find_first_not_of ("0123456789") != std::string::npos) {
+            send400 (sockFd);
+            return;
+        }
+        length = std::stoll (value);
+    } else {
+        sendStatus (sockFd, statusText (411));
+        return;
+    }
+
+    if (length > upload_max_bytes) {
+        DEBUG << "Upload of " << length << " bytes is over the limit" << ENDL;
+        sendStatus (sockFd, statusText (413));
+        return;
+    }
+
+    // a client waiting for the go ahead only gets it once the upload is accepted
+    auto expect = request.headers.find ("expect");
+    if (expect != request.headers.end () && string_to_lower (expect->second) == "100-continue") {
+        sendLine (sockFd, "HTTP/1.1 " + statusText (100) + "\r\n\r\n");
+    }
+
+    // written next to the target so the rename stays on one filesystem
+    std::string temp = "." + filepath + ".upload.XXXXXX";
+    int fileFd       = mkostemp (&temp[0], O_CLOEXEC);
+    if (fileFd < 0) {
+        ERROR << "Could not create a temporary file for " << filepath << ENDL;
+        sendStatus (sockFd, statusText (500));
+        return;
+    }
+    fchmod (fileFd, 0644);
+
+    // a stalled client gives up its worker instead of holding it forever
+    struct timeval timeout = { UPLOAD_TIMEOUT_SECONDS, 0 };
+    setsockopt (sockFd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof (timeout));
+
+    int status = receiveBody (sockFd, request, fileFd, length);
+    close (fileFd);
+
+    bool existed = access (filepath.c_str (), F_OK) == 0;
+    if (status == 0 && rename (temp.c_str (), filepath.c_str ()) < 0) {
+        ERROR << "Could not rename upload into place as " << filepath << ENDL;
+        status = 500;
+    }
+
+    switch (status) {
+    case (0): break;
+
+    case (413): sendStatus (sockFd, statusText (413)); break;
+
+    case (500): sendStatus (sockFd, statusText (500)); break;
+
+    default: sendStatus (sockFd, statusText (400)); break;
+    }
+
+    if (status != 0) {
+        unlink (temp.c_str ());
+        return;
+    }
+
+    // a sidecar compressed from the old contents would be served in place of the new file
+    unlink ((filepath + ".gz").c_str ());
+    for (const std::string& path : { filepath, filepath + ".gz" }) {
+        stat_cache.invalidate (path);
+        file_cache.invalidate (path);
+        map_cache.invalidate (path);
+    }
+
+    INFO << "Stored upload of " << filepath << ENDL;
+    sendStatus (sockFd, statusText (existed ? 204 : 201));
+}
+
+// **************************************************************************************
+// parseRequest()
+// Parses a request whose headers end at headers_end of full_message, what follows them is
+//  kept as the start of the body
+// Returns the status code to answer with, 200 if the request line is one we serve
+// **************************************************************************************
+int parseRequest (const std::string& full_message, size_t headers_end, Request& request) {
+    std::string message = full_message.substr (0, headers_end + 4);
+    request.body        = full_message.substr (headers_end + 4);
+    std::string filepath;
+    DEBUG << "CLRFCLRF found, processing full request: " << create_preview (string_to_literal (message))
+          << ENDL;
+
+    // stores all header lines + request line
+    std::vector<std::string> headers;
+
+    // split headers if any
+    int t = 0;
+    for (int i = 0; i < message.size (); i++) {
+        if (message[i] == '\r' && i < message.size () - 1 && message[i + 1] == '\n') {
+            std::string header = message.substr (t, i - t);
+            headers.push_back (header);
+            t = i + 2;
+        }
+    }
+
+    // keep every header field for the handlers, names are case insensitive
+    for (size_t i = 1; i < headers.size (); i++) {
+        size_t colon = headers.at (i).find (':');
+        if (colon == std::string::npos) {
+            continue;
+        }
+        std::string name  = string_to_lower (headers.at (i).substr (0, colon));
+        std::string value = remove_padding (headers.at (i).substr (colon + 1), ' ');
+        request.headers[name] = value;
+    }
+
+    // split up request line by spaces
+    std::vector<std::string> request_line = string_tokenize (headers.at (0), ' ');
+
+    // a request line is a method, a filepath and a version separated by spaces
+    if (request_line.size () != 3 || request_line[0].empty ()) {
+        DEBUG << "Request line was not parsed succesfully, preparing to return 400" << ENDL;
+        return 400;
+    }
+    request.method = request_line[0];
+
+    // a client speaking HTTP/2 with prior knowledge, processConnection() hands the
+    //  connection over
+    if (request_line[0] == "PRI" && request_line[1] == "*" && request_line[2] == "HTTP/2.0") {
+        DEBUG << "HTTP/2 preface received" << ENDL;
+        request.path    = "*";
+        request.version = request_line[2];
+        return 200;
+    }
+
+    // Support 1.1 requests as well since they are simple file requests and it makes
+    //  it easier to test on Safari but responses are sent back in 1.0
+    // Whether the method is supported is up to processConnection()
+    std::string version = request_line[2].substr (0, 8);
+    if (version == "HTTP/1.0" || version == "HTTP/1.1") {
+        filepath = request_line[1];
+
+        // clean up filepath a bit
+        filepath = remove_padding (filepath, '/', true, false);
+
+        DEBUG << "Request line parsed succesfully, " << request.method << " requesting " << filepath << ENDL;
+
+        request.path    = filepath;
+        request.version = request_line[2];
+        return 200;
+    }
+
+    // if the request line is valid but the http version is not one we speak
+    else if (version.substr (0, 5) == "HTTP/") {
+        DEBUG << "Request line parsed succesfully, unsupported HTTP version. Preparing to "
+                 "return 505"
+              << ENDL;
+        return 505;
+    }
+
+    // If request line can't be parsed than we send back Bad-Request
+    else {
+        DEBUG << "Request line was not parsed succesfully, preparing to return 400" << ENDL;
+        return 400;
+    }
+}
+
+// **************************************************************************************
+// readRequest()
+// Read the request and return a status code and file name if we can find one
+// Returns 0 if not a complete request
+// **************************************************************************************
+int readRequest (int sockFd, Request& request) {
+    std::string full_message = "";
+    int default_code         = DEFAULT_HTTP_CODE;
+    bool quitProgram         = true;
+    bool keepGoing           = true;
+    char buffer[BUFFER_SIZE];
+    int empty_messages = 0;
+
+    while (keepGoing) {
+
+        // Call read() call to get a buffer/line from the client.
+        // Hint - don't forget to zero out the buffer each time you use it.
+        // int bytesRead;
+        bzero (buffer, BUFFER_SIZE);
+        int bytesRead = read (sockFd, buffer, BUFFER_SIZE);
+
+        // Receive message, bytes past the headers may be the start of a binary body
+        std::string message (buffer, bytesRead > 0 ? bytesRead : 0);
+        INFO << "New message received: " << create_preview (string_to_literal (message)) << ENDL;
+
+        // if error reading from socket
+        if (bytesRead < 0) {
+            ERROR << "Error reading from socket, closing connection" << ENDL;
+            quitProgram = false;
+            break;
+        }
+
+        // if this message is empty then add 1 to keep track
+        if (bytesRead == 0) {
+            INFO << "Client disconnected, closing connection" << ENDL;
+            quitProgram = false;
+            break;
+        }
+
+        // When client side connection closes unexpectedly on nc, we get hit with repeated
+        //  empty messages so the connection is closed after a certain limit
+        if (empty_messages >= EMPTY_MSG_LIMIT) {
+            keepGoing = false;
+        }
+
+        // Append message to full message
+        full_message += message;
+
+        // checks for end of request \r\n\r\n
+        size_t headers_end = full_message.find ("\r\n\r\n");
+        if (headers_end != std::string::npos) {
+            return parseRequest (full_message, headers_end, request);
+        }
+
+        // \r\n\r\n not found
+        else {
+            DEBUG << "Message did not contain CLRFCLRF, waiting for more messages from this connection" << ENDL;
+
+            // this is implicit but it's restated for clarity
+            keepGoing = true;
+        }
+    }
+
+    return quitProgram;
+}
+
+// **************************************************************************************
+// handleRequest()
+// Answers a request readRequest() returned status_code for, with the method's handler if
+//  it was parsed
+// Returns 1 if the connection asked to quit
+// **************************************************************************************
+int handleRequest (int sockFd, const Request& request, int status_code) {
+    // errors for HEAD requests carry no body either
+    bool body = request.method != "HEAD";
+
+    switch (status_code) {
+    // request line OK, hand it to the method's handler
+    case (200): {
+        if (request.version == "HTTP/2.0") {
+            serveHttp2 (sockFd, request);
+            break;
+        }
+
+        // everything under a proxied prefix goes upstream, whatever the method
+        int route = proxy.route ("/" + request.path);
+        if (route >= 0) {
+            proxyRequest (sockFd, request, route);
+            break;
+        }
+
+        if (wantsHttp2 (request)) {
+            serveHttp2 (sockFd, request);
+            break;
+        }
+        if (wantsWebsocket (request)) {
+            return serveWebsocket (sockFd, request);
+        }
+
+        auto handler = methods.find (request.method);
+        if (handler == methods.end ()) {
+            send405 (sockFd);
+        } else {
+            handler->second (sockFd, request);
+        }
+        break;
+    }
+
+    // bad request
+    case (400): send400 (sockFd, body); break;
+
+    // http version not supported
+    // this needed because most browsers send http/1.1 by default and this
+    // assignment specifies only http/1.0
+    case (505): send505 (sockFd, body); break;
+
+    // file not found
+    case (404): send404 (sockFd, body); break;
+    }
+
+    return 0;
+}
+
+int processConnection (int sockFd) {
+    // request being made, will be parsed
+    Request request;
+
+    // get status code from request
+    int status_code = readRequest (sockFd, request);
+
+    return handleRequest (sockFd, request, status_code);
+}
+
+// **************************************************************************************
+// * stopWorkers()
+// * - Stops every worker's event loop, waking up the workers waiting for connections
+// **************************************************************************************
+void stopWorkers () {
+    quit_program = true;
+    for (const std::unique_ptr<Worker>& worker : worker_states) {
+        worker->loop.stop ();
+    }
+    if (acceptor) {
+        acceptor->loop.stop ();
+    }
+}
+
+// **************************************************************************************
+// * peerAllowed()
+// * - Returns true if the process at the other end of a unix socket runs as one of the
+// users given with -a, or if no users were given
+// **************************************************************************************
+bool peerAllowed (int sockFd) {
+    if (allowed_peers.empty ()) {
+        return true;
+    }
+
+    struct ucred cred;
+    socklen_t len = sizeof (cred);
+    if (getsockopt (sockFd, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0) {
+        WARNING << "Could not read peer credentials" << ENDL;
+        return false;
+    }
+
+    for (uid_t uid : allowed_peers) {
+        if (cred.uid == uid) {
+            return true;
+        }
+    }
 
-    // http version not supported
-    // this needed because most browsers send http/1.1 by default and this
-    // assignment specifies only http/1.0
-    case (505): send505 (sockFd); break;
+    WARNING << "Refused unix socket connection from pid " << cred.pid << " uid " << cred.uid << ENDL;
+    return false;
+}
 
-    // file not found
-    case (404): send404 (sockFd); break;
+// **************************************************************************************
+// readRequestAsync()
+// readRequest() for a coroutine, the worker serves other connections while it waits
+// Returns 0 if the client hung up or went quiet before the request was complete
+// **************************************************************************************
+Task<int> readRequestAsync (Stream& stream, Request& request) {
+    std::string full_message;
+    char buffer[BUFFER_SIZE];
+
+    while (true) {
+        ssize_t bytesRead = co_await stream.read (buffer, BUFFER_SIZE);
+        if (bytesRead < 0) {
+            DEBUG << "Error reading from socket, closing connection: " << strerror (errno) << ENDL;
+            co_return 0;
+        }
+        if (bytesRead == 0) {
+            INFO << "Client disconnected, closing connection" << ENDL;
+            co_return 0;
+        }
+
+        full_message.append (buffer, bytesRead);
+        size_t headers_end = full_message.find ("\r\n\r\n");
+        if (headers_end != std::string::npos) {
+            co_return parseRequest (full_message, headers_end, request);
+        }
     }
+}
 
-    return 0;
+// **************************************************************************************
+// servesAsync()
+// true for requests serveStream() answers itself besides proxied ones: GET and HEAD of
+//  pages and files, ranges included, that don't switch protocols
+// **************************************************************************************
+bool servesAsync (const Request& request) {
+    return (request.method == "GET" || request.method == "HEAD") && request.version != "HTTP/2.0" &&
+    !wantsHttp2 (request) && !wantsWebsocket (request);
+}
+
+// **************************************************************************************
+// sendResponseAsync()
+// sends a response respondHttp2() filled in as HTTP/1.0, from memory or with sendfile()
+// **************************************************************************************
+Task<void> sendResponseAsync (Stream& stream, const Request& request, Http2response& response) {
+    std::string status_line = "HTTP/1.0 " + statusText (response.status) + "\r\n";
+
+    // a 304 has no body, HEAD gets the length GET would have without it
+    bool body           = request.method != "HEAD" && response.status != 304;
+    std::string headers = status_line + response.headers;
+
+    // files take ranges like sendResponse() says they do, generated pages and errors don't
+    if ((response.status == 200 || response.status == 304) && generated.count (request.path) == 0) {
+        headers += "Accept-Ranges: bytes\r\n";
+    }
+    if (response.status != 304) {
+        headers += "Content-Length: " + std::to_string (response.len) + "\r\n";
+    }
+    headers += "\r\n";
+    DEBUG << "Sending headers to client: " << string_to_literal (headers) << ENDL;
+
+    struct iovec iov[2];
+    iov[0].iov_base = (void*)headers.data ();
+    iov[0].iov_len  = headers.size ();
+    iov[1].iov_base = (void*)response.data;
+    iov[1].iov_len  = response.len;
+
+    if (body && response.fd >= 0) {
+        if (co_await stream.write (iov, 1) == 0) {
+            co_await stream.sendfile (response.fd, response.offset, response.len);
+        }
+    } else {
+        co_await stream.write (iov, body && response.len > 0 ? 2 : 1);
+    }
+}
+
+// **************************************************************************************
+// sendRangesAsync()
+// sendRanges() for a response respondHttp2() filled in, each range sent from memory or with
+//  sendfile() like sendResponseAsync() sends the whole body. If-Range is checked against
+//  the validators in the response headers
+// returns 1 if the Range header was ignored and the whole body should be sent instead
+// **************************************************************************************
+Task<int> sendRangesAsync (Stream& stream, const Request& request, const Http2response& response) {
+    std::string etag;
+    time_t mtime = 0;
+    for (const std::string& line : string_tokenize (response.headers, '\n')) {
+        std::string lower = string_to_lower (line);
+        if (lower.compare (0, 5, "etag:") == 0) {
+            etag = remove_padding (remove_padding (line.substr (5), '\r'), ' ');
+        } else if (lower.compare (0, 14, "last-modified:") == 0) {
+            struct tm parts;
+            memset (&parts, 0, sizeof (parts));
+            std::string date = remove_padding (remove_padding (line.substr (14), '\r'), ' ');
+            if (strptime (date.c_str (), "%a, %d %b %Y %H:%M:%S GMT", &parts) != nullptr) {
+                mtime = timegm (&parts);
+            }
+        }
+    }
+    if (!ifRangeMatches (request, etag, mtime)) {
+        co_return 1;
+    }
+
+    std::string headers = "HTTP/1.0 " + statusText (200) + "\r\n" + response.headers + "Accept-Ranges: bytes\r\n";
+    Rangeplan plan;
+    int planned = planRanges (request.headers.at ("range"), response.len, headers, plan);
+    if (planned < 0) {
+        co_return 1;
+    }
+    if (planned == 0) {
+        co_await stream.write (plan.head.data (), plan.head.size ());
+        co_return 0;
+    }
+
+    // hold everything back so part headers share segments with the bodies around them
+    int cork = 1;
+    setsockopt (stream.get_fd (), IPPROTO_TCP, TCP_CORK, &cork, sizeof (cork));
+
+    int result = co_await stream.write (plan.head.data (), plan.head.size (), true);
+    for (size_t i = 0; i < plan.ranges.size () && result == 0; i++) {
+        const std::string& part = plan.part_headers.at (i);
+        if (!part.empty ()) {
+            result = co_await stream.write (part.data (), part.size (), true);
+        }
+
+        off_t first = plan.ranges.at (i).first;
+        off_t count = plan.ranges.at (i).second - first + 1;
+        if (result == 0 && response.fd >= 0) {
+            result = co_await stream.sendfile (response.fd, response.offset + first, count);
+        } else if (result == 0) {
+            result = co_await stream.write (response.data + first, count, true);
+        }
+    }
+    if (result == 0 && !plan.closing.empty ()) {
+        co_await stream.write (plan.closing.data (), plan.closing.size ());
+    }
+
+    cork = 0;
+    setsockopt (stream.get_fd (), IPPROTO_TCP, TCP_CORK, &cork, sizeof (cork));
+    co_return 0;
+}
+
+// **************************************************************************************
+// sendStatusAsync()
+// sendStatus() for a coroutine
+// **************************************************************************************
+Task<void> sendStatusAsync (Stream& stream, int code) {
+    std::string line = "HTTP/1.0 " + statusText (code) + "\r\nContent-Length: 0\r\n\r\n";
+    co_await stream.write (line.data (), line.size ());
+}
+
+// **************************************************************************************
+// loadsFile()
+// true if answering a request would touch the disk: stat() a file the stat cache has no
+//  fresh result for, or read or map one the file or map cache doesn't have, whatever the
+//  serve mode. serveStream() leaves those to cpu_pool
+// **************************************************************************************
+bool loadsFile (const Request& request) {
+    if (generated.count (request.path) != 0 || !isServable (request.path) || currentBundle ()) {
+        return false;
+    }
+
+    // fillHttp2() looks for a precompressed sidecar first, and serves it if there is one
+    std::string path = request.path;
+    if (is_compressible (mime_type (path)) && acceptsGzip (request)) {
+        Fileinfo info;
+        if (!stat_cache.fresh (path + ".gz")) {
+            return true;
+        }
+        if (stat_cache.get (path + ".gz", info)) {
+            path += ".gz";
+        }
+    }
+    if (!stat_cache.fresh (path)) {
+        return true;
+    }
+
+    // HEAD is answered from the stat cache alone, and sendfile mode just opens the file
+    if (request.method != "GET") {
+        return false;
+    }
+    switch (serve_mode) {
+    case (SERVE_MMAP): return !map_cache.peek (path);
+    case (SERVE_SENDFILE): return false;
+    default: return !file_cache.peek (path);
+    }
+}
+
+// **************************************************************************************
+// * serveBlocking()
+// * - Queues handleRequest() for a request a coroutine worker read on session_pool, which
+// closes the connection once done and stops every worker if it asks to quit
+// * - A request still queued when the server quits gets a 503 instead
+// **************************************************************************************
+void serveBlocking (Worker& worker, int sockFd, const Request& request) {
+    session_pool.submit ([&worker, sockFd, request] () {
+        if (quit_program) {
+            sendStatus (sockFd, statusText (503));
+        } else if (handleRequest (sockFd, request, 200)) {
+            stopWorkers ();
+        }
+        closeSocket (worker.loop, sockFd);
+    });
+}
+
+void acceptConnection (const Listener& listener, Worker& worker);
+
+// **************************************************************************************
+// * watchListeners()
+// * - Starts or stops a worker's event loop accepting connections on every listener
+// **************************************************************************************
+void watchListeners (Worker& worker, bool watching) {
+    for (const Listener& listener : listeners) {
+        if (!watching) {
+            worker.loop.remove (listener.get_fd ());
+            continue;
+        }
+
+        // every worker watches every listener, EPOLLEXCLUSIVE wakes one of them per
+        //  connection instead of all of them
+        const Listener* watched = &listener;
+        worker.loop.add (listener.get_fd (), EPOLLIN | EPOLLEXCLUSIVE, [watched, &worker] (uint32_t events) {
+            acceptConnection (*watched, worker);
+        });
+    }
+    worker.paused = !watching;
+}
+
+// **************************************************************************************
+// * serveStream()
+// * - processConnection() as a coroutine on a worker's event loop. The request is read
+// and GET and HEAD, ranges and proxied requests are answered without blocking the worker,
+// anything else is handed to session_pool
+// **************************************************************************************
+Task<void> serveStream (Worker& worker, int sockFd) {
+    {
+        Stream stream (worker.loop, sockFd);
+        stream.set_timeout (std::chrono::milliseconds (STREAM_TIMEOUT_MS));
+
+        Request request;
+        int status_code = co_await readRequestAsync (stream, request);
+
+        // everything under a proxied prefix goes upstream, whatever the method
+        int route = -1;
+        if (status_code == 200 && request.version != "HTTP/2.0") {
+            route = proxy.route ("/" + request.path);
+        }
+
+        if (route >= 0) {
+            int status = co_await proxy.forward (worker.loop, stream, request, route);
+            if (status != 0) {
+                co_await sendStatusAsync (stream, status == 411 || status == 502 || status == 504 ? status : 400);
+            }
+        } else if (status_code == 200 && servesAsync (request)) {
+            // byte ranges always refer to the identity encoding, compressed variants are skipped
+            bool ranged = request.method == "GET" && request.headers.count ("range") != 0 &&
+            generated.count (request.path) == 0;
+            if (ranged) {
+                request.headers.erase ("accept-encoding");
+            }
+
+            // the worker serves its other connections while a cold file is read
+            Http2response response;
+            if (loadsFile (request)) {
+                co_await cpu_pool.offload (worker.loop, [&request, &response] () { respondHttp2 (request, response); });
+            } else {
+                respondHttp2 (request, response);
+            }
+            if (!ranged || response.status != 200 || co_await sendRangesAsync (stream, request, response) != 0) {
+                co_await sendResponseAsync (stream, request, response);
+            }
+            if (response.fd >= 0) {
+                close (response.fd);
+            }
+        } else if (status_code == 200) {
+            // the other handlers block, for as long as an HTTP/2 or WebSocket session lasts,
+            //  so they go to session_pool and the worker moves on
+            serveBlocking (worker, stream.release (), request);
+        } else if (status_code != 0) {
+            stream.set_blocking ();
+            handleRequest (sockFd, request, status_code);
+            closeSocket (worker.loop, stream.release ());
+        }
+    }
+
+    worker.streams--;
+    worker.connections--;
+    if (worker.paused && !quit_program) {
+        watchListeners (worker, true);
+    }
+}
+
+// **************************************************************************************
+// * serveConnection()
+// * - Processes a connection a worker accepted or was handed, as a coroutine with -e.
+// Closes it once done, stopping every worker if it asks to quit
+// **************************************************************************************
+void serveConnection (Worker& worker, int sockFd) {
+    if (stream_limit > 0) {
+        // the acceptor keeps track of the limit itself
+        if (++worker.streams >= stream_limit && dispatch == DISPATCH_NONE) {
+            watchListeners (worker, false);
+        }
+        serveStream (worker, sockFd).spawn ();
+        return;
+    }
+
+    // Now we have a connection, so you can call processConnection() to do
+    // the work.
+    if (processConnection (sockFd)) {
+        // wake up the other workers, and main() if this isn't its thread
+        stopWorkers ();
+    }
+
+    closeSocket (worker.loop, sockFd);
+    worker.connections--;
+}
+
+// **************************************************************************************
+// * acceptConnection()
+// * - Accepts a connection waiting on a listener and processes it, stopping every worker
+// if it asks to quit or accept() fails
+// * - With -e the connection is served as a coroutine instead, alongside the worker's
+// others, and the worker stops accepting while it has stream_limit of them
+// **************************************************************************************
+void acceptConnection (const Listener& listener, Worker& worker) {
+    // ********************************************************************
+    // * The accept call creates a NEW socket with a new fd that will be
+    // * used for the communication.  Another worker may have taken the
+    // * connection first, which just means going back to sleep.
+    // ********************************************************************
+    int new_socket = listener.accept ();
+    if (new_socket < 0) {
+        if (errno == EINTR || errno == ECONNABORTED || errno == EAGAIN || errno == EWOULDBLOCK || quit_program) {
+            return;
+        }
+        FATAL << "Accept() failed" << ENDL;
+        worker.status = -1;
+        stopWorkers ();
+        return;
+    }
+
+    if (listener.is_unix () && !peerAllowed (new_socket)) {
+        close (new_socket);
+        return;
+    }
+
+    DEBUG << "Connection accepted" << ENDL;
+    connections_served++;
+    worker.connections++;
+    serveConnection (worker, new_socket);
+}
+
+// **************************************************************************************
+// * receiveConnections()
+// * - Serves every connection the acceptor has handed a worker, once its eventfd says
+// there are some. Those left once the server quits are refused by refuseQueued()
+// **************************************************************************************
+void receiveConnections (Worker& worker) {
+    uint64_t count;
+    if (read (worker.wakeFd, &count, sizeof (count)) < 0) {
+        DEBUG << "No connections were handed over" << ENDL;
+    }
+
+    int sockFd;
+    while (!quit_program && worker.inbox.pop (sockFd)) {
+        serveConnection (worker, sockFd);
+    }
+}
+
+// **************************************************************************************
+// * handOff()
+// * - Queues a connection for the worker -s picks: the one with the fewest connections or
+// the shortest queue, ties going to the other measure. Workers with a full queue, or
+// serving their -e limit, are skipped
+// * - Returns false if no worker can take it now
+// **************************************************************************************
+bool handOff (int sockFd) {
+    Worker* picked = nullptr;
+    std::pair<size_t, size_t> lightest;
+
+    for (const std::unique_ptr<Worker>& worker : worker_states) {
+        size_t queued      = worker->inbox.size ();
+        size_t connections = worker->connections;
+        if (queued >= worker->inbox.capacity () || (stream_limit > 0 && connections >= stream_limit)) {
+            continue;
+        }
+
+        std::pair<size_t, size_t> load = dispatch == DISPATCH_QUEUE ? std::make_pair (queued, connections) :
+                                                                      std::make_pair (connections, queued);
+        if (picked == nullptr || load < lightest) {
+            picked   = worker.get ();
+            lightest = load;
+        }
+    }
+    if (picked == nullptr) {
+        return false;
+    }
+
+    // counted before the worker can see it, so it can't go below zero
+    picked->connections++;
+    picked->inbox.push (sockFd);
+
+    uint64_t one = 1;
+    if (write (picked->wakeFd, &one, sizeof (one)) < 0) {
+        DEBUG << "Worker already has a wake up pending" << ENDL;
+    }
+    return true;
+}
+
+// **************************************************************************************
+// * drainBacklog()
+// * - Hands over the connections no worker could take before, and goes back to accepting
+// once they are all taken. Retries every HANDOFF_RETRY_MS until then
+// **************************************************************************************
+void watchForAcceptor (bool watching);
+
+void drainBacklog () {
+    while (!acceptor->backlog.empty () && handOff (acceptor->backlog.front ())) {
+        acceptor->backlog.pop_front ();
+    }
+
+    if (acceptor->backlog.empty ()) {
+        watchForAcceptor (true);
+    } else {
+        acceptor->loop.after (std::chrono::milliseconds (HANDOFF_RETRY_MS), drainBacklog);
+    }
+}
+
+// **************************************************************************************
+// * refuseQueued()
+// * - Answers every connection still waiting in the acceptor's backlog or a worker's inbox
+// with a 503 and closes it, once the acceptor and the workers have stopped
+// **************************************************************************************
+void refuseQueued () {
+    std::vector<int> queued (acceptor->backlog.begin (), acceptor->backlog.end ());
+    acceptor->backlog.clear ();
+
+    for (const std::unique_ptr<Worker>& worker : worker_states) {
+        int sockFd;
+        while (worker->inbox.pop (sockFd)) {
+            worker->connections--;
+            queued.push_back (sockFd);
+        }
+    }
+
+    if (!queued.empty ()) {
+        INFO << "Refusing " << queued.size () << " connections still queued" << ENDL;
+    }
+    for (int sockFd : queued) {
+        sendStatus (sockFd, statusText (503));
+        close (sockFd);
+    }
+}
+
+// **************************************************************************************
+// * dispatchConnections()
+// * - Accepts every connection waiting on a listener and hands each to a worker. If none
+// can take one, accepting stops until the backlog is drained, the kernel queues new
+// connections meanwhile
+// **************************************************************************************
+void dispatchConnections (const Listener& listener) {
+    while (acceptor->backlog.empty ()) {
+        int new_socket = listener.accept ();
+        if (new_socket < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK && !quit_program) {
+                FATAL << "Accept() failed" << ENDL;
+                acceptor->status = -1;
+                stopWorkers ();
+            }
+            return;
+        }
+
+        if (listener.is_unix () && !peerAllowed (new_socket)) {
+            close (new_socket);
+            continue;
+        }
+
+        DEBUG << "Connection accepted" << ENDL;
+        connections_served++;
+
+        if (!handOff (new_socket)) {
+            DEBUG << "Every worker is full, holding connections back" << ENDL;
+            acceptor->backlog.push_back (new_socket);
+            watchForAcceptor (false);
+            acceptor->loop.after (std::chrono::milliseconds (HANDOFF_RETRY_MS), drainBacklog);
+        }
+    }
+}
+
+// **************************************************************************************
+// * watchForAcceptor()
+// * - Starts or stops the acceptor's event loop accepting connections on every listener
+// **************************************************************************************
+void watchForAcceptor (bool watching) {
+    for (const Listener& listener : listeners) {
+        if (!watching) {
+            acceptor->loop.remove (listener.get_fd ());
+            continue;
+        }
+
+        const Listener* watched = &listener;
+        acceptor->loop.add (listener.get_fd (), EPOLLIN, [watched] (uint32_t events) {
+            dispatchConnections (*watched);
+        });
+    }
+}
+
+// **************************************************************************************
+// * runAcceptor()
+// * - Runs the acceptor's event loop until the workers are stopped
+// * - Run by the acceptor thread with -s
+// **************************************************************************************
+int runAcceptor () {
+    watchForAcceptor (true);
+    if (!quit_program && acceptor->loop.run () < 0) {
+        stopWorkers ();
+        return -1;
+    }
+    return acceptor->status;
+}
+
+// **************************************************************************************
+// * acceptConnections()
+// * - Runs a worker's event loop, which accepts connections on every listener and
+// processes them until a connection asks to quit or accept() fails
+// * - Run by every worker thread
+// **************************************************************************************
+int acceptConnections (int index) {
+    Worker& worker = *worker_states[index];
+
+    // with -s the acceptor hands connections over instead
+    if (dispatch != DISPATCH_NONE) {
+        worker.loop.add (worker.wakeFd, EPOLLIN, [&worker] (uint32_t events) {
+            receiveConnections (worker);
+        });
+    } else {
+        watchListeners (worker, true);
+    }
+
+    if (!quit_program && worker.loop.run () < 0) {
+        stopWorkers ();
+        return -1;
+    }
+    return worker.status;
 }
 
 // **************************************************************************************
@@ -434,15 +2836,25 @@ int main (int argc, char* argv[]) {
     // catch SIGINT and send to sig_handler
     signal (SIGINT, sig_handler);
 
-    // Obtain a pseudo random number to seed the dist generator
-    std::random_device rd;
-    std::mt19937 eng (rd ());
+    // a client hanging up mid response shows up as a failed send, not a dead server
+    signal (SIGPIPE, SIG_IGN);
 
     // ********************************************************************
     // * Process the command line arguments
     // ********************************************************************
     Argparser parser (argc, argv);
     parser.add_option ('d', true, false, 1, 1);
+    parser.add_option ('w', true, false, 1, 1);
+    parser.add_option ('m', true, false, 2, 1);
+    parser.add_option ('b', true, false, 1, 1);
+    parser.add_option ('u', true, false, 1, 1);
+    parser.add_option ('p', true, false, MAX_ARGS, 1);
+    parser.add_option ('c', true, false, 1, 1);
+    parser.add_option ('l', true, false, MAX_ARGS, 1);
+    parser.add_option ('a', true, false, MAX_ARGS, 1);
+    parser.add_option ('z', true, false, 1, 1);
+    parser.add_option ('e', true, false, 1, 1);
+    parser.add_option ('s', true, false, 1, 1);
     parser.parse ();
     std::vector<int> arg_values = parser.get_values_int ('d');
 
@@ -452,104 +2864,205 @@ int main (int argc, char* argv[]) {
         LOG_LEVEL = arg_values.at (0);
     }
 
-    // *******************************************************************
-    // * Creating the inital socket is the same as in a client.
-    // ********************************************************************
-    int listenFd = -1;
-    // Call socket() to create the socket you will use for lisening.
-    if ((listenFd = socket (AF_INET, SOCK_STREAM, 0)) < 0) {
-        FATAL << "Failed to create listening socket" << ENDL;
-        return -1;
+    // how files are sent, defaults to the in-memory cache
+    std::vector<std::string> mode_values = parser.get_values_string ('m');
+    if (mode_values.size () > 0) {
+        if (mode_values.at (0) == "mmap") {
+            serve_mode = SERVE_MMAP;
+        } else if (mode_values.at (0) == "sendfile") {
+            serve_mode = SERVE_SENDFILE;
+        } else if (mode_values.at (0) != "cache") {
+            FATAL << "Unknown serving mode " << mode_values.at (0) << ENDL;
+            return -1;
+        }
+
+        if (mode_values.size () > 1 && mode_values.at (1) == "populate") {
+            map_cache.set_populate (true);
+        }
+    }
+
+    // serve from a bundle instead of the working directory
+    std::vector<std::string> bundle_values = parser.get_values_string ('b');
+    if (bundle_values.size () > 0) {
+        bundle_path = bundle_values.at (0);
+        bundle.store (Bundle::open (bundle_path));
+        if (!bundle.load ()) {
+            FATAL << "Could not open bundle " << bundle_path << ENDL;
+            return -1;
+        }
+        signal (SIGHUP, hup_handler);
     }
 
-    DEBUG << "Calling Socket() assigned file descriptor " << listenFd << ENDL;
+    // accept PUT and POST uploads into the working directory, up to the given MiB
+    arg_values = parser.get_values_int ('u');
+    if (arg_values.size () > 0) {
+        if (bundle.load ()) {
+            FATAL << "Uploads go to the working directory and can't be combined with -b" << ENDL;
+            return -1;
+        }
+        upload_max_bytes = (off_t)arg_values.at (0) * 1024 * 1024;
+        methods["PUT"]   = receiveUpload;
+        methods["POST"]  = receiveUpload;
+    }
 
-    // ********************************************************************
-    // * The bind() and calls take a structure that specifies the
-    // * address to be used for the connection. On the cient it contains
-    // * the address of the server to connect to. On the server it specifies
-    // * which IP address and port to lisen for connections.
-    // ********************************************************************
-    struct sockaddr_in servaddr;
-    memset (&servaddr, 0, sizeof (servaddr));
+    // forward path prefixes to upstream servers, each given as prefix=[policy@]address[,address...]
+    //  where an address is host:port or unix:/path
+    for (const std::string& mapping : parser.get_values_string ('p')) {
+        size_t equals = mapping.find ('=');
+        if (equals == std::string::npos || !proxy.add_route (mapping.substr (0, equals), mapping.substr (equals + 1))) {
+            FATAL << "Invalid proxy mapping " << mapping << ", expected prefix=[rr|least|hash@]address[,address...]" << ENDL;
+            return -1;
+        }
+    }
 
-    // *** assign 3 fields in the servadd struct sin_family, sin_addr.s_addr and
-    // sin_port
-    // *** the value your port can be any value > 1024.
-    servaddr.sin_family      = AF_INET;              // IPv4
-    servaddr.sin_addr.s_addr = INADDR_ANY;           // listen to any address
-    servaddr.sin_port        = htons (DEFAULT_PORT); // htons converts the int to network byte order
+    // cache proxied responses in a shared memory segment of the given MiB
+    arg_values = parser.get_values_int ('c');
+    if (arg_values.size () > 0) {
+        if (!proxy_cache.open (PROXY_CACHE_NAME, (size_t)arg_values.at (0) * 1024 * 1024)) {
+            FATAL << "Could not map a " << arg_values.at (0) << " MiB proxy cache, it needs at least 4" << ENDL;
+            return -1;
+        }
+        proxy.set_cache (&proxy_cache, &refresh_pool);
+    }
 
-    // ********************************************************************
-    // * Binding configures the socket with the parameters we have
-    // * specified in the servaddr structure.  This step is implicit in
-    // * the connect() call, but must be explicitly listed for servers.
-    // ********************************************************************
-    bool bindSuccesful = false;
-
-    std::uniform_int_distribution<> distr (1025, 65535);
-    while (!bindSuccesful) {
-        // ** Call bind()
-        // You may have to call bind multiple times if another process is
-        // already using the port your program selects.
-        if (bind (listenFd, (struct sockaddr*)&servaddr, sizeof (servaddr)) < 0) {
-            DEBUG << "Bind failed" << ENDL;
-            servaddr.sin_port = htons (distr (eng));
+    // send bodies of at least the given KiB with MSG_ZEROCOPY
+    arg_values = parser.get_values_int ('z');
+    if (arg_values.size () > 0) {
+        if (arg_values.at (0) <= 0) {
+            FATAL << "The zero copy threshold has to be at least 1 KiB" << ENDL;
+            return -1;
+        }
+        zerocopy_min_bytes = (size_t)arg_values.at (0) * 1024;
+    }
+
+    // serve up to the given connections at once per worker as coroutines
+    arg_values = parser.get_values_int ('e');
+    if (arg_values.size () > 0) {
+        if (arg_values.at (0) <= 0) {
+            FATAL << "Each worker has to serve at least 1 connection" << ENDL;
+            return -1;
+        }
+        stream_limit = arg_values.at (0);
+    }
+
+    // one acceptor thread hands connections to the least loaded worker
+    std::vector<std::string> dispatch_values = parser.get_values_string ('s');
+    if (dispatch_values.size () > 0) {
+        if (dispatch_values.at (0) == "least") {
+            dispatch = DISPATCH_LEAST;
+        } else if (dispatch_values.at (0) == "queue") {
+            dispatch = DISPATCH_QUEUE;
         } else {
-            bindSuccesful = true;
-            DEBUG << "Bind succesfull" << ENDL;
+            FATAL << "Unknown dispatch policy " << dispatch_values.at (0) << ", expected least or queue" << ENDL;
+            return -1;
         }
     }
-    std::cout << "Using port: " << ntohs (servaddr.sin_port) << std::endl;
+
+    // only these users may connect over the unix sockets
+    for (int uid : parser.get_values_int ('a')) {
+        allowed_peers.push_back ((uid_t)uid);
+    }
+
+    file_cache.set_pool (&cpu_pool);
+
+    // number of worker threads accepting connections, defaults to 1
+    int num_workers = 1;
+    arg_values      = parser.get_values_int ('w');
+    if (arg_values.size () > 0 && arg_values.at (0) > 0) {
+        num_workers = arg_values.at (0);
+    }
+
+    // ********************************************************************
+    // * The TCP listener binds DEFAULT_PORT, or a random port above 1024
+    // * if another process is already using it, and starts listening.
+    // ********************************************************************
+    listeners.emplace_back ();
+    if (!listeners.back ().listen_tcp (DEFAULT_PORT)) {
+        return -1;
+    }
+    std::cout << "Using port: " << listeners.back ().get_port () << std::endl;
     // *** DON'T FORGET TO PRINT OUT WHAT PORT YOUR SERVER PICKED SO YOU KNOW
     // HOW TO CONNECT.
 
+    // same host clients can skip the TCP stack by connecting to a unix socket, served by the
+    //  same workers and handlers
+    for (const std::string& path : parser.get_values_string ('l')) {
+        listeners.emplace_back ();
+        if (!listeners.back ().listen_unix (path)) {
+            listeners.clear ();
+            return -1;
+        }
+        std::cout << "Using unix socket: " << path << std::endl;
+    }
+
+    // workers that lose the race for a connection go back to sleep instead of blocking
+    for (const Listener& listener : listeners) {
+        listener.set_nonblocking ();
+    }
+
     // ********************************************************************
-    // * Setting the socket to the listening state is the second step
-    // * needed to being accepting connections.  This creates a queue for
-    // * connections and starts the kernel listening for connections.
+    // * Every worker runs an event loop watching the same listening
+    // * sockets, the kernel wakes one of them for each new connection,
+    // * which is then handled start to finish by that worker, or with -e
+    // * served as a coroutine alongside its others.  The main thread is
+    // * worker 0.
     // ********************************************************************
-    int listenQueueLength = 1;
-    // ** Cal listen()
-    if (listen (listenFd, listenQueueLength) < 0) {
-        FATAL << "Listen() failed" << std::endl << ENDL;
-        close (listenFd);
-        return -1;
+    for (int i = 0; i < num_workers; i++) {
+        worker_states.push_back (std::make_unique<Worker> ());
+    }
+    if (dispatch != DISPATCH_NONE) {
+        acceptor = std::make_unique<Acceptor> ();
+    }
+
+    // CPU heavy work gets the cores left after the workers and the acceptor
+    int spare_cores = (int)std::thread::hardware_concurrency () - num_workers - (acceptor ? 1 : 0);
+    cpu_pool.start (std::max (spare_cores, CPU_MIN_THREADS));
+    if (stream_limit > 0) {
+        session_pool.start (SESSION_THREADS);
+    }
+
+    std::vector<std::thread> workers;
+    for (int i = 1; i < num_workers; i++) {
+        workers.emplace_back (acceptConnections, i);
     }
 
     // ********************************************************************
-    // * The accept call will sleep, waiting for a connection.  When
-    // * a connection request comes in the accept() call creates a NEW
-    // * socket with a new fd that will be used for the communication.
+    // * With -s the workers don't watch the listening sockets, a thread of
+    // * its own accepts every connection and hands it to a worker.
     // ********************************************************************
-    bool quitProgram = false;
-    while (!quitProgram) {
-        int connFd = 0;
-
-        // Call the accept() call to check the listening queue for connection
-        // requests. If a client has already tried to connect accept() will
-        // complete the connection and return a file descriptor that you can
-        // read from and write to. If there is no connection waiting accept()
-        // will block and not return until there is a connection.
-        // ** call accept()
-        int addrlen = sizeof (servaddr);
-        DEBUG << "Calling accept(" << listenFd << ", " << (struct sockaddr*)&servaddr << ", "
-              << (socklen_t*)&addrlen << ENDL;
-        int new_socket = accept (listenFd, (struct sockaddr*)&servaddr, (socklen_t*)&addrlen);
-        if (new_socket < 0) {
-            FATAL << "Accept() failed" << ENDL;
-            close (listenFd);
-            return -1;
-        }
+    std::thread dispatcher;
+    int acceptor_status = 0;
+    if (acceptor) {
+        dispatcher = std::thread ([&acceptor_status] () { acceptor_status = runAcceptor (); });
+    }
 
-        DEBUG << "Connection accepted" << ENDL;
+    int status = acceptConnections (0);
+
+    // wake up any workers still waiting for connections
+    stopWorkers ();
+    for (std::thread& worker : workers) {
+        worker.join ();
+    }
+    if (dispatcher.joinable ()) {
+        dispatcher.join ();
+        if (acceptor_status < 0) {
+            status = acceptor_status;
+        }
 
-        // Now we have a connection, so you can call processConnection() to do
-        // the work.
-        quitProgram = processConnection (new_socket);
+        // nothing is handed over any more, connections never served are answered here
+        refuseQueued ();
+    }
 
-        close (new_socket);
+    // sessions still running end on their own and those still queued get a 503, then work
+    //  still queued finishes and whatever either posted to the stopped workers' event loops
+    //  runs here so no coroutine waiting on the pool is left suspended
+    session_pool.stop ();
+    cpu_pool.stop ();
+    for (const std::unique_ptr<Worker>& worker : worker_states) {
+        worker->loop.run_posted ();
     }
 
-    close (listenFd);
+    // closing the listeners also removes the unix socket files
+    listeners.clear ();
+    return status;
 }
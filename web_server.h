@@ -2,17 +2,54 @@
 // * A common set of system include files needed for socket() programming
 // ********************************************************
 #include <arpa/inet.h>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
 #include <cstring>
+#include <ctime>
+#include <deque>
+#include <dirent.h>
 #include <filesystem>
+#include <fcntl.h>
 #include <fstream>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <netinet/tcp.h>
+#include <poll.h>
 #include <random>
 #include <regex>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <string>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 #include <signal.h>
+#include <sys/time.h>
 
 #include "Argparser.h"
+#include "Bundle.h"
+#include "Connection.h"
+#include "Filecache.h"
+#include "Http2.h"
+#include "Listener.h"
+#include "Mapcache.h"
+#include "Proxy.h"
+#include "Reactor.h"
+#include "Request.h"
+#include "Responsestream.h"
+#include "Ring.h"
+#include "Shmcache.h"
+#include "Statcache.h"
+#include "Stream.h"
 #include "Stringlib.h"
+#include "Task.h"
+#include "Threadpool.h"
+#include "Websocket.h"
 #include "logging.h"